@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 /**
  * @file error_handler.h
  * @brief Send an HTTP error response to the client.
@@ -22,3 +24,24 @@ void log_errno(const char *fmt, ...);
  * @param ... Additional arguments matching the format string.
  */
 void log_error(const char *fmt, ...);
+
+/**
+ * @brief Responses that are sent on hot rejection paths.
+ *
+ * Unlike send_http_error(), these are built once at compile time and written
+ * with a single non-blocking send(): no formatting, no allocation, no retry
+ * loop. They always fit in an empty socket send buffer, and when the client
+ * is too slow to take even that, dropping the response is fine.
+ */
+typedef enum
+{
+    CANNED_429_TOO_MANY_REQUESTS,
+    CANNED_503_SERVICE_UNAVAILABLE,
+} canned_response_t;
+
+/**
+ * @brief Send a precomputed error response to the client.
+ * @param client_fd file descriptor of client
+ * @param which Which canned response to send
+ */
+void send_canned_response(int client_fd, canned_response_t which);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @file frequency_sketch.h
+ * @brief Count-min sketch with aging: approximate access frequency for TinyLFU admission.
+ *
+ * 4 rows of 4-bit counters (two per byte). An item's frequency is the minimum
+ * of its 4 counters, so collisions can only over-estimate, never hide a hot
+ * item. After `sample_size` increments every counter is halved, which lets
+ * the sketch forget yesterday's popular objects.
+ *
+ * Memory: width / 2 bytes per row, independent of how many keys are seen.
+ *
+ * @note Not thread-safe; each cache owns its sketch.
+ */
+
+#define FREQUENCY_SKETCH_ROWS 4
+#define FREQUENCY_SKETCH_MAX 15 /**< Counters saturate here (4 bits) */
+
+typedef struct
+{
+    uint8_t *table;       /**< ROWS * width/2 bytes, two counters per byte */
+    size_t width;         /**< Counters per row (power of two) */
+    uint32_t additions;   /**< Increments since the last halving */
+    uint32_t sample_size; /**< Halve all counters after this many increments */
+} frequency_sketch_t;
+
+/**
+ * @brief Allocate a sketch sized for about `expected_items` distinct hot items.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int frequency_sketch_init(frequency_sketch_t *sketch, size_t expected_items);
+
+/**
+ * @brief Free the counters.
+ */
+void frequency_sketch_destroy(frequency_sketch_t *sketch);
+
+/**
+ * @brief Record one access of the item with this hash.
+ */
+void frequency_sketch_increment(frequency_sketch_t *sketch, uint64_t hash);
+
+/**
+ * @brief Estimated access count (0..FREQUENCY_SKETCH_MAX).
+ */
+int frequency_sketch_estimate(const frequency_sketch_t *sketch, uint64_t hash);
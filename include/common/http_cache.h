@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "common/http_types.h"
+
+/**
+ * @file http_cache.h
+ * @brief HTTP caching rules for a shared (proxy) cache: keys, request and response policy.
+ *
+ * Only the parts of RFC 9111 a reverse proxy in front of our own backends
+ * needs, and always on the safe side:
+ * - Only GET requests without Authorization or a body are cached.
+ * - A response is stored only with explicit freshness (s-maxage, max-age or
+ *   Expires). No heuristic freshness for responses that don't say anything.
+ * - no-store, private, no-cache, Set-Cookie and Vary: * are never stored.
+ * - Stale responses are only used as allowed by stale-while-revalidate and
+ *   stale-if-error (RFC 5861), never with must-revalidate/proxy-revalidate.
+ *
+ * Storage and eviction live in the event loop (see response_cache.h), this
+ * file has no state and is safe to call from any thread.
+ */
+
+#define HTTP_CACHE_MAX_KEY 2048 /**< Longest cache key; longer requests are not cached */
+#define HTTP_CACHE_MAX_VARY 256 /**< Room for the header names listed in Vary */
+
+/**
+ * @brief What the cache may do with a request.
+ */
+typedef enum
+{
+    HTTP_CACHE_BYPASS,     /**< Neither serve from nor store into the cache. */
+    HTTP_CACHE_LOOKUP,     /**< Serve a fresh hit, store the response on a miss. */
+    HTTP_CACHE_STORE_ONLY  /**< Client asked for an end-to-end reload: go upstream, but store the result. */
+} http_cache_request_t;
+
+/**
+ * @brief Cacheability of a backend response, extracted from its header.
+ */
+typedef struct
+{
+    bool cacheable;          /**< May be stored and served to other clients. */
+    int status;              /**< Status code. */
+    size_t header_len;       /**< Bytes up to and including the blank line. */
+    int64_t lifetime_s;      /**< Freshness lifetime in seconds (s-maxage > max-age > Expires - Date). */
+    uint32_t age_s;          /**< Age the response already had when we received it. */
+    int64_t content_length;  /**< Content-Length, -1 if absent (callers check the body against it). */
+    int64_t stale_while_revalidate_s; /**< May be served stale for this long while it is refreshed (0 = no). */
+    int64_t stale_if_error_s;         /**< May be served stale for this long if the backend fails (0 = no). */
+    char vary[HTTP_CACHE_MAX_VARY]; /**< Lowercase Vary header names separated by '\n' ("" if none). */
+} http_cache_policy_t;
+
+/**
+ * @brief Classify a request.
+ * @param req Parsed request
+ */
+http_cache_request_t http_cache_request_policy(const HttpRequest *req);
+
+/**
+ * @brief Build the cache key "METHOD host normalized-path[?query]".
+ *
+ * The path is normalized so equivalent spellings share one entry:
+ * percent-encoded unreserved characters are decoded, remaining escapes use
+ * upper-case hex, "//" is collapsed and "." / ".." segments are resolved.
+ * The host is lower-cased. The query string is kept as sent.
+ *
+ * @param req      Parsed request
+ * @param out      Output buffer
+ * @param out_size Size of out
+ * @return Key length, or -1 if it does not fit.
+ */
+int http_cache_key(const HttpRequest *req, char *out, size_t out_size);
+
+/**
+ * @brief Parse the header of a backend response.
+ *
+ * Only the head is looked at, so this works as soon as the head is in.
+ *
+ * @param resp   Raw response (status line, headers, body so far)
+ * @param len    Length of resp
+ * @param now    Current wall clock time (seconds), used when Date is missing
+ * @param policy Output
+ * @return 0 if the header was parsed (see policy->cacheable), -1 if malformed.
+ */
+int http_cache_parse_response(const char *resp, size_t len, int64_t now, http_cache_policy_t *policy);
+
+/**
+ * @brief Copy a response head for storage: without Age and X-Cache headers and without the final blank line.
+ *
+ * A stored head is sent with a fresh Age and X-Cache header appended (and the blank line).
+ *
+ * @param dst      Output (at least head_len bytes)
+ * @param head     Response head including the blank line
+ * @param head_len policy.header_len
+ * @return Bytes written to dst.
+ */
+size_t http_cache_copy_head(char *dst, const char *head, size_t head_len);
+
+/**
+ * @brief Collect the request's values of the headers named in a Vary list.
+ *
+ * Two requests may share a stored response only if these strings are equal.
+ * Accept-Encoding is compared by the codings it accepts (br, gzip,
+ * deflate), not by its spelling.
+ *
+ * @param req      Parsed request
+ * @param vary     Names as stored in http_cache_policy_t.vary
+ * @param out      Output buffer ("value\n" per name, empty value if absent)
+ * @param out_size Size of out
+ * @return Length written, or -1 if it does not fit.
+ */
+int http_cache_vary_values(const HttpRequest *req, const char *vary, char *out, size_t out_size);
+
+/**
+ * @brief Check whether an Accept-Encoding value accepts a content coding.
+ *
+ * @param accept Accept-Encoding header value (NULL = header absent)
+ * @param coding Coding name, e.g. "gzip"
+ * @return true if listed without q=0.
+ */
+bool http_cache_accepts_encoding(const char *accept, const char *coding);
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @file rate_limiter.h
+ * @brief Per-client token-bucket rate limiter in a fixed-size lock-free table.
+ *
+ * The table is an open-addressed hash table (linear probing) of 16-byte
+ * slots:
+ *
+ *   key   → 64-bit hash of "client_ip" or "client_ip|route prefix" (0 = empty)
+ *   state → [ tokens in 1/1000 units : 32 | last refill time in ms : 32 ]
+ *
+ * Both words are updated with C11 atomics (CAS loops), so any number of
+ * threads can check and consume tokens at the same time without a lock.
+ * The same holds across processes: the table is shared anonymous memory,
+ * so the worker processes forked by -w all update one table and a client
+ * gets the configured rate whatever worker its connections land on.
+ * Packing tokens and timestamp into one word means refill + consume is a
+ * single compare-and-swap: no torn bucket state.
+ *
+ * Fixed memory: RATE_LIMIT_TABLE_SIZE slots, mapped once by
+ * rate_limiter_init() before any worker is forked. When a
+ * new client cannot find a free slot within RATE_LIMIT_PROBE_LIMIT probes,
+ * the least recently refilled slot in that probe window is taken over
+ * (LRU-like eviction). An evicted client simply starts again with a full
+ * bucket, which errs on the side of letting traffic through.
+ */
+
+#define RATE_LIMIT_TABLE_SIZE 65536 /**< Slots, must be a power of two (1 MiB of memory) */
+#define RATE_LIMIT_PROBE_LIMIT 8    /**< Slots inspected before evicting */
+#define RATE_LIMIT_BURST_MAX 4294967 /**< UINT32_MAX / 1000: a bucket holds milli-tokens in 32 bits */
+
+/**
+ * @brief Map the shared table (before forking workers).
+ * @return 0 on success, -1 with errno set if mmap failed
+ */
+int rate_limiter_init(void);
+
+/**
+ * @brief Hash a client (and optionally a route) into a rate limiter key.
+ *
+ * @param client_ip Client address string
+ * @param scope     Route prefix for per-route buckets, or NULL for a per-IP bucket
+ * @return Non-zero 64-bit key
+ */
+uint64_t rate_limiter_key(const char *client_ip, const char *scope);
+
+/**
+ * @brief Take one token from the bucket of a key.
+ *
+ * Refills the bucket for the time elapsed since its last update, then tries
+ * to consume one token. Safe to call concurrently from any thread or
+ * process sharing the table. Allows everything before rate_limiter_init().
+ *
+ * @param key   Key from rate_limiter_key()
+ * @param rate  Refill rate in tokens per second
+ * @param burst Bucket capacity in tokens, at most RATE_LIMIT_BURST_MAX
+ * @return true if the request is allowed, false if it must be rejected (429)
+ */
+bool rate_limiter_allow(uint64_t key, double rate, int burst);
@@ -1,4 +1,5 @@
 #pragma once
+#include <sys/socket.h>
 #include "common/http_types.h" // For HttpRequest struct
 
 // Maximum size for rebuilt request
@@ -15,7 +16,7 @@
  * @return 0 on success & -1 on failure
  */
 
-ssize_t rebuild_request(HttpRequest *req, char *buffer,char *client_ip ,size_t buffer_size);
+ssize_t rebuild_request(HttpRequest *req, char *buffer, const char *client_ip, size_t buffer_size);
 
 /**
  * @brief Function to get client IP from socket
@@ -26,4 +27,16 @@ ssize_t rebuild_request(HttpRequest *req, char *buffer,char *client_ip ,size_t b
  * @return 0 on success & -1 on failure
  */
 
-int get_client_ip(int client_fd, char *ip_buffer, size_t buffer_size);
\ No newline at end of file
+int get_client_ip(int client_fd, char *ip_buffer, size_t buffer_size);
+
+/**
+ * @brief Format a client address as text (reentrant, IPv4 and IPv6).
+ *
+ * IPv4 clients of a dual-stack listener (::ffff:a.b.c.d) come out as
+ * plain a.b.c.d, so X-Forwarded-For and rate limit keys look the same
+ * whichever way they connected.
+ *
+ * @param ip_buffer At least INET6_ADDRSTRLEN bytes for IPv6 addresses
+ * @return 0 on success & -1 on failure ("127.0.0.1" is stored then)
+ */
+int format_client_ip(const struct sockaddr *addr, socklen_t addr_len, char *ip_buffer, size_t buffer_size);
\ No newline at end of file
@@ -16,4 +16,12 @@ int parse_http_request(char *buffer, HttpRequest *req);
  * @brief Frees any dynamically allocated memory in an HttpRequest and resets its fields.
  * @param req Pointer to a HttpRequest struct where the already parsed request fields will cleared.
  */
-void free_http_request(HttpRequest *req);
\ No newline at end of file
+void free_http_request(HttpRequest *req);
+
+/**
+ * @brief Look up a request header by name (case-insensitive).
+ * @param req  Parsed request
+ * @param name Header name, e.g. "Host"
+ * @return Value of the first matching header, or NULL if absent.
+ */
+const char *get_request_header(const HttpRequest *req, const char *name);
\ No newline at end of file
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <stdbool.h>
+
 #define MAX_ROUTES 10
 #define MAX_PREFIX_LEN 32
-#define MAX_HOST_LEN 64
+#define MAX_HOST_LEN 112 /**< Fits "unix:" and most of a sun_path */
+#define MAX_STATIC_PATH_LEN 256
 
 /**
  * @file rout_config.h
@@ -12,8 +15,8 @@
  * to load and match backend routes.
  *
  * @note Thread Safety
- *  We load at once at startup
- *  We are not modifying while serving the request
+ *  A loaded Route array is never modified while serving requests.
+ *  Reloads build a new array and publish it atomically (see route_table.h).
  */
 
 /**
@@ -23,6 +26,33 @@
  *  prefix: "/api/"
  *  host: "localhost"
  *  port: 8080
+ *
+ * Optional per-route settings follow the port as key=value tokens:
+ *
+ *  /api/ localhost 8080 ratelimit=20:40 ratelimit_scope=route
+ *
+ *  ratelimit=RPS:BURST      Token bucket per client IP (RPS refill rate, BURST capacity)
+ *  ratelimit_scope=ip|route ip    → one bucket per client shared by all "ip" scoped routes (default)
+ *                           route → separate bucket per client for this route
+ *  cache=on|off             Serve/store responses in the response cache (default on,
+ *                           only responses that allow it via Cache-Control/Expires are stored)
+ *  compress=on|off          gzip text responses for clients that accept it (default off, v2-epoll)
+ *  compress_min=BYTES       Smallest response worth compressing (default 1024)
+ *  proto=http1|h2c          Speak HTTP/2 cleartext to the backend, many requests per
+ *                           connection (default http1, v2-epoll)
+ *
+ * Co-located backends can be reached over a unix domain socket instead of
+ * loopback TCP (v2-epoll), the path takes the place of host and port:
+ *
+ *  /api/ unix:/run/app.sock proto=h2c
+ *
+ * Static routes serve files from disk instead of a backend (v2-epoll):
+ *
+ *  /_next/ static /srv/app/.next/          /_next/static/a.js → /srv/app/.next/static/a.js
+ *  /favicon.ico static /srv/app/public/favicon.ico
+ *
+ * The part of the request path after the prefix is appended to the
+ * directory; an exact match serves the named file itself.
  */
 
 typedef struct
@@ -30,6 +60,19 @@ typedef struct
     char prefix[MAX_PREFIX_LEN];
     char host[MAX_HOST_LEN];
     int port;
+
+    double ratelimit_rps;     /**< Requests per second per client (0 = no rate limit). */
+    int ratelimit_burst;      /**< Bucket capacity (max burst). */
+    bool ratelimit_per_route; /**< Key the bucket by client IP + prefix instead of client IP only. */
+
+    bool cache_disabled;      /**< Never use the response cache for this route. */
+
+    bool compress;            /**< gzip eligible responses on the fly (see compress.h). */
+    long compress_min_bytes;  /**< Smaller responses are sent as they are (0 = default). */
+
+    bool h2c;                 /**< Multiplex requests over shared HTTP/2 connections (see h2_upstream.h). */
+
+    char static_path[MAX_STATIC_PATH_LEN]; /**< Directory (or file) served from disk, empty for backend routes. */
 } Route;
 
 /**
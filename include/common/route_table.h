@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "common/route_config.h"
+
+/**
+ * @file route_table.h
+ * @brief Hot-reloadable routing table (RCU-style publish, epoch-based reclamation).
+ *
+ * Readers (event loops) never take a lock:
+ *
+ *   route_table_t *t = route_table_acquire();   // pin current generation
+ *   Route *r = find_backend(t->routes, t->count, path);
+ *   ... connection keeps using r until it is finished ...
+ *   route_table_release(t);
+ *
+ * Writer (reloader thread, woken by SIGHUP or inotify on routes.conf):
+ *   1. parse the file into a brand new table (off the event loop)
+ *   2. publish it with one atomic pointer exchange
+ *   3. retire the old table; free it once nobody can reach it any more
+ *
+ * Why both an epoch and a reference count?
+ * - The refcount keeps a table alive while in-flight connections still point
+ *   into it (selected_backend), which can be seconds.
+ * - But "load pointer, then increment refcount" has a window where the writer
+ *   could free the table in between. Readers announce the global epoch in
+ *   their slot for that tiny window; a retired table is only freed when no
+ *   reader slot is still in an epoch that could have seen it.
+ *
+ * @note Thread Safety
+ *  acquire/release may be called from any number of threads.
+ *  Only the reloader thread publishes and reclaims.
+ */
+
+#define ROUTE_TABLE_MAX_READERS 64 /**< Threads that may call route_table_acquire() */
+
+typedef struct route_table
+{
+    Route routes[MAX_ROUTES];
+    int count;
+
+    uint64_t generation;       /**< 1 for the startup table, +1 per successful reload */
+    _Atomic int refs;          /**< "current" pointer + every connection using it */
+    uint64_t retire_epoch;     /**< Global epoch at which it stopped being current */
+    struct route_table *next_retired;
+} route_table_t;
+
+/**
+ * @brief Load the initial table synchronously at startup.
+ *
+ * @param filename Path to routes.conf
+ * @return Number of routes loaded, or -1 on error.
+ */
+int route_table_init(const char *filename);
+
+/**
+ * @brief Start the background thread that reloads routes on SIGHUP or file change.
+ *
+ * SIGHUP must already be blocked in every thread (it is consumed with signalfd).
+ *
+ * @param filename Path to routes.conf (same as route_table_init)
+ * @return 0 on success, -1 on error (the proxy keeps running with the current table).
+ */
+int route_table_start_reloader(const char *filename);
+
+/**
+ * @brief Pin the current table. Lock-free; never blocks.
+ * @return Current table with one reference taken (never NULL after init).
+ */
+route_table_t *route_table_acquire(void);
+
+/**
+ * @brief Drop a reference taken with route_table_acquire().
+ * @param table Table to release (may be NULL).
+ */
+void route_table_release(route_table_t *table);
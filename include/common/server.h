@@ -1,5 +1,7 @@
 #pragma once
 
+#include <sys/socket.h>
+
 /**
  * @file server.h
  * @brief Declares functions for setting up a server socket and accepting client connections.
@@ -8,15 +10,57 @@
 /**
  * @brief Creates and binds a TCP server socket to the specified port.
  *
+ * Dual stack where the kernel has IPv6: an AF_INET6 socket on [::] with
+ * IPV6_V6ONLY off, so IPv4 clients arrive as ::ffff:a.b.c.d.
+ *
  * @param port The port number to bind the server socket to.
  * @return Server socket file descriptor on success, -1 on failure.
  */
 int setup_server(int port);
 
+/**
+ * @brief setup_server() with SO_REUSEPORT: every call adds one more socket
+ *        to the port's group, and the kernel spreads connections over them.
+ *
+ * Sockets join the group in the order they are bound, which is the index a
+ * SO_ATTACH_REUSEPORT_CBPF program returns to pick one.
+ */
+int setup_server_reuseport(int port);
+
+/**
+ * @brief Optional accept-path options for a listening socket.
+ *
+ * - TCP_DEFER_ACCEPT: the connection is only handed to accept() once the
+ *   client has sent data (or after defer_accept_s), so a connect that never
+ *   sends a request costs no descriptor or wakeup.
+ * - TCP_FASTOPEN: clients with a cookie from an earlier connection send
+ *   their request in the SYN and it is readable right after accept(), one
+ *   round trip earlier. Needs net.ipv4.tcp_fastopen with the server bit (2).
+ *
+ * @param server_id Listening socket (also works on one inherited in an upgrade)
+ * @param defer_accept_s Seconds to wait for data, 0 to leave it off
+ * @param fastopen_qlen Max pending Fast Open connections, 0 to leave it off
+ * @return 0 on success, -1 if an option was refused.
+ */
+int configure_listener(int server_id, int defer_accept_s, int fastopen_qlen);
+
 /**
  * @brief Accepts a new client connection on the server socket.
  *
  * @param server_id File descriptor of the server socket returned by setup_server.
- * @return Client socket file descriptor on success, -1 on failure.
+ * @return Client socket file descriptor on success, -1 if no connection is pending
+ *         (non-blocking socket), -2 on other failures (errno is preserved).
+ */
+int accept_client(int server_id);
+
+/**
+ * @brief Accept one client in a single accept4() call: non-blocking and
+ *        close-on-exec already, with its address filled in.
+ *
+ * @param server_id Listening socket
+ * @param addr Filled with the client's address (IPv4, IPv6 or v4-mapped)
+ * @param addr_len In: sizeof(*addr), out: the address length
+ * @return Client socket, -1 if no connection is pending, -2 on other
+ *         failures (errno is preserved).
  */
-int accept_client(int server_id);
\ No newline at end of file
+int accept_client_nb(int server_id, struct sockaddr_storage *addr, socklen_t *addr_len);
\ No newline at end of file
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+
+/**
+ * @file admission.h
+ * @brief CoDel-based overload shedding for new client connections.
+ *
+ * Queueing delay of the event loop
+ * --------------------------------
+ * Events that become ready while we are busy processing a batch sit in the
+ * epoll ready list until the next epoll_wait(). If that epoll_wait() returns
+ * immediately with events, the oldest of them waited roughly as long as the
+ * previous batch took to process. That busy time is our "sojourn time".
+ * If epoll_wait() actually blocked, nothing was waiting → sojourn is zero.
+ *
+ * CoDel (Controlled Delay, RFC 8289)
+ * ----------------------------------
+ * - A short spike above TARGET is fine (a good queue absorbs bursts).
+ * - If the sojourn stays above TARGET for a whole INTERVAL, the loop is
+ *   persistently overloaded → enter the "dropping" state.
+ * - While dropping, each drop is followed by a pause of INTERVAL / sqrt(count),
+ *   so shedding gets more aggressive the longer the overload lasts.
+ * - As soon as one sample is below TARGET, stop dropping.
+ *
+ * What a "drop" is here
+ * ---------------------
+ * Accept whatever is in the listen backlog and answer each one with a canned
+ * 503 + close (no connection_t, no epoll registration), then remove the
+ * listener from epoll for the pause. New SYNs queue in the kernel meanwhile,
+ * costing us nothing, and the loop spends its time finishing requests that
+ * are already in flight, which keeps goodput near peak instead of collapsing.
+ *
+ * EMFILE
+ * ------
+ * When accept() fails with EMFILE/ENFILE the pending connection stays in the
+ * backlog and a level-triggered listener wakes us forever. A spare fd
+ * (/dev/null) is reserved at startup; on EMFILE it is closed, the connection
+ * is accepted into the freed slot, gets the 503, and the spare is reopened.
+ */
+
+#define ADMISSION_TARGET_US 5000      /**< Acceptable standing queueing delay (5ms) */
+#define ADMISSION_INTERVAL_US 100000  /**< Time above target before shedding (100ms) */
+#define ADMISSION_SHED_BATCH 64       /**< Max backlog connections rejected per drop */
+
+/**
+ * @brief Reserve the spare fd used to shed connections on EMFILE.
+ * @return 0 on success, -1 on error.
+ */
+int admission_init(void);
+
+/**
+ * @brief Feed one epoll_wait() call into the CoDel state.
+ *
+ * @param wait_start_us Time just before epoll_wait()
+ * @param wait_end_us   Time just after epoll_wait() returned
+ * @param nfds          Number of events returned
+ */
+void admission_observe_wait(uint64_t wait_start_us, uint64_t wait_end_us, int nfds);
+
+/**
+ * @brief Whether the loop is persistently overloaded and new connections should be shed.
+ */
+bool admission_should_shed(void);
+
+/**
+ * @brief Perform one CoDel drop: reject pending connections and pause the listener.
+ *
+ * @param epoll_fd  Epoll instance
+ * @param listen_fd Listening socket (removed from epoll for the pause)
+ * @return Number of connections rejected.
+ */
+int admission_shed(int epoll_fd, int listen_fd);
+
+/**
+ * @brief Re-arm the listener once its pause has elapsed.
+ *
+ * @param epoll_fd  Epoll instance
+ * @param listen_fd Listening socket
+ * @param event     Event to register the listener with (same as at startup)
+ */
+void admission_resume_listener(int epoll_fd, int listen_fd, struct epoll_event *event);
+
+/**
+ * @brief Accept-and-reject one connection using the reserved spare fd.
+ *
+ * Call when accept() failed with EMFILE or ENFILE.
+ *
+ * @param listen_fd Listening socket
+ */
+void admission_shed_emfile(int listen_fd);
+
+/**
+ * @brief Milliseconds until the paused listener must be re-armed.
+ * @return -1 if the listener is not paused.
+ */
+int admission_next_timeout(void);
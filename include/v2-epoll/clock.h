@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @file clock.h
+ * @brief Monotonic time helpers for the event loop.
+ *
+ * CLOCK_MONOTONIC is used everywhere a deadline or a latency sample is
+ * needed, because wall-clock time (gettimeofday/time) can jump backwards
+ * or forwards when NTP adjusts it, which would corrupt queue deadlines
+ * and RTT measurements.
+ */
+
+/**
+ * @brief Current monotonic time in milliseconds.
+ * @return Milliseconds since an arbitrary fixed point.
+ */
+uint64_t clock_now_ms(void);
+
+/**
+ * @brief Current monotonic time in microseconds.
+ *
+ * Used for latency samples, where loopback backends answer well below
+ * one millisecond and ms resolution would round every sample to zero.
+ *
+ * @return Microseconds since an arbitrary fixed point.
+ */
+uint64_t clock_now_us(void);
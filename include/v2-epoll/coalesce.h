@@ -0,0 +1,187 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @file coalesce.h
+ * @brief Request coalescing (collapsed forwarding) for identical cacheable GETs.
+ *
+ * When a popular URL expires, hundreds of clients ask for it at once. Without
+ * coalescing every one of them opens its own backend connection. Here the
+ * first request for a cache key becomes the *leader* of a "flight" and goes
+ * upstream; requests for the same key that arrive while it is in flight
+ * become *followers* and get the leader's response bytes as they arrive.
+ *
+ *   leader:    client ── request ──► backend ── bytes ──► client
+ *                                       │
+ *                                       ▼  appended once
+ *   flight:             [chunk]→[chunk]→[chunk]→ ...   (refcounted, shared)
+ *                          ▲        ▲
+ *   followers:         cursor A  cursor B  ── each writes to its own client
+ *
+ * Sharing is only safe for responses a shared cache may store, which is not
+ * known before the response head arrives:
+ * - Followers wait (no backend connection, no upstream slot) until the head
+ *   is in. If it is shareable and their Vary values match, they start
+ *   streaming from the chain; otherwise they go upstream themselves.
+ * - A follower that waits longer than COALESCE_WAIT_TIMEOUT_MS for the head
+ *   gives up and goes upstream itself.
+ * - If the leader fails (backend error, leader's client gone) before the
+ *   response is complete, followers that have not sent anything yet go
+ *   upstream themselves; the others are closed, like the leader's client.
+ *
+ * Cost when there is no concurrency: one hash lookup. The leader only starts
+ * copying into the chain when the first follower joins (the bytes received
+ * so far are taken from its response buffer, which is never compacted).
+ *
+ * Followers that need the event loop's attention (bytes to stream, or lost
+ * their flight) are put on a pending list; the loop drains it with
+ * coalesce_pop_pending() after each batch of events.
+ *
+ * @note Single-threaded: owned by the event loop.
+ */
+
+#define COALESCE_WAIT_TIMEOUT_MS 2000 /**< Max wait for the leader's response head */
+#define COALESCE_CHUNK_SIZE 16384     /**< Bytes per chain chunk */
+#define COALESCE_MAX_BYTES (1024 * 1024) /**< Responses larger than this stop being shared (not cacheable anyway) */
+#define COALESCE_TABLE_SIZE 1024      /**< Hash buckets for in-flight keys */
+
+struct connection;
+
+typedef struct flight_chunk
+{
+    struct flight_chunk *next;
+    size_t len;
+    char data[COALESCE_CHUNK_SIZE];
+} flight_chunk_t;
+
+typedef enum
+{
+    FLIGHT_WAITING_HEAD, /**< Response head not evaluated yet; followers wait */
+    FLIGHT_SHARING,      /**< Shareable response, followers stream from the chain */
+    FLIGHT_COMPLETE,     /**< Backend finished; the chain holds the whole response */
+    FLIGHT_PRIVATE,      /**< Not shareable (or too large); followers went upstream */
+    FLIGHT_ABORTED       /**< Leader failed before the response was complete */
+} flight_state_t;
+
+typedef struct flight
+{
+    char *key;
+    uint64_t hash;
+    flight_state_t state;
+    int refs;                  /**< Leader + attached followers */
+    bool recording;            /**< Bytes are being copied into the chain */
+    bool in_table;             /**< Still joinable */
+
+    struct connection *leader;
+    struct connection *followers;
+
+    flight_chunk_t *chunks;    /**< First chunk of the response */
+    flight_chunk_t *last;      /**< Chunk being appended to */
+    size_t total_len;
+
+    char vary[256];            /**< Vary names of the response (once head is known) */
+
+    struct flight *hash_next;
+} flight_t;
+
+/**
+ * @brief Per-connection coalescing state (embedded in connection_t).
+ */
+typedef struct
+{
+    flight_t *flight;          /**< Flight this connection leads or follows (NULL if none) */
+    bool leader;
+    bool parked;               /**< Follower caught up with the chain, waiting for more bytes */
+
+    struct connection *prev;   /**< Followers of the same flight */
+    struct connection *next;
+    struct connection *wait_prev; /**< Global FIFO of followers waiting for a head */
+    struct connection *wait_next;
+    bool pending;              /**< On the pending list */
+    struct connection *pend_prev;
+    struct connection *pend_next;
+    uint64_t deadline_ms;      /**< Go upstream if still waiting for the head at this time */
+
+    flight_chunk_t *chunk;     /**< Follower's read cursor */
+    size_t chunk_off;
+    size_t sent;               /**< Bytes written to the follower's client */
+} coalesce_member_t;
+
+/**
+ * @brief Find a joinable in-flight request for this key.
+ */
+flight_t *coalesce_find(const char *key);
+
+/**
+ * @brief Make a connection the leader of a new flight for this key.
+ * @return 0 on success, -1 on allocation failure (the request simply isn't coalesced).
+ */
+int coalesce_lead(struct connection *leader, const char *key);
+
+/**
+ * @brief Attach a follower to a flight.
+ *
+ * @return 0 if attached (wait for the head, or start streaming if it is already
+ *         known to be shareable), -1 if this follower can't share the response
+ *         (Vary mismatch, not shareable, out of memory) and must go upstream.
+ */
+int coalesce_join(flight_t *flight, struct connection *follower, uint64_t now_ms);
+
+/**
+ * @brief Leader received more response bytes.
+ *
+ * Appends them to the chain if followers exist, evaluates the head once it
+ * is complete and marks parked followers pending. Followers that can't share
+ * the response are detached and marked pending too.
+ *
+ * @param leader Leading connection
+ * @param data   New bytes
+ * @param len    Number of new bytes
+ */
+void coalesce_leader_data(struct connection *leader, const char *data, size_t len);
+
+/**
+ * @brief Leader's backend finished the response (EOF).
+ */
+void coalesce_leader_complete(struct connection *leader);
+
+/**
+ * @brief Leave the flight (called from connection_free).
+ *
+ * A leader leaving an incomplete flight aborts it and orphans its followers.
+ */
+void coalesce_detach(struct connection *conn);
+
+/**
+ * @brief Write as much of the shared response to a follower's client as possible.
+ *
+ * @return 1 when the complete response was sent, 0 if the socket is full or the
+ *         follower caught up with the leader (check member.parked), -1 on error,
+ *         -2 if the client closed the connection.
+ */
+ssize_t coalesce_follower_send(struct connection *follower, int fd);
+
+/**
+ * @brief Detach followers whose wait for the head timed out and mark them pending.
+ */
+void coalesce_expire(uint64_t now_ms);
+
+/**
+ * @brief Next follower that needs the event loop.
+ *
+ * - member.flight != NULL: new bytes to stream, arm EPOLLOUT.
+ * - member.flight == NULL: detached (timeout, Vary mismatch, not shareable,
+ *   leader failed). Go upstream if member.sent is 0, otherwise close.
+ *
+ * @return Follower, or NULL if none is pending.
+ */
+struct connection *coalesce_pop_pending(void);
+
+/**
+ * @brief Milliseconds until the next head-wait deadline, 0 if followers are pending, -1 if none.
+ */
+int coalesce_next_timeout(uint64_t now_ms);
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "common/http_types.h"
+#include "common/route_config.h"
+#include "v2-epoll/buffer.h"
+
+/**
+ * @file compress.h
+ * @brief On-the-fly gzip of backend responses on routes with compress=on.
+ *
+ * Next.js compresses in the Node process, on the same thread that renders
+ * pages. On a compress route the proxy does it instead: Accept-Encoding is
+ * not forwarded, so the backend always answers uncompressed, and the
+ * response is gzipped on its way to clients that accept it.
+ *
+ *   backend ──► response_buffer ──► [dechunk] ──► worker: deflate() ──► out ──► client
+ *                    │ (raw copy: identity cache entry, followers)           │
+ *                    ▼                                                       ▼
+ *               cache[key]                                  cache[key + "\ngzip"]
+ *
+ * What is compressed
+ * ------------------
+ * A 200 response to a GET, without Content-Encoding, Content-Range or
+ * Cache-Control: no-transform, whose Content-Type is on the allow-list
+ * below (text/..., JavaScript, JSON, XML, SVG, web manifests, wasm and
+ * uncompressed fonts) and whose Content-Length is at least the route's
+ * compress_min (unknown lengths are compressed). Content-Length and
+ * Transfer-Encoding are dropped (chunked bodies are decoded first; the
+ * client reads until close), the ETag becomes weak, and Content-Encoding:
+ * gzip and Vary: Accept-Encoding are added.
+ *
+ * Offloaded jobs
+ * --------------
+ * deflate() never runs on the event loop. Each stream has at most one job
+ * in flight on the offload pool (offload.h); bytes that arrive meanwhile
+ * wait for the next job. A job ends with Z_SYNC_FLUSH (Z_FINISH for the
+ * last one), so every backend read reaches the client without waiting for
+ * more input. offload_collect() queues finished jobs here and the loop
+ * takes them with compress_pop_done(). The connection stays in
+ * CONN_COMPRESSING meanwhile.
+ *
+ * Compressed variant cache
+ * ------------------------
+ * A finished stream for a cacheable response is stored in the response
+ * cache under the variant key (compress_variant_key()), so an asset is
+ * compressed once and later clients get the stored gzip bytes. The
+ * uncompressed response is still stored under the plain key for clients
+ * that don't accept gzip.
+ *
+ * @note The stream API is for the event loop thread only; the pool only
+ *       touches a stream while its job is in flight.
+ */
+
+#define COMPRESS_LEVEL 6           /**< zlib level (1 fastest .. 9 smallest) */
+#define COMPRESS_MIN_BYTES 1024    /**< Default compress_min: smaller bodies barely shrink */
+#define COMPRESS_VARIANT_SUFFIX "\ngzip" /**< Appended to a cache key for the gzip copy ('\n' never occurs in keys) */
+
+struct connection;
+typedef struct compress_stream compress_stream_t;
+
+/**
+ * @brief What compress_pop_done() has to report about a stream.
+ */
+typedef enum
+{
+    COMPRESS_PROGRESS, /**< More compressed bytes in the output */
+    COMPRESS_FINISHED, /**< The whole gzip member is in the output */
+    COMPRESS_FAILED    /**< zlib error; the response can't be completed */
+} compress_result_t;
+
+/**
+ * @brief Would a response to this request be compressed if it qualifies?
+ *
+ * The route has compress=on, the offload pool runs, the method is GET and the
+ * client accepts gzip.
+ */
+bool compress_wanted(const Route *route, const HttpRequest *req);
+
+/**
+ * @brief Build the cache key of the gzip copy of a response.
+ * @return Length written, or -1 if it does not fit.
+ */
+int compress_variant_key(const char *key, char *out, size_t out_size);
+
+/**
+ * @brief Length of the plain key a key was built from (strlen(key) if it is not a variant key).
+ */
+size_t compress_base_key_len(const char *key);
+
+/**
+ * @brief Check whether a response should be compressed (see "What is compressed").
+ *
+ * @param head      Response head (status line and headers, blank line optional)
+ * @param head_len  Length of head
+ * @param body_len  Body length if known, -1 otherwise (Content-Length wins)
+ * @param min_bytes Smallest body worth compressing
+ */
+bool compress_eligible(const char *head, size_t head_len, int64_t body_len, size_t min_bytes);
+
+/**
+ * @brief Begin compressing a response: writes the rewritten head to the output.
+ *
+ * @param conn     Connection the stream belongs to (returned by compress_pop_done())
+ * @param head     Response head including the blank line
+ * @param head_len Length of head
+ * @return New stream, or NULL on error (send the response uncompressed).
+ */
+compress_stream_t *compress_start(struct connection *conn, const char *head, size_t head_len);
+
+/**
+ * @brief Hand more raw body bytes (as sent by the backend) to the stream.
+ *
+ * @param stream Stream
+ * @param data   Body bytes (chunked framing is removed here)
+ * @param len    Length of data
+ * @param eof    The backend finished: the stream is finished after these bytes
+ * @return 0 on success, -1 on error (allocation, bad chunked framing).
+ */
+int compress_feed(compress_stream_t *stream, const char *data, size_t len, bool eof);
+
+/**
+ * @brief Compressed response (head first) to send; the sent part is consumed via its offset.
+ *
+ * Never compacted, so after COMPRESS_FINISHED it holds the whole response.
+ */
+buffer_t *compress_output(compress_stream_t *stream);
+
+/**
+ * @brief True once the last job finished and its output is in compress_output().
+ */
+bool compress_finished(const compress_stream_t *stream);
+
+/**
+ * @brief Collect the next finished job (call after offload_collect()).
+ *
+ * Appends the job's output, submits the next job if input is waiting, and
+ * frees streams whose connection went away.
+ *
+ * @param result What happened to the returned connection's stream
+ * @return Connection whose stream made progress, or NULL when none is left.
+ */
+struct connection *compress_pop_done(compress_result_t *result);
+
+/**
+ * @brief Detach a stream from its connection and free it (once its job, if any, finished).
+ */
+void compress_release(compress_stream_t *stream);
@@ -1,10 +1,23 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 #include "buffer.h"
 #include "common/http_types.h"
 #include "common/route_config.h"
 #include "v2-epoll/connection_state.h"
+#include "v2-epoll/response_cache.h"
+#include "v2-epoll/coalesce.h"
+#include "v2-epoll/disk_cache.h"
+#include "v2-epoll/peer.h"
+#include "v2-epoll/static_files.h"
+#include "v2-epoll/compress.h"
+#include "v2-epoll/tunnel.h"
+#include "v2-epoll/h2_upstream.h"
+#include "v2-epoll/h2_server.h"
+#include "v2-epoll/tls.h"
 
 /**
  * Represents a single proxied connection (client <-> proxy <-> backend).
@@ -25,6 +38,7 @@ typedef struct connection
     HttpRequest parsed_request; /**< Parsed HTTP request (populated once parsing succeeds). */
     bool request_parsed;        /**< True once request has been fully parsed. */
     Route *selected_backend;     /**< Routing decision for backend (after parsing request). */
+    struct route_table *route_table; /**< Routing table generation selected_backend points into (pinned until free). */
 
     /* ---------------- Backend Communication ---------------- */
     buffer_t rebuilt_request_buffer;       /**< Buffer holding reconstructed/normalized request for backend. */
@@ -32,12 +46,61 @@ typedef struct connection
 
     /* ---------------- Response Handling ---------------- */
     buffer_t response_buffer;   /**< Buffer holding backend response data. */
-    
+
+    /* ---------------- Response Cache ---------------- */
+    char *cache_key;           /**< Key to store the response under (NULL = not cacheable). */
+    cache_reply_t cache_reply; /**< Cache hit being sent to the client (entry NULL if none). */
+    disk_reply_t disk_reply;   /**< Persistent tier hit being sent to the client (inactive if none). */
+    static_reply_t static_reply; /**< Static route response being sent to the client (inactive if none). */
+    coalesce_member_t coalesce; /**< Identical in-flight request this one leads or follows (see coalesce.h). */
+    cache_entry_t *stale_entry; /**< Expired copy to serve if the backend fails (stale-if-error), NULL if none. */
+    bool is_refresh;             /**< Background refresh of a stale entry: no client (client_fd is -1). */
+    cache_entry_t *refresh_entry; /**< Entry being refreshed, until the refresh ends. */
+    peer_member_t peer;          /**< Other proxy asked for this miss instead of the origin (see peer.h). */
+
+    /* ---------------- Compression ---------------- */
+    bool compress_pending;       /**< compress=on and the client takes gzip: decide once the response head is in. */
+    char *compress_key;          /**< Cache key of the gzip copy (NULL = the compressed response isn't stored). */
+    compress_stream_t *compress; /**< Response being gzipped on its way to the client (NULL if not, see compress.h). */
+    bool client_epollout;        /**< Client fd is watched for EPOLLOUT while compressed bytes wait. */
+
+    /* ---------------- Tunnel ---------------- */
+    tunnel_member_t tunnel;      /**< WebSocket or CONNECT relay, once the backend agreed (see tunnel.h). */
+
+    /* ---------------- HTTP/2 Upstream ---------------- */
+    h2_member_t h2;              /**< Stream on a shared h2c backend connection instead of backend_fd (see h2_upstream.h). */
+
+    /* ---------------- HTTP/2 Client ---------------- */
+    struct h2_server *h2_server; /**< Session of an HTTP/2 client connection (CONN_H2_CLIENT, see h2_server.h). */
+    bool h2_stream;              /**< Client end is a stream of an HTTP/2 session: never handed over in an upgrade. */
+
+    /* ---------------- TLS ---------------- */
+    struct tls_session *tls;     /**< TLS state of the client socket: handshake, bridge or kernel TLS (see tls.h). */
+    bool tls_inner;              /**< Client end is the plaintext side of a TLS bridge: never handed over in an upgrade. */
+
+    /* ---------------- Upstream Concurrency ---------------- */
+    struct upstream_limiter *upstream; /**< Limiter this request waits on or holds a slot of (NULL if none). */
+    bool upstream_slot_held;           /**< True once the request may talk to the backend. */
+    bool backend_responded;            /**< True once the backend sent any response bytes (RTT sample is valid). */
+    uint64_t upstream_start_us;        /**< When the slot was taken, for the RTT sample. */
+    uint64_t queue_deadline_ms;        /**< Reject with 503 if still queued at this time. */
+    struct connection *queue_prev;     /**< Intrusive links in the limiter queue (no allocation per request). */
+    struct connection *queue_next;
+
+    /* ---------------- Deferred Free ---------------- */
+    struct connection *free_next; /**< Link in the pending-free list (see connection_schedule_free). */
+
+    /* ---------------- Live Connections ---------------- */
+    struct connection *live_prev; /**< Links in the list of every allocated connection (upgrade handoff, draining). */
+    struct connection *live_next;
+
     /* ---------------- Error Handling ---------------- */
     int last_error; /**< Last errno or internal error code. */
 
     /* ---------------- Client Metadata ---------------- */
-    char client_ip[16]; /**< Client IPv4 string ("xxx.xxx.xxx.xxx"). */
+    struct sockaddr_storage peer_addr; /**< Client address as accept4() returned it (IPv4, IPv6 or v4-mapped). */
+    socklen_t peer_addr_len;           /**< 0 = not known (inherited fd, socketpair stream). */
+    char client_ip[INET6_ADDRSTRLEN];  /**< Client address as text, formatted on first use; see connection_client_ip(). */
 
 } connection_t;
 
@@ -56,4 +119,50 @@ connection_t *connection_create(int client_fd);
  * 
  * @param conn Pointer to the connection_t object to free (may be NULL).
  */
-void connection_free(connection_t *conn,int epoll_fd);
\ No newline at end of file
+void connection_free(connection_t *conn,int epoll_fd);
+
+/**
+ * @brief Mark a connection for cleanup at the end of the current loop iteration.
+ *
+ * Freeing immediately during event processing is unsafe if the same connection
+ * still has events pending in the current epoll batch. Safe to call more than
+ * once for the same connection; it is only queued once.
+ *
+ * @param conn Connection to free later.
+ */
+void connection_schedule_free(connection_t *conn);
+
+/**
+ * @brief Free every connection scheduled with connection_schedule_free().
+ *
+ * @param epoll_fd Epoll instance the connection fds are registered with.
+ */
+void connection_free_pending(int epoll_fd);
+
+/**
+ * @brief First connection in the list of all live (allocated, not yet freed) connections.
+ *
+ * Iterate with conn->live_next. Connections scheduled for free are still listed.
+ */
+connection_t *connection_live_first(void);
+
+/**
+ * @brief Number of live connections (in-flight and idle).
+ */
+int connection_live_count(void);
+
+/**
+ * @brief The client's address as text ("203.0.113.7", "2001:db8::1").
+ *
+ * Formatted on first use from the address accept4() returned, so
+ * connections that never need it (errors, static routes without rate
+ * limits) skip the formatting; only a connection without one (inherited
+ * during an upgrade) asks the kernel with getpeername().
+ */
+const char *connection_client_ip(connection_t *conn);
+
+/**
+ * @brief Accepted but nothing read yet: safe to move to another process as
+ *        a plain fd (upgrade handoff, migration between workers).
+ */
+bool connection_is_idle(const connection_t *conn);
@@ -22,13 +22,15 @@ typedef enum
  *
  * Reads and processes HTTP request from client. Handles request parsing,
  * backend connection establishment, and state transitions.
+ * Routing uses the current route table generation, which the connection
+ * keeps pinned until it is freed (see route_table.h).
  *
  * @param conn Pointer to connection structure
  * @return HANDLER_OK if write successful and connection can remain open.
  *         HANDLER_CLOSED if backend closed the connection.
  *         HANDLER_ERROR if a fatal error occurred.
  */
-handler_status_t handle_client_readable(connection_t *conn, Route *routes, int route_count, int epoll_fd);
+handler_status_t handle_client_readable(connection_t *conn, int epoll_fd);
 
 /**
  * @brief Handle outgoing data to client
@@ -77,3 +79,104 @@ handler_status_t handle_backend_writable(connection_t *conn, int epoll_fd);
  * @return HANDLER_ERROR always, since this represents a fatal state.
  */
 handler_status_t handle_connection_error(connection_t *conn, int epoll_fd);
+
+/**
+ * @brief Service the upstream wait queues.
+ *
+ * Rejects queued requests whose deadline passed with 503, and starts the
+ * backend connect for queued requests whose upstream has a free slot again.
+ * Call once per loop iteration, after finished connections were freed.
+ *
+ * @param epoll_fd Epoll instance
+ */
+void handle_upstream_queue(int epoll_fd);
+
+/**
+ * @brief Send requests whose peer missed its connect or response deadline to the origin.
+ *
+ * The peer is marked down (see peer.h). Call once per loop iteration, after
+ * finished connections were freed.
+ *
+ * @param epoll_fd Epoll instance
+ */
+void handle_peer_timeouts(int epoll_fd);
+
+/**
+ * @brief Service coalesced followers (see coalesce.h).
+ *
+ * Followers whose wait for the leader's head timed out, or that lost their
+ * flight before sending anything, go upstream themselves; followers with new
+ * shared bytes get EPOLLOUT. Call once per loop iteration, after finished
+ * connections were freed.
+ *
+ * @param epoll_fd Epoll instance
+ */
+void handle_coalesced(int epoll_fd);
+
+/**
+ * @brief Collect finished compression jobs and send their output (see compress.h).
+ *
+ * Call when the compression eventfd is readable. A finished response is
+ * stored as the gzip copy if it is cacheable.
+ *
+ * @param epoll_fd Epoll instance
+ */
+void handle_compress_done(int epoll_fd);
+
+/**
+ * @brief Relay tunnel bytes on any event of a CONN_TUNNEL connection (see tunnel.h).
+ *
+ * @param conn     Connection in state CONN_TUNNEL
+ * @param epoll_fd Epoll instance
+ * @param events   Events epoll reported for either of its fds
+ * @return HANDLER_OK while the tunnel is open, HANDLER_CLOSED when both
+ *         sides finished, HANDLER_ERROR on a socket error.
+ */
+handler_status_t handle_tunnel(connection_t *conn, int epoll_fd, uint32_t events);
+
+/**
+ * @brief Close tunnels that were idle for TUNNEL_IDLE_TIMEOUT_MS, and look
+ *        at offloaded ones waiting to pass on a FIN.
+ *
+ * Call once per loop iteration, before the pending connections are freed.
+ */
+void handle_tunnel_timeouts(int epoll_fd);
+
+/**
+ * @brief Service an HTTP/2 upstream connection (CONN_H2_UPSTREAM, see h2_upstream.h)
+ *        and relay what its streams received.
+ *
+ * @param session  The upstream connection's epoll entry
+ * @param epoll_fd Epoll instance
+ * @param events   Events epoll reported for it
+ * @return HANDLER_OK (the upstream connection frees itself).
+ */
+handler_status_t handle_h2_upstream(connection_t *session, int epoll_fd, uint32_t events);
+
+/**
+ * @brief Relay the news of h2c streams to their clients.
+ *
+ * Call once per loop iteration: freeing a connection can fail or start
+ * streams outside handle_h2_upstream().
+ */
+void handle_h2_streams(int epoll_fd);
+
+/**
+ * @brief Service an HTTP/2 client session (CONN_H2_CLIENT, see h2_server.h):
+ *        client frames, and the responses of its streams.
+ *
+ * @param conn     The client connection
+ * @param epoll_fd Epoll instance
+ * @return HANDLER_OK while the session lives, HANDLER_CLOSED when it is over.
+ */
+handler_status_t handle_h2_client(connection_t *conn, int epoll_fd);
+
+/**
+ * @brief Service a TLS client (CONN_TLS, see tls.h): handshake, or the
+ *        bridge between the client and its plaintext connection.
+ *
+ * @param conn     The client connection
+ * @param epoll_fd Epoll instance
+ * @return HANDLER_OK while it lives, HANDLER_CLOSED when it is over.
+ */
+handler_status_t handle_tls(connection_t *conn, int epoll_fd);
@@ -25,11 +25,20 @@ typedef enum
 {
     /**---Client Side--- */
     CONN_LISTENING,
+    CONN_UPGRADE_CONTROL,  /**< Unix control socket a new binary connects to for a handoff (see upgrade.h). */
+    CONN_OFFLOAD_NOTIFY,   /**< Eventfd the offload pool signals finished jobs on (see offload.h). */
+    CONN_MIGRATE_INBOX,    /**< Socket other workers send connections to (see migrate.h). */
+    CONN_STOP_SIGNAL,      /**< Signalfd for SIGTERM/SIGINT: save the cache index, then exit. */
+    CONN_H2_UPSTREAM,      /**< HTTP/2 connection to an h2c backend, shared by many requests (see h2_upstream.h). */
+    CONN_H2_CLIENT,        /**< HTTP/2 client connection: a session whose streams are connections of their own (see h2_server.h). */
+    CONN_TLS,              /**< TLS client: handshake, then a bridge to the plaintext connection (see tls.h). */
     // CONN_IDLE,             /**< Waiting for next HTTP request on an open connection (Keep-Alive only). */
     CONN_READING_REQUEST,  /**< Reading HTTP request bytes from client. */
     CONN_REQUEST_COMPLETE, /**< Full HTTP request received, ready to parse. */
 
     /**--- BACKEND SIDE --- */
+    CONN_QUEUED,             /**< Waiting for a free upstream concurrency slot (see upstream_limiter.h). */
+    CONN_COALESCED,          /**< Waiting for the response head of an identical in-flight request (see coalesce.h). */
     CONN_CONNECTING_BACKEND, /**< Establishing connection to backend (non-blocking). */
     CONN_SENDING_REQUEST,    /**< Forwarding the parsed request to backend. */
     CONN_READING_RESPONSE,   /**< Receiving HTTP response from backend. */
@@ -37,6 +46,8 @@ typedef enum
 
     /**--- RESPONSE TO CLIENT ---*/
     CONN_SENDING_RESPONSE, /**< Sending backend response back to client. */
+    CONN_COMPRESSING,      /**< Relaying a gzipped response: backend reads and client writes interleave. */
+    CONN_TUNNEL,           /**< WebSocket or CONNECT: bytes relayed both ways until both sides are done. */
 
     /**--- FINAL STATES ---*/
     CONN_ERROR, /**< Error occurred — cleanup required. */
@@ -54,6 +65,11 @@ typedef enum
 //                           │ full request parsed
 //                           ▼
 //               ┌─────────────────────────┐
+//               │ CONN_QUEUED             │  (only if upstream is at its limit;
+//               └───────────┬─────────────┘   503 when queue deadline passes)
+//                           │ slot freed
+//                           ▼
+//               ┌─────────────────────────┐
 //               │ CONN_CONNECTING_BACKEND │  (non-blocking connect)
 //               └───────────┬─────────────┘
 //                           │ EPOLLOUT fired, connect complete
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "common/http_types.h"
+
+/**
+ * @file disk_cache.h
+ * @brief Persistent second cache tier: a memory-mapped log of responses that survives restarts.
+ *
+ * The memory tier (response_cache.h) is empty after every restart, so a
+ * deploy sends the whole working set to the backend at once. This tier keeps
+ * every cacheable response in one large file and reloads its index on
+ * startup, so a restarted proxy serves hits within seconds.
+ *
+ * Data file: a circular log
+ * -------------------------
+ *
+ *   file:  [ rec ][ rec ][ rec ][ rec ]......[ rec ][ rec ]| (wraps to 0)
+ *                              ▲ write position            ▲
+ *                              └── oldest records are overwritten next
+ *
+ * - Records are appended at the write position (64-byte aligned) and never
+ *   updated in place; a new copy of a key simply makes the old one garbage.
+ * - Log positions grow forever; a record at position P is intact while
+ *   P >= write_pos - file size. No free lists, no compaction.
+ * - A record that doesn't fit before the end of the file starts at offset 0.
+ *
+ * Record:  [ header | key\0 | vary\0 | vary values\0 | head (no Age) | body ]
+ *
+ * Index: a compact open-addressing table (24 bytes per entry: key hash, log
+ * position, length), one record per primary key (the latest variant).
+ *
+ * Hits are sent without copying through user space: the head and the Age /
+ * X-Cache lines with one sendmsg(MSG_MORE), the body with sendfile() from the
+ * data file. Only fresh records are served from this tier.
+ *
+ * Warm restart
+ * ------------
+ * The index is written to "<file>.idx" every DISK_CACHE_SNAPSHOT_INTERVAL_MS
+ * while it changes, when a process hands over to a new one (upgrade.h), and
+ * when it stops on SIGTERM/SIGINT (disk_cache_release() on the way out).
+ * On startup it is loaded back. Records written after the last snapshot are
+ * simply not found; records the log overwrote after it fail the checksum
+ * that is verified on the first hit of every reloaded entry.
+ *
+ * Only one process may own the file (flock). A new binary started with -U
+ * waits up to DISK_CACHE_LOCK_WAIT_MS for the old one to let go.
+ *
+ * @note Single-threaded: owned by the event loop.
+ */
+
+#define DISK_CACHE_PATH "/var/tmp/turboproxy-cache.dat" /**< Default data file (index: same path + ".idx") */
+#define DISK_CACHE_BYTES (256ULL * 1024 * 1024)      /**< Size of the data file */
+#define DISK_CACHE_AVG_OBJECT 4096                    /**< Expected mean record size (sizes the index) */
+#define DISK_CACHE_ALIGN 64                           /**< Record alignment in the log */
+#define DISK_CACHE_SNAPSHOT_INTERVAL_MS 30000         /**< Max age of the persisted index while it changes */
+#define DISK_CACHE_LOCK_WAIT_MS 2000                  /**< How long an upgrading process waits for the file */
+
+/**
+ * @brief A disk tier hit being written to one client.
+ *
+ * While a reply is in progress its record is pinned: the log refuses to
+ * overwrite it.
+ */
+typedef struct disk_reply
+{
+    bool active;            /**< A disk reply is in progress */
+    uint64_t pos;           /**< Log position of the record (pin) */
+    const char *head;       /**< Stored head inside the mapping */
+    size_t head_len;
+    char extra[64];         /**< Age + X-Cache headers and the blank line */
+    size_t extra_len;
+    off_t body_off;         /**< File offset of the body (for sendfile) */
+    size_t body_len;
+    size_t sent;            /**< Bytes of head + extra + body already written */
+
+    struct disk_reply *pin_prev;
+    struct disk_reply *pin_next;
+} disk_reply_t;
+
+/**
+ * @brief Open (or create) the data file, map it and load the index snapshot.
+ *
+ * @param path    Data file
+ * @param wait_ms How long to wait for another process to release the file
+ * @return 0 on success, -1 on error (the proxy then runs without this tier).
+ */
+int disk_cache_open(const char *path, int wait_ms);
+
+/**
+ * @brief Write a final index snapshot and stop using the file, so a new process can take it.
+ *
+ * Replies in progress keep working; the mapping is released at exit.
+ */
+void disk_cache_release(void);
+
+/**
+ * @brief Serve a fresh copy of this request from the disk tier.
+ *
+ * @param key   Primary key from http_cache_key()
+ * @param req   Request (for Vary)
+ * @param reply Reply to start (pins the record)
+ * @return true on a hit (send with disk_cache_reply_send()), false on miss.
+ */
+bool disk_cache_lookup(const char *key, const HttpRequest *req, disk_reply_t *reply);
+
+/**
+ * @brief Append a complete backend response to the log if http_cache.h allows it.
+ *
+ * @return 0 if stored, -1 if not cacheable, too large, or it would overwrite a pinned record.
+ */
+int disk_cache_store(const char *key, const HttpRequest *req, const char *resp, size_t len);
+
+/**
+ * @brief Write as much of a disk reply as the socket accepts.
+ *
+ * @return 1 when everything was sent, 0 if the socket is full (wait for EPOLLOUT),
+ *         -1 on error, -2 if the client closed the connection.
+ */
+ssize_t disk_cache_reply_send(disk_reply_t *reply, int fd);
+
+/**
+ * @brief Unpin the record of a reply (safe on an idle reply).
+ */
+void disk_cache_reply_cleanup(disk_reply_t *reply);
+
+/**
+ * @brief Persist the index if it changed and the snapshot interval passed.
+ *
+ * Call once per loop iteration.
+ */
+void disk_cache_tick(uint64_t now_ms);
+
+/**
+ * @brief Milliseconds until disk_cache_tick() has work, -1 if none.
+ */
+int disk_cache_next_timeout(uint64_t now_ms);
@@ -1,11 +1,16 @@
 #pragma once
 
+#include <stdbool.h>
+
 /**
  * @brief Connects to specified non-blockin target backend host & port
  * 
- * @param host The host name or IP address of backend server
- * @param port Port number to connect to
+ * @param host The host name or IP address of backend server, or "unix:/path"
+ *             for a unix domain socket
+ * @param port Port number to connect to (ignored for unix sockets)
+ * @param early_data The caller writes first (a request), so with -O it may
+ *                   ride in the SYN (TCP Fast Open)
  * @return Socket file descriptor success & -1 on error
  */
 
-int connect_to_target_nb(char *host, int port);
\ No newline at end of file
+int connect_to_target_nb(char *host, int port, bool early_data);
\ No newline at end of file
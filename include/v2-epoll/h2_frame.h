@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "v2-epoll/buffer.h"
+
+/**
+ * @file h2_frame.h
+ * @brief HTTP/2 framing (RFC 9113): constants and frame reading/writing.
+ *
+ * Every HTTP/2 message travels in frames behind a 9 byte header:
+ *
+ *   +-----------------------------------------------+
+ *   |                 Length (24)                   |
+ *   +---------------+---------------+---------------+
+ *   |   Type (8)    |   Flags (8)   |
+ *   +-+-------------+---------------+-------------------------------+
+ *   |R|                 Stream Identifier (31)                      |
+ *   +=+=============================================================+
+ *   |                   Frame Payload (Length)                     ...
+ *   +---------------------------------------------------------------+
+ *
+ * Frames are read from and written to buffer_t, so a connection's input
+ * may end in the middle of one: h2_frame_next() only returns whole frames.
+ */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER_LEN 9
+#define H2_DEFAULT_FRAME_SIZE 16384 /**< SETTINGS_MAX_FRAME_SIZE until changed, also the most we accept */
+#define H2_DEFAULT_WINDOW 65535     /**< Flow control window a stream or connection starts with */
+#define H2_MAX_WINDOW 0x7fffffff
+
+/** Frame types */
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+/** Frame flags */
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+/** SETTINGS parameters */
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+/** Error codes (RST_STREAM, GOAWAY) */
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+
+/**
+ * @brief A frame header.
+ */
+typedef struct
+{
+    uint32_t length;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream_id;
+} h2_frame_t;
+
+/**
+ * @brief Take the next whole frame from a buffer.
+ *
+ * @param in    Received bytes; offset is moved past the frame
+ * @param frame Filled in with the frame header
+ * @param max_size Longest payload accepted (our SETTINGS_MAX_FRAME_SIZE)
+ * @return Payload, NULL if the frame is not complete yet. With frame->length
+ *         above max_size the frame is not consumed and NULL is returned too:
+ *         check it (FRAME_SIZE_ERROR).
+ */
+const uint8_t *h2_frame_next(buffer_t *in, h2_frame_t *frame, uint32_t max_size);
+
+/**
+ * @brief Payload of a DATA or HEADERS frame without padding (and priority).
+ * @return 0, or -1 if the padding is longer than the payload.
+ */
+int h2_frame_unpad(const h2_frame_t *frame, const uint8_t **payload, size_t *len);
+
+/**
+ * @brief Append a frame.
+ * @return 0, or -1 if out of memory.
+ */
+int h2_frame_append(buffer_t *out, uint8_t type, uint8_t flags, uint32_t stream_id, const void *payload, size_t len);
+
+/**
+ * @brief Append a header block as HEADERS plus CONTINUATION frames of at most max_frame bytes.
+ * @param flags H2_FLAG_END_STREAM or 0 (END_HEADERS is set on the last frame)
+ */
+int h2_frame_headers(buffer_t *out, uint32_t stream_id, uint8_t flags, const void *block, size_t len, size_t max_frame);
+
+int h2_frame_window_update(buffer_t *out, uint32_t stream_id, uint32_t increment);
+int h2_frame_rst_stream(buffer_t *out, uint32_t stream_id, uint32_t error);
+int h2_frame_goaway(buffer_t *out, uint32_t last_stream_id, uint32_t error);
+
+/**
+ * @brief Append a SETTINGS frame with n parameters.
+ */
+int h2_frame_settings(buffer_t *out, const uint16_t *ids, const uint32_t *values, int n);
+
+/**
+ * @brief Read a 32 bit big endian value.
+ */
+uint32_t h2_get32(const uint8_t *p);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "v2-epoll/buffer.h"
+
+/**
+ * @file h2_server.h
+ * @brief HTTP/2 towards clients: many concurrent requests on one client connection.
+ *
+ * A client that opens with the HTTP/2 connection preface (h2c with prior
+ * knowledge, or "h2" chosen by ALPN once the connection is TLS) turns its
+ * connection_t into a session (state CONN_H2_CLIENT). The session speaks
+ * frames with the client; every request stream becomes an ordinary
+ * connection_t whose client end is one side of a UNIX socketpair:
+ *
+ *   client ══ TCP ══► session ─┬─ socketpair ─► connection_t ─► route, cache, backend...
+ *           (frames)           ├─ socketpair ─► connection_t ─► ...
+ *                              └─ socketpair ─► connection_t ─► ...
+ *
+ * The session writes each request to its stream as HTTP/1.1 text and turns
+ * the HTTP/1.1 response coming back into HEADERS and DATA frames, so the
+ * whole request path (routing, rate limits, static files, the caches,
+ * coalescing, compression, CONNECT tunnels, upstreams) is shared with
+ * HTTP/1.1 clients unchanged. The stream's connection_t closes after the
+ * response, which ends the stream.
+ *
+ * Readiness
+ * ---------
+ * The session's side of every stream is watched by an epoll instance of the
+ * session's own, which is itself registered in the event loop's epoll (an
+ * epoll fd is readable while any of its fds is ready). Both the client
+ * socket and this fd point at the session's connection_t, and every event
+ * services both.
+ *
+ * Flow control
+ * ------------
+ * A stream's response is read from its socketpair only while the client's
+ * windows allow and the session's unsent output is below
+ * H2_SERVER_OUT_HIGH; otherwise the bytes wait in the socketpair and the
+ * stream's connection_t sees a full socket, like a slow HTTP/1.1 client.
+ * Request bodies get their window back once written to the stream.
+ *
+ * @note Single-threaded: owned by the event loop.
+ */
+
+#define H2_SERVER_MAX_STREAMS 100           /**< SETTINGS_MAX_CONCURRENT_STREAMS we announce */
+#define H2_SERVER_OUT_HIGH (256 * 1024)     /**< Stop reading responses above this much unsent output */
+#define H2_SERVER_MAX_HEAD (64 * 1024)      /**< Largest response head taken from a stream */
+#define H2_SERVER_MAX_BLOCK (64 * 1024)     /**< Largest request header block (SETTINGS_MAX_HEADER_LIST_SIZE) */
+#define H2_SERVER_MAX_BODY (64 * 1024)      /**< Largest body buffered to find its Content-Length */
+#define H2_SERVER_BUCKETS 64                /**< Stream id hash buckets per session */
+
+struct connection;
+struct h2_server;
+
+/**
+ * @brief Does the client speak HTTP/2?
+ * @return 1 if buf starts with the connection preface, -1 if it could still
+ *         (a prefix of it), 0 if not.
+ */
+int h2_server_preface(const buffer_t *buf);
+
+/**
+ * @brief Turn a client connection whose request_buffer starts with the
+ *        preface into an HTTP/2 session.
+ * @return 0, or -1 if the session could not be set up (close the connection).
+ */
+int h2_server_start(struct connection *conn, int epoll_fd);
+
+/**
+ * @brief Service a session: client frames, stream responses, output.
+ * @return 0 while the session lives, -1 when it is over (free the connection).
+ */
+int h2_server_io(struct connection *conn, int epoll_fd);
+
+/**
+ * @brief Close the streams and the session's epoll instance (connection_free()).
+ */
+void h2_server_free(struct connection *conn, int epoll_fd);
+
+/**
+ * @brief Stop taking new streams on every session (GOAWAY), for a drain.
+ *
+ * Sessions without streams close right away, the others when their last
+ * stream ends.
+ */
+void h2_server_drain(int epoll_fd);
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @file h2_upstream.h
+ * @brief HTTP/2 cleartext (h2c) to backends that support it (route option proto=h2c).
+ *
+ * Over HTTP/1.1 every in-flight request needs its own backend socket, so a
+ * burst of 500 requests means 500 connects (and 500 sockets in TIME_WAIT
+ * afterwards). An h2c route instead multiplexes its requests as streams over
+ * a few long-lived connections per backend (HTTP/2 with prior knowledge: no
+ * Upgrade round trip, the backend must speak h2c on that port):
+ *
+ *   client 1 ─┐                               ┌─ stream 1 ─┐
+ *   client 2 ─┼─► rebuilt HTTP/1.1 request ──►├─ stream 3 ─┼─► one TCP connection ─► backend
+ *   client 3 ─┘   (HPACK encoded, hpack.h)    └─ stream 5 ─┘
+ *
+ * Requests
+ * --------
+ * The request line and headers build_backend_request() produced are sent
+ * as a HEADERS frame (:method, :scheme, :authority from Host, :path, then
+ * the other fields minus the HTTP/1.1 connection headers), the body as DATA
+ * frames. A request goes to the open connection with the fewest streams; a
+ * new connection is opened only when all are at their stream limit, up to
+ * H2_UPSTREAM_MAX_CONNS. Beyond that requests wait for a stream to end.
+ *
+ * Responses
+ * ---------
+ * A response is turned back into HTTP/1.1 bytes in the connection's
+ * response_buffer (status line, headers, Connection: close, then the DATA
+ * payload) and END_STREAM counts as the backend's EOF, so caching,
+ * coalescing, compression and relaying work exactly as for HTTP/1.1
+ * backends. Streams with news are collected on a ready list that the
+ * connection handler drains (h2_upstream_pop_ready()).
+ *
+ * Flow control
+ * ------------
+ * Every stream may have H2_UPSTREAM_STREAM_WINDOW response bytes that the
+ * client hasn't taken yet; the window is given back (WINDOW_UPDATE) as the
+ * client drains them, so one slow client stalls its own stream and nobody
+ * else's. The connection window is given back as soon as bytes arrive.
+ * Request bodies are sent as the server's windows allow, and only while
+ * the connection's output is below H2_UPSTREAM_OUT_HIGH.
+ *
+ * Failures
+ * --------
+ * A stream the server never processed (REFUSED_STREAM, or above the last
+ * stream id of a GOAWAY) is sent again, on another connection if needed.
+ * Any other reset fails the stream; a protocol error or a lost connection
+ * fails all of its streams (with 502 while nothing was relayed yet).
+ *
+ * @note Single-threaded: owned by the event loop.
+ */
+
+#define H2_UPSTREAM_MAX 32                          /**< Distinct h2c backends (host:port) */
+#define H2_UPSTREAM_MAX_CONNS 4                     /**< Connections per backend */
+#define H2_UPSTREAM_MAX_STREAMS 128                 /**< Streams per connection (fewer if the server says so) */
+#define H2_UPSTREAM_STREAM_WINDOW (256 * 1024)      /**< Response bytes a stream may have waiting for its client */
+#define H2_UPSTREAM_CONN_WINDOW (16 * 1024 * 1024)  /**< Response bytes in flight per connection */
+#define H2_UPSTREAM_OUT_HIGH (256 * 1024)           /**< Stop adding request body frames above this much unsent output */
+#define H2_UPSTREAM_MAX_BLOCK (256 * 1024)          /**< Largest response header block accepted */
+#define H2_UPSTREAM_RETRIES 3                       /**< Times an unprocessed stream is sent again */
+#define H2_UPSTREAM_BUCKETS 64                      /**< Stream id hash buckets per connection */
+
+struct connection;
+struct h2_session;
+struct h2_upstream;
+
+/**
+ * @brief Per-connection stream state (embedded in connection_t).
+ */
+typedef struct
+{
+    bool active;                  /**< Request handed to h2_upstream_submit() and not finished */
+    struct h2_upstream *upstream; /**< Backend the request goes to */
+    struct h2_session *session;   /**< Connection the stream is on (NULL while waiting for one) */
+    uint32_t id;                  /**< Stream id (0 while waiting) */
+    int retries;                  /**< Times the request was sent again */
+    int64_t send_window;          /**< Request body bytes the server accepts now */
+    size_t body_sent;             /**< Offset of the next body byte in rebuilt_request_buffer */
+    uint32_t unacked;             /**< Response bytes received but not given back as window yet */
+    size_t fresh;                 /**< Response bytes added to response_buffer since the last pop */
+    bool head_done;               /**< Final response head written to response_buffer */
+    bool ended;                   /**< END_STREAM received, not reported yet */
+    bool failed;                  /**< Reset or its connection failed, not reported yet */
+    bool ready;                   /**< On the ready list */
+    bool held;                    /**< Popped, and the client hasn't taken the bytes yet */
+    struct connection *prev;      /**< Upstream wait list */
+    struct connection *next;
+    struct connection *hash_next; /**< Session's stream id bucket */
+    struct connection *send_next; /**< Session's list of streams with body left to send */
+    struct connection *ready_prev;
+    struct connection *ready_next;
+} h2_member_t;
+
+/**
+ * @brief Send the request in conn->rebuilt_request_buffer to conn->selected_backend.
+ * @return 0 (the response comes through h2_upstream_pop_ready()), or -1 if
+ *         no connection to the backend could be started.
+ */
+int h2_upstream_submit(struct connection *conn, int epoll_fd);
+
+/**
+ * @brief Service an upstream connection (epoll reported events for a CONN_H2_UPSTREAM).
+ */
+void h2_upstream_io(struct connection *session, int epoll_fd, uint32_t events);
+
+/**
+ * @brief Next stream with news.
+ *
+ * The stream is then held: it isn't returned again before
+ * h2_upstream_consumed(), so the end of a response never overtakes bytes
+ * still waiting for the client.
+ *
+ * @param bytes Set like buffer_read_from_fd(): > 0 bytes were added to
+ *              response_buffer, -2 the response is complete, -1 the stream failed
+ * @return The stream's connection, NULL if none is ready.
+ */
+struct connection *h2_upstream_pop_ready(ssize_t *bytes);
+
+/**
+ * @brief True if h2_upstream_pop_ready() has something.
+ */
+bool h2_upstream_has_ready(void);
+
+/**
+ * @brief The client took everything relayed so far: give the window back
+ *        and release the stream held by h2_upstream_pop_ready().
+ */
+void h2_upstream_consumed(struct connection *conn, int epoll_fd);
+
+/**
+ * @brief Leave the stream (RST_STREAM if the server is still sending it).
+ */
+void h2_upstream_detach(struct connection *conn, int epoll_fd);
+
+/**
+ * @brief Free upstream connections closed during this event loop iteration.
+ */
+void h2_upstream_reap(void);
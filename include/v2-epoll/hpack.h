@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "v2-epoll/buffer.h"
+
+/**
+ * @file hpack.h
+ * @brief HPACK header compression for HTTP/2 (RFC 7541).
+ *
+ * HTTP/2 sends header fields as a compressed block instead of text lines.
+ * Both ends keep a dynamic table of recently sent fields; a field that is in
+ * the static table (61 common ones) or the dynamic table is sent as a single
+ * index, anything else as a literal that may be added to the table:
+ *
+ *   :method GET             → 0x82                   (static index 2)
+ *   user-agent: curl/8.5    → 0x7a + "curl/8.5"      (name index 58, value
+ *                                                     literal, now index 62)
+ *   user-agent: curl/8.5    → 0xbe                   (next request: index 62)
+ *
+ * Encoding
+ * --------
+ * The encoder mirrors what the peer's decoder will hold. Fields that repeat
+ * from request to request (user-agent, accept, cookie...) are indexed; those
+ * that rarely do (:path, content-length, validators) and credentials are
+ * sent as literals without indexing. Strings are Huffman coded when that is
+ * shorter. Names must already be lowercase.
+ *
+ * Decoding
+ * --------
+ * Every field of a block is passed to a callback. A block must always be
+ * decoded completely, even if nobody wants its fields, or the dynamic table
+ * goes out of sync with the peer's; any decoding error is fatal to the whole
+ * HTTP/2 connection (COMPRESSION_ERROR).
+ *
+ * @note Single-threaded: a table belongs to one HTTP/2 connection.
+ */
+
+#define HPACK_TABLE_SIZE 4096       /**< Dynamic table size both directions use (the HTTP/2 default) */
+#define HPACK_MAX_STRING (64 * 1024) /**< Longest name or value accepted from a peer */
+
+/**
+ * @brief One direction's dynamic table (a ring, newest entry at index 62).
+ */
+typedef struct
+{
+    struct hpack_entry *entries; /**< Ring of slots, HPACK_TABLE_SIZE / 32 of them */
+    size_t slots;
+    size_t first;                /**< Slot of the oldest entry */
+    size_t count;
+    size_t size;                 /**< Sum of entry sizes (name + value + 32 each) */
+    size_t max_size;             /**< Current limit */
+    bool resized;                /**< Encoder: announce max_size at the start of the next block */
+} hpack_table_t;
+
+/**
+ * @brief Called for each decoded field (strings are not NUL terminated).
+ */
+typedef void (*hpack_field_fn)(void *ctx, const char *name, size_t name_len, const char *value, size_t value_len);
+
+/**
+ * @brief Initialize an empty table of HPACK_TABLE_SIZE bytes.
+ * @return 0, or -1 if out of memory.
+ */
+int hpack_table_init(hpack_table_t *table);
+
+/**
+ * @brief Free the table's entries.
+ */
+void hpack_table_cleanup(hpack_table_t *table);
+
+/**
+ * @brief Encoder: the peer allows a table of this size (SETTINGS_HEADER_TABLE_SIZE).
+ *
+ * The encoder never uses more than HPACK_TABLE_SIZE; a change is announced
+ * at the start of the next encoded block.
+ */
+void hpack_table_set_limit(hpack_table_t *table, size_t limit);
+
+/**
+ * @brief Append one field to a header block.
+ * @return 0, or -1 if out of memory.
+ */
+int hpack_encode(hpack_table_t *table, buffer_t *out, const char *name, size_t name_len,
+                 const char *value, size_t value_len);
+
+/**
+ * @brief Decode a complete header block.
+ * @return 0, or -1 on a malformed block (the connection must be closed).
+ */
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t len, hpack_field_fn fn, void *ctx);
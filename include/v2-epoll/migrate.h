@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file migrate.h
+ * @brief Move connections from a busy worker to an idle one (-w with -M).
+ *
+ * SO_REUSEPORT spreads connections, not load: a worker that got a handful
+ * of busy WebSockets (or all the connections of one RSS queue) stays hot
+ * while its siblings idle, for as long as those connections live.
+ *
+ * Load signal
+ * -----------
+ * Every worker publishes, in a MAP_SHARED page the supervisor mapped
+ * before forking, the microseconds its loop spent outside epoll_wait()
+ * (busy_us, only ever growing), its live connections and what it moved.
+ * Plain atomic stores, no locks; `kill -USR1 <supervisor>` prints them.
+ * A reader turns busy_us into a busy fraction over its own sampling
+ * interval, so a worker blocked in epoll_wait() reads as idle without
+ * having to wake up and say so.
+ *
+ * Balancing
+ * ---------
+ * Every MIGRATE_INTERVAL_MS a worker compares itself with the least busy
+ * one. Busier than the threshold given to -M (per mille, MIGRATE_BUSY_MIN
+ * is a sane default) and with the other one at least MIGRATE_IMBALANCE of
+ * its own busy time behind, it sends that worker a share of its movable
+ * connections (half the gap, at most MIGRATE_BATCH per interval):
+ *
+ * - accepted, nothing read yet (the same ones an upgrade hands over);
+ * - tunnels with nothing in flight: no bytes in a pipe or early buffer, no
+ *   EOF seen, not relayed by the kernel. Their state is the two sockets.
+ *
+ * TLS, HTTP/2 sessions and anything mid-request stay where they are.
+ *
+ * Transport
+ * ---------
+ * Shared memory can't carry file descriptors between processes, so the
+ * queue is the kernel's: each worker has a SOCK_DGRAM socketpair whose
+ * receive end only it holds, and every other worker sends to the other
+ * end, one datagram per batch with the fds in SCM_RIGHTS (many producers,
+ * one consumer, each sendmsg() atomic). The receive end is in the
+ * worker's epoll: it's also the wake-up. A full queue (EAGAIN) just keeps
+ * the batch here until the next interval. The sender drops its copies only
+ * after the send succeeded; bytes arriving meanwhile wait in the socket
+ * buffers for the new owner.
+ */
+
+#define MIGRATE_INTERVAL_MS 250       /**< Load comparison period */
+#define MIGRATE_BUSY_MIN 600          /**< Suggested -M: busy per mille below which a worker keeps everything */
+#define MIGRATE_IMBALANCE 400         /**< Per mille of our busy time the least busy worker must be behind */
+#define MIGRATE_BATCH 32              /**< Connections moved per interval (one datagram) */
+
+struct connection;
+
+/**
+ * @brief Shared load page and one inbox per worker (supervisor, before fork).
+ * @param busy_min Busy per mille above which a worker moves connections
+ * @return 0, or -1 (workers then run without migration)
+ */
+int migrate_init(int workers, int busy_min);
+
+/**
+ * @brief In worker @p index after fork: keep its inbox and the other
+ *        workers' send ends.
+ * @return The inbox fd to watch for EPOLLIN, or -1 without migration
+ */
+int migrate_attach(int index);
+
+/** @brief Account the loop's busy time around one epoll_wait(). */
+void migrate_observe_wait(uint64_t wait_start_us, uint64_t wait_end_us);
+
+/** @brief Publish this worker's load and move connections if it's the hot one. */
+void migrate_balance(int epoll_fd, uint64_t now_ms);
+
+/** @brief Take in the connections waiting in this worker's inbox. */
+void migrate_receive(int epoll_fd);
+
+/**
+ * @brief Print every worker's published load (supervisor, on SIGUSR1):
+ *        busy share since the last report, live connections, moved in/out.
+ */
+void migrate_report(void);
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file offload.h
+ * @brief Work-stealing thread pool for CPU-heavy steps the event loop must
+ *        not wait for (deflate() today, see compress.h).
+ *
+ * A job is a struct embedded in whatever it works on, with two callbacks:
+ * run() on a pool thread, complete() back on the loop. Between the two the
+ * owner must not touch what run() uses; a connection waiting for its job
+ * stays in its own state for that (CONN_COMPRESSING for compression).
+ *
+ *   loop ── offload_submit() ──► deque[i] ──► pool thread i: run()
+ *                                   │ (idle threads steal from the top)
+ *   loop ◄── eventfd ◄── completion stack ◄──────────────┘
+ *        offload_collect(): complete()
+ *
+ * Deques
+ * ------
+ * Every pool thread has a Chase-Lev deque. The loop is the only thread
+ * that submits, so it owns the bottom end of all of them: it pushes each
+ * job on the next deque round robin (no lock, one release store). Pool
+ * threads only ever take from the top end with one CAS: first from their
+ * own deque, oldest job first, then from the others' when theirs is empty.
+ * A thread stuck in a large job therefore doesn't hold up the jobs queued
+ * behind it. A semaphore counts queued jobs so idle threads sleep instead
+ * of spinning. When every deque is full the job waits in a list on the
+ * loop until completions make room.
+ *
+ * Completions
+ * -----------
+ * A finished job is pushed on a lock-free stack (CAS on its head). Only
+ * the push that finds the stack empty writes the eventfd, so a burst of
+ * completions costs the loop one wake-up. offload_collect() takes the whole
+ * stack with one exchange and calls complete() in finishing order.
+ *
+ * With -w every worker process has its own pool and eventfd: completions
+ * always come back to the loop that submitted the job.
+ *
+ * Metrics
+ * -------
+ * For every job the pool measures how long it waited in a deque (submit to
+ * run()) and how long run() took, and counts the jobs taken from another
+ * thread's deque. The loop logs a summary at most every
+ * OFFLOAD_REPORT_MS when jobs ran: average and worst queue wait, average
+ * run time and steal rate.
+ */
+
+#define OFFLOAD_THREADS 2         /**< Pool threads per event loop */
+#define OFFLOAD_DEQUE_SIZE 256    /**< Jobs queued per thread (power of two) */
+#define OFFLOAD_REPORT_MS 10000   /**< Interval of the metrics summary */
+
+typedef struct offload_job
+{
+    void (*run)(struct offload_job *job);      /**< Pool thread: the work itself */
+    void (*complete)(struct offload_job *job); /**< Loop: take the result */
+    uint64_t submitted_us;                     /**< Set by offload_submit() */
+    struct offload_job *next;                  /**< Waiting list or completion stack */
+} offload_job_t;
+
+/**
+ * @brief Start the pool threads and create the completion eventfd.
+ * @return 0 on success, -1 on error (nothing is offloaded then).
+ */
+int offload_init(void);
+
+/** @brief The pool runs (offload_submit() may be used). */
+bool offload_available(void);
+
+/** @brief Eventfd that becomes readable when jobs finished (-1 if not initialized). */
+int offload_notify_fd(void);
+
+/** @brief Queue a job (loop thread only); its complete() runs in a later offload_collect(). */
+void offload_submit(offload_job_t *job);
+
+/**
+ * @brief Call complete() for every finished job (when offload_notify_fd()
+ *        is readable), queue waiting jobs, and log the metrics when due.
+ */
+void offload_collect(void);
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <common/route_config.h>
+
+/**
+ * @file peer.h
+ * @brief Cache sharing between TurboProxy nodes (consistent-hash key ownership).
+ *
+ * A fleet of proxies in front of the same backends would otherwise each fetch
+ * (and cache) every object on its own. Here every node is started with the
+ * same list of nodes (-P) and its own name in it (-n). Cache keys are mapped
+ * onto a hash ring of all nodes, so every node agrees which one *owns* a key:
+ *
+ *   ring:  ──●A──●C──●B──●A──●B──●C──●A── ...   (PEER_VNODES points per node)
+ *                 ▲
+ *        hash(key)┘ → the next point clockwise owns the key (here: B)
+ *
+ * - A cache miss on a key owned by another node is sent to that node instead
+ *   of the origin, with an X-TurboProxy-Peer header. The owner answers from
+ *   its cache, or fetches the object once for the whole fleet (its coalescing
+ *   collapses concurrent misses from all nodes).
+ * - A request carrying the header is never forwarded again, so nodes with
+ *   different lists can't loop.
+ * - The response is relayed and cached locally like an origin response.
+ *
+ * A dead peer must not add latency:
+ * - Connect must finish within PEER_CONNECT_TIMEOUT_MS and the first response
+ *   byte must arrive within PEER_RESPONSE_TIMEOUT_MS. Otherwise (or on any
+ *   error before the first byte) the request falls back to the origin.
+ * - A failed peer is marked down for PEER_RETRY_MS: its keys go to the next
+ *   node on the ring (or to the origin if that is this node). After that
+ *   one request probes it while the others keep skipping it.
+ *
+ * Requests waiting on a peer deadline are linked through connection_t, so
+ * tracking them never allocates.
+ *
+ * @note Single-threaded: owned by the event loop.
+ */
+
+#define PEER_MAX 32
+#define PEER_VNODES 64                /**< Ring points per node (spreads keys evenly) */
+#define PEER_CONNECT_TIMEOUT_MS 50    /**< A peer in the same network connects in well under this */
+#define PEER_RESPONSE_TIMEOUT_MS 500  /**< Until the first response byte (covers the owner's origin fetch) */
+#define PEER_RETRY_MS 5000            /**< How long a failed peer is skipped before it is probed again */
+#define PEER_HEADER "X-TurboProxy-Peer"
+
+struct connection;
+
+typedef struct peer
+{
+    char name[MAX_HOST_LEN + 8]; /**< "host:port" as given on the command line */
+    char host[MAX_HOST_LEN];
+    int port;
+    bool self;                   /**< This node: its keys are fetched from the origin */
+    bool down;                   /**< Last request to it failed */
+    bool probing;                /**< A request is checking whether it is back */
+    uint64_t retry_ms;           /**< While down: when to probe it */
+} peer_t;
+
+/**
+ * @brief Per-connection peer state (embedded in connection_t).
+ */
+typedef struct
+{
+    peer_t *node;              /**< Peer the request was sent to, until it answers or fails (NULL if none) */
+    bool probe;                /**< This request checks whether a down peer is back */
+    int wait;                  /**< Deadline list the request is on (0 = none) */
+    uint64_t deadline_ms;      /**< Fall back to the origin at this time */
+    struct connection *prev;
+    struct connection *next;
+} peer_member_t;
+
+/**
+ * @brief Build the ring.
+ *
+ * @param list Comma separated "host:port" of every node, this one included
+ * @param self This node's entry in the list
+ * @return Number of nodes, or -1 on a malformed list or if self is not in it.
+ */
+int peer_init(const char *list, const char *self);
+
+/**
+ * @brief Name of this node (the X-TurboProxy-Peer value), NULL if sharing is off.
+ */
+const char *peer_self_name(void);
+
+/**
+ * @brief Send this request to the node owning its key, if that is another node that is up.
+ *
+ * Sets conn->peer.node (and .probe) on success.
+ *
+ * @return true if the request goes to a peer, false if it goes to the origin.
+ */
+bool peer_assign(struct connection *conn, const char *key, uint64_t now_ms);
+
+/**
+ * @brief Connect to the peer started: fall back if it isn't connected by the connect deadline.
+ */
+void peer_watch_connect(struct connection *conn, uint64_t now_ms);
+
+/**
+ * @brief Request sent: fall back if no response byte arrives by the response deadline.
+ */
+void peer_watch_response(struct connection *conn, uint64_t now_ms);
+
+/**
+ * @brief The peer answered (ok) or failed before answering.
+ *
+ * Updates the peer's up/down state, stops the deadline and clears
+ * conn->peer.node: from here on the response is handled like an origin one.
+ */
+void peer_report(struct connection *conn, bool ok, uint64_t now_ms);
+
+/**
+ * @brief Forget the peer without a verdict (called from connection_free).
+ */
+void peer_detach(struct connection *conn);
+
+/**
+ * @brief Pop a request whose peer deadline passed.
+ * @return Connection (still assigned to its peer), or NULL if none.
+ */
+struct connection *peer_pop_expired(uint64_t now_ms);
+
+/**
+ * @brief Milliseconds until the next peer deadline, -1 if none.
+ */
+int peer_next_timeout(uint64_t now_ms);
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "common/http_types.h"
+
+/**
+ * @file response_cache.h
+ * @brief In-memory HTTP response cache with W-TinyLFU eviction, bounded by bytes.
+ *
+ * What is cached is decided by http_cache.h (Cache-Control, Expires, Vary).
+ * This module stores complete responses and decides what to keep.
+ *
+ * Layout of an entry
+ * ------------------
+ * One allocation: entry struct, key, Vary values, response head, body.
+ * The head is stored without its Age header and without the final blank
+ * line, so a hit is one writev() of three pieces and never touches a backend:
+ *
+ *   [ head ][ "Age: N\r\nX-Cache: HIT\r\n\r\n" ][ body ]
+ *
+ * Eviction: W-TinyLFU
+ * -------------------
+ * A plain LRU lets one crawl over thousands of never-repeated URLs flush the
+ * hot assets. W-TinyLFU puts a frequency filter in front of the main cache:
+ *
+ *   new entry → [ window LRU 1% ] ─candidate─► admitted only if its estimated
+ *                                              frequency beats the victims'
+ *                                              ▼
+ *               [ main: probation 20% ⇄ protected 80% (segmented LRU) ]
+ *
+ * - Frequencies come from a count-min sketch (frequency_sketch.h) updated on
+ *   every lookup, so even requests that were not cached yet count.
+ * - The small window gives brand new objects a chance to build up frequency.
+ * - A hit in probation promotes to protected; protected overflow is demoted
+ *   back to probation, where the next admission contest can evict it.
+ *
+ * Serving stale
+ * -------------
+ * An expired entry is kept as long as its stale-while-revalidate or
+ * stale-if-error window allows:
+ *
+ *   stored ── fresh ──► expires ── stale-while-revalidate ──► ── stale-if-error ──► removed
+ *              HIT              STALE + one background refresh   only if the backend fails
+ *
+ * Background refreshes are deduplicated (one per entry at a time) and rate
+ * bounded: at most RESPONSE_CACHE_MAX_REFRESHES at once, and an entry whose
+ * refresh failed is not retried for RESPONSE_CACHE_REFRESH_RETRY_MS.
+ *
+ * Lifetime
+ * --------
+ * Entries are reference counted: the cache holds one reference, every
+ * in-flight hit holds one. Evicting an entry that is still being sent only
+ * unlinks it; memory is released by the last response_cache_release().
+ *
+ * @note Single-threaded: owned by the event loop.
+ */
+
+#define RESPONSE_CACHE_MAX_BYTES (64 * 1024 * 1024) /**< Total budget (headers + bodies + metadata) */
+#define RESPONSE_CACHE_MAX_OBJECT_BYTES (1024 * 1024) /**< Larger responses are never stored */
+#define RESPONSE_CACHE_WINDOW_PERCENT 1     /**< Admission window share of the budget */
+#define RESPONSE_CACHE_PROTECTED_PERCENT 80 /**< Protected share of the main segment */
+#define RESPONSE_CACHE_AVG_OBJECT 4096      /**< Expected mean entry size (sizes the sketch and table) */
+#define RESPONSE_CACHE_MAX_REFRESHES 32     /**< Background refreshes in flight at once */
+#define RESPONSE_CACHE_REFRESH_RETRY_MS 1000 /**< Pause before refreshing an entry again after a failed refresh */
+
+typedef enum
+{
+    CACHE_SEGMENT_NONE,      /**< Unlinked (evicted or replaced), only referenced by in-flight hits */
+    CACHE_SEGMENT_WINDOW,
+    CACHE_SEGMENT_PROBATION,
+    CACHE_SEGMENT_PROTECTED
+} cache_segment_t;
+
+typedef struct cache_entry
+{
+    uint64_t hash;           /**< Hash of key (table bucket and sketch) */
+    const char *key;         /**< Primary key, see http_cache_key() */
+    const char *vary;        /**< Lowercase Vary names ("" if none) */
+    const char *vary_values; /**< Request values of those headers when stored */
+    const char *head;        /**< Status line + headers (no Age, no final CRLF) */
+    size_t head_len;
+    const char *body;
+    size_t body_len;
+
+    uint64_t stored_ms;      /**< Monotonic time the response was stored */
+    uint64_t expires_ms;     /**< Monotonic time it stops being fresh */
+    uint32_t initial_age_s;  /**< Age it already had when stored */
+    uint64_t swr_until_ms;   /**< End of the stale-while-revalidate window */
+    uint64_t sie_until_ms;   /**< End of the stale-if-error window */
+
+    bool refreshing;         /**< A background refresh is in flight */
+    uint64_t next_refresh_ms; /**< No new refresh before this time */
+
+    size_t charge;           /**< Bytes counted against the budget */
+    int refs;                /**< Cache reference + in-flight hits */
+    cache_segment_t segment;
+
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+} cache_entry_t;
+
+/**
+ * @brief How a looked up entry may be used.
+ */
+typedef enum
+{
+    CACHE_LOOKUP_FRESH,         /**< Serve it. */
+    CACHE_LOOKUP_STALE,         /**< Serve it and refresh it in the background (stale-while-revalidate). */
+    CACHE_LOOKUP_STALE_IF_ERROR /**< Go upstream; serve it only if the backend fails (stale-if-error). */
+} cache_lookup_t;
+
+/**
+ * @brief A cached response being written to one client.
+ */
+typedef struct
+{
+    cache_entry_t *entry; /**< Referenced entry (NULL = no cached reply in progress) */
+    char extra[64];       /**< Age + X-Cache (HIT or STALE) headers and the blank line */
+    size_t extra_len;
+    size_t sent;          /**< Bytes of head + extra + body already written */
+} cache_reply_t;
+
+/**
+ * @brief Allocate the table and frequency sketch.
+ * @param max_bytes Memory budget
+ * @return 0 on success, -1 on error (the proxy then runs without a cache).
+ */
+int response_cache_init(size_t max_bytes);
+
+/**
+ * @brief Find a fresh response for this request.
+ *
+ * Records the access in the frequency sketch whether it hits or not.
+ * Entries past every stale window are removed.
+ *
+ * @param key    Primary key from http_cache_key()
+ * @param req    Request (for Vary)
+ * @param result How the entry may be used (set when an entry is returned)
+ * @return Entry with a reference taken (release it), or NULL on miss.
+ */
+cache_entry_t *response_cache_lookup(const char *key, const HttpRequest *req, cache_lookup_t *result);
+
+/**
+ * @brief Store a complete backend response if http_cache.h allows it.
+ *
+ * @param key  Primary key from http_cache_key()
+ * @param req  Request the response answers (for Vary)
+ * @param resp Raw response bytes (head + body)
+ * @param len  Length of resp
+ * @return 0 if stored, -1 if not cacheable or not admitted.
+ */
+int response_cache_store(const char *key, const HttpRequest *req, const char *resp, size_t len);
+
+/**
+ * @brief Claim the background refresh of a stale entry.
+ *
+ * @return true if the caller should start the refresh (takes a reference and
+ *         marks the entry refreshing), false if one is already running, the
+ *         entry failed to refresh recently or too many refreshes are in flight.
+ */
+bool response_cache_refresh_begin(cache_entry_t *entry);
+
+/**
+ * @brief A background refresh finished (stored or not); drops its reference.
+ *
+ * @param entry Entry passed to response_cache_refresh_begin()
+ * @param ok    false if the backend failed (delays the next attempt)
+ */
+void response_cache_refresh_end(cache_entry_t *entry, bool ok);
+
+/**
+ * @brief Drop a reference taken by response_cache_lookup().
+ */
+void response_cache_release(cache_entry_t *entry);
+
+/**
+ * @brief Prepare to send a cached entry (takes over the lookup reference).
+ */
+void response_cache_reply_start(cache_reply_t *reply, cache_entry_t *entry);
+
+/**
+ * @brief Write as much of the cached reply as the socket accepts (one writev per call).
+ *
+ * @return 1 when everything was sent, 0 if the socket is full (wait for EPOLLOUT),
+ *         -1 on error, -2 if the client closed the connection.
+ */
+ssize_t response_cache_reply_send(cache_reply_t *reply, int fd);
+
+/**
+ * @brief Release the entry held by a reply (safe on an idle reply).
+ */
+void response_cache_reply_cleanup(cache_reply_t *reply);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @file slab.h
+ * @brief Fixed-size object pool with NUMA-local (and optionally huge page) chunks.
+ *
+ * Objects come from chunks of SLAB_CHUNK_BYTES mapped with mmap() and are
+ * recycled through a free list, so a busy worker stops calling malloc() for
+ * its connections once it has seen its peak. Chunks stay mapped for the
+ * life of the process.
+ *
+ * With slab_set_numa() every new chunk is mbind()'ed to the worker's node
+ * and touched right away from the (pinned) worker, so the pages are local
+ * no matter what the process-wide policy is. With huge pages the chunk is
+ * 2MB-aligned and madvise(MADV_HUGEPAGE)'d: one TLB entry for hundreds of
+ * connections instead of one per 4KB page.
+ *
+ * @note Not thread-safe: a pool belongs to one event loop.
+ */
+
+#define SLAB_CHUNK_BYTES (2u << 20) /**< Mapping size per chunk (one huge page) */
+
+typedef struct slab
+{
+    size_t object_size;  /**< Rounded up to 64 bytes (no false sharing between objects) */
+    void *free_list;     /**< Freed objects, linked through their first word */
+    size_t chunks;       /**< Chunks mapped so far */
+    size_t in_use;       /**< Objects handed out and not yet freed */
+} slab_t;
+
+/**
+ * @brief Place chunks mapped from now on: on this NUMA node (-1 = wherever
+ *        the kernel puts them) and, optionally, on transparent huge pages.
+ */
+void slab_set_numa(int node, bool huge_pages);
+
+/** @brief Initialize an empty pool of objects of this size. */
+void slab_init(slab_t *slab, size_t object_size);
+
+/**
+ * @brief One object (uninitialized).
+ * @return NULL when no chunk could be mapped
+ */
+void *slab_alloc(slab_t *slab);
+
+/** @brief Return an object to its pool. */
+void slab_free(slab_t *slab, void *object);
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * @file sockmap.h
+ * @brief Kernel-side tunnel relay with a BPF sockmap (optional, -k).
+ *
+ * The splice relay in tunnel.c still wakes the event loop and costs two
+ * syscalls per chunk per direction. Once a tunnel is established, its two
+ * sockets can instead be put into a BPF sockmap whose sk_skb verdict
+ * program redirects every received skb straight to the other socket's
+ * send path: bytes go client ⇄ backend inside the kernel and the proxy only
+ * hears about the tunnel again when a side shuts down or fails.
+ *
+ *   peers    SOCKHASH  key(socket) → the other socket     redirect target
+ *   verdict  SOCKHASH  key(socket) → the socket itself    runs the program
+ *   bytes    HASH      key(socket) → bytes redirected     idle check, EOF
+ *
+ * A key is the socket's own address pair as the program sees it in
+ * __sk_buff (IPv4 only; anything else stays on the splice relay).
+ *
+ * Handover
+ * --------
+ * A tunnel is handed over only while the splice relay holds nothing (no
+ * early bytes, empty pipes): everything read from a socket so far has been
+ * written to the other one. Both sockets go into `peers` before either goes
+ * into `verdict`, so the program never runs without a target. Bytes that
+ * arrived in the meantime are still in the receive queue, in order, and
+ * are pushed through the program by setting SO_RCVLOWAT (which calls the
+ * socket's data_ready).
+ *
+ * EOF
+ * ---
+ * Redirected skbs are sent from a kernel work item, so when one side sends
+ * FIN its last bytes may not have reached the other socket yet. The FIN is
+ * passed on with shutdown(SHUT_WR) only once the destination's written
+ * byte count (TCP_INFO bytes_acked + SIOCOUTQ) has grown by what the
+ * program counted for that direction.
+ *
+ * Any failure while setting up (no bpf() permission, old kernel, map full)
+ * leaves the tunnel on the splice relay.
+ *
+ * @note Single-threaded: owned by the event loop.
+ */
+
+#define SOCKMAP_MAX_TUNNELS 65536 /**< Tunnels relayed by the kernel at once (2 map entries each) */
+
+#define SOCKMAP_CLIENT 0
+#define SOCKMAP_BACKEND 1
+
+/**
+ * @brief A socket's address pair, laid out as the verdict program builds it.
+ */
+typedef struct
+{
+    uint32_t local_ip4;   /**< Network byte order */
+    uint32_t remote_ip4;  /**< Network byte order */
+    uint32_t local_port;  /**< Host byte order */
+    uint32_t remote_port; /**< Network byte order port in the upper 16 bits (little endian) */
+} sockmap_key_t;
+
+/**
+ * @brief Kernel relay state of one tunnel (embedded in tunnel_member_t).
+ */
+typedef struct
+{
+    sockmap_key_t key[2];  /**< Indexed by SOCKMAP_CLIENT / SOCKMAP_BACKEND */
+    uint64_t written[2];   /**< Bytes the socket had been sent when the kernel took over */
+    uint64_t moved;        /**< Bytes redirected as of the last idle check */
+} sockmap_pair_t;
+
+/**
+ * @brief Create the maps and load and attach the verdict program.
+ * @return 0, or -1 if the kernel relay is unavailable (tunnels use splice).
+ */
+int sockmap_init(void);
+
+/**
+ * @brief Was sockmap_init() successful?
+ */
+bool sockmap_available(void);
+
+/**
+ * @brief Hand a tunnel's sockets over to the kernel.
+ *
+ * Only call while the user space relay holds no bytes for either direction.
+ *
+ * @return 1 if the kernel relays the tunnel now, 0 if it stays on the
+ *         splice relay, -1 if the tunnel is broken and must be closed.
+ */
+int sockmap_attach(sockmap_pair_t *pair, int client_fd, int backend_fd);
+
+/**
+ * @brief Has everything read from socket `from` been written to `to_fd`?
+ * @param from SOCKMAP_CLIENT or SOCKMAP_BACKEND (the socket that sent EOF)
+ * @return 1 if so, 0 if bytes are still on their way, -1 on error.
+ */
+int sockmap_flushed(const sockmap_pair_t *pair, int from, int to_fd);
+
+/**
+ * @brief Total bytes the kernel redirected for this tunnel, both directions.
+ */
+uint64_t sockmap_moved(const sockmap_pair_t *pair);
+
+/**
+ * @brief Forget the tunnel (the sockets leave the sockhashes when closed).
+ */
+void sockmap_detach(sockmap_pair_t *pair);
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "common/http_types.h"
+#include "common/route_config.h"
+
+/**
+ * @file static_files.h
+ * @brief Static routes: files served from disk with sendfile() instead of a backend.
+ *
+ * Proxying "/_next/..." or "/favicon.ico" to a Node process that just reads
+ * the file costs a backend connection, a copy through two processes and the
+ * backend's CPU. A static route (see route_config.h) answers from the proxy:
+ *
+ *   request path ──► resolve under the route's directory ──► fd cache ──► head + sendfile()
+ *
+ * Open file cache
+ * ---------------
+ * Files are kept open in an LRU of STATIC_FD_CACHE_SIZE entries together with
+ * their stat() data, ETag, Last-Modified and content type, so a hit costs no
+ * open(), no stat() and no formatting beyond the response head. Missing files
+ * are cached too (negative entries, no fd), so probing for ".br"/".gz"
+ * siblings is free after the first request. An entry is trusted for
+ * STATIC_REVALIDATE_MS; after that one stat() checks whether the file was
+ * replaced (deploys rename new files over old ones).
+ *
+ * Protocol
+ * --------
+ * - GET and HEAD only (405 otherwise).
+ * - ETag / If-None-Match and Last-Modified / If-Modified-Since → 304.
+ * - Range: one "bytes=" range → 206, unsatisfiable → 416, several → whole file.
+ *   If-Range is honoured.
+ * - Precompressed siblings: "app.js.br" / "app.js.gz" next to "app.js" are
+ *   sent with Content-Encoding when the client accepts them (not for ranges).
+ *
+ * Path traversal: the decoded path may not contain ".." segments or NUL
+ * bytes, and files are opened with openat2(RESOLVE_BENEATH) relative to the
+ * route's directory, so symlinks can't lead outside it either.
+ *
+ * @note Single-threaded: owned by the event loop.
+ */
+
+#define STATIC_FD_CACHE_SIZE 256   /**< Open files kept (each holds an fd) */
+#define STATIC_NEG_CACHE_SIZE 1024 /**< Missing files remembered (no fd) */
+#define STATIC_REVALIDATE_MS 1000  /**< How long cached stat() data is trusted */
+#define STATIC_MAX_PATH 512
+
+typedef struct static_file
+{
+    char *path;              /**< Resolved path (cache key) */
+    uint64_t hash;
+    int fd;                  /**< -1 for a missing file */
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char etag[48];
+    char last_modified[32];
+    const char *content_type;
+    uint64_t checked_ms;     /**< Last stat() check */
+
+    int refs;                /**< Cache reference + replies in progress */
+    bool in_table;
+    struct static_file *hash_next;
+    struct static_file *lru_prev;
+    struct static_file *lru_next;
+} static_file_t;
+
+/**
+ * @brief A static route response being written to one client.
+ */
+typedef struct
+{
+    bool active;             /**< A static reply is in progress */
+    static_file_t *file;     /**< File the body comes from (NULL: head only) */
+    char head[768];          /**< Status line and headers (or a whole error response) */
+    size_t head_len;
+    size_t head_sent;
+    off_t off;               /**< Next body byte to send */
+    off_t end;               /**< One past the last body byte */
+} static_reply_t;
+
+/**
+ * @brief Prepare the response to a request on a static route.
+ *
+ * Every outcome (file, 304, 404, 405, 416...) becomes a reply, so the caller
+ * only has to send it with static_reply_send().
+ *
+ * @param route Static route the request matched
+ * @param req   Parsed request
+ * @param reply Reply to fill in
+ * @return 0 on success, -1 on an internal error (nothing prepared).
+ */
+int static_files_start(const Route *route, const HttpRequest *req, static_reply_t *reply);
+
+/**
+ * @brief Write as much of a static reply as the socket accepts.
+ *
+ * @return 1 when everything was sent, 0 if the socket is full (wait for EPOLLOUT),
+ *         -1 on error, -2 if the client closed the connection.
+ */
+ssize_t static_reply_send(static_reply_t *reply, int fd);
+
+/**
+ * @brief Release the file of a reply (safe on an idle reply).
+ */
+void static_reply_cleanup(static_reply_t *reply);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "v2-epoll/buffer.h"
+
+/**
+ * @file tls.h
+ * @brief TLS on the listener (OpenSSL), handshakes inside the event loop.
+ *
+ * With a certificate configured (-C/-K) every accepted client starts in
+ * CONN_TLS: the handshake runs non-blocking, driven by the client socket's
+ * epoll events. Then one of two things happens:
+ *
+ * - Kernel TLS: if the kernel took over both directions (SSL_OP_ENABLE_KTLS,
+ *   the "tls" ULP), the socket reads and writes plaintext. The connection
+ *   simply continues as a plaintext client on the same fd, so sendfile(),
+ *   splice() and every other path work unchanged; the kernel encrypts.
+ *
+ * - Bridge: otherwise the plaintext goes through a UNIX socketpair whose
+ *   other end becomes an ordinary client connection_t (like the streams of
+ *   an HTTP/2 session, see h2_server.h). The TLS connection pumps
+ *   SSL_read() into the pair and the pair into SSL_write(); with kernel TLS
+ *   for sending only, SSL_write() hands records to the kernel as well.
+ *
+ * ALPN offers "h2" and "http/1.1". A client that picks h2 sends the
+ * connection preface as its first plaintext, which starts an HTTP/2 session
+ * like on a cleartext connection.
+ *
+ * Resumption: one SSL_CTX is shared by every connection, with a server-side
+ * session cache (TLS 1.2 session ids) and session tickets (TLS 1.3), so a
+ * returning client skips the key exchange and certificate.
+ *
+ * @note Not handed over in a binary upgrade: the new process can't take
+ *       over the TLS state of a connection.
+ */
+
+#define TLS_SESSION_CACHE_SIZE 20480    /**< Sessions kept for resumption by session id */
+#define TLS_SESSION_TIMEOUT_S 3600      /**< Lifetime of a cached session or ticket */
+#define TLS_BRIDGE_HIGH (64 * 1024)     /**< Decrypted bytes buffered for the plaintext side before reading stops */
+#define TLS_RECORD_SIZE 16384           /**< Plaintext read per SSL_write() */
+
+struct connection;
+struct tls_session;
+
+/**
+ * @brief Load the certificate chain and key, create the shared context.
+ * @return 0, or -1 if TLS can't be enabled.
+ */
+int tls_init(const char *cert_file, const char *key_file);
+
+/** @brief Has tls_init() succeeded? */
+bool tls_enabled(void);
+
+/**
+ * @brief Start the handshake on a freshly accepted client (state CONN_TLS).
+ * @return 0, or -1 on error (free the connection).
+ */
+int tls_start(struct connection *conn, int epoll_fd);
+
+/**
+ * @brief Service a CONN_TLS connection: handshake progress, or pumping the
+ *        bridge in both directions.
+ * @return 0 while it lives, -1 when it is over (free the connection).
+ */
+int tls_io(struct connection *conn, int epoll_fd);
+
+/**
+ * @brief Send close_notify if possible and release the TLS state (connection_free()).
+ */
+void tls_free(struct connection *conn, int epoll_fd);
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "common/http_types.h"
+#include "v2-epoll/buffer.h"
+#include "v2-epoll/sockmap.h"
+
+/**
+ * @file tunnel.h
+ * @brief Full-duplex byte relay for WebSocket upgrades and CONNECT.
+ *
+ * Everything else the proxy does is one request, one response, close. A
+ * WebSocket (Next.js HMR, websocket APIs) or a CONNECT keeps both sockets
+ * open and bytes flow both ways until either side is done:
+ *
+ *   GET + Upgrade: websocket ──► request to backend ──► 101 Switching Protocols ──┐
+ *   CONNECT host:port ─────────► connect() ──────────► 200 Connection Established ┤
+ *                                                                                  ▼
+ *            client ══splice══► pipe ══splice══► backend     (up)
+ *            client ◄══splice══ pipe ◄══splice══ backend     (down)
+ *
+ * Zero copy
+ * ---------
+ * Each direction moves bytes socket → pipe → socket with splice(), so the
+ * payload never enters user space. Pipes are only held while bytes are in
+ * flight: a direction takes one from a small pool when its source becomes
+ * readable and gives it back once it is empty again. An idle tunnel holds
+ * no pipe, just its two sockets and the connection_t.
+ *
+ * Bytes that were already read into user space before the switch (the 101
+ * head and any frames behind it, data a CONNECT client sent right after its
+ * request) are sent from their buffers first.
+ *
+ * Flow control and shutdown
+ * -------------------------
+ * A direction stops reading while its pipe can't be drained into the
+ * destination and waits for EPOLLOUT there instead, so a slow reader holds
+ * at most one pipe (64 KB) per direction. EOF on one side is passed on with
+ * shutdown(SHUT_WR) once the pipe is empty; the tunnel ends when both
+ * directions did that, on any error, or after TUNNEL_IDLE_TIMEOUT_MS
+ * without a byte in either direction.
+ *
+ * Idle tunnels are linked through connection_t in last-activity order, so
+ * the oldest is always at the head and the timeout check is O(1).
+ *
+ * Kernel relay
+ * ------------
+ * With -k, the first time a tunnel has nothing in flight its sockets are
+ * handed to a BPF sockmap (sockmap.h) and the kernel forwards the bytes.
+ * The proxy then only watches for EOF and errors; the idle check reads the
+ * program's byte counters instead of the last-activity time (so such a
+ * tunnel closes one to two timeouts after its last byte). A FIN waits
+ * until the kernel has written the bytes before it, which nothing signals:
+ * tunnels in that state are polled every TUNNEL_FLUSH_POLL_MS. If the
+ * kernel can't take a tunnel, it stays on splice.
+ *
+ * @note Single-threaded: owned by the event loop.
+ */
+
+#define TUNNEL_IDLE_TIMEOUT_MS (300 * 1000) /**< Close a tunnel with no traffic either way for this long */
+#define TUNNEL_SPLICE_BYTES (64 * 1024)     /**< Most bytes moved into a pipe per splice() (default pipe size) */
+#define TUNNEL_PUMP_ROUNDS 16               /**< Pipe fills per direction per event, so one tunnel can't hog the loop */
+#define TUNNEL_PIPE_POOL 64                 /**< Empty pipes kept for reuse instead of closed */
+#define TUNNEL_FLUSH_POLL_MS 2              /**< Offloaded tunnel waiting for the kernel to pass on its last bytes: look again after */
+#define TUNNEL_CONNECT_REPLY "HTTP/1.1 200 Connection Established\r\n\r\n"
+
+struct connection;
+
+/**
+ * @brief One direction of a tunnel.
+ */
+typedef struct
+{
+    int pipe[2];      /**< Pipe holding spliced bytes ({-1, -1} while none is held) */
+    size_t queued;    /**< Bytes in the pipe */
+    buffer_t *early;  /**< Bytes read before the switch, sent first (NULL once sent) */
+    bool eof;         /**< Source sent EOF */
+    bool shut;        /**< EOF passed on with shutdown(SHUT_WR) */
+} tunnel_flow_t;
+
+/**
+ * @brief Per-connection tunnel state (embedded in connection_t).
+ */
+typedef struct
+{
+    bool requested;        /**< Upgrade or CONNECT request: becomes a tunnel once the backend agrees */
+    bool connect;          /**< CONNECT: the tunnel starts as soon as the backend is connected */
+    bool active;           /**< Relaying (state CONN_TUNNEL) */
+    tunnel_flow_t up;      /**< client → backend */
+    tunnel_flow_t down;    /**< backend → client */
+    uint32_t client_events;  /**< Events the client fd is registered for */
+    uint32_t backend_events; /**< Events the backend fd is registered for */
+    uint64_t active_ms;    /**< Last time a byte moved */
+    bool offload_tried;    /**< Handed to sockmap_attach() once already */
+    bool offloaded;        /**< Relayed by the kernel: pipes and early buffers unused */
+    sockmap_pair_t kernel; /**< Kernel relay state while offloaded */
+    bool flushing;         /**< Offloaded, on the list of tunnels waiting to pass on a FIN */
+    struct connection *prev;
+    struct connection *next;
+    struct connection *flush_prev;
+    struct connection *flush_next;
+} tunnel_member_t;
+
+/**
+ * @brief Is this a request for a tunnel (GET with Upgrade: websocket, or CONNECT)?
+ */
+bool tunnel_request(const HttpRequest *req);
+
+/**
+ * @brief Does a response head accept the WebSocket upgrade (status 101)?
+ */
+bool tunnel_accepted(const char *head, size_t len);
+
+/**
+ * @brief Switch a connection into tunnel mode and relay what can be relayed.
+ *
+ * Both fds must be registered with epoll. Early bytes are the unsent part
+ * of response_buffer (to the client) and of rebuilt_request_buffer (to the
+ * backend); request_buffer and the parsed request are freed.
+ *
+ * @return 0 while the tunnel is open, 1 when it finished, -1 on error.
+ */
+int tunnel_start(struct connection *conn, int epoll_fd, uint64_t now_ms);
+
+/**
+ * @brief Move bytes in both directions (on any event of a tunnel fd).
+ *
+ * @param events Reported epoll events: after EPOLLERR/EPOLLHUP the tunnel
+ *               ends as soon as there is nothing left to move.
+ * @return 0 while the tunnel is open, 1 when it finished, -1 on error.
+ */
+int tunnel_pump(struct connection *conn, int epoll_fd, uint32_t events, uint64_t now_ms);
+
+/**
+ * @brief Nothing in flight and both directions open: the tunnel's whole
+ *        state is its two sockets, so it can move to another worker and
+ *        restart there with tunnel_start().
+ */
+bool tunnel_movable(const struct connection *conn);
+
+/**
+ * @brief Leave the idle list and give back the pipes (called from connection_free).
+ */
+void tunnel_detach(struct connection *conn);
+
+/**
+ * @brief Pop a tunnel idle for TUNNEL_IDLE_TIMEOUT_MS.
+ * @return Connection (already off the idle list), or NULL if none.
+ */
+struct connection *tunnel_pop_expired(uint64_t now_ms);
+
+/**
+ * @brief Take the offloaded tunnels waiting to pass on a FIN, once every
+ *        TUNNEL_FLUSH_POLL_MS.
+ *
+ * Pump each with events 0 (it goes back on the list if it still waits).
+ *
+ * @return First tunnel, chained through tunnel.flush_next, or NULL.
+ */
+struct connection *tunnel_take_flushing(uint64_t now_ms);
+
+/**
+ * @brief Milliseconds until the next tunnel idle timeout or flush poll, -1 if none.
+ */
+int tunnel_next_timeout(uint64_t now_ms);
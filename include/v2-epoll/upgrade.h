@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @file upgrade.h
+ * @brief Zero-downtime binary upgrade: hand the listener (and idle clients) to a new process.
+ *
+ * Every running proxy listens on a unix "control" socket. Starting a new
+ * build with -U connects to it instead of binding the TCP port:
+ *
+ *   new process                          old process
+ *   -----------                          -----------
+ *   connect(control socket)
+ *   HELLO                 ───────────►   accept on control socket
+ *                         ◄───────────   LISTENER  + SCM_RIGHTS [listen fd]
+ *                         ◄───────────   IDLE (n)  + SCM_RIGHTS [n client fds]  (batched)
+ *   register fds in own epoll
+ *   DONE                  ───────────►   close own listener copy, close idle copies,
+ *                                        keep serving in-flight requests, exit when
+ *   bind control socket                  the last one finishes (or drain timeout)
+ *
+ * Why nothing is lost
+ * - SCM_RIGHTS passes the same open socket, not a copy: both processes accept
+ *   from one accept queue until the old one closes its fd, so connections
+ *   that arrive during the swap simply go to whichever process accepts first.
+ * - "Idle" means accepted but no request byte read yet. Any bytes that arrive
+ *   meanwhile are still in the kernel socket buffer and are read by the new
+ *   process. Connections with a partial or in-flight request stay in the old
+ *   process until they complete.
+ * - Until DONE arrives the old process keeps everything, so a new process that
+ *   crashes mid-handoff costs nothing.
+ */
+
+#define UPGRADE_SOCKET_PATH "/tmp/turboproxy-upgrade.sock" /**< Default control socket path */
+#define UPGRADE_IO_TIMEOUT_MS 2000  /**< Max time a handoff may block either event loop */
+#define UPGRADE_DRAIN_TIMEOUT_MS 30000 /**< Old process exits after this even if requests remain */
+#define UPGRADE_FDS_PER_MSG 64      /**< fds per SCM_RIGHTS message (kernel limit is 253) */
+
+/**
+ * @brief Bind the control socket new processes connect to.
+ *
+ * Any stale socket file at @p path is replaced.
+ *
+ * @param path Filesystem path of the unix socket
+ * @return Non-blocking listening fd, or -1 on error.
+ */
+int upgrade_listen(const char *path);
+
+/**
+ * @brief Take over from a running process (new process side).
+ *
+ * @param path      Control socket of the running process
+ * @param listen_fd Out: inherited TCP listening socket
+ * @param idle_fds  Out: malloc'd array of inherited idle client fds (free() it; NULL if none)
+ * @return Number of idle client fds received, or -1 on error (nothing inherited).
+ */
+int upgrade_inherit(const char *path, int *listen_fd, int **idle_fds);
+
+/**
+ * @brief Serve one upgrade request on the control socket (old process side).
+ *
+ * On success the caller must stop accepting: remove listen_fd from epoll,
+ * close it and drain. Idle connections that were handed over have already
+ * been scheduled for free (that only closes this process's copy).
+ *
+ * @param control_fd Listening control socket from upgrade_listen()
+ * @param listen_fd  TCP listening socket to hand over
+ * @return 0 if the new process took over, -1 if not (keep serving as before).
+ */
+int upgrade_handoff(int control_fd, int listen_fd);
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <common/route_config.h>
+
+/**
+ * @file upstream_limiter.h
+ * @brief Adaptive per-upstream concurrency limit with a bounded wait queue.
+ *
+ * Every distinct backend (host + port) gets one limiter. A request may only
+ * connect to the backend while `inflight < limit`; otherwise it waits in a
+ * FIFO queue inside the event loop until a slot frees up or its queue
+ * deadline passes (then the client gets a 503).
+ *
+ * The limit is not a fixed number. It follows the Gradient algorithm from
+ * Netflix's concurrency-limits:
+ *
+ *   gradient  = clamp(RTT_TOLERANCE * long_rtt / sample_rtt, 0.5, 1.0)
+ *   new_limit = limit * gradient + sqrt(limit)
+ *   limit     = limit * (1 - SMOOTHING) + new_limit * SMOOTHING
+ *
+ * - long_rtt is a slow moving average = "how fast the backend is when healthy"
+ * - When latency rises above that baseline the gradient drops below 1 and the
+ *   limit shrinks, so we stop piling requests on a backend that is already
+ *   queueing them internally.
+ * - The sqrt(limit) term lets the limit probe upwards while latency is flat.
+ * - A failed request (connect error, reset, no response) is a drop signal and
+ *   multiplicatively backs the limit off (the "MD" of AIMD).
+ *
+ * Memory: the limiter table and the queue are fixed-size. Queued requests are
+ * linked through fields inside connection_t, so queueing never allocates.
+ */
+
+#define MAX_UPSTREAMS 32
+
+#define UPSTREAM_LIMIT_INITIAL 20.0
+#define UPSTREAM_LIMIT_MIN 4.0
+#define UPSTREAM_LIMIT_MAX 1000.0
+
+#define UPSTREAM_QUEUE_MAX 256          /**< Waiting requests per upstream before rejecting immediately */
+#define UPSTREAM_QUEUE_TIMEOUT_MS 1000  /**< Max time a request waits for a slot */
+
+#define UPSTREAM_RTT_TOLERANCE 1.5      /**< Latency increase tolerated before the limit shrinks */
+#define UPSTREAM_LIMIT_SMOOTHING 0.2    /**< Weight of each new limit estimate */
+#define UPSTREAM_LONG_RTT_WINDOW 600.0  /**< Samples in the long-term RTT average */
+#define UPSTREAM_DROP_BACKOFF 0.9       /**< Multiplicative decrease on failure */
+#define UPSTREAM_READAHEAD_BYTES (256 * 1024) /**< Response bytes read ahead of a slow client */
+
+struct connection;
+
+typedef struct upstream_limiter
+{
+    char host[MAX_HOST_LEN];
+    int port;
+
+    double limit;      /**< Current adaptive concurrency limit */
+    int inflight;      /**< Requests currently holding a slot */
+    double long_rtt;   /**< Long-term average RTT in microseconds */
+
+    struct connection *queue_head; /**< Oldest waiting request */
+    struct connection *queue_tail; /**< Newest waiting request */
+    int queue_len;
+} upstream_limiter_t;
+
+/**
+ * @brief Find (or lazily create) the limiter of a backend.
+ *
+ * @param host Backend host name as written in routes.conf
+ * @param port Backend port
+ * @return Limiter, or NULL if the fixed table is full (request is then unlimited).
+ */
+upstream_limiter_t *upstream_limiter_get(const char *host, int port);
+
+/**
+ * @brief Take a concurrency slot for a connection if one is free.
+ *
+ * On success the connection is bound to the limiter and its RTT clock starts.
+ *
+ * @return true if the request may connect to the backend now.
+ */
+bool upstream_limiter_try_acquire(upstream_limiter_t *ul, struct connection *conn);
+
+/**
+ * @brief Park a connection in the limiter queue.
+ *
+ * @param now_ms Current monotonic time, used to compute the queue deadline.
+ * @return 0 on success, -1 if the queue is already full.
+ */
+int upstream_limiter_enqueue(upstream_limiter_t *ul, struct connection *conn, uint64_t now_ms);
+
+/**
+ * @brief Detach a connection from its limiter: once the backend response is
+ *        complete (backend EOF or end of an h2c stream), or when it is freed.
+ *
+ * A queued connection is simply removed from the queue. A connection holding a
+ * slot releases it and feeds its RTT (or a drop, if the backend never answered)
+ * into the limit. The sample stops at the backend's last byte, so a slow
+ * client draining the response is not counted as backend latency. Calling it
+ * again after that is a no-op.
+ */
+void upstream_limiter_finish(struct connection *conn);
+
+/**
+ * @brief Pop a queued request whose deadline has passed (any upstream).
+ * @return Expired connection (no longer queued), or NULL if none.
+ */
+struct connection *upstream_limiter_pop_expired(uint64_t now_ms);
+
+/**
+ * @brief Pop the next queued request of an upstream that has a free slot.
+ *
+ * The returned connection already holds the slot; the caller only has to start
+ * the backend connect.
+ *
+ * @return Connection to dispatch, or NULL if nothing can run right now.
+ */
+struct connection *upstream_limiter_pop_ready(void);
+
+/**
+ * @brief Milliseconds until the next queue event, for epoll_wait().
+ * @return -1 when nothing is queued, 0 if a queued request can run now.
+ */
+int upstream_limiter_next_timeout(uint64_t now_ms);
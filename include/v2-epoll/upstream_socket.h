@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * @file upstream_socket.h
+ * @brief Source addresses, port ranges, Fast Open and close strategy for backend connects.
+ *
+ * Every request opens a new TCP connection to its backend, and each one
+ * takes an ephemeral port of the proxy's address. Under sustained load the
+ * ports run out: sockets closed by the proxy wait in TIME_WAIT for 60s, and
+ * connect() fails with EADDRNOTAVAIL. Three defenses, all opt-in (-b, -R):
+ *
+ * - Source pool: connects bind to one of several local addresses, in turn
+ *   (e.g. 127.0.0.2-127.0.0.5 for a loopback backend), each with its own
+ *   ports. With IP_BIND_ADDRESS_NO_PORT the port is picked at connect() time
+ *   for the full 4-tuple, so a bound source doesn't reserve a port for every
+ *   destination. When an address is out of ports the next one is tried.
+ *
+ * - Port range per source: IP_LOCAL_PORT_RANGE (Linux 6.3+) keeps the
+ *   proxy's connects inside LO-HI, away from ports other programs on the
+ *   host need; without it the system-wide ip_local_port_range applies.
+ *
+ * - Reset on abandon: TIME_WAIT stays with the side that closes first. On a
+ *   complete response the backend closes first (Connection: close), but
+ *   when the proxy gives up on a connection (client gone, errors, timeouts)
+ *   it closes first and keeps the port for 60s. With -R those closes send
+ *   a RST instead (SO_LINGER 0), which leaves no TIME_WAIT. Only done when
+ *   the backend hasn't closed yet (nothing it sends is wanted anymore) and
+ *   all we sent has been acknowledged (nothing of ours is lost); a backend
+ *   that already sent its FIN gets a normal close, which never leaves
+ *   TIME_WAIT on our side.
+ *
+ * Fast Open (-O): with TCP_FASTOPEN_CONNECT, connect() returns at once
+ * and the first write (the request) goes out in the SYN when the kernel
+ * has a cookie for the backend, which saves the round trip of the
+ * handshake on every new connection. The backend's listener must have
+ * TCP_FASTOPEN; without it (or without a cookie yet) it's a plain
+ * handshake. Not used for CONNECT, where the backend speaks first as far
+ * as the proxy knows.
+ *
+ * Connect results are counted by errno, and failures are summarised in the
+ * log at most every UPSTREAM_CONNECT_REPORT_MS.
+ */
+
+#define UPSTREAM_SOURCES_MAX 16           /**< Addresses in the -b pool */
+#define UPSTREAM_CONNECT_REPORT_MS 10000  /**< Interval of the connect error summary */
+#define UPSTREAM_ERRNO_MAX 256            /**< errno values counted one by one, higher ones share the last slot */
+
+/**
+ * @brief Configure the source pool and close strategy.
+ *
+ * @param sources  NULL, or "ADDR[:LO-HI],..." with IPv4 addresses; "*" as
+ *                 ADDR keeps the kernel's source address and only restricts
+ *                 the port range
+ * @param reset_abandoned Close abandoned backend connections with a RST
+ * @param fastopen Send the first bytes in the SYN (TCP_FASTOPEN_CONNECT)
+ * @return 0, or -1 on a malformed list
+ */
+int upstream_socket_init(const char *sources, bool reset_abandoned, bool fastopen);
+
+/** @brief Sources in the pool (0 = connects aren't bound). */
+int upstream_socket_source_count(void);
+
+/**
+ * @brief Set up a fresh IPv4 socket before connect(): bind it to the next
+ *        source in the pool, and turn on Fast Open.
+ * @param attempt 0 for the first try, n to skip ahead after EADDRNOTAVAIL
+ * @param early_data The proxy writes first on this connection
+ * @return 0, or -1 with errno set
+ */
+int upstream_socket_prepare(int fd, int attempt, bool early_data);
+
+/** @brief Count the result of a backend connect (0 = connected, else errno). */
+void upstream_socket_connect_result(int err);
+
+/** @brief Close a backend socket, with a RST when -R is on and the backend hasn't closed. */
+void upstream_socket_close(int fd);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * @file workers.h
+ * @brief One event loop per CPU: pinned worker processes with NUMA-local memory.
+ *
+ * The event loop keeps its state (caches, upstream limits, live
+ * connections) in process globals, so a worker is a process, not a thread:
+ * the proxy forks one per CPU and each runs the usual loop on its own
+ * SO_REUSEPORT listener. The rate limit table is the exception: it is
+ * mapped shared before the fork (rate_limiter.h), so limits hold across
+ * workers. The parent stays behind as a supervisor that only forwards
+ * signals (SIGTERM, SIGINT, SIGHUP for route reloads), prints the workers'
+ * load on SIGUSR1 (see migrate.h) and exits once every worker is gone.
+ *
+ * Each worker:
+ * - is pinned to its CPU (sched_setaffinity), so its caches stay warm and
+ *   the scheduler never moves it away from its memory;
+ * - prefers its CPU's NUMA node for every allocation (set_mempolicy), and
+ *   maps its connection slab there explicitly (mbind + first touch, see
+ *   slab.h), optionally on huge pages;
+ * - gets the connections whose packets its CPU received: a reuseport CBPF
+ *   program returns the index of the listener that belongs to the
+ *   receiving CPU (RSS/RPS already picked that CPU for the flow), so the
+ *   socket, its skbs and the connection_t all stay on one core and node.
+ *   CPUs without a worker fall back to the kernel's hash. Where the program
+ *   can't be attached, SO_INCOMING_CPU on each listener does the same on
+ *   kernels that honour it in reuseport selection. Workers that share a
+ *   CPU get no steering: the kernel's hash spreads connections over them.
+ *
+ * Listeners are created by the supervisor, in worker order, before forking:
+ * the group index the program returns is the order of bind().
+ */
+
+#define WORKERS_MAX 256 /**< Worker processes (-w) */
+
+/**
+ * @brief Start the workers; returns only in a worker process.
+ *
+ * @param count      Workers; 0 = one per CPU in cpus
+ * @param cpus       CPU list ("0-3,8"), NULL = the CPUs we may run on.
+ *                   Shorter than count: workers share CPUs round robin.
+ * @param port       Bind one reuseport listener per worker here; -1 = the
+ *                   workers take theirs over from a running proxy (-U)
+ * @param huge_pages Map connection slabs on transparent huge pages
+ * @param migrate    Busy per mille above which a worker moves connections
+ *                   to another one (migrate.h); 0 = never
+ * @param listener   Set to the worker's listener (-1 with port -1)
+ * @return This worker's index (0 .. count-1), or -1 if nothing was
+ *         started (bad CPU list, bind failed) or a fork failed (the
+ *         workers already forked are stopped first)
+ */
+int workers_start(int count, const char *cpus, int port, bool huge_pages, int migrate, int *listener);
+
+/** @brief Workers started (0 = the proxy runs as one process). */
+int workers_count(void);
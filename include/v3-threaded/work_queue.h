@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+/**
+ * @file work_queue.h
+ * @brief Bounded queue of accepted client sockets, from the acceptor thread
+ *        to the worker pool.
+ *
+ * The ring is lock-free (Vyukov's bounded MPMC queue): every cell carries a
+ * sequence number that says whose turn it is, so a producer and the
+ * consumers claim positions with one compare-and-swap each and never wait
+ * for one another inside the queue. Any number of threads may push or pop.
+ *
+ * Two semaphores count the items and the free cells. They only put a
+ * thread to sleep when there is nothing to do: workers on an empty queue,
+ * the acceptor on a full one (connections then wait in the listen backlog
+ * instead of in memory). A sem_post() on a semaphore nobody waits on is
+ * one atomic increment, no syscall.
+ */
+
+typedef struct
+{
+    _Atomic size_t sequence; /**< pos: free for the push at pos; pos + 1: holds its item */
+    int fd;
+} work_queue_cell_t;
+
+typedef struct
+{
+    work_queue_cell_t *cells;
+    size_t mask; /**< capacity - 1 */
+    _Alignas(64) _Atomic size_t enqueue_pos;
+    _Alignas(64) _Atomic size_t dequeue_pos;
+    sem_t items; /**< Pushed, not yet popped */
+    sem_t slots; /**< Free cells */
+} work_queue_t;
+
+/**
+ * @brief Allocate the ring.
+ * @param capacity Cells, a power of two
+ * @return 0 on success, -1 on failure
+ */
+int work_queue_init(work_queue_t *queue, size_t capacity);
+
+/** @brief Free the ring (no thread may still use it). */
+void work_queue_destroy(work_queue_t *queue);
+
+/**
+ * @brief Add @p fd without blocking.
+ * @return true, or false if the queue is full
+ */
+bool work_queue_try_push(work_queue_t *queue, int fd);
+
+/**
+ * @brief Take the oldest fd without blocking.
+ * @return true with *fd set, or false if the queue is empty
+ */
+bool work_queue_try_pop(work_queue_t *queue, int *fd);
+
+/** @brief Add @p fd, sleeping while the queue is full. */
+void work_queue_push(work_queue_t *queue, int fd);
+
+/** @brief Take the oldest fd, sleeping while the queue is empty. */
+int work_queue_pop(work_queue_t *queue);
@@ -0,0 +1,200 @@
+#!/bin/bash
+
+# Syscalls the proxy makes per client connection, two builds side by side
+# (e.g. before and after a change to the accept path). Each proxy runs
+# with a small LD_PRELOAD shim that counts the socket calls it makes into
+# libc, while one client makes sequential requests, each on a new
+# connection, against a Python backend (port 3992); the proxy listens on
+# 8455. Reports calls per connection by name, then req/s for a burst of
+# concurrent clients.
+#
+# The shim only sees calls that go through libc wrappers (OpenSSL and
+# zlib aren't involved on this path), which is every syscall the accept
+# path makes.
+#
+# Usage:
+#   git worktree add /tmp/old HEAD~1 && make -C /tmp/old VERSION=v2-epoll
+#   make VERSION=v2-epoll
+#   ./scripts/accept_syscalls.sh /tmp/old/bin/v2-epoll-server bin/v2-epoll-server [requests]
+
+OLD_BIN=$(realpath "${1:-bin/v2-epoll-server}")
+NEW_BIN=$(realpath "${2:-bin/v2-epoll-server}")
+REQUESTS=${3:-2000}
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/accept_syscalls.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+ulimit -n 65535 2>/dev/null
+
+echo "/ localhost 3992" > "$WORKDIR/routes.conf"
+
+# Counters live in a shared file, so they can be read while the proxy runs
+cat > "$WORKDIR/count.c" <<'EOF'
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+enum { ACCEPT, ACCEPT4, FCNTL, GETPEERNAME, GETSOCKNAME, SETSOCKOPT, GETSOCKOPT, EPOLL_CTL,
+       SOCKET, CONNECT, CLOSE, READ, WRITE, RECV, SEND, WRITEV, COUNTERS };
+static volatile uint64_t *counters;
+
+__attribute__((constructor)) static void init(void)
+{
+    int fd = open(getenv("SYSCOUNT_FILE"), O_RDWR);
+    counters = mmap(NULL, COUNTERS * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+}
+
+#define NEXT(name) static __typeof__(name) *next; if (!next) next = dlsym(RTLD_NEXT, #name)
+#define COUNT(i) __atomic_fetch_add(&counters[i], 1, __ATOMIC_RELAXED)
+
+int accept(int fd, struct sockaddr *a, socklen_t *l) { NEXT(accept); COUNT(ACCEPT); return next(fd, a, l); }
+int accept4(int fd, struct sockaddr *a, socklen_t *l, int f) { NEXT(accept4); COUNT(ACCEPT4); return next(fd, a, l, f); }
+int getpeername(int fd, struct sockaddr *a, socklen_t *l) { NEXT(getpeername); COUNT(GETPEERNAME); return next(fd, a, l); }
+int getsockname(int fd, struct sockaddr *a, socklen_t *l) { NEXT(getsockname); COUNT(GETSOCKNAME); return next(fd, a, l); }
+int setsockopt(int fd, int lv, int o, const void *v, socklen_t l) { NEXT(setsockopt); COUNT(SETSOCKOPT); return next(fd, lv, o, v, l); }
+int getsockopt(int fd, int lv, int o, void *v, socklen_t *l) { NEXT(getsockopt); COUNT(GETSOCKOPT); return next(fd, lv, o, v, l); }
+int epoll_ctl(int e, int op, int fd, struct epoll_event *ev) { NEXT(epoll_ctl); COUNT(EPOLL_CTL); return next(e, op, fd, ev); }
+int socket(int d, int t, int p) { NEXT(socket); COUNT(SOCKET); return next(d, t, p); }
+int connect(int fd, const struct sockaddr *a, socklen_t l) { NEXT(connect); COUNT(CONNECT); return next(fd, a, l); }
+int close(int fd) { NEXT(close); if (counters) COUNT(CLOSE); return next(fd); }
+ssize_t read(int fd, void *b, size_t n) { NEXT(read); COUNT(READ); return next(fd, b, n); }
+ssize_t write(int fd, const void *b, size_t n) { NEXT(write); COUNT(WRITE); return next(fd, b, n); }
+ssize_t recv(int fd, void *b, size_t n, int f) { NEXT(recv); COUNT(RECV); return next(fd, b, n, f); }
+ssize_t send(int fd, const void *b, size_t n, int f) { NEXT(send); COUNT(SEND); return next(fd, b, n, f); }
+ssize_t writev(int fd, const struct iovec *v, int n) { NEXT(writev); COUNT(WRITEV); return next(fd, v, n); }
+
+int fcntl(int fd, int cmd, ...)
+{
+    NEXT(fcntl);
+    va_list ap;
+    va_start(ap, cmd);
+    void *arg = va_arg(ap, void *);
+    va_end(ap);
+    COUNT(FCNTL);
+    return next(fd, cmd, arg);
+}
+EOF
+gcc -O2 -shared -fPIC -o "$WORKDIR/count.so" "$WORKDIR/count.c" -ldl || exit 1
+NAMES="accept accept4 fcntl getpeername getsockname setsockopt getsockopt epoll_ctl socket connect close read write recv send writev"
+
+cat > "$WORKDIR/backend.py" <<'EOF'
+import socketserver
+
+class Handler(socketserver.BaseRequestHandler):
+    def handle(self):
+        data = b""
+        while b"\r\n\r\n" not in data:
+            chunk = self.request.recv(4096)
+            if not chunk:
+                return
+            data += chunk
+        self.request.sendall(b"HTTP/1.1 200 OK\r\nContent-Length: 6\r\nConnection: close\r\n\r\nhello\n")
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+    request_queue_size = 4096
+
+Server(("127.0.0.1", 3992), Handler).serve_forever()
+EOF
+
+cat > "$WORKDIR/client.py" <<'EOF'
+import socket, sys, threading, time
+
+mode, count = sys.argv[1], int(sys.argv[2])
+request = b"GET /x HTTP/1.1\r\nHost: localhost\r\n\r\n"
+
+def one():
+    s = socket.create_connection(("127.0.0.1", 8455))
+    s.sendall(request)
+    reply = b""
+    while chunk := s.recv(4096):
+        reply += chunk
+    s.close()
+    return reply.startswith(b"HTTP/1.1 200")
+
+if mode == "sequential":
+    failed = sum(not one() for _ in range(count))
+    sys.exit(failed != 0)
+
+# burst: 50 threads connecting at once
+ok = 0
+lock = threading.Lock()
+def worker(n):
+    global ok
+    for _ in range(n):
+        try:
+            good = one()
+        except OSError:
+            good = False
+        with lock:
+            ok += good
+start = time.time()
+threads = [threading.Thread(target=worker, args=(count // 50,)) for _ in range(50)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+print("%.0f req/s (%d/%d ok)" % (count / (time.time() - start), ok, count))
+EOF
+
+counters() { od -An -v -t u8 -w8 "$WORKDIR/counters" | tr -s ' \n' ' '; }
+
+run() {
+    local name=$1 bin=$2
+    head -c 4096 /dev/zero > "$WORKDIR/counters"
+    (cd "$WORKDIR" && SYSCOUNT_FILE="$WORKDIR/counters" LD_PRELOAD="$WORKDIR/count.so" \
+        exec "$bin" -p 8455 -c none -s "$WORKDIR/upgrade.sock" > proxy.log 2>&1) &
+    PROXY_PID=$!
+    sleep 1
+
+    local before after
+    read -r -a before <<< "$(counters)"
+    if ! python3 "$WORKDIR/client.py" sequential "$REQUESTS"; then
+        echo "❌ $name: failed requests"
+    fi
+    read -r -a after <<< "$(counters)"
+
+    echo "== $name ($REQUESTS connections) =="
+    local i=0 total=0
+    for syscall in $NAMES; do
+        local n=$((after[i] - before[i]))
+        total=$((total + n))
+        [ "$n" -gt 0 ] && awk -v s="$syscall" -v n="$n" -v r="$REQUESTS" 'BEGIN { printf "  %-12s %5.2f\n", s, n / r }'
+        i=$((i + 1))
+    done
+    awk -v n="$total" -v r="$REQUESTS" 'BEGIN { printf "  %-12s %5.2f per connection\n", "total", n / r }'
+    echo -n "  burst of 50 concurrent clients: "
+    python3 "$WORKDIR/client.py" burst "$REQUESTS"
+
+    kill "$PROXY_PID" 2>/dev/null
+    wait "$PROXY_PID" 2>/dev/null
+}
+
+echo "🔧 Syscalls per connection: $OLD_BIN vs $NEW_BIN"
+(cd "$WORKDIR" && exec python3 backend.py > backend.log 2>&1) &
+BACKEND_PID=$!
+sleep 1
+
+{
+    run "old: $OLD_BIN" "$OLD_BIN"
+    run "new: $NEW_BIN" "$NEW_BIN"
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
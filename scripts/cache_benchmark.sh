@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Response cache: hit path vs proxied path on the same URL.
+#
+# The proxied run sends "Cache-Control: no-cache", which makes the proxy go
+# to the backend every time (and refresh the cached copy), so both runs do
+# identical work except for the cache. The backend must answer the URL with
+# a cacheable response (e.g. "Cache-Control: max-age=60").
+#
+# Usage:
+#   VERSION=v2-epoll ./scripts/cache_benchmark.sh [path]
+
+URL="http://localhost:8000${1:-/robots.txt}"
+VERSION=${VERSION:-"v2-epoll"}
+DURATION=${DURATION:-10s}
+OUTDIR="benchmarks/$VERSION"
+mkdir -p "$OUTDIR"
+
+echo "🔧 Cache benchmark for TurboProxy ($VERSION) at $URL"
+
+# First request fills the cache, the second one must be a hit
+curl -s -o /dev/null "$URL"
+if ! curl -s -D - -o /dev/null "$URL" | grep -qi "^X-Cache: HIT"; then
+    echo "❌ $URL is not served from the cache (check the backend's Cache-Control)"
+    exit 1
+fi
+
+echo "🚀 Running wrk on the hit path..."
+wrk -t4 -c100 -d"$DURATION" --latency "$URL" > "$OUTDIR/cache-hit.txt" 2>&1
+echo "✅ hit done → $OUTDIR/cache-hit.txt"
+
+echo "🚀 Running wrk on the proxied path (Cache-Control: no-cache)..."
+wrk -t4 -c100 -d"$DURATION" --latency -H "Cache-Control: no-cache" "$URL" > "$OUTDIR/cache-miss.txt" 2>&1
+echo "✅ proxied done → $OUTDIR/cache-miss.txt"
+
+echo "📊 Compare 'Requests/sec' and the latency distribution of both files."
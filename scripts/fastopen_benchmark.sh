@@ -0,0 +1,145 @@
+#!/bin/bash
+
+# TCP_DEFER_ACCEPT and TCP Fast Open on the listener (-D, -F) and TCP Fast
+# Open toward the backend (-O): request latency with each, one request at a
+# time on a new connection (so every request pays both handshakes), and the
+# descriptors held by clients that connect without sending anything.
+#
+# Runs a Python backend with TCP_FASTOPEN on its listener (port 3996) and
+# one proxy per configuration (port 8454) from a temporary directory. The
+# client sends with MSG_FASTOPEN, so with -F its request rides in the SYN
+# once it has a cookie. TcpExt counters show how many connections actually
+# used Fast Open (Active = sent data in the SYN, Passive = accepted it; both
+# directions count, the client's and the proxy's).
+#
+# Fast Open needs net.ipv4.tcp_fastopen=3 (client and server bits); the
+# script only reports the current value. On loopback a round trip is a few
+# microseconds, so the savings here are the handshake's cost in the kernel
+# and the event loop; across a network each one saves a full RTT.
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/fastopen_benchmark.sh [requests] [idle_connections]
+
+REQUESTS=${1:-5000}
+IDLE=${2:-500}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/fastopen.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+ulimit -n 65535 2>/dev/null
+
+echo "/ localhost 3996" > "$WORKDIR/routes.conf"
+
+cat > "$WORKDIR/backend.py" <<'EOF'
+import socket, socketserver
+
+class Handler(socketserver.BaseRequestHandler):
+    def handle(self):
+        data = b""
+        while b"\r\n\r\n" not in data:
+            chunk = self.request.recv(4096)
+            if not chunk:
+                return
+            data += chunk
+        self.request.sendall(b"HTTP/1.1 200 OK\r\nContent-Length: 6\r\nConnection: close\r\n\r\nhello\n")
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+    request_queue_size = 4096
+    def server_bind(self):
+        self.socket.setsockopt(socket.IPPROTO_TCP, socket.TCP_FASTOPEN, 256)
+        super().server_bind()
+
+Server(("127.0.0.1", 3996), Handler).serve_forever()
+EOF
+
+cat > "$WORKDIR/client.py" <<'EOF'
+import socket, sys, time
+
+mode, count = sys.argv[1], int(sys.argv[2])
+request = b"GET /x HTTP/1.1\r\nHost: localhost\r\n\r\n"
+
+if mode == "idle":
+    # Connect and say nothing
+    conns = [socket.create_connection(("127.0.0.1", 8454)) for _ in range(count)]
+    time.sleep(2)
+    print(len(conns))
+    sys.exit()
+
+times, failed = [], 0
+for _ in range(count):
+    start = time.perf_counter()
+    s = socket.socket()
+    try:
+        s.sendto(request, socket.MSG_FASTOPEN, ("127.0.0.1", 8454))
+        reply = b""
+        while chunk := s.recv(4096):
+            reply += chunk
+        if reply.startswith(b"HTTP/1.1 200"):
+            times.append(time.perf_counter() - start)
+        else:
+            failed += 1
+    except OSError:
+        failed += 1
+    s.close()
+
+times.sort()
+pct = lambda p: times[min(len(times) - 1, int(len(times) * p))] * 1e6
+print("median %4.0f us  p99 %5.0f us  (%d failed)" % (pct(0.5), pct(0.99), failed), end="")
+EOF
+
+tfo_counters() {
+    awk '/^TcpExt:/ { if (!n) { split($0, k); n = 1 } else { for (i = 2; i <= NF; i++) if (k[i] == "TCPFastOpenActive" || k[i] == "TCPFastOpenPassive") printf "%s ", $i } }' /proc/net/netstat
+}
+
+fds() { ls "/proc/$PROXY_PID/fd" | wc -l; }
+
+run() {
+    local name=$1
+    shift
+    (cd "$WORKDIR" && exec "$BIN" -p 8454 -c none -s "$WORKDIR/upgrade.sock" "$@" > proxy.log 2>&1) &
+    PROXY_PID=$!
+    sleep 1
+
+    local before after idle_before
+    printf "%-14s " "$name"
+    read -r -a before <<< "$(tfo_counters)"
+    python3 "$WORKDIR/client.py" latency "$REQUESTS"
+    read -r -a after <<< "$(tfo_counters)"
+    echo -n "  fastopen active $((after[0] - before[0])) passive $((after[1] - before[1]))"
+
+    idle_before=$(fds)
+    python3 "$WORKDIR/client.py" idle "$IDLE" > /dev/null &
+    local client=$!
+    sleep 1
+    echo "  idle clients: $(($(fds) - idle_before)) fds"
+    wait "$client"
+
+    kill "$PROXY_PID" 2>/dev/null
+    wait "$PROXY_PID" 2>/dev/null
+}
+
+echo "🔧 Fast Open / deferred accept: $REQUESTS requests, $IDLE idle clients (net.ipv4.tcp_fastopen=$(cat /proc/sys/net/ipv4/tcp_fastopen))"
+(cd "$WORKDIR" && exec python3 backend.py > backend.log 2>&1) &
+BACKEND_PID=$!
+sleep 1
+
+{
+    echo "== request latency on new connections (net.ipv4.tcp_fastopen=$(cat /proc/sys/net/ipv4/tcp_fastopen)) =="
+    run "baseline"
+    run "-D 5" -D 5
+    run "-F 256" -F 256
+    run "-O" -O
+    run "-D 5 -F 256 -O" -D 5 -F 256 -O
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
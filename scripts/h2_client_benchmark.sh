@@ -0,0 +1,160 @@
+#!/bin/bash
+
+# HTTP/2 clients (prior knowledge) against HTTP/1.1 clients, same proxy and
+# backend. Runs its own proxy (port 8430) from a temporary directory and a
+# Node HTTP/1.1 backend (port 3992):
+#
+#   throughput  REQUESTS small requests, CONCURRENCY at a time: HTTP/1.1
+#               opens a connection per request, HTTP/2 sends them as
+#               streams over 10 connections
+#   memory      HELD requests held open at once (headers sent, body never
+#               finished, so they wait in the proxy rather than on a
+#               backend slot); reports the proxy's RSS and fds per request
+#               and the client TCP connections it took
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/h2_client_benchmark.sh [requests] [concurrency] [held]
+
+REQUESTS=${1:-20000}
+CONCURRENCY=${2:-200}
+HELD=${3:-1000}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+NODE=${NODE:-node}
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/h2.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+if ! command -v "$NODE" > /dev/null; then
+    echo "❌ Needs node (set NODE=/path/to/node)"
+    exit 1
+fi
+ulimit -n 65535 2>/dev/null
+
+echo "/ localhost 3992" > "$WORKDIR/routes.conf"
+
+cat > "$WORKDIR/backend.js" <<'EOF'
+const http = require("http");
+http.createServer((req, res) => {
+    res.writeHead(200, { "content-type": "text/plain" });
+    res.end("hello\n");
+}).listen(3992, "127.0.0.1", 65535);
+EOF
+
+# HTTP/1.1: a connection per request
+cat > "$WORKDIR/h1.py" <<'EOF'
+import asyncio, sys, time
+
+mode, count, concurrency = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+ok = failed = 0
+
+async def request(head):
+    global ok, failed
+    try:
+        reader, writer = await asyncio.open_connection("127.0.0.1", 8430)
+        writer.write(head)
+        reply = await reader.read()
+        writer.close()
+        if reply.startswith(b"HTTP/1.1 200"):
+            ok += 1
+        else:
+            failed += 1
+    except OSError:
+        failed += 1
+
+async def worker(n):
+    for _ in range(n):
+        await request(b"GET /x HTTP/1.1\r\nHost: localhost\r\n\r\n")
+
+async def main():
+    start = time.time()
+    if mode == "load":
+        await asyncio.gather(*(worker(count // concurrency) for _ in range(concurrency)))
+        print("%6.0f req/s  (%d ok, %d failed)" % ((ok + failed) / (time.time() - start), ok, failed))
+    else:
+        await asyncio.gather(*(request(b"POST /x HTTP/1.1\r\nHost: localhost\r\nContent-Length: 10\r\n\r\n")
+                               for _ in range(count)))
+
+asyncio.run(main())
+EOF
+
+# HTTP/2: streams over a few connections
+cat > "$WORKDIR/h2.js" <<'EOF'
+const http2 = require("http2");
+const [mode, count, concurrency] = [process.argv[2], +process.argv[3], +process.argv[4]];
+const sessions = [...Array(10)].map(() => http2.connect("http://127.0.0.1:8430"));
+let started = 0, done = 0, ok = 0, failed = 0;
+const start = Date.now();
+
+function request(headers, next) {
+    const r = sessions[started++ % sessions.length].request(headers, { endStream: next });
+    r.on("response", h => h[":status"] == 200 ? ok++ : failed++);
+    r.on("error", () => failed++);
+    r.on("close", () => {
+        if (++done == count) {
+            if (mode == "load")
+                console.log("%s req/s  (%d ok, %d failed)",
+                    (done / ((Date.now() - start) / 1000)).toFixed(0).padStart(6), ok, failed);
+            sessions.forEach(s => s.close());
+        } else if (next && started < count) {
+            request(headers, next);
+        }
+    });
+    r.resume();
+}
+
+if (mode == "load")
+    for (let i = 0; i < concurrency; i++) request({ ":path": "/x" }, true);
+else
+    for (let i = 0; i < count; i++) request({ ":path": "/x", ":method": "POST", "content-length": "10" }, false);
+EOF
+
+rss_kb() { awk '/VmRSS/ { print $2 }' "/proc/$PROXY_PID/status"; }
+fds() { ls "/proc/$PROXY_PID/fd" | wc -l; }
+client_conns() { ss -tn state established "( sport = :8430 )" | tail -n +2 | wc -l; }
+
+# Proxy RSS and fds with HELD requests open, per request
+held() {
+    local rss_before fds_before
+    rss_before=$(rss_kb)
+    fds_before=$(fds)
+    "$@" &
+    local client=$!
+    sleep 5
+    local rss_after fds_after conns
+    rss_after=$(rss_kb)
+    fds_after=$(fds)
+    conns=$(client_conns)
+    kill "$client" 2>/dev/null
+    sleep 1
+    echo "$(((rss_after - rss_before) * 1024 / HELD)) bytes RSS and $(((fds_after - fds_before) * 100 / HELD))/100 fds per request, $conns client connections"
+}
+
+echo "🔧 HTTP/2 client benchmark: $REQUESTS requests, $CONCURRENCY concurrent, $HELD held"
+(cd "$WORKDIR" && exec "$NODE" backend.js > backend.log 2>&1) &
+BACKEND_PID=$!
+(cd "$WORKDIR" && exec "$BIN" -p 8430 -c none -s "$WORKDIR/upgrade.sock" > proxy.log 2>&1) &
+PROXY_PID=$!
+sleep 1
+
+{
+    echo "== HTTP/1.1 (connection per request) =="
+    echo -n "throughput:   "
+    python3 "$WORKDIR/h1.py" load "$REQUESTS" "$CONCURRENCY"
+    echo -n "held:         "
+    held python3 "$WORKDIR/h1.py" hold "$HELD" 0
+    echo "== HTTP/2 (streams over 10 connections) =="
+    echo -n "throughput:   "
+    "$NODE" "$WORKDIR/h2.js" load "$REQUESTS" "$CONCURRENCY"
+    echo -n "held:         "
+    held "$NODE" "$WORKDIR/h2.js" hold "$HELD" 0
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
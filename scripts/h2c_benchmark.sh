@@ -0,0 +1,127 @@
+#!/bin/bash
+
+# h2c upstreams (route option proto=h2c): the same load against one backend,
+# once over HTTP/1.1 (a backend connection per request) and once over
+# multiplexed HTTP/2 connections.
+#
+# Runs its own proxy (port 8410) from a temporary directory and a Node
+# backend (built-in http and http2 modules) answering both protocols:
+#
+#   /h1/ localhost 3991              HTTP/1.1
+#   /h2/ localhost 3990 proto=h2c    HTTP/2 with prior knowledge
+#
+# For each route it reports requests/s, the connections the backend
+# accepted, and the sockets left in TIME_WAIT between proxy and backend
+# (on whichever side closed first).
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/h2c_benchmark.sh [requests] [concurrency]
+
+REQUESTS=${1:-20000}
+CONCURRENCY=${2:-200}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+NODE=${NODE:-node}
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/h2c.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+if ! command -v "$NODE" > /dev/null; then
+    echo "❌ Needs node (set NODE=/path/to/node)"
+    exit 1
+fi
+
+cat > "$WORKDIR/routes.conf" <<EOF
+/h1/ localhost 3991
+/h2/ localhost 3990 proto=h2c
+EOF
+
+cat > "$WORKDIR/backend.js" <<'EOF'
+const http = require("http");
+const http2 = require("http2");
+const connections = { h1: 0, h2: 0 };
+
+function handle(proto) {
+    return (req, res) => {
+        if (req.url.endsWith("/stats")) {
+            res.end(JSON.stringify(connections));
+            return;
+        }
+        res.writeHead(200, { "content-type": "text/plain" });
+        res.end("hello from " + proto + "\n");
+    };
+}
+
+const h1 = http.createServer(handle("h1"));
+h1.on("connection", () => connections.h1++);
+h1.listen(3991, "127.0.0.1", 65535);
+
+const h2 = http2.createServer(handle("h2"));
+h2.on("session", () => connections.h2++);
+h2.listen(3990, "127.0.0.1", 65535);
+EOF
+
+cat > "$WORKDIR/load.py" <<'EOF'
+import asyncio, sys, time
+
+path, requests, concurrency = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+ok = failed = 0
+
+async def worker(count):
+    global ok, failed
+    for _ in range(count):
+        try:
+            reader, writer = await asyncio.open_connection("127.0.0.1", 8410)
+            writer.write(b"GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n" % path.encode())
+            reply = await reader.read()
+            writer.close()
+            if reply.startswith(b"HTTP/1.1 200"):
+                ok += 1
+            else:
+                failed += 1
+        except OSError:
+            failed += 1
+
+async def main():
+    start = time.time()
+    await asyncio.gather(*(worker(requests // concurrency) for _ in range(concurrency)))
+    print("%6.0f req/s  (%d ok, %d failed)" % ((ok + failed) / (time.time() - start), ok, failed))
+
+asyncio.run(main())
+EOF
+
+time_wait() { ss -tan state time-wait "( dport = :$1 or sport = :$1 )" | tail -n +2 | wc -l; }
+# Counted by the backend; asking costs one HTTP/1.1 connection itself
+backend_conns() { curl -s "http://127.0.0.1:3991/stats" | sed "s/.*\"$1\":\([0-9]*\).*/\1/"; }
+
+echo "🔧 h2c upstream benchmark: $REQUESTS requests, $CONCURRENCY concurrent"
+(cd "$WORKDIR" && exec "$NODE" backend.js > backend.log 2>&1) &
+BACKEND_PID=$!
+(cd "$WORKDIR" && exec "$BIN" -p 8410 -c none -s "$WORKDIR/upgrade.sock" > proxy.log 2>&1) &
+PROXY_PID=$!
+sleep 1
+
+{
+    for route in h1:3991 h2:3990; do
+        name=${route%%:*}
+        port=${route##*:}
+        before=$(backend_conns "$name")
+        tw_before=$(time_wait "$port")
+        echo "== /$name/ =="
+        echo -n "throughput:           "
+        python3 "$WORKDIR/load.py" "/$name/x" "$REQUESTS" "$CONCURRENCY"
+        after=$(backend_conns "$name")
+        [ "$name" = h1 ] && after=$((after - 1))
+        echo "backend connections:  $((after - before))"
+        echo "TIME_WAIT sockets:    $(($(time_wait "$port") - tw_before))"
+    done
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
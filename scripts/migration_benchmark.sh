@@ -0,0 +1,142 @@
+#!/bin/bash
+
+# Load imbalance between workers (-w) and connection migration (-M).
+#
+# Two workers with reuseport steering by CPU (-a 0,1) and a client pinned
+# to CPU 0: every connection is received on CPU 0, so the steering program
+# gives all of them to worker 0, the way one hot RSS queue would. (On a
+# single-CPU machine worker 1 can't be pinned to CPU 1, which is logged and
+# changes nothing else.) The client opens TUNNELS CONNECT tunnels through
+# the proxy (port 8458) to an echo server (port 3990) and keeps messages
+# going back and forth on all of them for SECONDS seconds. Tunnels hold an
+# upstream slot for their lifetime: stay under UPSTREAM_LIMIT_INITIAL.
+#
+# Without -M worker 0 carries everything; with -M it moves tunnels that
+# have nothing in flight to worker 1. The threshold (BUSY, per mille) is
+# low by default because on a small machine the client and the echo
+# server compete with the proxy for the same CPUs: worker 0 can't get
+# anywhere near 60% busy there. Use MIGRATE_BUSY_MIN (600) on real cores. Reports the echo rate, each worker's
+# CPU time during the run, the spread of those (standard deviation over
+# mean: 1.0 = all on one of two workers, 0 = even) and the supervisor's
+# load report (SIGUSR1): busy share, live connections, moved out/in.
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/migration_benchmark.sh [tunnels] [seconds]
+
+TUNNELS=${1:-16}
+SECONDS_=${2:-10}
+BUSY=${BUSY:-100}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/migration.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+ulimit -n 65535 2>/dev/null
+
+echo "/ localhost 3990" > "$WORKDIR/routes.conf"
+
+cat > "$WORKDIR/echo.py" <<'EOF'
+import asyncio
+
+async def echo(reader, writer):
+    while data := await reader.read(65536):
+        writer.write(data)
+        await writer.drain()
+    writer.close()
+
+async def main():
+    server = await asyncio.start_server(echo, "127.0.0.1", 3990, backlog=4096)
+    await server.serve_forever()
+
+asyncio.run(main())
+EOF
+
+cat > "$WORKDIR/client.py" <<'EOF'
+import asyncio, os, sys, time
+
+tunnels, seconds = int(sys.argv[1]), float(sys.argv[2])
+os.sched_setaffinity(0, {0})
+message = b"x" * 4096
+rounds = 0
+
+async def tunnel(deadline):
+    global rounds
+    reader, writer = await asyncio.open_connection("127.0.0.1", 8458)
+    writer.write(b"CONNECT localhost:3990 HTTP/1.1\r\nHost: localhost:3990\r\n\r\n")
+    head = await reader.readuntil(b"\r\n\r\n")
+    if not head.startswith(b"HTTP/1.1 200"):
+        raise SystemExit("CONNECT refused: %r" % head[:40])
+    while time.time() < deadline:
+        writer.write(message)
+        await reader.readexactly(len(message))
+        rounds += 1
+    writer.close()
+
+async def main():
+    deadline = time.time() + seconds
+    await asyncio.gather(*(tunnel(deadline) for _ in range(tunnels)))
+    print("%7.0f echoes/s over %d tunnels" % (rounds / seconds, tunnels))
+
+asyncio.run(main())
+EOF
+
+workers() { cat "/proc/$PROXY_PID/task/$PROXY_PID/children"; }
+cpu_ticks() { awk '{ print $14 + $15 }' "/proc/$1/stat"; }
+
+run() {
+    local name=$1
+    shift
+    (cd "$WORKDIR" && exec "$BIN" -p 8458 -c none -s "$WORKDIR/upgrade.sock" -w 2 -a 0,1 "$@" > proxy.log 2>&1) &
+    PROXY_PID=$!
+    sleep 1
+
+    local pids before=() after=()
+    read -r -a pids <<< "$(workers)"
+    for pid in "${pids[@]}"; do before+=("$(cpu_ticks "$pid")"); done
+    kill -USR1 "$PROXY_PID"
+
+    echo "== $name${*:+ ($*)} =="
+    echo -n "  "
+    python3 "$WORKDIR/client.py" "$TUNNELS" "$SECONDS_"
+
+    for pid in "${pids[@]}"; do after+=("$(cpu_ticks "$pid")"); done
+    local hz i ticks=()
+    hz=$(getconf CLK_TCK)
+    for i in "${!pids[@]}"; do
+        ticks+=($((after[i] - before[i])))
+        awk -v i="$i" -v t="${ticks[i]}" -v hz="$hz" 'BEGIN { printf "  worker %d: %5.2fs cpu\n", i, t / hz }'
+    done
+    echo "${ticks[@]}" | awk '{ for (i = 1; i <= NF; i++) { s += $i; q += $i * $i }
+                                m = s / NF; sd = sqrt(q / NF - m * m)
+                                printf "  cpu spread (stddev / mean): %.2f\n", m ? sd / m : 0 }'
+
+    # Supervisor's report: busy since the previous SIGUSR1, i.e. during the run
+    local lines
+    lines=$(wc -l < "$WORKDIR/proxy.log")
+    kill -USR1 "$PROXY_PID"
+    sleep 0.5
+    tail -n +"$((lines + 1))" "$WORKDIR/proxy.log" | grep "^worker" | sed 's/^/  /'
+    echo "  batches moved: $(grep -c "moved .* connections" "$WORKDIR/proxy.log")"
+
+    kill "$PROXY_PID" 2>/dev/null
+    wait "$PROXY_PID" 2>/dev/null
+}
+
+echo "🔧 Migration benchmark: $TUNNELS tunnels for ${SECONDS_}s, 2 workers, $(nproc) CPUs"
+(cd "$WORKDIR" && exec python3 echo.py > echo.log 2>&1) &
+BACKEND_PID=$!
+sleep 1
+
+{
+    run "steered to one worker"
+    run "with migration" -M "$BUSY"
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
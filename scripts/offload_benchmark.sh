@@ -0,0 +1,146 @@
+#!/bin/bash
+
+# Offload pool under compression load: throughput, latency of small
+# responses next to large ones, and the pool's own metrics.
+#
+# Runs a Python backend (port 3997) behind the proxy (port 8460) on a
+# compress=on route. Every response is Cache-Control: no-store, so each one
+# is gzipped again. CONCURRENCY clients fetch for SECONDS seconds: one in
+# four a 1 MB script (/big), the others an 8 KB page (/small). Each body is
+# gunzipped and checked against what the backend sent.
+#
+# Reports req/s and latency per size, then the pool's summary lines
+# (queue wait, run time, steal rate; see offload.h), which the proxy logs
+# every 10 s. With OLD_BIN set, the same load runs against that build too.
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/offload_benchmark.sh [seconds] [concurrency]
+
+SECONDS_=${1:-21}
+CONCURRENCY=${2:-32}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/offload.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+ulimit -n 65535 2>/dev/null
+
+echo "/ localhost 3997 compress=on" > "$WORKDIR/routes.conf"
+
+cat > "$WORKDIR/bodies.py" <<'EOF'
+import random
+
+def body(size, seed):
+    rng = random.Random(seed)
+    words = [("var%d" % i).encode() for i in range(2000)]
+    out = bytearray()
+    while len(out) < size:
+        out += b"function " + rng.choice(words) + b"(a, b) { return a + " + rng.choice(words) + b"(b); }\n"
+    return bytes(out[:size])
+
+BIG, SMALL = body(1 << 20, 1), body(8 << 10, 2)
+EOF
+
+cat > "$WORKDIR/backend.py" <<'EOF'
+import socketserver
+from bodies import BIG, SMALL
+
+class Handler(socketserver.BaseRequestHandler):
+    def handle(self):
+        data = b""
+        while b"\r\n\r\n" not in data:
+            chunk = self.request.recv(4096)
+            if not chunk:
+                return
+            data += chunk
+        body = BIG if data.startswith(b"GET /big") else SMALL
+        self.request.sendall(b"HTTP/1.1 200 OK\r\nContent-Type: application/javascript\r\n"
+                             b"Cache-Control: no-store\r\nContent-Length: %d\r\nConnection: close\r\n\r\n" % len(body) + body)
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+    request_queue_size = 4096
+
+Server(("127.0.0.1", 3997), Handler).serve_forever()
+EOF
+
+cat > "$WORKDIR/load.py" <<'EOF'
+import asyncio, sys, time, zlib
+from bodies import BIG, SMALL
+
+seconds, concurrency = float(sys.argv[1]), int(sys.argv[2])
+latencies = {"big": [], "small": []}
+failed = 0
+
+async def fetch(path, expected):
+    reader, writer = await asyncio.open_connection("127.0.0.1", 8460)
+    writer.write(b"GET /" + path.encode() + b" HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip\r\n\r\n")
+    reply = await reader.read()
+    writer.close()
+    head, _, body = reply.partition(b"\r\n\r\n")
+    return head.startswith(b"HTTP/1.1 200") and b"Content-Encoding: gzip" in head and \
+        zlib.decompress(body, 16 + zlib.MAX_WBITS) == expected
+
+async def client(n, deadline):
+    global failed
+    i = n
+    while time.time() < deadline:
+        path, expected = ("big", BIG) if i % 4 == 0 else ("small", SMALL)
+        i += 1
+        start = time.time()
+        try:
+            ok = await fetch(path, expected)
+        except (OSError, zlib.error):
+            ok = False
+        if ok:
+            latencies[path].append(time.time() - start)
+        else:
+            failed += 1
+
+async def main():
+    start = time.time()
+    await asyncio.gather(*(client(n, start + seconds) for n in range(concurrency)))
+    elapsed = time.time() - start
+    total = sum(len(v) for v in latencies.values())
+    print("%6.0f req/s (%d ok, %d failed)" % ((total + failed) / elapsed, total, failed))
+    for path, values in latencies.items():
+        values.sort()
+        pct = lambda p: values[min(len(values) - 1, int(p * len(values)))] * 1000 if values else 0
+        print("  %-5s %6d  p50 %7.1f ms  p99 %7.1f ms" % (path, len(values), pct(0.50), pct(0.99)))
+
+asyncio.run(main())
+EOF
+
+run() {
+    local name=$1 bin=$2
+    (cd "$WORKDIR" && exec "$bin" -p 8460 -c none -s "$WORKDIR/upgrade.sock" > proxy.log 2>&1) &
+    PROXY_PID=$!
+    sleep 1
+
+    echo "== $name =="
+    echo -n "  "
+    (cd "$WORKDIR" && python3 load.py "$SECONDS_" "$CONCURRENCY") | sed '2,$s/^/  /'
+    kill "$PROXY_PID" 2>/dev/null
+    wait "$PROXY_PID" 2>/dev/null
+    grep "^offload:" "$WORKDIR/proxy.log" | sed 's/^/  /'
+}
+
+echo "🔧 Offload benchmark: ${SECONDS_}s, $CONCURRENCY clients, 1 in 4 requests 1 MB, $(nproc) CPUs"
+(cd "$WORKDIR" && exec python3 backend.py > backend.log 2>&1) &
+BACKEND_PID=$!
+sleep 1
+
+{
+    [ -n "$OLD_BIN" ] && run "before (mutex queue)" "$(realpath "$OLD_BIN")"
+    run "work-stealing pool" "$BIN"
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Goodput under overload: drive the proxy at 1x and 2x its peak request rate
+# with an open-loop load generator (wrk2, "wrk -R") and record how many
+# requests still complete with 2xx and at what latency.
+#
+# Usage:
+#   PEAK_RPS=20000 VERSION=v2-epoll ./scripts/overload_benchmark.sh
+#
+# PEAK_RPS is the highest rate the proxy sustains without errors; find it
+# first with scripts/benchmark.sh. With CoDel shedding, the 2x run should show
+# 2xx throughput close to PEAK_RPS (excess gets fast 503s) instead of a
+# collapse where every request times out.
+
+URL="http://localhost:8000/"
+VERSION=${VERSION:-"v2-epoll"}
+PEAK_RPS=${PEAK_RPS:-10000}
+DURATION=${DURATION:-30s}
+OUTDIR="benchmarks/$VERSION"
+mkdir -p "$OUTDIR"
+
+if ! wrk -h 2>&1 | grep -q -- "-R"; then
+    echo "❌ wrk2 (wrk with -R/--rate) is required for open-loop load"
+    exit 1
+fi
+
+echo "🔧 Overload benchmark for TurboProxy ($VERSION), peak=$PEAK_RPS rps"
+
+for factor in 1 2; do
+    rate=$((PEAK_RPS * factor))
+    out="$OUTDIR/overload-${factor}x.txt"
+    echo "🚀 Running wrk2 at ${factor}x ($rate rps)..."
+    wrk -t4 -c400 -d"$DURATION" -R"$rate" --latency "$URL" > "$out" 2>&1
+    echo "✅ ${factor}x done → $out"
+done
+
+echo "📊 Compare 'Requests/sec' minus 'Non-2xx or 3xx responses' between the two runs."
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# Cache sharing check: start three proxies on one machine as a fleet (-P),
+# fetch a set of URLs through the first one, then through the others, and
+# verify that the others answer from the fleet's caches (X-Cache: HIT)
+# instead of going to the origin again. Then kill one node and check that
+# requests for keys it owned don't get slower.
+#
+# Usage (backend from routes.conf must be running and send cacheable
+# responses, e.g. Cache-Control: max-age=60):
+#   make VERSION=v2-epoll
+#   ./scripts/peer_test.sh [binary]
+
+BIN=${1:-"bin/v2-epoll-server"}
+URL_PATH=${URL_PATH:-"/settings/peer-test"}
+KEYS=${KEYS:-30}
+HOST_HEADER="Host: peer-test.local" # same Host on every node → same cache keys
+PORTS=(8001 8002 8003)
+PEERS="127.0.0.1:8001,127.0.0.1:8002,127.0.0.1:8003"
+WORKDIR=$(mktemp -d)
+RUN=$$
+
+cleanup() {
+    kill "${PIDS[@]}" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+echo "🔧 Starting ${#PORTS[@]} nodes: $PEERS"
+PIDS=()
+for port in "${PORTS[@]}"; do
+    "$BIN" -p "$port" -P "$PEERS" -s "$WORKDIR/up.$port.sock" -c none > "$WORKDIR/node.$port.log" 2>&1 &
+    PIDS+=($!)
+done
+sleep 0.5
+
+echo "📥 Fetching $KEYS URLs through :${PORTS[0]}"
+for k in $(seq 1 "$KEYS"); do
+    curl -s -o /dev/null -H "$HOST_HEADER" "http://localhost:${PORTS[0]}$URL_PATH-$RUN-$k"
+done
+
+echo "🔁 Fetching them again through the other nodes"
+hits=0
+total=0
+for port in "${PORTS[@]:1}"; do
+    for k in $(seq 1 "$KEYS"); do
+        curl -s -D - -o /dev/null -H "$HOST_HEADER" "http://localhost:$port$URL_PATH-$RUN-$k" | grep -qi '^X-Cache: HIT' && hits=$((hits + 1))
+        total=$((total + 1))
+    done
+done
+echo "📊 $hits/$total answered from the fleet's caches"
+
+echo "💀 Killing :${PORTS[2]}, fetching new URLs through :${PORTS[0]}"
+kill "${PIDS[2]}"
+slowest=$(for k in $(seq 1 "$KEYS"); do
+    curl -s -o /dev/null -w '%{time_total}\n' -H "$HOST_HEADER" "http://localhost:${PORTS[0]}$URL_PATH-$RUN-dead-$k"
+done | sort -n | tail -1)
+echo "⏱️  Slowest request with a dead peer: ${slowest}s"
+
+[ "$hits" -eq "$total" ]
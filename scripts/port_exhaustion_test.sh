@@ -0,0 +1,138 @@
+#!/bin/bash
+
+# Ephemeral port exhaustion toward a backend, and the -b/-R defenses.
+#
+# Every configuration confines the proxy's backend connects to 100 ports
+# (IP_LOCAL_PORT_RANGE via -b), which stands in for a full ephemeral range
+# without waiting for 28k connections. The proxy (port 8453) then closes
+# first on connections it gives up on, each of which holds its port in
+# TIME_WAIT for 60s:
+#
+#   abandoned   clients that leave after the response head of a streamed
+#               response (the proxy drops the backend mid-response)
+#   tunnels     CONNECT tunnels closed by the client
+#   requests    ordinary GETs afterwards, which need fresh ports
+#
+# Configurations (distinct port ranges, so one's TIME_WAIT doesn't hit the
+# next):
+#
+#   baseline    -b '*:LO-HI'                      one address, normal close
+#   reset       -b '*:LO-HI' -R                   RST instead of TIME_WAIT
+#   pool        -b 127.0.0.1:LO-HI,...127.0.0.3   three source addresses
+#   pool+reset  both
+#
+# Reports ok/failed per phase, the proxy's TIME_WAIT sockets toward the
+# backend and the connects that failed with EADDRNOTAVAIL.
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/port_exhaustion_test.sh
+
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+NODE=${NODE:-node}
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/port_exhaustion.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+if ! command -v "$NODE" > /dev/null; then
+    echo "❌ Needs node (set NODE=/path/to/node)"
+    exit 1
+fi
+
+echo "/ localhost 3994" > "$WORKDIR/routes.conf"
+
+cat > "$WORKDIR/backend.js" <<'EOF'
+const http = require("http");
+http.createServer((req, res) => {
+    res.writeHead(200, { "content-type": "text/plain" });
+    if (!req.url.startsWith("/stream"))
+        return res.end("hello\n");
+    // A response that takes a while: the client leaves after the head
+    let n = 0;
+    res.write("0\n");
+    const timer = setInterval(() => ++n == 10 ? (clearInterval(timer), res.end("done\n")) : res.write(n + "\n"), 50);
+    res.on("close", () => clearInterval(timer));
+}).listen(3994, "127.0.0.1", 65535);
+EOF
+
+cat > "$WORKDIR/client.py" <<'EOF'
+import socket, sys, threading
+
+phase, count = sys.argv[1], int(sys.argv[2])
+ok = failed = 0
+lock = threading.Lock()
+
+def one():
+    s = socket.create_connection(("127.0.0.1", 8453))
+    try:
+        if phase == "abandoned":
+            s.sendall(b"GET /stream HTTP/1.1\r\nHost: localhost\r\n\r\n")
+            return s.recv(4096).startswith(b"HTTP/1.1 200")
+        if phase == "tunnels":
+            s.sendall(b"CONNECT localhost:3994 HTTP/1.1\r\nHost: localhost:3994\r\n\r\n")
+            return s.recv(4096).startswith(b"HTTP/1.1 200")
+        s.sendall(b"GET /x HTTP/1.1\r\nHost: localhost\r\n\r\n")
+        reply = b""
+        while chunk := s.recv(4096):
+            reply += chunk
+        return reply.startswith(b"HTTP/1.1 200")
+    finally:
+        s.close()
+
+def worker(n):
+    global ok, failed
+    for _ in range(n):
+        try:
+            good = one()
+        except OSError:
+            good = False
+        with lock:
+            ok, failed = ok + good, failed + (not good)
+
+threads = [threading.Thread(target=worker, args=(count // 10,)) for _ in range(10)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+print("%-10s %4d ok %4d failed" % (phase, ok, failed))
+EOF
+
+proxy_time_wait() { ss -tan state time-wait "( dport = :3994 )" | tail -n +2 | wc -l; }
+
+run() {
+    local name=$1
+    shift
+    (cd "$WORKDIR" && exec "$BIN" -p 8453 -c none -s "$WORKDIR/upgrade.sock" "$@" > proxy.log 2>&1) &
+    PROXY_PID=$!
+    sleep 1
+    local before
+    before=$(proxy_time_wait)
+    echo "== $name: $* =="
+    python3 "$WORKDIR/client.py" abandoned 150
+    python3 "$WORKDIR/client.py" tunnels 150
+    python3 "$WORKDIR/client.py" requests 200
+    echo "TIME_WAIT toward the backend: $(($(proxy_time_wait) - before)), connects failed with EADDRNOTAVAIL: $(grep -c "Cannot assign requested address" "$WORKDIR/proxy.log")"
+    kill "$PROXY_PID" 2>/dev/null
+    wait "$PROXY_PID" 2>/dev/null
+}
+
+echo "🔧 Port exhaustion test (100 ports per source address)"
+(cd "$WORKDIR" && exec "$NODE" backend.js > backend.log 2>&1) &
+BACKEND_PID=$!
+sleep 1
+
+{
+    run baseline -b '*:42000-42099'
+    run reset -b '*:42100-42199' -R
+    run pool -b 127.0.0.1:42200-42299,127.0.0.2:42200-42299,127.0.0.3:42200-42299
+    run pool+reset -b 127.0.0.1:42300-42399,127.0.0.2:42300-42399,127.0.0.3:42300-42399 -R
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
@@ -0,0 +1,160 @@
+#!/bin/bash
+
+# Kernel tunnel relay (-k, BPF sockmap) vs the splice relay: how much CPU the
+# proxy's event loop spends on bulk tunnels.
+#
+# Runs the proxy twice (port 8401, without and with -k) from a temporary
+# directory, with a Python backend on port 3994 that sinks or sources bytes
+# after a CONNECT. PARALLEL clients each upload then download MB megabytes
+# through their own tunnel. Reported per run:
+#
+#   MB/s        upload and download throughput per tunnel (average)
+#   proxy CPU   user+system seconds of the proxy process
+#   machine CPU busy seconds of all CPUs (includes the clients, the backend,
+#               and the kernel workers that send redirected bytes for -k)
+#
+# -k needs CAP_BPF and CAP_NET_ADMIN (or root) and Linux 5.13+; without them
+# the proxy logs "Kernel tunnel relay disabled" and the second run measures
+# splice again.
+#
+# Usage:
+#   make VERSION=v2-epoll && sudo ./scripts/sockmap_benchmark.sh [transfer_mb] [parallel]
+
+MB=${1:-1024}
+PARALLEL=${2:-4}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/sockmap.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+cat > "$WORKDIR/routes.conf" <<EOF
+/ localhost 3994
+EOF
+
+cat > "$WORKDIR/backend.py" <<'EOF'
+import asyncio
+
+async def handle(reader, writer):
+    command = (await reader.readuntil(b"\r\n\r\n")).split()
+    if command[0] == b"SOURCE":
+        chunk = b"x" * (1 << 20)
+        for _ in range(int(command[1])):
+            writer.write(chunk)
+            await writer.drain()
+    elif command[0] == b"SINK":
+        total = 0
+        while True:
+            data = await reader.read(1 << 20)
+            if not data:
+                break
+            total += len(data)
+        writer.write(b"%d" % total)
+    writer.close()
+
+async def main():
+    server = await asyncio.start_server(handle, "127.0.0.1", 3994, backlog=1024)
+    await server.serve_forever()
+
+asyncio.run(main())
+EOF
+
+cat > "$WORKDIR/client.py" <<'EOF'
+import socket, sys, time
+
+mb = int(sys.argv[1])
+
+def open_tunnel():
+    s = socket.create_connection(("127.0.0.1", 8401))
+    s.sendall(b"CONNECT localhost:3994 HTTP/1.1\r\nHost: localhost:3994\r\n\r\n")
+    reply = b""
+    while b"\r\n\r\n" not in reply:
+        reply += s.recv(4096)
+    assert b" 200 " in reply.split(b"\r\n")[0], reply
+    return s
+
+s = open_tunnel()
+s.sendall(b"SINK\r\n\r\n")
+chunk = b"x" * (1 << 20)
+start = time.time()
+for _ in range(mb):
+    s.sendall(chunk)
+s.shutdown(socket.SHUT_WR)
+total = int(s.recv(64))
+up = mb / (time.time() - start)
+assert total == mb << 20, total
+
+s = open_tunnel()
+s.sendall(b"SOURCE %d\r\n\r\n" % mb)
+start = time.time()
+got = 0
+buf = bytearray(1 << 20)
+while True:
+    n = s.recv_into(buf)
+    if not n:
+        break
+    got += n
+down = mb / (time.time() - start)
+assert got == mb << 20, got
+print("%.0f %.0f" % (up, down))
+EOF
+
+TICKS=$(getconf CLK_TCK)
+proxy_ticks() { awk '{print $14 + $15}' "/proc/$PROXY_PID/stat"; }
+machine_ticks() { awk '/^cpu / {print $2 + $3 + $4 + $7 + $8}' /proc/stat; }
+
+run() {
+    local label=$1
+    shift
+    (cd "$WORKDIR" && exec "$BIN" -p 8401 -c none "$@" > proxy.log 2>&1) &
+    PROXY_PID=$!
+    sleep 1
+    grep -h "relay disabled" "$WORKDIR/proxy.log"
+
+    local proxy_before machine_before
+    proxy_before=$(proxy_ticks)
+    machine_before=$(machine_ticks)
+    local clients=()
+    for i in $(seq "$PARALLEL"); do
+        python3 "$WORKDIR/client.py" "$MB" > "$WORKDIR/client$i.txt" &
+        clients+=($!)
+    done
+    wait "${clients[@]}"
+    local proxy_after machine_after
+    proxy_after=$(proxy_ticks)
+    machine_after=$(machine_ticks)
+
+    cat "$WORKDIR"/client*.txt | awk -v label="$label" -v n="$PARALLEL" \
+        -v proxy="$(((proxy_after - proxy_before) * 100 / TICKS))" \
+        -v machine="$(((machine_after - machine_before) * 100 / TICKS))" '
+        { up += $1; down += $2 }
+        END {
+            if (NR != n) { print label ": " n - NR " transfers failed"; exit }
+            printf "%-8s upload %6.0f MB/s  download %6.0f MB/s  proxy CPU %6.2f s  machine CPU %6.2f s\n",
+                   label, up / n, down / n, proxy / 100, machine / 100
+        }'
+    rm -f "$WORKDIR"/client*.txt
+
+    kill "$PROXY_PID"
+    wait "$PROXY_PID" 2>/dev/null
+}
+
+echo "🔧 Sockmap benchmark"
+(cd "$WORKDIR" && exec python3 backend.py > backend.log 2>&1) &
+BACKEND_PID=$!
+sleep 1
+
+{
+    echo "== $PARALLEL tunnels, $MB MB up then $MB MB down each ($(nproc) CPUs, Linux $(uname -r)) =="
+    run splice
+    run sockmap -k
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
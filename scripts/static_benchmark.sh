@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# Static routes: the same files served by the proxy (sendfile + open file
+# cache) vs proxied to a backend that serves them from disk.
+#
+# Runs its own proxy (port 8200) from a temporary directory with this
+# routes.conf, and a Python file server as the backend:
+#
+#   /static/  static <tmp>/files/       served by TurboProxy
+#   /proxied/ localhost 3999 cache=off  Python http.server on <tmp>
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/static_benchmark.sh [file_size_bytes]
+
+SIZE=${1:-16384}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+VERSION=${VERSION:-"v2-epoll"}
+DURATION=${DURATION:-10s}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR" "$WORKDIR/files"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+head -c "$SIZE" /dev/urandom > "$WORKDIR/files/asset.js"
+ln -s files "$WORKDIR/proxied"
+cat > "$WORKDIR/routes.conf" <<EOF
+/static/ static $WORKDIR/files/
+/proxied/ localhost 3999 cache=off
+EOF
+
+echo "🔧 Static file benchmark ($SIZE byte file)"
+(cd "$WORKDIR" && python3 -m http.server 3999 --bind 127.0.0.1 > backend.log 2>&1) &
+BACKEND_PID=$!
+(cd "$WORKDIR" && "$BIN" -p 8200 -c none > proxy.log 2>&1) &
+PROXY_PID=$!
+sleep 1
+
+for path in /static/asset.js /proxied/asset.js; do
+    if ! curl -s "http://localhost:8200$path" | cmp -s - "$WORKDIR/files/asset.js"; then
+        echo "❌ $path does not return the file"
+        cat "$WORKDIR/proxy.log"
+        exit 1
+    fi
+done
+
+echo "🚀 Running wrk on the static route..."
+wrk -t4 -c100 -d"$DURATION" --latency "http://localhost:8200/static/asset.js" > "$OUTDIR/static-file.txt" 2>&1
+echo "✅ static done → $OUTDIR/static-file.txt"
+
+echo "🚀 Running wrk on the proxied route..."
+wrk -t4 -c100 -d"$DURATION" --latency "http://localhost:8200/proxied/asset.js" > "$OUTDIR/static-proxied.txt" 2>&1
+echo "✅ proxied done → $OUTDIR/static-proxied.txt"
+
+echo "📊 Compare 'Requests/sec' and the latency distribution of both files."
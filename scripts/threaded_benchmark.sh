@@ -0,0 +1,139 @@
+#!/bin/bash
+
+# Thread pool (v3-threaded) against the event loop (v2-epoll) on the same
+# workload, backend and load generator.
+#
+# Runs a Python backend (port 3995) and each proxy in turn (port 8459) from
+# a temporary directory. Every request is a new connection (both versions
+# close after one response). Two workloads:
+#
+#   fast   the backend answers right away: cost per request
+#   slow   the backend sleeps DELAY_MS first: a worker thread is blocked
+#          for the whole wait, an event loop is not
+#
+# For every run: req/s, latency percentiles, and the proxy's CPU time,
+# threads and resident memory at the end.
+#
+# Usage:
+#   make VERSION=v2-epoll && make VERSION=v3-threaded &&
+#   ./scripts/threaded_benchmark.sh [requests] [concurrency] [delay_ms]
+
+REQUESTS=${1:-10000}
+CONCURRENCY=${2:-100}
+DELAY_MS=${3:-20}
+V2_BIN=$(realpath "${V2_BIN:-bin/v2-epoll-server}")
+V3_BIN=$(realpath "${V3_BIN:-bin/v3-threaded-server}")
+OUTDIR="$(pwd)/benchmarks/v3-threaded"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/compare.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+ulimit -n 65535 2>/dev/null
+
+echo "/ localhost 3995" > "$WORKDIR/routes.conf"
+
+cat > "$WORKDIR/backend.py" <<'EOF'
+import socketserver, sys, time
+
+delay = int(sys.argv[1]) / 1000
+
+class Handler(socketserver.BaseRequestHandler):
+    def handle(self):
+        data = b""
+        while b"\r\n\r\n" not in data:
+            chunk = self.request.recv(4096)
+            if not chunk:
+                return
+            data += chunk
+        if data.startswith(b"GET /slow"):
+            time.sleep(delay)
+        self.request.sendall(b"HTTP/1.1 200 OK\r\nContent-Length: 6\r\nConnection: close\r\n\r\nhello\n")
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+    request_queue_size = 4096
+
+Server(("127.0.0.1", 3995), Handler).serve_forever()
+EOF
+
+cat > "$WORKDIR/load.py" <<'EOF'
+import asyncio, sys, time
+
+count, concurrency, path = int(sys.argv[1]), int(sys.argv[2]), sys.argv[3]
+request = b"GET " + path.encode() + b" HTTP/1.1\r\nHost: localhost\r\n\r\n"
+latencies = []
+failed = 0
+
+async def worker(n):
+    global failed
+    for _ in range(n):
+        start = time.time()
+        try:
+            reader, writer = await asyncio.open_connection("127.0.0.1", 8459)
+            writer.write(request)
+            reply = await reader.read()
+            writer.close()
+            if reply.startswith(b"HTTP/1.1 200"):
+                latencies.append(time.time() - start)
+            else:
+                failed += 1
+        except OSError:
+            failed += 1
+
+async def main():
+    start = time.time()
+    await asyncio.gather(*(worker(count // concurrency) for _ in range(concurrency)))
+    elapsed = time.time() - start
+    latencies.sort()
+    pct = lambda p: latencies[min(len(latencies) - 1, int(p * len(latencies)))] * 1000 if latencies else 0
+    print("%6.0f req/s  p50 %6.1f ms  p99 %6.1f ms  (%d ok, %d failed)" %
+          ((len(latencies) + failed) / elapsed, pct(0.50), pct(0.99), len(latencies), failed))
+
+asyncio.run(main())
+EOF
+
+report_proxy() {
+    local cpu_ticks threads rss
+    cpu_ticks=$(awk '{ print $14 + $15 }' "/proc/$PROXY_PID/stat")
+    threads=$(awk '/^Threads/ { print $2 }' "/proc/$PROXY_PID/status")
+    rss=$(awk '/^VmRSS/ { print $2 }' "/proc/$PROXY_PID/status")
+    awk -v t="$cpu_ticks" -v hz="$(getconf CLK_TCK)" -v th="$threads" -v rss="$rss" \
+        'BEGIN { printf "  proxy: %5.2fs cpu  %3d threads  %6.1f MiB resident\n", t / hz, th, rss / 1024 }'
+}
+
+run() {
+    local name=$1 bin=$2
+    shift 2
+    (cd "$WORKDIR" && exec "$bin" -p 8459 "$@" > proxy.log 2>&1) &
+    PROXY_PID=$!
+    sleep 1
+
+    echo "== $name${*:+ ($*)} =="
+    for workload in fast slow; do
+        printf "  %-4s " "$workload"
+        python3 "$WORKDIR/load.py" "$REQUESTS" "$CONCURRENCY" "/$workload"
+    done
+    report_proxy
+
+    kill "$PROXY_PID" 2>/dev/null
+    wait "$PROXY_PID" 2>/dev/null
+}
+
+echo "🔧 Thread pool vs event loop: $REQUESTS requests per workload, $CONCURRENCY concurrent, slow backend ${DELAY_MS}ms, $(nproc) CPUs"
+(cd "$WORKDIR" && exec python3 backend.py "$DELAY_MS" > backend.log 2>&1) &
+BACKEND_PID=$!
+sleep 1
+
+{
+    run "v2-epoll, one event loop" "$V2_BIN" -c none -s "$WORKDIR/upgrade.sock"
+    run "v3-threaded, pool larger than the load" "$V3_BIN" -t 128
+    run "v3-threaded, pool smaller than the load" "$V3_BIN" -t 16
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
@@ -0,0 +1,84 @@
+#!/bin/bash
+
+# TLS on the listener (-C/-K): handshakes per second, full and resumed, and
+# bulk throughput of a static file over TLS against the same file in
+# plaintext.
+#
+# Generates a throwaway P-256 certificate and runs two proxies from a
+# temporary directory on the same routes.conf:
+#
+#   8440  plaintext
+#   8441  TLS
+#
+# Handshakes use `openssl s_time` (one connection at a time, no request);
+# the download uses curl. Kernel TLS counters are shown when the kernel has
+# the tls module (/proc/net/tls_stat), otherwise records are encrypted by
+# OpenSSL in the bridge.
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/tls_benchmark.sh [file_size_mb]
+
+SIZE_MB=${1:-512}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+VERSION=${VERSION:-"v2-epoll"}
+SECONDS_EACH=${SECONDS_EACH:-5}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR" "$WORKDIR/files"
+OUT="$OUTDIR/tls.txt"
+
+cleanup() {
+    kill "$PLAIN_PID" "$TLS_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 1 -subj /CN=localhost \
+    -keyout "$WORKDIR/key.pem" -out "$WORKDIR/cert.pem" 2>/dev/null
+head -c "$((SIZE_MB * 1024 * 1024))" /dev/urandom > "$WORKDIR/files/blob.bin"
+echo "/files/ static $WORKDIR/files/" > "$WORKDIR/routes.conf"
+
+echo "🔧 TLS benchmark (${SIZE_MB} MB file)"
+(cd "$WORKDIR" && exec "$BIN" -p 8440 -c none -s "$WORKDIR/plain.sock" > plain.log 2>&1) &
+PLAIN_PID=$!
+(cd "$WORKDIR" && exec "$BIN" -p 8441 -c none -s "$WORKDIR/tls.sock" -C cert.pem -K key.pem > tls.log 2>&1) &
+TLS_PID=$!
+sleep 1
+
+if ! curl -sk "https://localhost:8441/files/blob.bin" | cmp -s - "$WORKDIR/files/blob.bin"; then
+    echo "❌ TLS download does not match the file"
+    cat "$WORKDIR/tls.log"
+    exit 1
+fi
+
+handshakes() {
+    openssl s_time -connect 127.0.0.1:8441 "$@" -time "$SECONDS_EACH" 2>/dev/null |
+        awk '/connections in [0-9.]+s/ { printf "%8.0f /s\n", $1 / substr($4, 1, length($4) - 1) }' | head -1
+}
+
+download() {
+    curl -sk -o /dev/null -w "%{speed_download}" "$1" | awk '{ printf "%8.0f MB/s\n", $1 / 1048576 }'
+}
+
+{
+    echo "== handshakes (one at a time) =="
+    echo -n "TLS 1.3 full:        "
+    handshakes -new -tls1_3
+    echo -n "TLS 1.2 full:        "
+    handshakes -new -tls1_2
+    echo -n "TLS 1.2 resumed:     "
+    handshakes -reuse -tls1_2
+    echo "== bulk download (${SIZE_MB} MB static file) =="
+    echo -n "plaintext:           "
+    download "http://localhost:8440/files/blob.bin"
+    echo -n "TLS:                 "
+    download "https://localhost:8441/files/blob.bin"
+    echo -n "kernel TLS:          "
+    if [ -r /proc/net/tls_stat ]; then
+        awk '/TlsTxSw|TlsTxDevice|TlsRxSw/ { printf "%s=%s ", $1, $2 } END { print "" }' /proc/net/tls_stat
+    else
+        echo "unavailable (no tls module), OpenSSL encrypts in the bridge"
+    fi
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
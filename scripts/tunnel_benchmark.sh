@@ -0,0 +1,194 @@
+#!/bin/bash
+
+# Tunnels (WebSocket upgrade / CONNECT): relay throughput and the memory an
+# idle tunnel costs.
+#
+# Runs its own proxy (port 8400) from a temporary directory and a Python
+# backend that answers upgrades with 101 and then sinks or sources bytes:
+#
+#   /ws1/ localhost 3996     two backend ports, because one (proxy, backend)
+#   /ws2/ localhost 3995     address pair only has ~28k ephemeral ports
+#
+#   1. Throughput: MB/s uploaded and downloaded through one CONNECT tunnel,
+#      and the same directly against the backend for comparison.
+#   2. Idle memory: opens IDLE WebSocket tunnels (default 50000) and reports
+#      the proxy's RSS growth per tunnel and the kernel slab growth (which
+#      covers all four sockets of a tunnel: client, proxy x2, backend).
+#
+# Needs about 2 fds per tunnel in the proxy and in the load generator, so
+# raise the hard limit first (ulimit -Hn). Client sockets are spread over
+# 127.0.0.1-127.0.0.4 for the same ephemeral port reason. Closing the tunnels
+# leaves the proxy's backend ports in TIME_WAIT: wait a minute between runs.
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/tunnel_benchmark.sh [idle_tunnels] [transfer_mb]
+
+IDLE=${1:-50000}
+MB=${2:-1024}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/tunnel.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+if ! ulimit -n $((IDLE * 2 + 1024)) 2>/dev/null; then
+    HARD=$(ulimit -Hn)
+    ulimit -n "$HARD"
+    IDLE=$(((HARD - 1024) / 2))
+    echo "⚠️  fd hard limit is $HARD: measuring $IDLE idle tunnels"
+fi
+
+cat > "$WORKDIR/routes.conf" <<EOF
+/ws1/ localhost 3996
+/ws2/ localhost 3995
+EOF
+
+cat > "$WORKDIR/backend.py" <<'EOF'
+import asyncio, sys
+
+async def handle(reader, writer):
+    head = await reader.readuntil(b"\r\n\r\n")
+    if head.startswith(b"GET "):
+        writer.write(b"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n\r\n")
+        await writer.drain()
+        head = await reader.readuntil(b"\r\n\r\n")
+    command = head.split()
+    if command[0] == b"SOURCE":
+        chunk = b"x" * (1 << 20)
+        for _ in range(int(command[1])):
+            writer.write(chunk)
+            await writer.drain()
+    elif command[0] == b"SINK":
+        total = 0
+        while True:
+            data = await reader.read(1 << 20)
+            if not data:
+                break
+            total += len(data)
+        writer.write(b"%d" % total)
+    else:
+        await reader.read()
+    writer.close()
+
+async def main():
+    servers = [await asyncio.start_server(handle, "127.0.0.1", port, backlog=65535) for port in (3996, 3995)]
+    await asyncio.gather(*(s.serve_forever() for s in servers))
+
+asyncio.run(main())
+EOF
+
+cat > "$WORKDIR/client.py" <<'EOF'
+import os, socket, sys, time
+
+mode, port = sys.argv[1], int(sys.argv[2])
+
+def open_tunnel(i, port):
+    s = socket.socket()
+    s.bind(("127.0.0.%d" % (1 + i % 4), 0))
+    s.connect(("127.0.0.1", port))
+    if port == 8400:
+        s.sendall(b"CONNECT localhost:3996 HTTP/1.1\r\nHost: localhost:3996\r\n\r\n")
+        reply = b""
+        while b"\r\n\r\n" not in reply:
+            reply += s.recv(4096)
+        assert b" 200 " in reply.split(b"\r\n")[0], reply
+    return s
+
+if mode == "throughput":
+    mb = int(sys.argv[3])
+    s = open_tunnel(0, port)
+    s.sendall(b"SINK\r\n\r\n")
+    chunk = b"x" * (1 << 20)
+    start = time.time()
+    for _ in range(mb):
+        s.sendall(chunk)
+    s.shutdown(socket.SHUT_WR)
+    total = int(s.recv(64))
+    up = mb / (time.time() - start)
+    assert total == mb << 20, total
+
+    s = open_tunnel(0, port)
+    s.sendall(b"SOURCE %d\r\n\r\n" % mb)
+    start = time.time()
+    got = 0
+    buf = bytearray(1 << 20)
+    while True:
+        n = s.recv_into(buf)
+        if not n:
+            break
+        got += n
+    down = mb / (time.time() - start)
+    assert got == mb << 20, got
+    print("upload %8.0f MB/s   download %8.0f MB/s" % (up, down))
+
+elif mode == "idle":
+    count = int(sys.argv[3])
+    socks = []
+    # In small waves: a burst of connects overflows the backend's accept queue
+    # (SYN retransmit after 1 s) and the requests miss their upstream queue deadline
+    for first in range(0, count, 64):
+        wave = []
+        for i in range(first, min(first + 64, count)):
+            s = socket.socket()
+            s.bind(("127.0.0.%d" % (1 + i % 4), 0))
+            s.connect(("127.0.0.1", port))
+            s.sendall(b"GET /ws%d/ HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n\r\n" % (1 + i % 2))
+            wave.append(s)
+        for s in wave:
+            reply = b""
+            while b"\r\n\r\n" not in reply:
+                reply += s.recv(4096)
+            assert b" 101 " in reply.split(b"\r\n")[0], reply
+        socks += wave
+    print("open", flush=True)
+    sys.stdin.readline()
+EOF
+
+proxy_rss_kb() { awk '/VmRSS/ {print $2}' "/proc/$PROXY_PID/status"; }
+kernel_kb() { awk '/^Slab:/ {print $2}' /proc/meminfo; }
+
+echo "🔧 Tunnel benchmark"
+(cd "$WORKDIR" && exec python3 backend.py > backend.log 2>&1) &
+BACKEND_PID=$!
+(cd "$WORKDIR" && exec "$BIN" -p 8400 -c none > proxy.log 2>&1) &
+PROXY_PID=$!
+sleep 1
+
+{
+    echo "== Relay throughput, $MB MB each way =="
+    echo -n "direct:        "
+    python3 "$WORKDIR/client.py" throughput 3996 "$MB"
+    echo -n "proxy tunnel:  "
+    python3 "$WORKDIR/client.py" throughput 8400 "$MB"
+} | tee "$OUT"
+
+echo "🚀 Opening $IDLE idle WebSocket tunnels..."
+RSS_BEFORE=$(proxy_rss_kb)
+SLAB_BEFORE=$(kernel_kb)
+coproc IDLE_CLIENT { python3 "$WORKDIR/client.py" idle 8400 "$IDLE"; }
+if ! read -r line <&"${IDLE_CLIENT[0]}"; then
+    echo "❌ Could not open the tunnels"
+    tail -5 "$WORKDIR/proxy.log"
+    exit 1
+fi
+sleep 1
+RSS_AFTER=$(proxy_rss_kb)
+SLAB_AFTER=$(kernel_kb)
+
+{
+    echo "== $IDLE idle tunnels =="
+    echo "proxy RSS:       $RSS_BEFORE kB -> $RSS_AFTER kB ($(((RSS_AFTER - RSS_BEFORE) * 1024 / IDLE)) bytes per tunnel)"
+    echo "kernel slab:     $SLAB_BEFORE kB -> $SLAB_AFTER kB ($(((SLAB_AFTER - SLAB_BEFORE) * 1024 / IDLE)) bytes per tunnel, 4 sockets)"
+    echo "proxy fds:       $(ls "/proc/$PROXY_PID/fd" | wc -l)"
+} | tee -a "$OUT"
+
+echo >&"${IDLE_CLIENT[1]}"
+wait "$IDLE_CLIENT_PID" 2>/dev/null
+echo "✅ done → $OUT"
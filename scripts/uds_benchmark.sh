@@ -0,0 +1,115 @@
+#!/bin/bash
+
+# Unix domain socket upstreams against loopback TCP, small responses. One
+# Node backend listens on both (port 3993 and a socket in a temporary
+# directory); one proxy (port 8450) routes to each:
+#
+#   /tcp/   localhost 3993
+#   /uds/   unix:$WORKDIR/backend.sock
+#
+# Every request opens a new backend connection, so TCP pays a handshake and
+# an ephemeral port that sits in TIME_WAIT afterwards; the unix socket pays
+# neither. Reports req/s and the TIME_WAIT sockets toward the backend each
+# run left behind.
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/uds_benchmark.sh [requests] [concurrency]
+
+REQUESTS=${1:-20000}
+CONCURRENCY=${2:-50}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+NODE=${NODE:-node}
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/uds.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+if ! command -v "$NODE" > /dev/null; then
+    echo "❌ Needs node (set NODE=/path/to/node)"
+    exit 1
+fi
+ulimit -n 65535 2>/dev/null
+
+cat > "$WORKDIR/routes.conf" <<EOF
+/tcp/ localhost 3993
+/uds/ unix:$WORKDIR/backend.sock
+EOF
+
+cat > "$WORKDIR/backend.js" <<'EOF'
+const http = require("http");
+const handler = (req, res) => {
+    res.writeHead(200, { "content-type": "text/plain" });
+    res.end("hello\n");
+};
+http.createServer(handler).listen(3993, "127.0.0.1", 65535);
+http.createServer(handler).listen({ path: process.argv[2], backlog: 65535 });
+EOF
+
+cat > "$WORKDIR/load.py" <<'EOF'
+import asyncio, sys, time
+
+path, count, concurrency = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+ok = failed = 0
+
+async def worker(n):
+    global ok, failed
+    for _ in range(n):
+        try:
+            reader, writer = await asyncio.open_connection("127.0.0.1", 8450)
+            writer.write(b"GET " + path.encode() + b" HTTP/1.1\r\nHost: localhost\r\n\r\n")
+            reply = await reader.read()
+            writer.close()
+            if reply.startswith(b"HTTP/1.1 200"):
+                ok += 1
+            else:
+                failed += 1
+        except OSError:
+            failed += 1
+
+async def main():
+    start = time.time()
+    await asyncio.gather(*(worker(count // concurrency) for _ in range(concurrency)))
+    print("%6.0f req/s  (%d ok, %d failed)" % ((ok + failed) / (time.time() - start), ok, failed), end="")
+
+asyncio.run(main())
+EOF
+
+backend_time_wait() { ss -tan state time-wait "( sport = :3993 or dport = :3993 )" | tail -n +2 | wc -l; }
+
+run() {
+    local before after
+    before=$(backend_time_wait)
+    python3 "$WORKDIR/load.py" "$1" "$REQUESTS" "$CONCURRENCY"
+    after=$(backend_time_wait)
+    echo ", $((after - before)) backend sockets in TIME_WAIT"
+}
+
+echo "🔧 UDS benchmark: $REQUESTS requests, $CONCURRENCY concurrent"
+(cd "$WORKDIR" && exec "$NODE" backend.js "$WORKDIR/backend.sock" > backend.log 2>&1) &
+BACKEND_PID=$!
+sleep 1
+(cd "$WORKDIR" && exec "$BIN" -p 8450 -c none -s "$WORKDIR/upgrade.sock" > proxy.log 2>&1) &
+PROXY_PID=$!
+sleep 1
+
+if ! curl -s "http://localhost:8450/uds/x" | grep -q hello; then
+    echo "❌ No response through the unix socket route"
+    cat "$WORKDIR/proxy.log"
+    exit 1
+fi
+
+{
+    echo "== loopback TCP (/tcp/ → localhost 3993) =="
+    run /tcp/x
+    echo "== unix socket (/uds/ → unix:backend.sock) =="
+    run /uds/x
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
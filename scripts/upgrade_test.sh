@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# Zero-downtime upgrade check: keep load on the proxy, start a second build
+# with -U so it takes over the listener from the running one, and verify
+# that the old process drains and exits without a single failed request.
+#
+# Usage (backend from routes.conf must be running):
+#   make VERSION=v2-epoll && cp bin/v2-epoll-server /tmp/old-server
+#   ... rebuild with your change ...
+#   ./scripts/upgrade_test.sh /tmp/old-server bin/v2-epoll-server
+#
+# Both arguments default to bin/v2-epoll-server (upgrade to the same build).
+
+OLD_BIN=${1:-"bin/v2-epoll-server"}
+NEW_BIN=${2:-"bin/v2-epoll-server"}
+URL=${URL:-"http://localhost:8000/"}
+WORKERS=${WORKERS:-8}
+CONTROL=${CONTROL:-"/tmp/turboproxy-upgrade-test.sock"}
+WORKDIR=$(mktemp -d)
+
+cleanup() {
+    touch "$WORKDIR/stop"
+    wait "${LOAD_PIDS[@]}" 2>/dev/null
+    kill "$OLD_PID" "$NEW_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+echo "🔧 Starting old build: $OLD_BIN"
+"$OLD_BIN" -s "$CONTROL" > "$WORKDIR/old.log" 2>&1 &
+OLD_PID=$!
+sleep 0.5
+
+if ! curl -s -o /dev/null "$URL"; then
+    echo "❌ Proxy not answering on $URL (is the backend running?)"
+    cat "$WORKDIR/old.log"
+    exit 1
+fi
+
+echo "🚀 Starting $WORKERS load workers..."
+LOAD_PIDS=()
+for w in $(seq 1 "$WORKERS"); do
+    (
+        while [ ! -e "$WORKDIR/stop" ]; do
+            curl -s -o /dev/null -w '%{http_code}\n' --max-time 5 "$URL"
+        done > "$WORKDIR/codes.$w"
+    ) &
+    LOAD_PIDS+=($!)
+done
+sleep 2
+
+echo "🔁 Upgrading to: $NEW_BIN"
+"$NEW_BIN" -U -s "$CONTROL" > "$WORKDIR/new.log" 2>&1 &
+NEW_PID=$!
+
+for _ in $(seq 1 100); do
+    kill -0 "$OLD_PID" 2>/dev/null || break
+    sleep 0.1
+done
+if kill -0 "$OLD_PID" 2>/dev/null; then
+    echo "❌ Old process did not exit after handoff"
+    cat "$WORKDIR/old.log" "$WORKDIR/new.log"
+    exit 1
+fi
+echo "✅ Old process drained and exited"
+
+sleep 2
+touch "$WORKDIR/stop"
+wait "${LOAD_PIDS[@]}"
+
+total=$(cat "$WORKDIR"/codes.* | wc -l)
+failed=$(cat "$WORKDIR"/codes.* | grep -vc '^200$')
+echo "📊 $total requests, $failed failed"
+grep -h -v '^200$' "$WORKDIR"/codes.* | sort | uniq -c
+
+[ "$failed" -eq 0 ]
@@ -0,0 +1,156 @@
+#!/bin/bash
+
+# One event loop per CPU (-w) against the single loop: throughput, how the
+# load spreads over the workers, and where their memory lives.
+#
+# Runs a Python backend (port 3991) and the proxy (port 8457) from a
+# temporary directory, once as a single process and once with one pinned
+# worker per CPU (-w 0 -H). For every run it reports:
+#
+#   req/s             new connection per request, CONCURRENCY at a time
+#   per worker        CPU time, and migrations between CPUs (from
+#                     /proc/PID/sched; a pinned worker should have none)
+#   pages             resident pages per NUMA node (from /proc/PID/numa_maps)
+#                     next to the worker's own node
+#   other_node        allocations the kernel satisfied from another node
+#                     than the one asked for, system wide (numastat)
+#   node-load-misses  loads served from remote memory, if perf is installed
+#
+# On a single-node machine everything is local by definition; the numbers
+# that matter there are the spread and the migrations.
+#
+# Usage:
+#   make VERSION=v2-epoll && ./scripts/workers_benchmark.sh [requests] [concurrency]
+
+REQUESTS=${1:-20000}
+CONCURRENCY=${2:-50}
+BIN=$(realpath "${BIN:-bin/v2-epoll-server}")
+VERSION=${VERSION:-"v2-epoll"}
+OUTDIR="$(pwd)/benchmarks/$VERSION"
+WORKDIR=$(mktemp -d)
+mkdir -p "$OUTDIR"
+OUT="$OUTDIR/workers.txt"
+
+cleanup() {
+    kill "$PROXY_PID" "$BACKEND_PID" "$PERF_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+ulimit -n 65535 2>/dev/null
+
+echo "/ localhost 3991" > "$WORKDIR/routes.conf"
+
+cat > "$WORKDIR/backend.py" <<'EOF'
+import socketserver
+
+class Handler(socketserver.BaseRequestHandler):
+    def handle(self):
+        data = b""
+        while b"\r\n\r\n" not in data:
+            chunk = self.request.recv(4096)
+            if not chunk:
+                return
+            data += chunk
+        self.request.sendall(b"HTTP/1.1 200 OK\r\nContent-Length: 6\r\nConnection: close\r\n\r\nhello\n")
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+    request_queue_size = 4096
+
+Server(("127.0.0.1", 3991), Handler).serve_forever()
+EOF
+
+cat > "$WORKDIR/load.py" <<'EOF'
+import asyncio, sys, time
+
+count, concurrency = int(sys.argv[1]), int(sys.argv[2])
+ok = failed = 0
+
+async def worker(n):
+    global ok, failed
+    for _ in range(n):
+        try:
+            reader, writer = await asyncio.open_connection("127.0.0.1", 8457)
+            writer.write(b"GET /x HTTP/1.1\r\nHost: localhost\r\n\r\n")
+            reply = await reader.read()
+            writer.close()
+            if reply.startswith(b"HTTP/1.1 200"):
+                ok += 1
+            else:
+                failed += 1
+        except OSError:
+            failed += 1
+
+async def main():
+    start = time.time()
+    await asyncio.gather(*(worker(count // concurrency) for _ in range(concurrency)))
+    print("%6.0f req/s  (%d ok, %d failed)" % ((ok + failed) / (time.time() - start), ok, failed))
+
+asyncio.run(main())
+EOF
+
+other_node() { cat /sys/devices/system/node/node*/numastat | awk '$1 == "other_node" { n += $2 } END { print n + 0 }'; }
+
+# Event loops: the workers, or the process itself without -w
+loops() {
+    local children
+    children=$(cat "/proc/$PROXY_PID/task/$PROXY_PID/children" 2>/dev/null)
+    echo "${children:-$PROXY_PID}"
+}
+
+report_loop() {
+    local pid=$1 cpu_ticks migrations pages
+    cpu_ticks=$(awk '{ print $14 + $15 }' "/proc/$pid/stat")
+    migrations=$(awk '/nr_migrations/ { print $3 }' "/proc/$pid/sched" 2>/dev/null)
+    pages=$(awk '{ for (i = 2; i <= NF; i++) if ($i ~ /^N[0-9]+=/) { split($i, kv, "="); n[kv[1]] += kv[2] } }
+                 END { for (k in n) printf "%s=%d ", k, n[k] }' "/proc/$pid/numa_maps")
+    printf "  pid %-7s cpu %-3s %5.1fs cpu  %4s migrations  pages %s\n" "$pid" \
+        "$(awk '{ print $39 }' "/proc/$pid/stat")" "$(awk -v t="$cpu_ticks" -v hz="$(getconf CLK_TCK)" 'BEGIN { print t / hz }')" \
+        "${migrations:-?}" "$pages"
+}
+
+run() {
+    local name=$1
+    shift
+    (cd "$WORKDIR" && exec "$BIN" -p 8457 -c none -s "$WORKDIR/upgrade.sock" "$@" > proxy.log 2>&1) &
+    PROXY_PID=$!
+    sleep 1
+
+    echo "== $name${*:+ ($*)} =="
+    local before perf_out="$WORKDIR/perf.txt"
+    before=$(other_node)
+    if command -v perf > /dev/null; then
+        # shellcheck disable=SC2046
+        perf stat -e node-loads,node-load-misses $(loops | sed 's/^/-p /; s/ / -p /g') -o "$perf_out" &
+        PERF_PID=$!
+    fi
+    echo -n "  "
+    python3 "$WORKDIR/load.py" "$REQUESTS" "$CONCURRENCY"
+    for pid in $(loops); do
+        report_loop "$pid"
+    done
+    echo "  other_node allocations: $(($(other_node) - before))"
+    if [ -n "$PERF_PID" ]; then
+        kill -INT "$PERF_PID" 2>/dev/null
+        wait "$PERF_PID" 2>/dev/null
+        PERF_PID=
+        grep -E "node-load" "$perf_out" | sed 's/^ */  /'
+    fi
+
+    kill "$PROXY_PID" 2>/dev/null
+    wait "$PROXY_PID" 2>/dev/null
+}
+
+echo "🔧 Workers benchmark: $REQUESTS requests, $CONCURRENCY concurrent, $(nproc) CPUs, $(ls -d /sys/devices/system/node/node* 2>/dev/null | wc -l) NUMA nodes"
+(cd "$WORKDIR" && exec python3 backend.py > backend.log 2>&1) &
+BACKEND_PID=$!
+sleep 1
+
+{
+    run "single event loop"
+    run "one worker per CPU" -w 0 -H
+    run "two workers per CPU" -w $(($(nproc) * 2)) -H
+} | tee "$OUT"
+
+echo "✅ done → $OUT"
@@ -121,4 +121,48 @@ void send_http_error(int client_fd, int status_code, const char *message)
         }
         total_sent += bytes_sent;
     }
-}
\ No newline at end of file
+}
+
+static const char response_429[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 18\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Too Many Requests\n";
+
+static const char response_503[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 20\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Service Unavailable\n";
+
+void send_canned_response(int client_fd, canned_response_t which)
+{
+    const char *response = NULL;
+    size_t len = 0;
+
+    switch (which)
+    {
+    case CANNED_429_TOO_MANY_REQUESTS:
+        response = response_429;
+        len = sizeof(response_429) - 1;
+        break;
+    case CANNED_503_SERVICE_UNAVAILABLE:
+        response = response_503;
+        len = sizeof(response_503) - 1;
+        break;
+    }
+
+    if (!response)
+        return;
+
+    if (send(client_fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        log_errno("send_canned_response: Failed to send response to client %d", client_fd);
+    }
+}
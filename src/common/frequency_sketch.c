@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include "common/frequency_sketch.h"
+#include "common/error_handler.h"
+
+/** Odd 64-bit constants: one independent-enough hash per row from a single key hash */
+static const uint64_t row_seeds[FREQUENCY_SKETCH_ROWS] = {
+    0xc3a5c85c97cb3127ULL,
+    0xb492b66fbe98f273ULL,
+    0x9ae16a3b2f90404fULL,
+    0xcbf29ce484222325ULL,
+};
+
+static inline size_t counter_index(const frequency_sketch_t *sketch, uint64_t hash, int row)
+{
+    uint64_t h = (hash + row_seeds[row]) * row_seeds[row];
+    h ^= h >> 32;
+    return (size_t)h & (sketch->width - 1);
+}
+
+static inline int counter_get(const frequency_sketch_t *sketch, int row, size_t index)
+{
+    uint8_t byte = sketch->table[row * (sketch->width / 2) + index / 2];
+    return (index & 1) ? (byte >> 4) : (byte & 0x0f);
+}
+
+static inline void counter_set(frequency_sketch_t *sketch, int row, size_t index, int value)
+{
+    uint8_t *byte = &sketch->table[row * (sketch->width / 2) + index / 2];
+    if (index & 1)
+        *byte = (*byte & 0x0f) | (uint8_t)(value << 4);
+    else
+        *byte = (*byte & 0xf0) | (uint8_t)value;
+}
+
+int frequency_sketch_init(frequency_sketch_t *sketch, size_t expected_items)
+{
+    size_t width = 64;
+    while (width < expected_items)
+        width <<= 1;
+
+    sketch->table = calloc(FREQUENCY_SKETCH_ROWS, width / 2);
+    if (!sketch->table)
+    {
+        log_errno("frequency_sketch_init: Failed to allocate %zu counters", width * FREQUENCY_SKETCH_ROWS);
+        return -1;
+    }
+    sketch->width = width;
+    sketch->additions = 0;
+    sketch->sample_size = (uint32_t)(10 * width);
+    return 0;
+}
+
+void frequency_sketch_destroy(frequency_sketch_t *sketch)
+{
+    free(sketch->table);
+    sketch->table = NULL;
+}
+
+/** Halve every counter: old popularity decays, recent popularity wins */
+static void sketch_age(frequency_sketch_t *sketch)
+{
+    size_t bytes = FREQUENCY_SKETCH_ROWS * (sketch->width / 2);
+    for (size_t i = 0; i < bytes; i++)
+    {
+        /** Shift both nibbles right by one without letting the high one leak into the low one */
+        sketch->table[i] = (sketch->table[i] >> 1) & 0x77;
+    }
+    sketch->additions /= 2;
+}
+
+void frequency_sketch_increment(frequency_sketch_t *sketch, uint64_t hash)
+{
+    bool added = false;
+    for (int row = 0; row < FREQUENCY_SKETCH_ROWS; row++)
+    {
+        size_t index = counter_index(sketch, hash, row);
+        int value = counter_get(sketch, row, index);
+        if (value < FREQUENCY_SKETCH_MAX)
+        {
+            counter_set(sketch, row, index, value + 1);
+            added = true;
+        }
+    }
+
+    if (added && ++sketch->additions >= sketch->sample_size)
+        sketch_age(sketch);
+}
+
+int frequency_sketch_estimate(const frequency_sketch_t *sketch, uint64_t hash)
+{
+    int min = FREQUENCY_SKETCH_MAX;
+    for (int row = 0; row < FREQUENCY_SKETCH_ROWS; row++)
+    {
+        int value = counter_get(sketch, row, counter_index(sketch, hash, row));
+        if (value < min)
+            min = value;
+    }
+    return min;
+}
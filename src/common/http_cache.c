@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include "common/http_cache.h"
+#include "common/request_parser.h"
+#include "common/debug.h"
+
+/** Parsed Cache-Control directives (only the ones we act on) */
+typedef struct
+{
+    bool no_store;
+    bool no_cache;
+    bool is_private;
+    bool must_revalidate; /**< must-revalidate or proxy-revalidate: never serve stale */
+    int64_t max_age;  /**< -1 if absent */
+    int64_t s_maxage; /**< -1 if absent */
+    int64_t stale_while_revalidate; /**< -1 if absent */
+    int64_t stale_if_error;         /**< -1 if absent */
+} cache_control_t;
+
+static bool token_is(const char *tok, size_t len, const char *name)
+{
+    return strlen(name) == len && strncasecmp(tok, name, len) == 0;
+}
+
+static void parse_cache_control(const char *value, size_t len, cache_control_t *cc)
+{
+    const char *p = value;
+    const char *end = value + len;
+
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char *tok = p;
+        while (p < end && *p != ',' && *p != '=')
+            p++;
+        size_t tok_len = p - tok;
+        while (tok_len && (tok[tok_len - 1] == ' ' || tok[tok_len - 1] == '\t'))
+            tok_len--;
+
+        int64_t arg = -1;
+        if (p < end && *p == '=')
+        {
+            p++;
+            if (p < end && *p == '"')
+                p++;
+            if (p < end && isdigit((unsigned char)*p))
+                arg = strtoll(p, NULL, 10);
+            /** Skip the argument, including quoted field lists like no-cache="set-cookie, foo" */
+            bool quoted = p > value && p[-1] == '"';
+            while (p < end && (quoted ? *p != '"' : *p != ','))
+                p++;
+            if (p < end && *p == '"')
+                p++;
+        }
+
+        if (token_is(tok, tok_len, "no-store"))
+            cc->no_store = true;
+        else if (token_is(tok, tok_len, "no-cache"))
+            cc->no_cache = true;
+        else if (token_is(tok, tok_len, "private"))
+            cc->is_private = true;
+        else if (token_is(tok, tok_len, "max-age"))
+            cc->max_age = arg;
+        else if (token_is(tok, tok_len, "s-maxage"))
+            cc->s_maxage = arg;
+        else if (token_is(tok, tok_len, "must-revalidate") || token_is(tok, tok_len, "proxy-revalidate"))
+            cc->must_revalidate = true;
+        else if (token_is(tok, tok_len, "stale-while-revalidate"))
+            cc->stale_while_revalidate = arg;
+        else if (token_is(tok, tok_len, "stale-if-error"))
+            cc->stale_if_error = arg;
+    }
+}
+
+/** IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT") → epoch seconds, -1 if invalid */
+static int64_t parse_http_date(const char *value)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end)
+        return -1;
+    return (int64_t)timegm(&tm);
+}
+
+http_cache_request_t http_cache_request_policy(const HttpRequest *req)
+{
+    if (strcmp(req->methode, "GET") != 0 || req->body_length > 0)
+        return HTTP_CACHE_BYPASS;
+
+    /** Responses to authenticated requests are per user */
+    if (get_request_header(req, "Authorization"))
+        return HTTP_CACHE_BYPASS;
+
+    cache_control_t cc = {.max_age = -1, .s_maxage = -1, .stale_while_revalidate = -1, .stale_if_error = -1};
+    const char *value = get_request_header(req, "Cache-Control");
+    if (value)
+        parse_cache_control(value, strlen(value), &cc);
+
+    if (cc.no_store)
+        return HTTP_CACHE_BYPASS;
+
+    const char *pragma = get_request_header(req, "Pragma");
+    if (cc.no_cache || cc.max_age == 0 || (!value && pragma && strcasestr(pragma, "no-cache")))
+        return HTTP_CACHE_STORE_ONLY;
+
+    return HTTP_CACHE_LOOKUP;
+}
+
+static int hex_value(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static bool is_unreserved(int c)
+{
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+int http_cache_key(const HttpRequest *req, char *out, size_t out_size)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const char *path = req->path;
+
+    /** Absolute-form or asterisk-form targets are not worth caching */
+    if (!path || path[0] != '/')
+        return -1;
+
+    const char *host = get_request_header(req, "Host");
+    int written = snprintf(out, out_size, "%s ", req->methode);
+    if (written < 0 || (size_t)written >= out_size)
+        return -1;
+    size_t pos = written;
+
+    for (const char *h = host ? host : ""; *h; h++)
+    {
+        if (pos + 1 >= out_size)
+            return -1;
+        out[pos++] = tolower((unsigned char)*h);
+    }
+    if (pos + 1 >= out_size)
+        return -1;
+    out[pos++] = ' ';
+
+    /** 1. Percent-decoding of unreserved characters, upper-case hex for the rest */
+    char decoded[HTTP_CACHE_MAX_KEY];
+    size_t dlen = 0;
+    const char *p = path;
+    for (; *p && *p != '?' && *p != '#'; p++)
+    {
+        if (dlen + 3 >= sizeof(decoded))
+            return -1;
+
+        int hi, lo;
+        if (*p == '%' && (hi = hex_value(p[1])) >= 0 && (lo = hex_value(p[2])) >= 0)
+        {
+            int c = hi * 16 + lo;
+            if (is_unreserved(c))
+            {
+                decoded[dlen++] = (char)c;
+            }
+            else
+            {
+                decoded[dlen++] = '%';
+                decoded[dlen++] = hex[hi];
+                decoded[dlen++] = hex[lo];
+            }
+            p += 2;
+        }
+        else
+        {
+            decoded[dlen++] = *p;
+        }
+    }
+    const char *query = (*p == '?') ? p : NULL;
+
+    /** 2. Segment by segment: drop empty and "." segments, ".." removes the previous one */
+    size_t path_start = pos;
+    bool trailing_slash = false;
+    size_t i = 0;
+    while (i < dlen)
+    {
+        size_t seg = i;
+        while (i < dlen && decoded[i] != '/')
+            i++;
+        size_t seg_len = i - seg;
+        if (i < dlen)
+            i++; /** skip '/' */
+
+        if (seg_len == 0 || (seg_len == 1 && decoded[seg] == '.'))
+        {
+            trailing_slash = true;
+            continue;
+        }
+        if (seg_len == 2 && decoded[seg] == '.' && decoded[seg + 1] == '.')
+        {
+            while (pos > path_start && out[pos - 1] != '/')
+                pos--;
+            if (pos > path_start)
+                pos--;
+            trailing_slash = true;
+            continue;
+        }
+
+        if (pos + 1 + seg_len >= out_size)
+            return -1;
+        out[pos++] = '/';
+        memcpy(out + pos, decoded + seg, seg_len);
+        pos += seg_len;
+        trailing_slash = (i == dlen && decoded[dlen - 1] == '/');
+    }
+    if (pos == path_start || trailing_slash)
+    {
+        if (pos + 1 >= out_size)
+            return -1;
+        out[pos++] = '/';
+    }
+
+    /** 3. Query string as sent (parameter order can be significant to the backend) */
+    if (query)
+    {
+        size_t qlen = strcspn(query, "#");
+        if (pos + qlen >= out_size)
+            return -1;
+        memcpy(out + pos, query, qlen);
+        pos += qlen;
+    }
+
+    out[pos] = '\0';
+    return (int)pos;
+}
+
+static bool status_cacheable(int status)
+{
+    /** "Heuristically cacheable" codes (RFC 9110 15.1); we still require explicit freshness */
+    switch (status)
+    {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void parse_vary(const char *value, http_cache_policy_t *policy)
+{
+    size_t pos = strlen(policy->vary);
+    const char *p = value;
+
+    while (*p)
+    {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        const char *name = p;
+        while (*p && *p != ',' && *p != ' ' && *p != '\t')
+            p++;
+        size_t len = p - name;
+        if (len == 0)
+            continue;
+
+        if (len == 1 && *name == '*')
+        {
+            policy->cacheable = false;
+            return;
+        }
+        if (pos + len + 1 >= sizeof(policy->vary))
+        {
+            /** Can't remember every dimension → can't tell variants apart safely */
+            policy->cacheable = false;
+            return;
+        }
+        for (size_t k = 0; k < len; k++)
+            policy->vary[pos++] = tolower((unsigned char)name[k]);
+        policy->vary[pos++] = '\n';
+        policy->vary[pos] = '\0';
+    }
+}
+
+int http_cache_parse_response(const char *resp, size_t len, int64_t now, http_cache_policy_t *policy)
+{
+    memset(policy, 0, sizeof(*policy));
+    policy->lifetime_s = -1;
+
+    const char *head_end = memmem(resp, len, "\r\n\r\n", 4);
+    if (!head_end)
+        return -1;
+    policy->header_len = (head_end - resp) + 4;
+
+    int minor = 0;
+    if (sscanf(resp, "HTTP/1.%d %d", &minor, &policy->status) != 2)
+        return -1;
+
+    policy->cacheable = status_cacheable(policy->status);
+
+    cache_control_t cc = {.max_age = -1, .s_maxage = -1, .stale_while_revalidate = -1, .stale_if_error = -1};
+    int64_t date = -1, expires = -1;
+    bool has_expires = false;
+    policy->content_length = -1;
+
+    const char *line = memchr(resp, '\n', head_end - resp);
+    while (line && line < head_end)
+    {
+        line++;
+        const char *eol = memchr(line, '\r', head_end + 2 - line);
+        if (!eol)
+            break;
+
+        /** NUL-terminated copy so the value can be handed to strtol/strptime */
+        char buf[1024];
+        size_t llen = eol - line;
+        if (llen >= sizeof(buf))
+            llen = sizeof(buf) - 1;
+        memcpy(buf, line, llen);
+        buf[llen] = '\0';
+
+        char *colon = strchr(buf, ':');
+        if (colon)
+        {
+            *colon = '\0';
+            char *value = colon + 1;
+            while (*value == ' ' || *value == '\t')
+                value++;
+
+            if (strcasecmp(buf, "Cache-Control") == 0)
+                parse_cache_control(value, strlen(value), &cc);
+            else if (strcasecmp(buf, "Expires") == 0)
+            {
+                has_expires = true;
+                expires = parse_http_date(value);
+            }
+            else if (strcasecmp(buf, "Date") == 0)
+                date = parse_http_date(value);
+            else if (strcasecmp(buf, "Age") == 0)
+                policy->age_s = (uint32_t)strtoul(value, NULL, 10);
+            else if (strcasecmp(buf, "Vary") == 0)
+                parse_vary(value, policy);
+            else if (strcasecmp(buf, "Set-Cookie") == 0)
+                policy->cacheable = false;
+            else if (strcasecmp(buf, "Content-Length") == 0)
+                policy->content_length = strtoll(value, NULL, 10);
+        }
+
+        line = memchr(eol, '\n', head_end + 2 - eol);
+    }
+
+    if (cc.no_store || cc.no_cache || cc.is_private)
+        policy->cacheable = false;
+
+    if (cc.s_maxage >= 0)
+        policy->lifetime_s = cc.s_maxage;
+    else if (cc.max_age >= 0)
+        policy->lifetime_s = cc.max_age;
+    else if (has_expires)
+        /** An invalid Expires (e.g. "0") means "already expired" */
+        policy->lifetime_s = expires < 0 ? 0 : expires - (date >= 0 ? date : now);
+
+    if (policy->lifetime_s <= 0)
+        policy->cacheable = false;
+
+    /** RFC 5861 extensions, overridden by an explicit "don't serve stale" */
+    if (!cc.must_revalidate)
+    {
+        policy->stale_while_revalidate_s = cc.stale_while_revalidate > 0 ? cc.stale_while_revalidate : 0;
+        policy->stale_if_error_s = cc.stale_if_error > 0 ? cc.stale_if_error : 0;
+    }
+
+    DEBUG_PRINT("http_cache: status=%d lifetime=%lld cacheable=%d\n",
+                policy->status, (long long)policy->lifetime_s, policy->cacheable);
+    return 0;
+}
+
+size_t http_cache_copy_head(char *dst, const char *head, size_t head_len)
+{
+    size_t out = 0;
+    const char *p = head;
+    const char *end = head + head_len - 2; /** keep the CRLF of the last header line */
+
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        size_t line_len = eol ? (size_t)(eol - p) + 1 : (size_t)(end - p);
+        /** Age is recomputed on every hit; X-Cache may come from a peer proxy's hit */
+        if (!(line_len >= 4 && strncasecmp(p, "Age:", 4) == 0) &&
+            !(line_len >= 8 && strncasecmp(p, "X-Cache:", 8) == 0))
+        {
+            memcpy(dst + out, p, line_len);
+            out += line_len;
+        }
+        p += line_len;
+    }
+    return out;
+}
+
+bool http_cache_accepts_encoding(const char *accept, const char *coding)
+{
+    size_t coding_len = strlen(coding);
+
+    for (const char *p = accept; p && *p;)
+    {
+        while (*p == ' ' || *p == ',')
+            p++;
+        size_t tok_len = strcspn(p, " ,;");
+        const char *params = p + tok_len;
+        const char *next = strchr(p, ',');
+
+        if (tok_len == coding_len && strncasecmp(p, coding, coding_len) == 0)
+        {
+            const char *q = strstr(params, "q=");
+            if (q && (!next || q < next) && strtod(q + 2, NULL) == 0.0)
+                return false;
+            return true;
+        }
+        p = next;
+    }
+    return false;
+}
+
+/**
+ * Accept-Encoding reduced to the codings anyone here produces: browsers
+ * spell the same preference in many ways ("gzip, deflate, br" vs
+ * "br;q=1.0, gzip;q=0.8, *;q=0.1"), which would give every spelling its own
+ * copy of a response that varies on it.
+ */
+static const char *normalize_accept_encoding(const char *value, char *out, size_t out_size)
+{
+    static const char *codings[] = {"br", "gzip", "deflate"};
+    size_t pos = 0;
+
+    out[0] = '\0';
+    for (size_t i = 0; value && i < sizeof(codings) / sizeof(codings[0]); i++)
+    {
+        if (http_cache_accepts_encoding(value, codings[i]))
+            pos += snprintf(out + pos, out_size - pos, "%s%s", pos ? "," : "", codings[i]);
+    }
+    return out;
+}
+
+int http_cache_vary_values(const HttpRequest *req, const char *vary, char *out, size_t out_size)
+{
+    size_t pos = 0;
+    const char *name = vary;
+
+    while (*name)
+    {
+        const char *nl = strchr(name, '\n');
+        size_t name_len = nl ? (size_t)(nl - name) : strlen(name);
+
+        char header[HTTP_CACHE_MAX_VARY];
+        if (name_len >= sizeof(header))
+            return -1;
+        memcpy(header, name, name_len);
+        header[name_len] = '\0';
+
+        const char *value = get_request_header(req, header);
+        char normalized[32];
+        if (strcmp(header, "accept-encoding") == 0)
+            value = normalize_accept_encoding(value, normalized, sizeof(normalized));
+        size_t vlen = value ? strlen(value) : 0;
+        if (pos + vlen + 1 >= out_size)
+            return -1;
+        memcpy(out + pos, value ? value : "", vlen);
+        pos += vlen;
+        out[pos++] = '\n';
+
+        name += name_len + (nl ? 1 : 0);
+    }
+
+    out[pos] = '\0';
+    return (int)pos;
+}
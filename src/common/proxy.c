@@ -12,16 +12,30 @@
 
 int connect_to_target(char *host, int port)
 {
-    char *colon = strchr(host, ':');
+    /**
+     * "host:port" routes: resolve only the host part. Copied, not cut in
+     * place: the route is shared by every thread in v3-threaded.
+     */
+    char name[256];
+    snprintf(name, sizeof(name), "%s", host);
+    char *colon = strchr(name, ':');
     if (colon)
     {
         *colon = '\0'; // terminate string at ':'
     }
-    // gethostbyname → resolve backend hostname (example: "backend.local" → 10.0.0.5).
-    struct hostent *server = gethostbyname(host);
-    if (server == NULL)
+    /**
+     * getaddrinfo → resolve backend hostname (example: "backend.local" → 10.0.0.5).
+     * Unlike gethostbyname() it returns its own allocation instead of a
+     * static hostent, so concurrent lookups don't overwrite each other.
+     */
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(name, NULL, &hints, &result);
+    if (rc != 0)
     {
-        log_error("No such host: %s", host);
+        log_error("No such host: %s (%s)", name, gai_strerror(rc));
         return -1;
     }
     struct sockaddr_in target_addr;
@@ -31,26 +45,22 @@ int connect_to_target(char *host, int port)
     if (socket_fd < 0)
     {
         log_errno("Failed to create socket");
+        freeaddrinfo(result);
         return -1;
     }
 
-    memset(&target_addr, 0, sizeof(target_addr));
-    target_addr.sin_family = AF_INET;
-    target_addr.sin_port = htons(port);
-
     /** 
      * target_addr.sin_addr.s_addr = INADDR_ANY;
      * INADDR_ANY (value 0.0.0.0) is not valid for client connections.
      * It's used on servers to listen on all interfaces, not to connect.
      */
-    memcpy(&target_addr.sin_addr, server->h_addr_list[0], server->h_length);
-    DEBUG_PRINT("%s\n", server->h_addr_list[0]);
-    DEBUG_PRINT("%d\n", server->h_length);
-    DEBUG_PRINT("%s\n", server->h_name);
+    memcpy(&target_addr, result->ai_addr, sizeof(target_addr));
+    target_addr.sin_port = htons(port);
+    freeaddrinfo(result);
 
     if (connect(socket_fd, (struct sockaddr *)&target_addr, sizeof(target_addr)) < 0)
     {
-        log_errno("Failed to connect to target %s:%d", host, port);
+        log_errno("Failed to connect to target %s:%d", name, port);
         close(socket_fd);
         return -1;
     }
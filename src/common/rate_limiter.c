@@ -0,0 +1,213 @@
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "common/rate_limiter.h"
+
+#define TOKEN_SCALE 1000ULL /**< Tokens are stored in 1/1000 units to keep fractional refills */
+
+typedef struct
+{
+    _Atomic uint64_t key;
+    _Atomic uint64_t state;
+} rate_slot_t;
+
+/**
+ * Zero-filled by mmap: key 0 means "empty". Each slot is 16 bytes, so
+ * four slots share a cache line; a probe window of 8 touches two lines.
+ */
+static rate_slot_t *table = NULL;
+
+int rate_limiter_init(void)
+{
+    if (table)
+        return 0;
+    /** Shared, so worker processes forked afterwards (-w) keep using this one */
+    void *mem = mmap(NULL, RATE_LIMIT_TABLE_SIZE * sizeof(rate_slot_t), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return -1;
+    table = mem;
+    return 0;
+}
+
+static inline uint64_t pack_state(uint64_t tokens, uint32_t stamp_ms)
+{
+    return (tokens << 32) | stamp_ms;
+}
+
+static inline uint64_t state_tokens(uint64_t state)
+{
+    return state >> 32;
+}
+
+static inline uint32_t state_stamp(uint64_t state)
+{
+    return (uint32_t)state;
+}
+
+/**
+ * Monotonic milliseconds truncated to 32 bits. Wraps every ~49 days, but
+ * every comparison below uses unsigned subtraction so the wrap is harmless
+ * for any bucket touched within that period.
+ */
+static uint32_t now_ms32(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000);
+}
+
+uint64_t rate_limiter_key(const char *client_ip, const char *scope)
+{
+    /** FNV-1a, then a final avalanche (splitmix64) so linear probing spreads well */
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = client_ip; p && *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    if (scope)
+    {
+        h ^= '|';
+        h *= 1099511628211ULL;
+        for (const char *p = scope; *p; p++)
+        {
+            h ^= (unsigned char)*p;
+            h *= 1099511628211ULL;
+        }
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h ? h : 1;
+}
+
+/**
+ * Locate the slot of a key, claiming an empty one or evicting the stalest
+ * one in the probe window if the key is not present yet.
+ *
+ * @param fresh Set to true when the slot was just (re)assigned to key.
+ */
+static rate_slot_t *find_slot(uint64_t key, uint32_t now, bool *fresh)
+{
+    size_t mask = RATE_LIMIT_TABLE_SIZE - 1;
+    size_t start = (size_t)key & mask;
+
+    for (;;)
+    {
+        rate_slot_t *victim = NULL;
+        uint32_t victim_age = 0;
+
+        for (size_t i = 0; i < RATE_LIMIT_PROBE_LIMIT; i++)
+        {
+            rate_slot_t *slot = &table[(start + i) & mask];
+            uint64_t k = atomic_load_explicit(&slot->key, memory_order_acquire);
+
+            if (k == key)
+            {
+                *fresh = false;
+                return slot;
+            }
+
+            if (k == 0)
+            {
+                uint64_t expected = 0;
+                if (atomic_compare_exchange_strong_explicit(&slot->key, &expected, key,
+                                                            memory_order_acq_rel, memory_order_acquire))
+                {
+                    *fresh = true;
+                    return slot;
+                }
+                /** Lost the race: maybe another thread inserted this very key */
+                if (expected == key)
+                {
+                    *fresh = false;
+                    return slot;
+                }
+                continue;
+            }
+
+            uint32_t age = now - state_stamp(atomic_load_explicit(&slot->state, memory_order_relaxed));
+            if (!victim || age > victim_age)
+            {
+                victim = slot;
+                victim_age = age;
+            }
+        }
+
+        /**
+         * Every probe lost its empty slot to another key: no candidate yet.
+         * Those slots are taken now, so the next scan sees them as victims.
+         */
+        if (!victim)
+            continue;
+
+        /** Window full of other clients → take over the least recently used one */
+        uint64_t old_key = atomic_load_explicit(&victim->key, memory_order_acquire);
+        if (old_key != 0 && old_key != key &&
+            atomic_compare_exchange_strong_explicit(&victim->key, &old_key, key,
+                                                    memory_order_acq_rel, memory_order_acquire))
+        {
+            *fresh = true;
+            return victim;
+        }
+        /** Someone changed the window under us, rescan */
+    }
+}
+
+bool rate_limiter_allow(uint64_t key, double rate, int burst)
+{
+    if (!table)
+        return true;
+
+    uint32_t now = now_ms32();
+    uint64_t capacity = (uint64_t)burst * TOKEN_SCALE;
+    bool fresh = false;
+
+    rate_slot_t *slot = find_slot(key, now, &fresh);
+
+    if (fresh)
+    {
+        /** New (or evicted-and-reused) bucket: start full, minus this request */
+        atomic_store_explicit(&slot->state, pack_state(capacity - TOKEN_SCALE, now), memory_order_release);
+        return true;
+    }
+
+    uint64_t old_state = atomic_load_explicit(&slot->state, memory_order_acquire);
+    for (;;)
+    {
+        uint32_t elapsed = now - state_stamp(old_state);
+
+        /** Another thread may have stamped a slightly later "now" than ours */
+        if (elapsed > (1U << 31))
+            elapsed = 0;
+
+        uint64_t tokens = state_tokens(old_state) + (uint64_t)(elapsed * rate);
+        if (tokens > capacity)
+            tokens = capacity;
+
+        bool allowed = tokens >= TOKEN_SCALE;
+        if (allowed)
+            tokens -= TOKEN_SCALE;
+
+        /**
+         * Only move the stamp forward when it produced at least one whole
+         * milli-token; otherwise frequent callers would keep resetting the
+         * clock and the bucket would never refill at low rates.
+         */
+        uint32_t stamp = (elapsed * rate >= 1.0) ? now : state_stamp(old_state);
+        uint64_t new_state = pack_state(tokens, stamp);
+
+        if (atomic_compare_exchange_weak_explicit(&slot->state, &old_state, new_state,
+                                                  memory_order_acq_rel, memory_order_acquire))
+        {
+            return allowed;
+        }
+
+        /** Slot was taken over by another client meanwhile → treat as fresh */
+        if (atomic_load_explicit(&slot->key, memory_order_acquire) != key)
+            return true;
+    }
+}
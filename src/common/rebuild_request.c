@@ -1,11 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <arpa/inet.h>
 #include "common/rebuild_request.h"
 #include "common/error_handler.h"
 
-ssize_t rebuild_request(HttpRequest *req, char *buffer, char *client_ip, size_t buffer_size)
+ssize_t rebuild_request(HttpRequest *req, char *buffer, const char *client_ip, size_t buffer_size)
 {
     // validate input parameter
     if (!req || !buffer || buffer_size == 0)
@@ -45,6 +46,10 @@ ssize_t rebuild_request(HttpRequest *req, char *buffer, char *client_ip, size_t
     // Adding all headers
     for (int i = 0; i < req->header_count; i++)
     {
+        // The body's Content-Length is added below; a second copy makes strict parsers reject the request
+        if (req->body && req->body_length && strcasecmp(req->Headers[i].key, "Content-Length") == 0)
+            continue;
+
         written = snprintf(buffer + write_pos, buffer_size - write_pos, "%s: %s\r\n", req->Headers[i].key, req->Headers[i].value);
         if (written < 0 || (size_t)written >= buffer_size - write_pos)
         {
@@ -136,7 +141,7 @@ ssize_t rebuild_request(HttpRequest *req, char *buffer, char *client_ip, size_t
 
 int get_client_ip(int client_fd, char *ip_buffer, size_t buffer_size)
 {
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addr_len = sizeof(addr);
 
     // Fill addr with actual client address info
@@ -148,15 +153,32 @@ int get_client_ip(int client_fd, char *ip_buffer, size_t buffer_size)
         ip_buffer[buffer_size - 1] = '\0';
         return -1;
     }
-    const char *ip = inet_ntoa(addr.sin_addr);
+    return format_client_ip((struct sockaddr *)&addr, addr_len, ip_buffer, buffer_size);
+}
+
+int format_client_ip(const struct sockaddr *addr, socklen_t addr_len, char *ip_buffer, size_t buffer_size)
+{
+    const char *ip = NULL;
+
+    // inet_ntop writes into our buffer (inet_ntoa shares one static buffer between threads)
+    if (addr->sa_family == AF_INET && addr_len >= sizeof(struct sockaddr_in))
+    {
+        ip = inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, ip_buffer, buffer_size);
+    }
+    else if (addr->sa_family == AF_INET6 && addr_len >= sizeof(struct sockaddr_in6))
+    {
+        const struct in6_addr *a6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a6))
+            ip = inet_ntop(AF_INET, &a6->s6_addr[12], ip_buffer, buffer_size);
+        else
+            ip = inet_ntop(AF_INET6, a6, ip_buffer, buffer_size);
+    }
     if (!ip)
     {
-        log_error("get_client_ip: inet_ntoa returned NULL for fd=%d", client_fd);
+        log_error("format_client_ip: no IP address (family %d)", addr->sa_family);
         strncpy(ip_buffer, "127.0.0.1", buffer_size - 1);
         ip_buffer[buffer_size - 1] = '\0';
         return -1;
     }
-    strncpy(ip_buffer, ip, buffer_size - 1);
-    ip_buffer[buffer_size - 1] = '\0';
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "common/request_parser.h"
 #include "common/error_handler.h"
 #include "common/debug.h"
@@ -51,8 +52,11 @@ int parse_http_request(char *buffer, HttpRequest *req)
     /**
      * strtok modifies the original string by inserting '\0' at the delimiter positions
      * returns a char*, this points to the start of the token it just found.
+     * strtok_r keeps its position in saveptr instead of a hidden static, so
+     * threads (v3-threaded) can parse requests at the same time.
      */
-    char *line = strtok(parseCopy, "\r\n");
+    char *saveptr;
+    char *line = strtok_r(parseCopy, "\r\n", &saveptr);
     if (!line)
     {
         log_error("Request line is missing");
@@ -69,9 +73,9 @@ int parse_http_request(char *buffer, HttpRequest *req)
         free(bufferCopy);
         return -1;
     }
-    char *method = strtok(request_line, " "); // Parse methode
-    char *path = strtok(NULL, " ");           // Parse Path version
-    char *version = strtok(NULL, " ");        // Parse HTTP version
+    char *method = strtok_r(request_line, " ", &saveptr); // Parse methode
+    char *path = strtok_r(NULL, " ", &saveptr);           // Parse Path version
+    char *version = strtok_r(NULL, " ", &saveptr);        // Parse HTTP version
     if (!method || !path || !version)
     {
         log_error("parse_http_request: Malformed request line: '%s'", line);
@@ -97,7 +101,7 @@ int parse_http_request(char *buffer, HttpRequest *req)
 
     // Header parser
 
-    line = strtok(bufferCopy, "\r\n"); // skip request line in bufferCopy
+    line = strtok_r(bufferCopy, "\r\n", &saveptr); // skip request line in bufferCopy
     if (!line)
     {
         log_error("Header parsing failed: no lines found");
@@ -106,7 +110,7 @@ int parse_http_request(char *buffer, HttpRequest *req)
         free(parseCopy);
         return -1;
     }
-    while ((line = strtok(NULL, "\r\n")) && *line != '\0')
+    while ((line = strtok_r(NULL, "\r\n", &saveptr)) && *line != '\0')
     {
         if (strlen(line) == 0)
         {
@@ -230,4 +234,14 @@ void free_http_request(HttpRequest *req)
         req->body = NULL;
     }
     req->body_length = 0;
-}
\ No newline at end of file
+}
+
+const char *get_request_header(const HttpRequest *req, const char *name)
+{
+    for (int i = 0; i < req->header_count; i++)
+    {
+        if (strcasecmp(req->Headers[i].key, name) == 0)
+            return req->Headers[i].value;
+    }
+    return NULL;
+}
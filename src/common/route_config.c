@@ -2,10 +2,88 @@
 #include <stdlib.h>
 #include <string.h>
 #include "common/route_config.h"
+#include "common/rate_limiter.h"
 #include "common/error_handler.h"
 
 #define MAX_LINE_LEN 256
 
+/**
+ * Apply one "key=value" setting from a route line.
+ * Returns 0 if the option was understood, -1 otherwise.
+ */
+static int parse_route_option(Route *route, const char *key, const char *value)
+{
+    if (strcmp(key, "ratelimit") == 0)
+    {
+        // "RPS" or "RPS:BURST" - burst defaults to one second worth of requests
+        double rps = 0;
+        int burst = 0;
+        int n = sscanf(value, "%lf:%d", &rps, &burst);
+        if (n < 1 || rps <= 0)
+            return -1;
+        if (n == 1 || burst <= 0)
+            burst = rps < 1 ? 1 : rps > RATE_LIMIT_BURST_MAX ? RATE_LIMIT_BURST_MAX : (int)rps;
+        if (burst > RATE_LIMIT_BURST_MAX)
+        {
+            log_error("ratelimit burst %d clamped to %d", burst, RATE_LIMIT_BURST_MAX);
+            burst = RATE_LIMIT_BURST_MAX;
+        }
+        route->ratelimit_rps = rps;
+        route->ratelimit_burst = burst;
+        return 0;
+    }
+    if (strcmp(key, "ratelimit_scope") == 0)
+    {
+        if (strcmp(value, "ip") == 0)
+            route->ratelimit_per_route = false;
+        else if (strcmp(value, "route") == 0)
+            route->ratelimit_per_route = true;
+        else
+            return -1;
+        return 0;
+    }
+    if (strcmp(key, "cache") == 0)
+    {
+        if (strcmp(value, "on") == 0)
+            route->cache_disabled = false;
+        else if (strcmp(value, "off") == 0)
+            route->cache_disabled = true;
+        else
+            return -1;
+        return 0;
+    }
+    if (strcmp(key, "compress") == 0)
+    {
+        if (strcmp(value, "on") == 0)
+            route->compress = true;
+        else if (strcmp(value, "off") == 0)
+            route->compress = false;
+        else
+            return -1;
+        return 0;
+    }
+    if (strcmp(key, "compress_min") == 0)
+    {
+        char *end;
+        long bytes = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || bytes < 0)
+            return -1;
+        route->compress_min_bytes = bytes;
+        return 0;
+    }
+    if (strcmp(key, "proto") == 0)
+    {
+        if (strcmp(value, "h2c") == 0)
+            route->h2c = true;
+        else if (strcmp(value, "http1") == 0)
+            route->h2c = false;
+        else
+            return -1;
+        return 0;
+    }
+    return -1;
+}
+
 int load_routes(const char *filename, Route *routes, int max_routes)
 {
     if (!filename || !routes || max_routes <= 0)
@@ -22,11 +100,19 @@ int load_routes(const char *filename, Route *routes, int max_routes)
     }
 
     int count = 0;
-    char line[MAX_PREFIX_LEN];
+    int line_no = 0;
+
+    /**
+     * Must hold a full line. With a 32 byte buffer fgets() silently split
+     * longer lines and the tail was parsed as a separate (broken) route.
+     */
+    char line[MAX_LINE_LEN];
 
     //  Read file line by line until end of file or max_routes reached
     while (fgets(line, sizeof(line), file) && count < max_routes)
     {
+        line_no++;
+
         // Remove newline character because fgets keeps newline
         size_t len = strlen(line);
         if (len > 0 && line[len - 1] == '\n')
@@ -44,8 +130,9 @@ int load_routes(const char *filename, Route *routes, int max_routes)
 
         // Temporary buffers for parse fields prefix, host, port
         char prefix[32];
-        char host[64];
+        char host[MAX_HOST_LEN];
         int port;
+        int consumed = 0;
 
         /*
             The sscanf() function in C is a standard library function used for reading formatted input from a string.
@@ -53,8 +140,25 @@ int load_routes(const char *filename, Route *routes, int max_routes)
             it reads from a specified character array(string)
         */
 
-        // Expect format: "/api example.com 8080"
-        int parts = sscanf(line, "%s %s %d", prefix, host, &port);
+        char static_path[MAX_STATIC_PATH_LEN];
+        static_path[0] = '\0';
+
+        // Expect format: "/api example.com 8080 [key=value ...]", "/api unix:/run/app.sock [key=value ...]"
+        // or "/assets/ static /srv/assets/ [key=value ...]"
+        int parts = sscanf(line, "%31s %111s %d %n", prefix, host, &port, &consumed);
+        if (parts == 2 && strcmp(host, "static") == 0 &&
+            sscanf(line, "%31s %*s %255s %n", prefix, static_path, &consumed) == 2)
+        {
+            port = 0;
+            parts = 3;
+        }
+        else if (parts == 2 && strncmp(host, "unix:", 5) == 0 && host[5] != '\0')
+        {
+            // Unix domain socket upstream, no port
+            sscanf(line, "%*s %*s %n", &consumed);
+            port = 0;
+            parts = 3;
+        }
         if (parts != 3)
         {
             // If the line doesn't match format, warn and skip
@@ -73,6 +177,25 @@ int load_routes(const char *filename, Route *routes, int max_routes)
 
         routes[count].port = port;
 
+        strncpy(routes[count].static_path, static_path, sizeof(routes[count].static_path) - 1);
+
+        // Remaining tokens are optional key=value settings
+        char *saveptr = NULL;
+        for (char *tok = strtok_r(line + consumed, " \t", &saveptr); tok; tok = strtok_r(NULL, " \t", &saveptr))
+        {
+            char *eq = strchr(tok, '=');
+            if (!eq)
+            {
+                log_error("routes %s:%d: option '%s' is not key=value, ignored", filename, line_no, tok);
+                continue;
+            }
+            *eq = '\0';
+            if (parse_route_option(&routes[count], tok, eq + 1) != 0)
+            {
+                log_error("routes %s:%d: invalid option %s=%s, ignored", filename, line_no, tok, eq + 1);
+            }
+        }
+
         count++;
     }
 
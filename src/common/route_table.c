@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/inotify.h>
+#include "common/route_table.h"
+#include "common/error_handler.h"
+#include "common/debug.h"
+
+static _Atomic(route_table_t *) current_table = NULL;
+
+/**
+ * Epoch state. A reader slot holds the global epoch while the reader is
+ * between "load current_table" and "increment refs", 0 otherwise.
+ */
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic uint64_t reader_epochs[ROUTE_TABLE_MAX_READERS];
+static _Atomic int reader_slots_used = 0;
+static __thread int reader_slot = -1;
+
+/** Only touched by the reloader thread */
+static route_table_t *retired_head = NULL;
+static uint64_t next_generation = 1;
+
+static route_table_t *build_table(const char *filename)
+{
+    route_table_t *table = calloc(1, sizeof(route_table_t));
+    if (!table)
+    {
+        log_errno("route_table: Failed to allocate table");
+        return NULL;
+    }
+
+    table->count = load_routes(filename, table->routes, MAX_ROUTES);
+    if (table->count <= 0)
+    {
+        free(table);
+        return NULL;
+    }
+
+    table->generation = next_generation++;
+    atomic_init(&table->refs, 1); /** the reference owned by current_table */
+    return table;
+}
+
+int route_table_init(const char *filename)
+{
+    route_table_t *table = build_table(filename);
+    if (!table)
+        return -1;
+
+    atomic_store(&current_table, table);
+    return table->count;
+}
+
+route_table_t *route_table_acquire(void)
+{
+    if (reader_slot < 0)
+    {
+        int slot = atomic_fetch_add(&reader_slots_used, 1);
+        if (slot >= ROUTE_TABLE_MAX_READERS)
+        {
+            log_error("route_table_acquire: more than %d reader threads", ROUTE_TABLE_MAX_READERS);
+            abort();
+        }
+        reader_slot = slot;
+    }
+
+    /** Enter the epoch critical section, pin the table, leave again */
+    atomic_store(&reader_epochs[reader_slot], atomic_load(&global_epoch));
+    route_table_t *table = atomic_load(&current_table);
+    atomic_fetch_add(&table->refs, 1);
+    atomic_store(&reader_epochs[reader_slot], 0);
+
+    return table;
+}
+
+void route_table_release(route_table_t *table)
+{
+    if (!table)
+        return;
+
+    /**
+     * The current table never reaches zero (current_table owns a reference),
+     * so hitting zero means it is retired. Freeing is left to the reloader,
+     * which also checks the epoch grace period.
+     */
+    atomic_fetch_sub(&table->refs, 1);
+}
+
+/** True if some reader might still be about to take a reference to a table retired at `epoch` */
+static bool reader_in_epoch(uint64_t epoch)
+{
+    int used = atomic_load(&reader_slots_used);
+    if (used > ROUTE_TABLE_MAX_READERS)
+        used = ROUTE_TABLE_MAX_READERS;
+
+    for (int i = 0; i < used; i++)
+    {
+        uint64_t e = atomic_load(&reader_epochs[i]);
+        if (e != 0 && e <= epoch)
+            return true;
+    }
+    return false;
+}
+
+static void reclaim_retired(void)
+{
+    route_table_t **link = &retired_head;
+    while (*link)
+    {
+        route_table_t *table = *link;
+
+        /** Order matters: first make sure no reader can still grab it, then check refs */
+        if (!reader_in_epoch(table->retire_epoch) && atomic_load(&table->refs) == 0)
+        {
+            *link = table->next_retired;
+            DEBUG_PRINT("route_table: freed generation %llu", (unsigned long long)table->generation);
+            free(table);
+            continue;
+        }
+        link = &table->next_retired;
+    }
+}
+
+static void reload(const char *filename)
+{
+    route_table_t *table = build_table(filename);
+    if (!table)
+    {
+        log_error("route_table: reload of %s failed, keeping current routes", filename);
+        return;
+    }
+
+    route_table_t *old = atomic_exchange(&current_table, table);
+    old->retire_epoch = atomic_fetch_add(&global_epoch, 1);
+    old->next_retired = retired_head;
+    retired_head = old;
+    route_table_release(old); /** drop the current_table reference */
+
+    printf("Reloaded %d routes from %s (generation %llu)\n",
+           table->count, filename, (unsigned long long)table->generation);
+    fflush(stdout);
+
+    reclaim_retired();
+}
+
+typedef struct
+{
+    char path[PATH_MAX];
+    char name[NAME_MAX + 1];
+    int signal_fd;
+    int inotify_fd;
+} reloader_t;
+
+static void *reloader_main(void *arg)
+{
+    reloader_t *r = arg;
+    struct pollfd fds[2] = {
+        {.fd = r->signal_fd, .events = POLLIN},
+        {.fd = r->inotify_fd, .events = POLLIN},
+    };
+
+    while (1)
+    {
+        /** While old generations are still pinned by connections, check back every second */
+        int ready = poll(fds, r->inotify_fd >= 0 ? 2 : 1, retired_head ? 1000 : -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_errno("route_table: poll failed, hot reload disabled");
+            return NULL;
+        }
+
+        bool changed = false;
+
+        if (fds[0].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            while (read(r->signal_fd, &info, sizeof(info)) == sizeof(info))
+                changed = true;
+        }
+
+        if (r->inotify_fd >= 0 && (fds[1].revents & POLLIN))
+        {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len;
+            while ((len = read(r->inotify_fd, events, sizeof(events))) > 0)
+            {
+                for (char *p = events; p < events + len;)
+                {
+                    struct inotify_event *ev = (struct inotify_event *)p;
+                    if (ev->len && strcmp(ev->name, r->name) == 0)
+                        changed = true;
+                    p += sizeof(struct inotify_event) + ev->len;
+                }
+            }
+        }
+
+        if (changed)
+            reload(r->path);
+
+        reclaim_retired();
+    }
+    return NULL;
+}
+
+int route_table_start_reloader(const char *filename)
+{
+    static reloader_t reloader;
+
+    strncpy(reloader.path, filename, sizeof(reloader.path) - 1);
+
+    /** basename/dirname may modify their argument */
+    char copy[PATH_MAX];
+    strncpy(copy, filename, sizeof(copy) - 1);
+    strncpy(reloader.name, basename(copy), sizeof(reloader.name) - 1);
+    strncpy(copy, filename, sizeof(copy) - 1);
+    char *dir = dirname(copy);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    reloader.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (reloader.signal_fd < 0)
+    {
+        log_errno("route_table: signalfd failed");
+        return -1;
+    }
+
+    /**
+     * Watch the directory, not the file: editors and config management
+     * usually write a temp file and rename() it over routes.conf, which
+     * would silently end a watch on the old inode.
+     */
+    reloader.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (reloader.inotify_fd < 0 ||
+        inotify_add_watch(reloader.inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        log_errno("route_table: inotify unavailable for %s, reload only on SIGHUP", dir);
+        if (reloader.inotify_fd >= 0)
+            close(reloader.inotify_fd);
+        reloader.inotify_fd = -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, reloader_main, &reloader) != 0)
+    {
+        log_error("route_table: failed to start reloader thread");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
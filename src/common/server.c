@@ -1,21 +1,30 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
 #include "common/server.h"
 #include "common/error_handler.h"
 #include "common/debug.h"
 
-int setup_server(int port)
+/** setup_server() and setup_server_reuseport() */
+static int open_listener(int port, bool reuseport)
 {
     int server_id;
-    struct sockaddr_in address;
 
-    // creating a socket
+    // creating a socket, IPv6 (which also takes IPv4) unless the kernel has no IPv6
 
-    server_id = socket(AF_INET, SOCK_STREAM, 0);
+    bool ipv6 = true;
+    server_id = socket(AF_INET6, SOCK_STREAM, 0);
+    if (server_id < 0 && errno == EAFNOSUPPORT)
+    {
+        ipv6 = false;
+        server_id = socket(AF_INET, SOCK_STREAM, 0);
+    }
     if (server_id < 0)
     {
         log_errno("Socket creation failed");
@@ -30,18 +39,42 @@ int setup_server(int port)
         close(server_id);
         return -1;
     }
+    if (reuseport && setsockopt(server_id, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    {
+        log_errno("setsockopt SO_REUSEPORT failed");
+        close(server_id);
+        return -1;
+    }
 
     // initalizing memory for address variable
 
+    struct sockaddr_in address;
+    struct sockaddr_in6 address6;
     memset(&address, 0, sizeof(address));
+    memset(&address6, 0, sizeof(address6));
 
     // intialize address structer
 
     address.sin_family = AF_INET;
     address.sin_port = htons(port);
     address.sin_addr.s_addr = INADDR_ANY;
+
+    // [::] with V6ONLY off accepts both families (the default depends on net.ipv6.bindv6only)
+    int v6only = 0;
+    address6.sin6_family = AF_INET6;
+    address6.sin6_port = htons(port);
+    address6.sin6_addr = in6addr_any;
+    if (ipv6 && setsockopt(server_id, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0)
+    {
+        log_errno("setsockopt IPV6_V6ONLY failed");
+        close(server_id);
+        return -1;
+    }
+
     // despit define address as specific structure struct sockaddr_in for IPv4 address, bind fucntion expect to work with multiple protocols, they work with the generic struct sockaddr type.thats why type casted in bind function
-    if (bind(server_id, (struct sockaddr *)&address, sizeof(address)) < 0)
+    int bound = ipv6 ? bind(server_id, (struct sockaddr *)&address6, sizeof(address6))
+                     : bind(server_id, (struct sockaddr *)&address, sizeof(address));
+    if (bound < 0)
     {
         log_errno("Bind failed on port %d", port);
         close(server_id);
@@ -103,9 +136,36 @@ int setup_server(int port)
     return server_id;
 }
 
+int configure_listener(int server_id, int defer_accept_s, int fastopen_qlen)
+{
+    if (defer_accept_s > 0 &&
+        setsockopt(server_id, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept_s, sizeof(defer_accept_s)) < 0)
+    {
+        log_errno("setsockopt TCP_DEFER_ACCEPT failed");
+        return -1;
+    }
+    if (fastopen_qlen > 0 &&
+        setsockopt(server_id, IPPROTO_TCP, TCP_FASTOPEN, &fastopen_qlen, sizeof(fastopen_qlen)) < 0)
+    {
+        log_errno("setsockopt TCP_FASTOPEN failed");
+        return -1;
+    }
+    return 0;
+}
+
+int setup_server(int port)
+{
+    return open_listener(port, false);
+}
+
+int setup_server_reuseport(int port)
+{
+    return open_listener(port, true);
+}
+
 int accept_client(int server_id)
 {
-    struct sockaddr_in client_addr;
+    struct sockaddr_storage client_addr;
     socklen_t len = sizeof(client_addr);
     int client_id = accept(server_id, (struct sockaddr *)&client_addr, (socklen_t *)&len);
     if (client_id < 0)
@@ -115,13 +175,34 @@ int accept_client(int server_id)
         {
             return -1; //"No connection available" - not an error
         }
+        // keep errno intact for the caller (e.g. EMFILE handling), logging may clobber it
+        int saved_errno = errno;
         log_errno("accept failed");
+        errno = saved_errno;
         return -2; //other erros
     }
     else
     {
-        DEBUG_PRINT("Connection from %s:%d\n",
-               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        DEBUG_PRINT("Connection accepted: fd=%d\n", client_id);
+    }
+    return client_id;
+}
+
+int accept_client_nb(int server_id, struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+    /** One syscall instead of accept() + fcntl(F_GETFL) + fcntl(F_SETFL) + getpeername() */
+    int client_id = accept4(server_id, (struct sockaddr *)addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_id < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            return -1; //"No connection available" - not an error
+        }
+        // keep errno intact for the caller (e.g. EMFILE handling), logging may clobber it
+        int saved_errno = errno;
+        log_errno("accept4 failed");
+        errno = saved_errno;
+        return -2; //other erros
     }
     return client_id;
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <signal.h>
 #include <errno.h>
+#include <netinet/in.h>
 #include "common/server.h"
 #include "common/request_parser.h"
 #include "common/proxy.h"
@@ -141,6 +142,22 @@ int main()
             goto cleanup;
         }
 
+        if (backend->static_path[0])
+        {
+            log_error("Static route %s is only served by v2-epoll", backend->prefix);
+            send_http_error(client_id, 404, "Not Found");
+            goto cleanup;
+        }
+
+        /** connect_to_target() only speaks HTTP/1.1 over TCP */
+        if (strncmp(backend->host, "unix:", 5) == 0 || backend->h2c)
+        {
+            log_error("Route %s (%s%s) is only served by v2-epoll", backend->prefix, backend->host,
+                      backend->h2c ? " proto=h2c" : "");
+            send_http_error(client_id, 502, "Bad Gateway");
+            goto cleanup;
+        }
+
         DEBUG_PRINT("Routing to backend: %s:%d for prefix: %s\n", backend->host, backend->port, backend->prefix);
 
         targetfd = connect_to_target(backend->host, backend->port);
@@ -153,7 +170,7 @@ int main()
         }
 
         // Get client IP
-        char client_ip[16];
+        char client_ip[INET6_ADDRSTRLEN];
 
         get_client_ip(client_id, client_ip, sizeof(client_ip));
 
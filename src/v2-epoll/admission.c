@@ -0,0 +1,187 @@
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <v2-epoll/admission.h>
+#include <v2-epoll/epoll_server.h>
+#include <v2-epoll/clock.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+static int spare_fd = -1;
+
+/** CoDel state */
+static uint64_t prev_wait_end_us = 0; /**< End of the previous epoll_wait = start of the busy period */
+static uint64_t first_above_us = 0;   /**< When sojourn above target becomes "persistent" (0 = below target) */
+static bool dropping = false;
+static uint32_t drop_count = 0;      /**< Drops in the current dropping state (drives the control law) */
+static uint32_t last_drop_count = 0; /**< drop_count when the previous dropping state ended */
+static uint64_t drop_next_us = 0;    /**< Earliest time for the next drop */
+
+/** Listener pause */
+static bool listener_paused = false;
+static uint64_t resume_us = 0;
+
+/**
+ * Answer a freshly accepted connection with a canned 503 and close it.
+ *
+ * The request is usually already sitting in the receive buffer. Closing a
+ * socket with unread data makes the kernel send RST instead of FIN, and the
+ * client then sees "connection reset" instead of our 503, so read it away
+ * first (one non-blocking recv, the request itself is ignored).
+ */
+static void reject_connection(int fd)
+{
+    char scratch[2048];
+    (void)recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT);
+    send_canned_response(fd, CANNED_503_SERVICE_UNAVAILABLE);
+    close(fd);
+}
+
+int admission_init(void)
+{
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (spare_fd < 0)
+    {
+        log_errno("admission_init: Failed to reserve spare fd");
+        return -1;
+    }
+    return 0;
+}
+
+void admission_observe_wait(uint64_t wait_start_us, uint64_t wait_end_us, int nfds)
+{
+    uint64_t sojourn_us = 0;
+
+    /** epoll_wait returned without sleeping → events were queued behind the last batch */
+    if (nfds > 0 && prev_wait_end_us && wait_end_us - wait_start_us < 1000)
+    {
+        sojourn_us = wait_start_us - prev_wait_end_us;
+    }
+    prev_wait_end_us = wait_end_us;
+
+    uint64_t now = wait_end_us;
+
+    if (sojourn_us < ADMISSION_TARGET_US)
+    {
+        first_above_us = 0;
+        if (dropping)
+        {
+            DEBUG_PRINT("admission: loop recovered after %u drops", drop_count);
+            dropping = false;
+            last_drop_count = drop_count;
+        }
+        return;
+    }
+
+    if (first_above_us == 0)
+    {
+        first_above_us = now + ADMISSION_INTERVAL_US;
+        return;
+    }
+
+    if (!dropping && now >= first_above_us)
+    {
+        /**
+         * Re-entering the dropping state shortly after leaving it means the
+         * overload never really went away: continue near the previous drop
+         * rate instead of starting gently again (RFC 8289 section 5.5).
+         */
+        uint32_t delta = drop_count - last_drop_count;
+        if (delta > 1 && now - drop_next_us < 16 * ADMISSION_INTERVAL_US)
+            drop_count = delta;
+        else
+            drop_count = 0;
+
+        dropping = true;
+        drop_next_us = now;
+        log_error("admission: event loop overloaded (queueing delay %lluus), shedding new connections",
+                  (unsigned long long)sojourn_us);
+    }
+}
+
+bool admission_should_shed(void)
+{
+    return dropping && clock_now_us() >= drop_next_us;
+}
+
+int admission_shed(int epoll_fd, int listen_fd)
+{
+    int shed = 0;
+
+    while (shed < ADMISSION_SHED_BATCH)
+    {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EMFILE || errno == ENFILE)
+                admission_shed_emfile(listen_fd);
+            break;
+        }
+        reject_connection(fd);
+        shed++;
+    }
+
+    /** CoDel control law: next drop after interval / sqrt(count) */
+    drop_count++;
+    uint64_t now = clock_now_us();
+    drop_next_us = now + (uint64_t)(ADMISSION_INTERVAL_US / sqrt((double)drop_count));
+
+    if (epoll_server_delete(epoll_fd, listen_fd) == 0)
+    {
+        listener_paused = true;
+        resume_us = drop_next_us;
+    }
+
+    DEBUG_PRINT("admission: shed %d connections, listener paused for %lluus (drop #%u)",
+                shed, (unsigned long long)(drop_next_us - now), drop_count);
+    return shed;
+}
+
+void admission_resume_listener(int epoll_fd, int listen_fd, struct epoll_event *event)
+{
+    if (!listener_paused || clock_now_us() < resume_us)
+        return;
+
+    if (epoll_server_add(epoll_fd, listen_fd, event) == 0)
+    {
+        listener_paused = false;
+    }
+}
+
+void admission_shed_emfile(int listen_fd)
+{
+    if (spare_fd < 0)
+        return;
+
+    close(spare_fd);
+    spare_fd = -1;
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd >= 0)
+    {
+        reject_connection(fd);
+    }
+
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (spare_fd < 0)
+    {
+        log_errno("admission_shed_emfile: Failed to re-reserve spare fd");
+    }
+}
+
+int admission_next_timeout(void)
+{
+    if (!listener_paused)
+        return -1;
+
+    uint64_t now = clock_now_us();
+    if (now >= resume_us)
+        return 0;
+
+    /** Round up so we never wake up a little too early and spin */
+    return (int)((resume_us - now + 999) / 1000);
+}
@@ -106,6 +106,26 @@ int buffer_ensure_space(buffer_t *buf, size_t needed)
     return 0;
 }
 
+void buffer_compact(buffer_t *buf)
+{
+    if (buf->offset == 0)
+        return;
+
+    memmove(buf->data, buf->data + buf->offset, buf->len - buf->offset);
+    buf->len -= buf->offset;
+    buf->offset = 0;
+}
+
+int buffer_append(buffer_t *buf, const void *data, size_t len)
+{
+    if (buffer_ensure_space(buf, len) != 0)
+        return -1;
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
 size_t buffer_available_space(const buffer_t *buf)
 {
     if (buf->size > buf->len)
@@ -105,9 +105,9 @@ ssize_t buffer_write_to_fd(buffer_t *buf, int fd)
         ssize_t sent = send(fd, read_ptr, data_to_send, 0);
         if (sent < 0)
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)
             {
-                /** Kernel send buffer is full → wait for EPOLLOUT*/
+                /** Kernel send buffer is full (or a Fast Open SYN without a cookie is out) → wait for EPOLLOUT*/
                 return total_bytes_sent > 0 ? total_bytes_sent : 0;
             }
             else if (errno == EINTR)
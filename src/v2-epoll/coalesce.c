@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <v2-epoll/coalesce.h>
+#include <v2-epoll/connection.h>
+#include <common/http_cache.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+static flight_t *table[COALESCE_TABLE_SIZE];
+
+/** Followers waiting for a head, oldest first (one timeout → deadlines are ordered) */
+static connection_t *wait_head = NULL;
+static connection_t *wait_tail = NULL;
+
+/** Followers the event loop has to look at */
+static connection_t *pend_head = NULL;
+static connection_t *pend_tail = NULL;
+
+static uint64_t hash_key(const char *key)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = key; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* ---------------- Intrusive lists ---------------- */
+
+static void wait_push(connection_t *conn)
+{
+    coalesce_member_t *m = &conn->coalesce;
+    m->wait_prev = wait_tail;
+    m->wait_next = NULL;
+    if (wait_tail)
+        wait_tail->coalesce.wait_next = conn;
+    else
+        wait_head = conn;
+    wait_tail = conn;
+}
+
+static void wait_remove(connection_t *conn)
+{
+    coalesce_member_t *m = &conn->coalesce;
+    if (!m->wait_prev && wait_head != conn)
+        return; /** not waiting */
+
+    if (m->wait_prev)
+        m->wait_prev->coalesce.wait_next = m->wait_next;
+    else
+        wait_head = m->wait_next;
+    if (m->wait_next)
+        m->wait_next->coalesce.wait_prev = m->wait_prev;
+    else
+        wait_tail = m->wait_prev;
+    m->wait_prev = m->wait_next = NULL;
+}
+
+static void pend_push(connection_t *conn)
+{
+    coalesce_member_t *m = &conn->coalesce;
+    if (m->pending)
+        return;
+
+    m->pending = true;
+    m->pend_prev = pend_tail;
+    m->pend_next = NULL;
+    if (pend_tail)
+        pend_tail->coalesce.pend_next = conn;
+    else
+        pend_head = conn;
+    pend_tail = conn;
+}
+
+static void pend_remove(connection_t *conn)
+{
+    coalesce_member_t *m = &conn->coalesce;
+    if (!m->pending)
+        return;
+
+    if (m->pend_prev)
+        m->pend_prev->coalesce.pend_next = m->pend_next;
+    else
+        pend_head = m->pend_next;
+    if (m->pend_next)
+        m->pend_next->coalesce.pend_prev = m->pend_prev;
+    else
+        pend_tail = m->pend_prev;
+    m->pend_prev = m->pend_next = NULL;
+    m->pending = false;
+}
+
+/* ---------------- Flights ---------------- */
+
+static void table_remove(flight_t *flight)
+{
+    if (!flight->in_table)
+        return;
+
+    flight_t **link = &table[flight->hash % COALESCE_TABLE_SIZE];
+    while (*link && *link != flight)
+        link = &(*link)->hash_next;
+    if (*link)
+        *link = flight->hash_next;
+    flight->in_table = false;
+}
+
+static void flight_put(flight_t *flight)
+{
+    if (--flight->refs > 0)
+        return;
+
+    table_remove(flight);
+    flight_chunk_t *chunk = flight->chunks;
+    while (chunk)
+    {
+        flight_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(flight->key);
+    free(flight);
+}
+
+static int chain_append(flight_t *flight, const char *data, size_t len)
+{
+    if (flight->total_len + len > COALESCE_MAX_BYTES)
+        return -1;
+
+    while (len > 0)
+    {
+        if (!flight->last || flight->last->len == COALESCE_CHUNK_SIZE)
+        {
+            flight_chunk_t *chunk = malloc(sizeof(flight_chunk_t));
+            if (!chunk)
+            {
+                log_errno("coalesce: Failed to allocate chain chunk");
+                return -1;
+            }
+            chunk->next = NULL;
+            chunk->len = 0;
+            if (flight->last)
+                flight->last->next = chunk;
+            else
+                flight->chunks = chunk;
+            flight->last = chunk;
+        }
+
+        size_t n = COALESCE_CHUNK_SIZE - flight->last->len;
+        if (n > len)
+            n = len;
+        memcpy(flight->last->data + flight->last->len, data, n);
+        flight->last->len += n;
+        flight->total_len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/** Detach a follower from its flight and hand it to the event loop */
+static void orphan(connection_t *conn)
+{
+    coalesce_member_t *m = &conn->coalesce;
+    flight_t *flight = m->flight;
+
+    if (m->prev)
+        m->prev->coalesce.next = m->next;
+    else
+        flight->followers = m->next;
+    if (m->next)
+        m->next->coalesce.prev = m->prev;
+    m->prev = m->next = NULL;
+
+    wait_remove(conn);
+    m->flight = NULL;
+    m->parked = false;
+    m->chunk = NULL;
+    flight_put(flight);
+
+    pend_push(conn);
+}
+
+static void orphan_all(flight_t *flight)
+{
+    /** orphan() may drop the last reference, keep one while iterating */
+    flight->refs++;
+    while (flight->followers)
+        orphan(flight->followers);
+    flight_put(flight);
+}
+
+/** Follower and leader agree on every header the response varies on */
+static bool vary_matches(flight_t *flight, connection_t *follower)
+{
+    if (flight->vary[0] == '\0')
+        return true;
+
+    char mine[HTTP_CACHE_MAX_KEY], theirs[HTTP_CACHE_MAX_KEY];
+    if (http_cache_vary_values(&follower->parsed_request, flight->vary, mine, sizeof(mine)) < 0 ||
+        http_cache_vary_values(&flight->leader->parsed_request, flight->vary, theirs, sizeof(theirs)) < 0)
+        return false;
+    return strcmp(mine, theirs) == 0;
+}
+
+static void start_streaming(connection_t *conn)
+{
+    wait_remove(conn);
+    conn->coalesce.parked = false;
+    pend_push(conn);
+}
+
+/**
+ * Once the leader's response head is complete, decide whether it may be
+ * shared. The leader is alive in this state (a leader leaving aborts the
+ * flight), and its response buffer holds the head contiguously.
+ */
+static void evaluate_head(flight_t *flight)
+{
+    if (flight->state != FLIGHT_WAITING_HEAD || !flight->recording)
+        return;
+
+    buffer_t *resp = &flight->leader->response_buffer;
+    if (resp->len == 0 || !memmem(resp->data, resp->len, "\r\n\r\n", 4))
+        return;
+
+    http_cache_policy_t policy;
+    if (http_cache_parse_response(resp->data, resp->len, (int64_t)time(NULL), &policy) != 0 || !policy.cacheable)
+    {
+        DEBUG_PRINT("coalesce: %s not shareable, followers go upstream\n", flight->key);
+        flight->state = FLIGHT_PRIVATE;
+        table_remove(flight);
+        orphan_all(flight);
+        return;
+    }
+
+    flight->state = FLIGHT_SHARING;
+    memcpy(flight->vary, policy.vary, sizeof(flight->vary));
+
+    connection_t *conn = flight->followers;
+    while (conn)
+    {
+        connection_t *next = conn->coalesce.next;
+        if (vary_matches(flight, conn))
+            start_streaming(conn);
+        else
+            orphan(conn);
+        conn = next;
+    }
+}
+
+flight_t *coalesce_find(const char *key)
+{
+    uint64_t hash = hash_key(key);
+    for (flight_t *f = table[hash % COALESCE_TABLE_SIZE]; f; f = f->hash_next)
+    {
+        if (f->hash == hash && strcmp(f->key, key) == 0)
+            return f;
+    }
+    return NULL;
+}
+
+int coalesce_lead(connection_t *leader, const char *key)
+{
+    flight_t *flight = calloc(1, sizeof(flight_t));
+    if (!flight)
+    {
+        log_errno("coalesce_lead: Failed to allocate flight");
+        return -1;
+    }
+    flight->key = strdup(key);
+    if (!flight->key)
+    {
+        free(flight);
+        return -1;
+    }
+
+    flight->hash = hash_key(key);
+    flight->state = FLIGHT_WAITING_HEAD;
+    flight->refs = 1;
+    flight->leader = leader;
+
+    size_t bucket = flight->hash % COALESCE_TABLE_SIZE;
+    flight->hash_next = table[bucket];
+    table[bucket] = flight;
+    flight->in_table = true;
+
+    leader->coalesce.flight = flight;
+    leader->coalesce.leader = true;
+    return 0;
+}
+
+int coalesce_join(flight_t *flight, connection_t *follower, uint64_t now_ms)
+{
+    /** First follower: from now on the leader's bytes are kept for sharing */
+    if (!flight->recording)
+    {
+        buffer_t *resp = &flight->leader->response_buffer;
+        if (chain_append(flight, resp->data, resp->len) != 0)
+            return -1;
+        flight->recording = true;
+        evaluate_head(flight);
+    }
+
+    if (flight->state == FLIGHT_SHARING && !vary_matches(flight, follower))
+        return -1;
+    if (flight->state != FLIGHT_WAITING_HEAD && flight->state != FLIGHT_SHARING)
+        return -1;
+
+    coalesce_member_t *m = &follower->coalesce;
+    m->flight = flight;
+    m->leader = false;
+    m->sent = 0;
+    m->chunk = NULL;
+    m->chunk_off = 0;
+    m->prev = NULL;
+    m->next = flight->followers;
+    if (flight->followers)
+        flight->followers->coalesce.prev = follower;
+    flight->followers = follower;
+    flight->refs++;
+
+    if (flight->state == FLIGHT_SHARING)
+    {
+        start_streaming(follower);
+    }
+    else
+    {
+        m->deadline_ms = now_ms + COALESCE_WAIT_TIMEOUT_MS;
+        wait_push(follower);
+    }
+
+    DEBUG_PRINT("coalesce: client %d follows %s\n", follower->client_fd, flight->key);
+    return 0;
+}
+
+static void wake_parked(flight_t *flight)
+{
+    for (connection_t *c = flight->followers; c; c = c->coalesce.next)
+    {
+        if (c->coalesce.parked)
+        {
+            c->coalesce.parked = false;
+            pend_push(c);
+        }
+    }
+}
+
+void coalesce_leader_data(connection_t *leader, const char *data, size_t len)
+{
+    flight_t *flight = leader->coalesce.flight;
+    if (!flight || !flight->recording)
+        return;
+    if (flight->state != FLIGHT_WAITING_HEAD && flight->state != FLIGHT_SHARING)
+        return;
+
+    if (chain_append(flight, data, len) != 0)
+    {
+        /** Too large to share: whoever has not sent anything yet goes upstream */
+        flight->state = FLIGHT_PRIVATE;
+        table_remove(flight);
+        orphan_all(flight);
+        return;
+    }
+
+    evaluate_head(flight);
+    if (flight->state == FLIGHT_SHARING)
+        wake_parked(flight);
+}
+
+void coalesce_leader_complete(connection_t *leader)
+{
+    flight_t *flight = leader->coalesce.flight;
+    if (!flight)
+        return;
+
+    /** Complete responses are in the response cache now (if cacheable) */
+    table_remove(flight);
+
+    if (flight->recording && flight->state == FLIGHT_WAITING_HEAD)
+    {
+        evaluate_head(flight);
+        if (flight->state == FLIGHT_WAITING_HEAD)
+        {
+            /** EOF without a complete head: nothing to share */
+            flight->state = FLIGHT_PRIVATE;
+            orphan_all(flight);
+        }
+    }
+
+    if (flight->state == FLIGHT_SHARING || flight->state == FLIGHT_WAITING_HEAD)
+    {
+        flight->state = FLIGHT_COMPLETE;
+        wake_parked(flight);
+    }
+}
+
+void coalesce_detach(connection_t *conn)
+{
+    coalesce_member_t *m = &conn->coalesce;
+    pend_remove(conn);
+
+    flight_t *flight = m->flight;
+    if (!flight)
+        return;
+
+    if (!m->leader)
+    {
+        orphan(conn);
+        pend_remove(conn);
+        return;
+    }
+
+    m->flight = NULL;
+    table_remove(flight);
+    if (flight->state == FLIGHT_WAITING_HEAD || flight->state == FLIGHT_SHARING)
+    {
+        DEBUG_PRINT("coalesce: leader of %s failed, %s\n", flight->key,
+                    flight->followers ? "re-routing followers" : "no followers");
+        flight->state = FLIGHT_ABORTED;
+        orphan_all(flight);
+    }
+    flight->leader = NULL;
+    flight_put(flight);
+}
+
+ssize_t coalesce_follower_send(connection_t *follower, int fd)
+{
+    coalesce_member_t *m = &follower->coalesce;
+    flight_t *flight = m->flight;
+
+    if (!m->chunk)
+    {
+        m->chunk = flight->chunks;
+        m->chunk_off = 0;
+    }
+
+    while (m->chunk)
+    {
+        size_t avail = m->chunk->len - m->chunk_off;
+        if (avail == 0)
+        {
+            if (!m->chunk->next)
+                break;
+            m->chunk = m->chunk->next;
+            m->chunk_off = 0;
+            continue;
+        }
+
+        ssize_t n = send(fd, m->chunk->data + m->chunk_off, avail, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EPIPE || errno == ECONNRESET)
+                return -2;
+            log_errno("coalesce_follower_send: send failed on fd %d", fd);
+            return -1;
+        }
+        m->chunk_off += n;
+        m->sent += n;
+    }
+
+    if (flight->state == FLIGHT_COMPLETE && m->sent == flight->total_len)
+        return 1;
+
+    /** Caught up with the leader: wait until coalesce_leader_data() wakes us */
+    m->parked = true;
+    return 0;
+}
+
+void coalesce_expire(uint64_t now_ms)
+{
+    while (wait_head && wait_head->coalesce.deadline_ms <= now_ms)
+    {
+        DEBUG_PRINT("coalesce: client %d gave up waiting for the leader\n", wait_head->client_fd);
+        orphan(wait_head);
+    }
+}
+
+connection_t *coalesce_pop_pending(void)
+{
+    connection_t *conn = pend_head;
+    if (conn)
+        pend_remove(conn);
+    return conn;
+}
+
+int coalesce_next_timeout(uint64_t now_ms)
+{
+    if (pend_head)
+        return 0;
+    if (!wait_head)
+        return -1;
+    if (wait_head->coalesce.deadline_ms <= now_ms)
+        return 0;
+    return (int)(wait_head->coalesce.deadline_ms - now_ms);
+}
@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <zlib.h>
+#include <v2-epoll/compress.h>
+#include <v2-epoll/offload.h>
+#include <common/http_cache.h>
+#include <common/request_parser.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+#define COMPRESS_OUT_STEP 16384 /**< Output room added per deflate() call */
+
+/** Growable byte array owned by one side at a time (swapped on submit) */
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} bytes_t;
+
+/** Chunked transfer coding decoder states */
+typedef enum
+{
+    DECHUNK_SIZE,     /**< Hex chunk size */
+    DECHUNK_EXT,      /**< Chunk extension, up to the LF */
+    DECHUNK_DATA,     /**< Chunk payload */
+    DECHUNK_DATA_END, /**< CRLF after the payload */
+    DECHUNK_TRAILER,  /**< Trailer lines, up to the empty one */
+    DECHUNK_DONE
+} dechunk_state_t;
+
+struct compress_stream
+{
+    struct connection *conn; /**< NULL once released (freed when its job comes back) */
+    z_stream zs;
+    bool zs_ready;
+
+    /* Event loop side */
+    bytes_t pending;         /**< Decoded body bytes waiting for the next job */
+    bool eof;                /**< No input after pending */
+    bool busy;               /**< A job is queued or running */
+    bool final_submitted;
+    bool finished;
+    buffer_t out;            /**< Rewritten head + compressed body */
+
+    bool chunked;
+    dechunk_state_t dechunk;
+    uint64_t chunk_left;     /**< Payload bytes left in the current chunk */
+    size_t line_len;         /**< Length of the current trailer line */
+
+    /* Pool side, while busy */
+    offload_job_t job;
+    bytes_t job_in;
+    bytes_t job_out;
+    bool job_final;
+    bool job_failed;
+
+    struct compress_stream *next; /**< Link in the ready list */
+};
+
+/** Finished jobs, handed out by compress_pop_done() (loop only) */
+static compress_stream_t *ready_head = NULL;
+static compress_stream_t *ready_tail = NULL;
+
+/** Content types worth compressing besides text/... (already compressed formats are not) */
+static const char *compressible_types[] = {
+    "application/javascript",
+    "application/x-javascript",
+    "application/json",
+    "application/ld+json",
+    "application/manifest+json",
+    "application/xml",
+    "application/xhtml+xml",
+    "application/rss+xml",
+    "application/atom+xml",
+    "application/wasm",
+    "application/vnd.ms-fontobject",
+    "image/svg+xml",
+    "image/x-icon",
+    "font/ttf",
+    "font/otf",
+};
+
+static int bytes_reserve(bytes_t *b, size_t extra)
+{
+    if (b->cap - b->len >= extra)
+        return 0;
+    size_t cap = b->cap ? b->cap * 2 : 4096;
+    while (cap - b->len < extra)
+        cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data)
+        return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static int bytes_append(bytes_t *b, const char *data, size_t len)
+{
+    if (bytes_reserve(b, len) != 0)
+        return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+/* ---------------- Offloaded jobs ---------------- */
+
+/**
+ * Compress one job's input into job_out (on a pool thread). Z_SYNC_FLUSH
+ * makes everything fed so far decodable by the client; Z_FINISH writes the
+ * gzip trailer.
+ */
+static void run_job(offload_job_t *job)
+{
+    compress_stream_t *s = (compress_stream_t *)((char *)job - offsetof(compress_stream_t, job));
+    z_stream *zs = &s->zs;
+    int flush = s->job_final ? Z_FINISH : Z_SYNC_FLUSH;
+
+    s->job_out.len = 0;
+    zs->next_in = (Bytef *)s->job_in.data;
+    zs->avail_in = s->job_in.len;
+
+    for (;;)
+    {
+        if (bytes_reserve(&s->job_out, COMPRESS_OUT_STEP) != 0)
+        {
+            s->job_failed = true;
+            break;
+        }
+        size_t room = s->job_out.cap - s->job_out.len;
+        zs->next_out = (Bytef *)(s->job_out.data + s->job_out.len);
+        zs->avail_out = room;
+
+        int ret = deflate(zs, flush);
+        s->job_out.len += room - zs->avail_out;
+        if (ret == Z_STREAM_ERROR)
+        {
+            s->job_failed = true;
+            break;
+        }
+        if (flush == Z_FINISH ? ret == Z_STREAM_END : zs->avail_out != 0)
+            break;
+    }
+    s->job_in.len = 0;
+}
+
+/** Back on the loop: queue the stream for compress_pop_done() */
+static void complete_job(offload_job_t *job)
+{
+    compress_stream_t *s = (compress_stream_t *)((char *)job - offsetof(compress_stream_t, job));
+    s->next = NULL;
+    if (ready_tail)
+        ready_tail->next = s;
+    else
+        ready_head = s;
+    ready_tail = s;
+}
+
+/* ---------------- Policy ---------------- */
+
+bool compress_wanted(const Route *route, const HttpRequest *req)
+{
+    return route && route->compress && offload_available() &&
+           strcmp(req->methode, "GET") == 0 &&
+           http_cache_accepts_encoding(get_request_header(req, "Accept-Encoding"), "gzip");
+}
+
+int compress_variant_key(const char *key, char *out, size_t out_size)
+{
+    int n = snprintf(out, out_size, "%s" COMPRESS_VARIANT_SUFFIX, key);
+    if (n < 0 || (size_t)n >= out_size)
+        return -1;
+    return n;
+}
+
+size_t compress_base_key_len(const char *key)
+{
+    size_t len = strlen(key);
+    size_t suffix_len = sizeof(COMPRESS_VARIANT_SUFFIX) - 1;
+    if (len >= suffix_len && strcmp(key + len - suffix_len, COMPRESS_VARIANT_SUFFIX) == 0)
+        return len - suffix_len;
+    return len;
+}
+
+/**
+ * Value of a response header (first occurrence), trimmed, into out.
+ * Returns false if the header is absent.
+ */
+static bool find_header(const char *head, size_t head_len, const char *name, char *out, size_t out_size)
+{
+    size_t name_len = strlen(name);
+    const char *end = head + head_len;
+    const char *p = memchr(head, '\n', head_len); /* skip the status line */
+
+    while (p && ++p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *line_end = eol ? eol : end;
+
+        if ((size_t)(line_end - p) > name_len && p[name_len] == ':' && strncasecmp(p, name, name_len) == 0)
+        {
+            const char *v = p + name_len + 1;
+            while (v < line_end && (*v == ' ' || *v == '\t'))
+                v++;
+            const char *v_end = line_end;
+            while (v_end > v && (v_end[-1] == '\r' || v_end[-1] == ' ' || v_end[-1] == '\t'))
+                v_end--;
+            size_t n = (size_t)(v_end - v) < out_size - 1 ? (size_t)(v_end - v) : out_size - 1;
+            memcpy(out, v, n);
+            out[n] = '\0';
+            return true;
+        }
+        p = eol;
+    }
+    return false;
+}
+
+static bool type_compressible(const char *content_type)
+{
+    size_t len = strcspn(content_type, "; \t");
+
+    if (len > 5 && strncasecmp(content_type, "text/", 5) == 0)
+        return !(len == 17 && strncasecmp(content_type, "text/event-stream", 17) == 0);
+
+    for (size_t i = 0; i < sizeof(compressible_types) / sizeof(compressible_types[0]); i++)
+    {
+        if (strlen(compressible_types[i]) == len && strncasecmp(content_type, compressible_types[i], len) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool compress_eligible(const char *head, size_t head_len, int64_t body_len, size_t min_bytes)
+{
+    char value[256];
+    int status = 0;
+
+    if (head_len < 12 || strncmp(head, "HTTP/1.", 7) != 0 || sscanf(head + 9, "%3d", &status) != 1 || status != 200)
+        return false;
+
+    if (find_header(head, head_len, "Content-Encoding", value, sizeof(value)) && strcasecmp(value, "identity") != 0)
+        return false;
+    if (find_header(head, head_len, "Content-Range", value, sizeof(value)))
+        return false;
+    if (find_header(head, head_len, "Cache-Control", value, sizeof(value)) && strcasestr(value, "no-transform"))
+        return false;
+    if (find_header(head, head_len, "Transfer-Encoding", value, sizeof(value)) && strcasecmp(value, "chunked") != 0)
+        return false;
+    if (!find_header(head, head_len, "Content-Type", value, sizeof(value)) || !type_compressible(value))
+        return false;
+
+    if (find_header(head, head_len, "Content-Length", value, sizeof(value)))
+        body_len = strtoll(value, NULL, 10);
+    return body_len < 0 || (size_t)body_len >= min_bytes;
+}
+
+/* ---------------- Streams ---------------- */
+
+/**
+ * Copy the backend's head for the gzip representation: no Content-Length or
+ * Transfer-Encoding (the body ends with the connection), a weak ETag (the
+ * bytes differ from the identity representation), plus Content-Encoding and
+ * Vary.
+ */
+static int write_head(compress_stream_t *s, const char *head, size_t head_len)
+{
+    const char *end = head + head_len;
+    const char *p = memchr(head, '\n', head_len);
+    if (!p)
+        return -1;
+    p++;
+
+    if (buffer_ensure_space(&s->out, head_len + 128) != 0)
+        return -1;
+    char *dst = buffer_write_ptr(&s->out);
+    size_t out = p - head;
+    bool has_vary = false;
+    memcpy(dst, head, out); /* status line */
+
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        size_t line_len = eol ? (size_t)(eol + 1 - p) : (size_t)(end - p);
+        char line[256];
+        size_t n = line_len < sizeof(line) ? line_len : sizeof(line) - 1;
+        memcpy(line, p, n);
+        line[n] = '\0';
+
+        if (line_len <= 2)
+            break; /* blank line */
+
+        if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+            s->chunked = strcasestr(line, "chunked") != NULL;
+        else if (strncasecmp(line, "Content-Length:", 15) == 0 || strncasecmp(line, "Content-Encoding:", 17) == 0)
+            ; /* dropped */
+        else if (strncasecmp(line, "ETag:", 5) == 0)
+        {
+            const char *v = p + 5;
+            while (*v == ' ')
+                v++;
+            size_t v_len = p + line_len - v;
+            out += sprintf(dst + out, "ETag: %s", strncmp(v, "W/", 2) == 0 ? "" : "W/");
+            memcpy(dst + out, v, v_len);
+            out += v_len;
+        }
+        else
+        {
+            if (strncasecmp(line, "Vary:", 5) == 0 && strcasestr(line, "Accept-Encoding"))
+                has_vary = true;
+            memcpy(dst + out, p, line_len);
+            out += line_len;
+        }
+        p += line_len;
+    }
+
+    out += sprintf(dst + out, "Content-Encoding: gzip\r\n%s\r\n", has_vary ? "" : "Vary: Accept-Encoding\r\n");
+    s->out.len += out;
+    return 0;
+}
+
+static void stream_free(compress_stream_t *s)
+{
+    if (s->zs_ready)
+        deflateEnd(&s->zs);
+    free(s->pending.data);
+    free(s->job_in.data);
+    free(s->job_out.data);
+    buffer_cleanup(&s->out);
+    free(s);
+}
+
+compress_stream_t *compress_start(struct connection *conn, const char *head, size_t head_len)
+{
+    compress_stream_t *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        log_errno("compress_start: allocation failed");
+        return NULL;
+    }
+    s->conn = conn;
+    s->job.run = run_job;
+    s->job.complete = complete_job;
+    buffer_init(&s->out);
+
+    /** windowBits 15 + 16: gzip wrapper instead of zlib's */
+    if (deflateInit2(&s->zs, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        log_error("compress_start: deflateInit2 failed");
+        stream_free(s);
+        return NULL;
+    }
+    s->zs_ready = true;
+
+    if (write_head(s, head, head_len) != 0)
+    {
+        stream_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * Strip chunked framing: payload bytes go to pending, sizes, extensions and
+ * trailers are dropped. Returns -1 on a malformed size line.
+ */
+static int dechunk(compress_stream_t *s, const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+
+    while (p < end && s->dechunk != DECHUNK_DONE)
+    {
+        switch (s->dechunk)
+        {
+        case DECHUNK_SIZE:
+            if (isxdigit((unsigned char)*p))
+            {
+                if (s->chunk_left >> 60)
+                    return -1;
+                int c = tolower((unsigned char)*p);
+                s->chunk_left = s->chunk_left * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+            }
+            else if (*p == ';' || *p == ' ' || *p == '\t' || *p == '\r')
+                s->dechunk = DECHUNK_EXT;
+            else if (*p == '\n')
+                s->dechunk = s->chunk_left ? DECHUNK_DATA : DECHUNK_TRAILER;
+            else
+                return -1;
+            p++;
+            break;
+        case DECHUNK_EXT:
+            if (*p++ == '\n')
+                s->dechunk = s->chunk_left ? DECHUNK_DATA : DECHUNK_TRAILER;
+            break;
+        case DECHUNK_DATA:
+        {
+            size_t n = (size_t)(end - p) < s->chunk_left ? (size_t)(end - p) : s->chunk_left;
+            if (bytes_append(&s->pending, p, n) != 0)
+                return -1;
+            p += n;
+            s->chunk_left -= n;
+            if (!s->chunk_left)
+                s->dechunk = DECHUNK_DATA_END;
+            break;
+        }
+        case DECHUNK_DATA_END:
+            if (*p++ == '\n')
+                s->dechunk = DECHUNK_SIZE;
+            break;
+        case DECHUNK_TRAILER:
+            if (*p == '\n')
+            {
+                s->dechunk = s->line_len ? DECHUNK_TRAILER : DECHUNK_DONE;
+                s->line_len = 0;
+            }
+            else if (*p != '\r')
+                s->line_len++;
+            p++;
+            break;
+        case DECHUNK_DONE:
+            break;
+        }
+    }
+    return 0;
+}
+
+/** Hand pending input to the pool (one job per stream at a time) */
+static void submit(compress_stream_t *s)
+{
+    if (s->busy || s->final_submitted || (!s->pending.len && !s->eof))
+        return;
+
+    bytes_t in = s->job_in;
+    s->job_in = s->pending;
+    s->pending = in;
+    s->pending.len = 0;
+    s->job_final = s->eof;
+    s->final_submitted = s->eof;
+    s->busy = true;
+    offload_submit(&s->job);
+}
+
+int compress_feed(compress_stream_t *stream, const char *data, size_t len, bool eof)
+{
+    if (stream->eof)
+        return 0;
+
+    int ret = stream->chunked ? dechunk(stream, data, len) : bytes_append(&stream->pending, data, len);
+    if (ret != 0)
+        return -1;
+    stream->eof = eof;
+    submit(stream);
+    return 0;
+}
+
+buffer_t *compress_output(compress_stream_t *stream)
+{
+    return &stream->out;
+}
+
+bool compress_finished(const compress_stream_t *stream)
+{
+    return stream->finished;
+}
+
+struct connection *compress_pop_done(compress_result_t *result)
+{
+    for (;;)
+    {
+        if (!ready_head)
+            return NULL;
+
+        compress_stream_t *s = ready_head;
+        ready_head = s->next;
+        if (!ready_head)
+            ready_tail = NULL;
+        s->busy = false;
+
+        if (!s->conn)
+        {
+            stream_free(s);
+            continue;
+        }
+
+        if (s->job_failed)
+        {
+            *result = COMPRESS_FAILED;
+            return s->conn;
+        }
+
+        if (s->job_out.len)
+        {
+            if (buffer_ensure_space(&s->out, s->job_out.len) != 0)
+            {
+                *result = COMPRESS_FAILED;
+                return s->conn;
+            }
+            memcpy(buffer_write_ptr(&s->out), s->job_out.data, s->job_out.len);
+            s->out.len += s->job_out.len;
+        }
+
+        if (s->job_final)
+        {
+            /** The deflate state is ~256 KB, don't keep it while the rest is sent */
+            deflateEnd(&s->zs);
+            s->zs_ready = false;
+            s->finished = true;
+            *result = COMPRESS_FINISHED;
+        }
+        else
+        {
+            submit(s);
+            *result = COMPRESS_PROGRESS;
+        }
+        return s->conn;
+    }
+}
+
+void compress_release(compress_stream_t *stream)
+{
+    if (!stream)
+        return;
+    stream->conn = NULL;
+    if (!stream->busy)
+        stream_free(stream);
+}
@@ -8,13 +8,61 @@
 #include <v2-epoll/connection_state.h>
 #include <v2-epoll/buffer.h>
 #include <v2-epoll/epoll_server.h>
+#include <v2-epoll/upstream_limiter.h>
+#include <v2-epoll/upstream_socket.h>
+#include <v2-epoll/slab.h>
 #include <common/request_parser.h>
+#include <common/route_table.h>
+#include <common/rebuild_request.h>
 #include <common/debug.h>
 
+/**
+ * Every allocated connection, so the event loop can find idle ones to hand
+ * over during a binary upgrade and know when draining is finished.
+ */
+static connection_t *live_head = NULL;
+static int live_count = 0;
+
+/** connection_t storage: recycled, and local to the worker's NUMA node (see slab.h) */
+static slab_t conn_slab;
+
+static void live_link(connection_t *conn)
+{
+    conn->live_prev = NULL;
+    conn->live_next = live_head;
+    if (live_head)
+        live_head->live_prev = conn;
+    live_head = conn;
+    live_count++;
+}
+
+static void live_unlink(connection_t *conn)
+{
+    if (conn->live_prev)
+        conn->live_prev->live_next = conn->live_next;
+    else
+        live_head = conn->live_next;
+    if (conn->live_next)
+        conn->live_next->live_prev = conn->live_prev;
+    live_count--;
+}
+
+connection_t *connection_live_first(void)
+{
+    return live_head;
+}
+
+int connection_live_count(void)
+{
+    return live_count;
+}
+
 connection_t *connection_create(int client_fd)
 {
     /**Allocate the memory for connection object */
-    connection_t *conn = malloc(sizeof(connection_t));
+    if (!conn_slab.object_size)
+        slab_init(&conn_slab, sizeof(connection_t));
+    connection_t *conn = slab_alloc(&conn_slab);
 
     if (!conn)
     {
@@ -34,7 +82,7 @@ connection_t *connection_create(int client_fd)
     if (buffer_init(&conn->request_buffer) != 0)
     {
         log_error("connection_create: Failed to initialize request buffer for client %d", client_fd);
-        free(conn);
+        slab_free(&conn_slab, conn);
         return NULL;
     }
 
@@ -43,19 +91,21 @@ connection_t *connection_create(int client_fd)
     if (buffer_init(&conn->rebuilt_request_buffer) != 0)
     {
         log_error("connection_create: Failed to initialize rebuilt request buffer for client %d", client_fd);
-        free(conn);
+        slab_free(&conn_slab, conn);
         return NULL;
     }
 
     if (buffer_init(&conn->response_buffer) != 0)
     {
         log_error("connection_create: Failed to initialize response buffer for client %d", client_fd);
-        free(conn);
+        slab_free(&conn_slab, conn);
         return NULL;
     }
 
     conn->last_error = 0;
 
+    live_link(conn);
+
     /**
      * After using memset(conn, 0, sizeof(connection_t));
      * all below field has become zero
@@ -99,6 +149,54 @@ void connection_free(connection_t *conn, int epoll_fd)
     DEBUG_PRINT("DEBUG: Freeing connection %p (client_fd=%d, backend_fd=%d)\n",
            (void *)conn, conn->client_fd, conn->backend_fd);
 
+    live_unlink(conn);
+
+    /**Give back the upstream concurrency slot (or leave the wait queue) */
+    upstream_limiter_finish(conn);
+
+    /**Stop a peer deadline; an unfinished probe lets the next request probe */
+    peer_detach(conn);
+
+    /**Leave the tunnel idle list, give back the pipes */
+    tunnel_detach(conn);
+
+    /**Leave the h2c stream (reset if the backend is still sending) */
+    h2_upstream_detach(conn, epoll_fd);
+
+    /**An HTTP/2 client session closes its streams */
+    h2_server_free(conn, epoll_fd);
+
+    /**TLS: close_notify while the socket is still open */
+    tls_free(conn, epoll_fd);
+
+    /**Unpin the routing table generation; a reloaded-away table is freed once unused */
+    route_table_release(conn->route_table);
+    conn->route_table = NULL;
+    conn->selected_backend = NULL;
+
+    /**Leave a coalesced flight; a leader leaving early sends its followers upstream */
+    coalesce_detach(conn);
+
+    response_cache_reply_cleanup(&conn->cache_reply);
+    disk_cache_reply_cleanup(&conn->disk_reply);
+    static_reply_cleanup(&conn->static_reply);
+    response_cache_release(conn->stale_entry);
+    conn->stale_entry = NULL;
+    if (conn->refresh_entry)
+    {
+        /** Refresh ended without storing a new copy */
+        response_cache_refresh_end(conn->refresh_entry, false);
+        conn->refresh_entry = NULL;
+    }
+    free(conn->cache_key);
+    conn->cache_key = NULL;
+
+    /**A stream with a job in flight is freed when the job comes back */
+    compress_release(conn->compress);
+    conn->compress = NULL;
+    free(conn->compress_key);
+    conn->compress_key = NULL;
+
     if (conn->request_parsed)
     {
         free_http_request(&conn->parsed_request);
@@ -108,7 +206,7 @@ void connection_free(connection_t *conn, int epoll_fd)
     if (conn->backend_fd >= 0)
     {
         epoll_server_delete(epoll_fd, conn->backend_fd);
-        close(conn->backend_fd);
+        upstream_socket_close(conn->backend_fd);
         conn->backend_fd = -1;
     }
 
@@ -124,6 +222,52 @@ void connection_free(connection_t *conn, int epoll_fd)
     buffer_cleanup(&conn->response_buffer);
 
     DEBUG_PRINT("DEBUG: About to free connection %p\n", (void *)conn);
-    free(conn);
+    slab_free(&conn_slab, conn);
     DEBUG_PRINT("DEBUG: Freed connection %p\n", (void *)conn);
-}
\ No newline at end of file
+}
+/**
+ * Intrusive singly-linked list through conn->free_next, so scheduling a free
+ * never fails or allocates, no matter how many connections die in one batch.
+ */
+static connection_t *pending_free_head = NULL;
+
+void connection_schedule_free(connection_t *conn)
+{
+    if (!conn || conn->should_free_conn)
+        return;
+
+    conn->should_free_conn = true;
+    conn->free_next = pending_free_head;
+    pending_free_head = conn;
+}
+
+void connection_free_pending(int epoll_fd)
+{
+    while (pending_free_head)
+    {
+        connection_t *conn = pending_free_head;
+        pending_free_head = conn->free_next;
+        connection_free(conn, epoll_fd);
+    }
+}
+
+const char *connection_client_ip(connection_t *conn)
+{
+    if (!conn->client_ip[0])
+    {
+        if (conn->peer_addr_len)
+            format_client_ip((struct sockaddr *)&conn->peer_addr, conn->peer_addr_len, conn->client_ip, sizeof(conn->client_ip));
+        else
+            get_client_ip(conn->client_fd, conn->client_ip, sizeof(conn->client_ip));
+    }
+    return conn->client_ip;
+}
+
+bool connection_is_idle(const connection_t *conn)
+{
+    return !conn->should_free_conn &&
+           !conn->h2_stream && !conn->tls && !conn->tls_inner &&
+           conn->state == CONN_READING_REQUEST &&
+           conn->request_buffer.len == 0 &&
+           conn->backend_fd < 0;
+}
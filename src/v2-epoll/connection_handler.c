@@ -1,5 +1,9 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
@@ -9,11 +13,548 @@
 #include <v2-epoll/http_utils.h>
 #include <common/error_handler.h>
 #include <common/rebuild_request.h>
+#include <common/rate_limiter.h>
+#include <common/route_table.h>
+#include <common/http_cache.h>
 #include <v2-epoll/epoll_proxy.h>
 #include <v2-epoll/epoll_server.h>
+#include <v2-epoll/upstream_limiter.h>
+#include <v2-epoll/upstream_socket.h>
+#include <v2-epoll/clock.h>
+#include <v2-epoll/response_cache.h>
+#include <v2-epoll/coalesce.h>
+#include <v2-epoll/disk_cache.h>
+#include <v2-epoll/peer.h>
+#include <v2-epoll/static_files.h>
+#include <v2-epoll/compress.h>
+#include <v2-epoll/tunnel.h>
+#include <v2-epoll/h2_upstream.h>
+#include <v2-epoll/h2_server.h>
+#include <v2-epoll/tls.h>
 #include <common/debug.h>
 
-handler_status_t handle_client_readable(connection_t *conn, Route *routes, int route_count, int epoll_fd)
+/**
+ * Write the next part of a reply the proxy answers itself (memory or
+ * persistent cache tier, static file). The first call comes straight from
+ * the request parser; if the socket fills up, the rest is sent on EPOLLOUT.
+ */
+static handler_status_t send_cached_reply(connection_t *conn, int epoll_fd)
+{
+    ssize_t sent;
+    if (conn->static_reply.active)
+        sent = static_reply_send(&conn->static_reply, conn->client_fd);
+    else if (conn->disk_reply.active)
+        sent = disk_cache_reply_send(&conn->disk_reply, conn->client_fd);
+    else
+        sent = response_cache_reply_send(&conn->cache_reply, conn->client_fd);
+
+    if (sent == 1)
+    {
+        conn->state = CONN_DONE;
+        return HANDLER_CLOSED;
+    }
+    else if (sent == -1)
+    {
+        conn->state = CONN_ERROR;
+        return HANDLER_ERROR;
+    }
+    else if (sent == -2)
+    {
+        DEBUG_PRINT("send_cached_reply: Client closed connection");
+        return HANDLER_CLOSED;
+    }
+
+    if (conn->state != CONN_SENDING_RESPONSE)
+    {
+        conn->state = CONN_SENDING_RESPONSE;
+        struct epoll_event event;
+        event.events = EPOLLOUT | EPOLLERR | EPOLLHUP;
+        event.data.ptr = conn;
+        if (epoll_server_modify(epoll_fd, conn->client_fd, &event) < 0)
+        {
+            log_error("send_cached_reply: Failed to modify client fd %d to EPOLLOUT\n", conn->client_fd);
+            conn->state = CONN_ERROR;
+            return HANDLER_ERROR;
+        }
+    }
+    return HANDLER_OK;
+}
+
+/**
+ * The backend could not be used (connect failure, send/read error, queue
+ * deadline, or a 5xx while a stale copy is held) and nothing was relayed yet.
+ * Serve the stale copy if stale-if-error allows it, otherwise answer with
+ * status (0 = close without a response). Background refreshes just end.
+ */
+static handler_status_t fail_upstream(connection_t *conn, int epoll_fd, int status, const char *reason)
+{
+    if (conn->stale_entry)
+    {
+        DEBUG_PRINT("fail_upstream: serving stale copy to client %d\n", conn->client_fd);
+
+        /** Done with the backend: drop it, give back the slot, release any followers */
+        if (conn->backend_fd >= 0)
+        {
+            epoll_server_delete(epoll_fd, conn->backend_fd);
+            upstream_socket_close(conn->backend_fd);
+            conn->backend_fd = -1;
+        }
+        h2_upstream_detach(conn, epoll_fd);
+        upstream_limiter_finish(conn);
+        coalesce_detach(conn);
+
+        response_cache_reply_start(&conn->cache_reply, conn->stale_entry);
+        conn->stale_entry = NULL;
+        return send_cached_reply(conn, epoll_fd);
+    }
+
+    if (status && !conn->is_refresh)
+    {
+        send_http_error(conn->client_fd, status, reason);
+    }
+    conn->state = CONN_ERROR;
+    return HANDLER_ERROR;
+}
+
+static handler_status_t peer_fallback(connection_t *conn, int epoll_fd);
+
+/**
+ * Start the non-blocking connect to the selected backend (or the peer owning
+ * the key) and wait for EPOLLOUT.
+ * The caller must already hold an upstream slot (or the upstream is unlimited).
+ */
+static handler_status_t connect_backend(connection_t *conn, int epoll_fd)
+{
+    peer_t *peer = conn->peer.node;
+    char *host = peer ? peer->host : conn->selected_backend->host;
+    int port = peer ? peer->port : conn->selected_backend->port;
+
+    /** proto=h2c: a stream on a shared connection, the response comes through handle_h2_streams() */
+    if (!peer && conn->selected_backend->h2c && !conn->tunnel.requested)
+    {
+        if (h2_upstream_submit(conn, epoll_fd) != 0)
+            return fail_upstream(conn, epoll_fd, 502, "Bad Gateway");
+
+        conn->state = CONN_READING_RESPONSE;
+        if (conn->is_refresh)
+            return HANDLER_OK;
+
+        /** Like CONN_QUEUED: only watch for the client going away */
+        struct epoll_event event;
+        event.events = EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+        event.data.ptr = conn;
+        if (epoll_server_modify(epoll_fd, conn->client_fd, &event) < 0)
+        {
+            log_error("connect_backend: Failed to modify client fd %d\n", conn->client_fd);
+            conn->state = CONN_ERROR;
+            return HANDLER_ERROR;
+        }
+        return HANDLER_OK;
+    }
+
+    conn->backend_fd = connect_to_target_nb(host, port, !conn->tunnel.connect);
+
+    if (conn->backend_fd < 0)
+    {
+        log_error("connect_backend: Failed to connect to backend %s:%d\n", host, port);
+        if (peer)
+            return peer_fallback(conn, epoll_fd);
+        return fail_upstream(conn, epoll_fd, 502, "Bad Gateway");
+    }
+
+    conn->state = CONN_CONNECTING_BACKEND;
+    if (peer)
+        peer_watch_connect(conn, clock_now_ms());
+
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLERR | EPOLLHUP;
+    event.data.ptr = conn;
+
+    /**
+     * epoll_server_add → Add an fd from the kernel’s watchlist.
+     */
+    if (epoll_server_add(epoll_fd, conn->backend_fd, &event))
+    {
+        log_error("connect_backend: Could not add backend fd %d to epoll watchlist\n", conn->backend_fd);
+        close(conn->backend_fd);
+        conn->backend_fd = -1;
+        conn->state = CONN_ERROR;
+        return HANDLER_ERROR;
+    }
+    return HANDLER_OK;
+}
+
+/**
+ * Remove a header from a rebuilt request (the head ends at the first empty
+ * line; a body after it is left alone).
+ */
+static void strip_request_header(buffer_t *buf, const char *name)
+{
+    size_t name_len = strlen(name);
+    char *line = memmem(buf->data, buf->len, "\r\n", 2);
+
+    while (line)
+    {
+        line += 2;
+        size_t left = buf->data + buf->len - line;
+        char *end = memmem(line, left, "\r\n", 2);
+        if (!end || end == line)
+            break; /** blank line: end of the head */
+
+        if ((size_t)(end - line) > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0)
+        {
+            size_t cut = end + 2 - line;
+            memmove(line, end + 2, left - cut);
+            buf->len -= cut;
+            end = line - 2;
+        }
+        line = end;
+    }
+}
+
+/**
+ * Rebuild the parsed request for the backend into rebuilt_request_buffer.
+ * Returns 0 on success, -1 on failure (nothing sent to the client).
+ */
+static int build_backend_request(connection_t *conn)
+{
+    /**Ensure buffer has space available for rebuild request */
+    if (buffer_ensure_space(&conn->rebuilt_request_buffer, 4096) != 0)
+    {
+        log_error("Failed to ensure buffer space for rebuilt request");
+        return -1;
+    }
+
+    char *data_ptr = buffer_write_ptr(&conn->rebuilt_request_buffer);
+    size_t available_space = buffer_available_space(&conn->rebuilt_request_buffer);
+
+    ssize_t rebuilt_request_size = rebuild_request(&conn->parsed_request, data_ptr, connection_client_ip(conn), available_space);
+
+    /**
+     * Update buffer metadata after external function wrote data directly to buffer memory.
+     *
+     * CRITICAL: This manual update is required because rebuild_request() operates on raw
+     * memory (char*) and has no knowledge of our buffer_t wrapper structure. The buffer's
+     * len field tracks how much valid data exists, but it can only know what we tell it.
+     *
+     * Without this update:
+     * - buffer_available_data() returns 0 (thinks buffer is empty)
+     * - buffer_write_to_fd() has no data to send
+     * - Connection gets stuck in infinite EPOLLOUT loop
+     *
+     * @param rebuilt_request_size: Number of bytes rebuild_request() wrote to buffer memory
+     */
+    if (rebuilt_request_size > 0)
+    {
+        conn->rebuilt_request_buffer.len += rebuilt_request_size;
+    }
+    else
+    {
+        log_error("build_backend_request: Failed to rebuild request from client %d\n", conn->client_fd);
+        return -1;
+    }
+
+    /** compress=on: the proxy compresses, the backend always answers uncompressed */
+    if (conn->selected_backend->compress)
+        strip_request_header(&conn->rebuilt_request_buffer, "Accept-Encoding");
+    return 0;
+}
+
+/**
+ * Admission to the backend: take a concurrency slot if one is free,
+ * otherwise wait in the upstream queue (bounded, deadline-aware).
+ */
+static handler_status_t dispatch_upstream(connection_t *conn, int epoll_fd)
+{
+    /** A peer protects its origin with its own limiter */
+    if (conn->peer.node)
+        return connect_backend(conn, epoll_fd);
+
+    upstream_limiter_t *ul = upstream_limiter_get(conn->selected_backend->host, conn->selected_backend->port);
+    if (!ul || upstream_limiter_try_acquire(ul, conn))
+    {
+        return connect_backend(conn, epoll_fd);
+    }
+
+    if (upstream_limiter_enqueue(ul, conn, clock_now_ms()) != 0)
+    {
+        log_error("dispatch_upstream: Upstream %s:%d queue full, rejecting client %d\n",
+                  conn->selected_backend->host, conn->selected_backend->port, conn->client_fd);
+        return fail_upstream(conn, epoll_fd, 503, "Service Unavailable");
+    }
+
+    conn->state = CONN_QUEUED;
+    if (conn->is_refresh)
+        return HANDLER_OK; /** No client fd to watch */
+
+    /**
+     * While queued we only care about the client going away. Leaving
+     * EPOLLIN armed would spin the loop if the client half-closes.
+     */
+    struct epoll_event event;
+    event.events = EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+    event.data.ptr = conn;
+    if (epoll_server_modify(epoll_fd, conn->client_fd, &event) < 0)
+    {
+        log_error("dispatch_upstream: Failed to modify client fd %d while queued\n", conn->client_fd);
+        conn->state = CONN_ERROR;
+        return HANDLER_ERROR;
+    }
+    return HANDLER_OK;
+}
+
+/**
+ * Add a header line ("Name: value\r\n") at the end of the rebuilt request's head.
+ */
+static int add_request_header(buffer_t *buf, const char *line, size_t line_len)
+{
+    char *end = memmem(buf->data, buf->len, "\r\n\r\n", 4);
+    if (!end || buffer_ensure_space(buf, line_len) != 0)
+        return -1;
+
+    /** buffer_ensure_space may have moved the data */
+    end = memmem(buf->data, buf->len, "\r\n\r\n", 4) + 2;
+    memmove(end + line_len, end, buf->data + buf->len - end);
+    memcpy(end, line, line_len);
+    buf->len += line_len;
+    return 0;
+}
+
+/**
+ * Mark the request as coming from a peer, so the owner doesn't forward it
+ * again.
+ */
+static int add_peer_header(connection_t *conn)
+{
+    char header[sizeof(((peer_t *)0)->name) + sizeof(PEER_HEADER) + 8];
+    int n = snprintf(header, sizeof(header), PEER_HEADER ": %s\r\n", peer_self_name());
+    if (n < 0 || (size_t)n >= sizeof(header))
+        return -1;
+    return add_request_header(&conn->rebuilt_request_buffer, header, n);
+}
+
+/**
+ * The peer owning the key did not answer in time or failed before the first
+ * response byte (nothing was relayed yet): mark it down and fetch from the
+ * origin, as if the peer had never been asked.
+ */
+static handler_status_t peer_fallback(connection_t *conn, int epoll_fd)
+{
+    DEBUG_PRINT("peer_fallback: %s failed, client %d goes to the origin\n", conn->peer.node->name, conn->client_fd);
+    peer_report(conn, false, clock_now_ms());
+
+    if (conn->backend_fd >= 0)
+    {
+        epoll_server_delete(epoll_fd, conn->backend_fd);
+        upstream_socket_close(conn->backend_fd);
+        conn->backend_fd = -1;
+    }
+    conn->rebuilt_request_buffer.len = 0;
+    conn->rebuilt_request_buffer.offset = 0;
+    conn->response_buffer.len = 0;
+    conn->response_buffer.offset = 0;
+
+    if (build_backend_request(conn) != 0)
+        return fail_upstream(conn, epoll_fd, 500, "Internal Server Error");
+    return dispatch_upstream(conn, epoll_fd);
+}
+
+/**
+ * stale-while-revalidate: the client gets the stale copy right away, and a
+ * connection without a client (client_fd -1) fetches a new copy through the
+ * normal upstream path. Its response only goes into the cache.
+ */
+static void start_background_refresh(connection_t *conn, cache_entry_t *entry, int epoll_fd)
+{
+    /** A gzip copy is refreshed by fetching the plain response and compressing it again */
+    char *key = strndup(entry->key, compress_base_key_len(entry->key));
+    bool variant = key && entry->key[strlen(key)] != '\0';
+
+    /** An identical request already on its way upstream refreshes it anyway */
+    if (!key || coalesce_find(key) || !response_cache_refresh_begin(entry))
+    {
+        free(key);
+        return;
+    }
+
+    connection_t *refresh = connection_create(-1);
+    if (!refresh)
+    {
+        free(key);
+        response_cache_refresh_end(entry, false);
+        return;
+    }
+    refresh->is_refresh = true;
+    refresh->refresh_entry = entry;
+    refresh->state = CONN_REQUEST_COMPLETE;
+    memcpy(refresh->client_ip, connection_client_ip(conn), sizeof(refresh->client_ip));
+
+    refresh->cache_key = key;
+
+    if (parse_http_request(conn->request_buffer.data, &refresh->parsed_request) != 0)
+    {
+        connection_schedule_free(refresh);
+        return;
+    }
+    refresh->request_parsed = true;
+
+    refresh->route_table = route_table_acquire();
+    refresh->selected_backend = find_backend(refresh->route_table->routes, refresh->route_table->count, refresh->parsed_request.path);
+
+    if (variant && compress_wanted(refresh->selected_backend, &refresh->parsed_request))
+    {
+        refresh->compress_key = strdup(entry->key);
+        refresh->compress_pending = refresh->compress_key != NULL;
+    }
+
+    if (!refresh->selected_backend || build_backend_request(refresh) != 0 ||
+        dispatch_upstream(refresh, epoll_fd) != HANDLER_OK)
+    {
+        connection_schedule_free(refresh);
+        return;
+    }
+    DEBUG_PRINT("Background refresh of %s started\n", entry->key);
+}
+
+/**
+ * Stream the leader's response to a follower. When the follower has caught
+ * up, stop watching EPOLLOUT until coalesce_leader_data() marks it pending.
+ */
+static handler_status_t send_coalesced(connection_t *conn, int epoll_fd)
+{
+    ssize_t sent = coalesce_follower_send(conn, conn->client_fd);
+
+    if (sent == 1)
+    {
+        conn->state = CONN_DONE;
+        return HANDLER_CLOSED;
+    }
+    else if (sent == -1)
+    {
+        conn->state = CONN_ERROR;
+        return HANDLER_ERROR;
+    }
+    else if (sent == -2)
+    {
+        DEBUG_PRINT("send_coalesced: Client closed connection");
+        return HANDLER_CLOSED;
+    }
+
+    if (conn->coalesce.parked)
+    {
+        struct epoll_event event;
+        event.events = EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+        event.data.ptr = conn;
+        if (epoll_server_modify(epoll_fd, conn->client_fd, &event) < 0)
+        {
+            log_error("send_coalesced: Failed to modify client fd %d\n", conn->client_fd);
+            conn->state = CONN_ERROR;
+            return HANDLER_ERROR;
+        }
+    }
+    return HANDLER_OK;
+}
+
+/**
+ * Cache lookup for a client that takes gzip on a compress route: the gzip
+ * copy, else the plain copy if it is something we wouldn't compress anyway
+ * (an image, a tiny body). A plain copy that should be compressed is a
+ * miss, so the response that comes back gets compressed and stored once.
+ */
+static cache_entry_t *lookup_compressed(const Route *route, const char *key, const char *variant,
+                                        const HttpRequest *req, cache_lookup_t *freshness)
+{
+    cache_entry_t *hit = response_cache_lookup(variant, req, freshness);
+    if (hit)
+        return hit;
+
+    hit = response_cache_lookup(key, req, freshness);
+    size_t min_bytes = route->compress_min_bytes ? (size_t)route->compress_min_bytes : COMPRESS_MIN_BYTES;
+    if (hit && compress_eligible(hit->head, hit->head_len, hit->body_len, min_bytes))
+    {
+        response_cache_release(hit);
+        return NULL;
+    }
+    return hit;
+}
+
+/**
+ * CONNECT only reaches the backends of our own routes ("host:port" exactly
+ * as a route names it): anything else would make the proxy an open relay.
+ */
+static Route *find_connect_route(struct route_table *table, const char *authority)
+{
+    const char *colon = strrchr(authority, ':');
+    if (!colon || colon == authority)
+        return NULL;
+
+    size_t host_len = colon - authority;
+    int port = atoi(colon + 1);
+    for (int i = 0; i < table->count; i++)
+    {
+        Route *route = &table->routes[i];
+        if (!route->static_path[0] && route->port == port &&
+            strlen(route->host) == host_len && strncmp(route->host, authority, host_len) == 0)
+            return route;
+    }
+    return NULL;
+}
+
+/**
+ * WebSocket or CONNECT: no cache, no coalescing, no compression. An upgrade
+ * is forwarded with its Connection: Upgrade (instead of close) and becomes a
+ * tunnel on a 101; a CONNECT becomes one when the backend is connected, and
+ * whatever the client sent behind its request goes to the backend first.
+ */
+static handler_status_t start_tunnel_request(connection_t *conn, int epoll_fd)
+{
+    conn->tunnel.requested = true;
+    conn->tunnel.connect = strcmp(conn->parsed_request.methode, "CONNECT") == 0;
+
+    if (conn->tunnel.connect)
+    {
+        buffer_t *req = &conn->request_buffer;
+        char *head_end = memmem(req->data, req->len, "\r\n\r\n", 4);
+        size_t early = head_end ? req->data + req->len - (head_end + 4) : 0;
+        if (early > 0)
+        {
+            if (buffer_ensure_space(&conn->rebuilt_request_buffer, early) != 0)
+                return fail_upstream(conn, epoll_fd, 500, "Internal Server Error");
+            memcpy(buffer_write_ptr(&conn->rebuilt_request_buffer), head_end + 4, early);
+            conn->rebuilt_request_buffer.len += early;
+        }
+    }
+    else
+    {
+        static const char upgrade[] = "Connection: Upgrade\r\n";
+        if (build_backend_request(conn) != 0)
+            return fail_upstream(conn, epoll_fd, 500, "Internal Server Error");
+        strip_request_header(&conn->rebuilt_request_buffer, "Connection");
+        if (add_request_header(&conn->rebuilt_request_buffer, upgrade, sizeof(upgrade) - 1) != 0)
+            return fail_upstream(conn, epoll_fd, 500, "Internal Server Error");
+    }
+    return dispatch_upstream(conn, epoll_fd);
+}
+
+/**
+ * The backend agreed (101, or connected for CONNECT): relay both ways from
+ * here. A tunnel may stay open for hours, so its upstream slot goes back now.
+ */
+static handler_status_t enter_tunnel(connection_t *conn, int epoll_fd)
+{
+    conn->backend_responded = true;
+    upstream_limiter_finish(conn);
+
+    int rc = tunnel_start(conn, epoll_fd, clock_now_ms());
+    if (rc < 0)
+    {
+        conn->state = CONN_ERROR;
+        return HANDLER_ERROR;
+    }
+    return rc > 0 ? HANDLER_CLOSED : HANDLER_OK;
+}
+
+handler_status_t handle_client_readable(connection_t *conn, int epoll_fd)
 {
     conn->state = CONN_READING_REQUEST;
     ssize_t bytes_read = buffer_read_from_fd(&conn->request_buffer, conn->client_fd);
@@ -33,6 +574,23 @@ handler_status_t handle_client_readable(connection_t *conn, Route *routes, int r
     }
     else if (bytes_read > 0)
     {
+        /**
+         * HTTP/2 with prior knowledge: the preface contains "\r\n\r\n", so
+         * it must be recognised before the buffer looks like a request.
+         */
+        int preface = conn->h2_stream ? 0 : h2_server_preface(&conn->request_buffer);
+        if (preface < 0)
+            return HANDLER_OK;
+        if (preface > 0)
+        {
+            if (h2_server_start(conn, epoll_fd) != 0)
+            {
+                conn->state = CONN_ERROR;
+                return HANDLER_ERROR;
+            }
+            return HANDLER_OK;
+        }
+
         if (http_request_complete(&conn->request_buffer))
         {
             conn->state = CONN_REQUEST_COMPLETE;
@@ -48,7 +606,26 @@ handler_status_t handle_client_readable(connection_t *conn, Route *routes, int r
 
             conn->request_parsed = true;
 
-            conn->selected_backend = find_backend(routes, route_count, conn->parsed_request.path);
+            /**
+             * Pin the current routing table: a reload may publish a new one at
+             * any time, but this request keeps its selected_backend valid.
+             */
+            conn->route_table = route_table_acquire();
+            if (strcmp(conn->parsed_request.methode, "CONNECT") == 0)
+            {
+                conn->selected_backend = find_connect_route(conn->route_table, conn->parsed_request.path);
+                if (!conn->selected_backend)
+                {
+                    log_error("handle_client_readable: CONNECT to %s is not a backend\n", conn->parsed_request.path);
+                    send_http_error(conn->client_fd, 403, "Forbidden");
+                    conn->state = CONN_ERROR;
+                    return HANDLER_ERROR;
+                }
+            }
+            else
+            {
+                conn->selected_backend = find_backend(conn->route_table->routes, conn->route_table->count, conn->parsed_request.path);
+            }
             if (!conn->selected_backend)
             {
                 log_error("handle_client_readable: No backend found for path: %s\n", conn->parsed_request.path);
@@ -59,77 +636,140 @@ handler_status_t handle_client_readable(connection_t *conn, Route *routes, int r
 
             DEBUG_PRINT("Routing to backend: %s:%d for prefix: %s\n", conn->selected_backend->host, conn->selected_backend->port, conn->selected_backend->prefix);
 
-            /** Get client IP */
-
-            get_client_ip(conn->client_fd, conn->client_ip, sizeof(conn->client_ip));
-
-            /**Ensure buffer has space available for rebuild request */
-            if (buffer_ensure_space(&conn->rebuilt_request_buffer, 4096) != 0)
+            /**
+             * Rate limit before any further work (rebuild, backend connect),
+             * so a scraper over its budget costs us one hash lookup and one send().
+             */
+            Route *route = conn->selected_backend;
+            if (route->ratelimit_rps > 0)
             {
-                log_error("Failed to ensure buffer space for rebuilt request");
-                send_http_error(conn->client_fd, 500, "Internal Server Error");
-                conn->state = CONN_ERROR;
-                return HANDLER_ERROR;
+                uint64_t key = rate_limiter_key(connection_client_ip(conn), route->ratelimit_per_route ? route->prefix : NULL);
+                if (!rate_limiter_allow(key, route->ratelimit_rps, route->ratelimit_burst))
+                {
+                    DEBUG_PRINT("Rate limited client %s on %s\n", connection_client_ip(conn), route->prefix);
+                    send_canned_response(conn->client_fd, CANNED_429_TOO_MANY_REQUESTS);
+                    conn->state = CONN_ERROR;
+                    return HANDLER_ERROR;
+                }
             }
 
-            char *data_ptr = buffer_write_ptr(&conn->rebuilt_request_buffer);
-            size_t available_space = buffer_available_space(&conn->rebuilt_request_buffer);
+            /** Static route: the file is sent from here, no backend involved */
+            if (route->static_path[0])
+            {
+                if (static_files_start(route, &conn->parsed_request, &conn->static_reply) != 0)
+                {
+                    send_http_error(conn->client_fd, 500, "Internal Server Error");
+                    conn->state = CONN_ERROR;
+                    return HANDLER_ERROR;
+                }
+                return send_cached_reply(conn, epoll_fd);
+            }
 
-            ssize_t rebuilt_request_size = rebuild_request(&conn->parsed_request, data_ptr, conn->client_ip, available_space);
+            if (tunnel_request(&conn->parsed_request))
+                return start_tunnel_request(conn, epoll_fd);
 
             /**
-             * Update buffer metadata after external function wrote data directly to buffer memory.
-             *
-             * CRITICAL: This manual update is required because rebuild_request() operates on raw
-             * memory (char*) and has no knowledge of our buffer_t wrapper structure. The buffer's
-             * len field tracks how much valid data exists, but it can only know what we tell it.
-             *
-             * Without this update:
-             * - buffer_available_data() returns 0 (thinks buffer is empty)
-             * - buffer_write_to_fd() has no data to send
-             * - Connection gets stuck in infinite EPOLLOUT loop
-             *
-             * @param rebuilt_request_size: Number of bytes rebuild_request() wrote to buffer memory
+             * Response cache: a fresh hit is answered right here with the
+             * stored bytes, no request rebuild and no backend connection.
+             * On a miss remember the key so the response can be stored.
+             * Only requests that accept a cached answer may share another
+             * request's response (coalescing below).
              */
-            if (rebuilt_request_size > 0)
+            bool may_follow = false;
+            conn->compress_pending = compress_wanted(route, &conn->parsed_request);
+            if (!route->cache_disabled)
             {
-                conn->rebuilt_request_buffer.len += rebuilt_request_size;
-            }
-            else
-            {
-                log_error("handle_client_readable: Failed to rebuild request from client %d\n", conn->client_fd);
-                send_http_error(conn->client_fd, 500, "Internal Server Error");
-                conn->state = CONN_ERROR;
-                return HANDLER_ERROR;
-            }
+                http_cache_request_t cache_policy = http_cache_request_policy(&conn->parsed_request);
+                char key[HTTP_CACHE_MAX_KEY];
+                char variant[HTTP_CACHE_MAX_KEY];
+
+                if (cache_policy != HTTP_CACHE_BYPASS &&
+                    http_cache_key(&conn->parsed_request, key, sizeof(key)) > 0)
+                {
+                    /** The client takes gzip: its cached answer is the gzip copy */
+                    bool gzip = conn->compress_pending && compress_variant_key(key, variant, sizeof(variant)) > 0;
 
-            conn->backend_fd = connect_to_target_nb(conn->selected_backend->host, conn->selected_backend->port);
+                    if (cache_policy == HTTP_CACHE_LOOKUP)
+                    {
+                        cache_lookup_t freshness;
+                        cache_entry_t *hit = gzip ? lookup_compressed(route, key, variant, &conn->parsed_request, &freshness)
+                                                  : response_cache_lookup(key, &conn->parsed_request, &freshness);
+                        if (hit && freshness == CACHE_LOOKUP_STALE_IF_ERROR)
+                        {
+                            /** Keep it in case the backend fails */
+                            conn->stale_entry = hit;
+                        }
+                        else if (hit)
+                        {
+                            if (freshness == CACHE_LOOKUP_STALE)
+                                start_background_refresh(conn, hit, epoll_fd);
+                            response_cache_reply_start(&conn->cache_reply, hit);
+                            return send_cached_reply(conn, epoll_fd);
+                        }
+                        else if (disk_cache_lookup(gzip ? variant : key, &conn->parsed_request, &conn->disk_reply))
+                        {
+                            /** Not in memory (evicted, or just restarted) but on disk */
+                            return send_cached_reply(conn, epoll_fd);
+                        }
+                    }
+                    /** strdup failure only means the response won't be stored */
+                    conn->cache_key = strdup(key);
+                    if (gzip)
+                        conn->compress_key = strdup(variant);
+                    may_follow = cache_policy == HTTP_CACHE_LOOKUP;
+
+                    /**
+                     * Miss on a key another node owns: ask it before the
+                     * origin, unless a peer sent us this request.
+                     */
+                    if (may_follow && !conn->parsed_request.body_length &&
+                        !get_request_header(&conn->parsed_request, PEER_HEADER))
+                    {
+                        peer_assign(conn, key, clock_now_ms());
+                    }
+                }
+            }
 
-            if (conn->backend_fd < 0)
+            if (build_backend_request(conn) != 0 || (conn->peer.node && add_peer_header(conn) != 0))
             {
-                log_error("handle_client_readable: Failed to connect to backend %s:%d\n", conn->selected_backend->host, conn->selected_backend->port);
-                send_http_error(conn->client_fd, 502, "Bad Gateway");
+                send_http_error(conn->client_fd, 500, "Internal Server Error");
                 conn->state = CONN_ERROR;
                 return HANDLER_ERROR;
             }
 
-            conn->state = CONN_CONNECTING_BACKEND;
-
-            struct epoll_event event;
-            event.events = EPOLLOUT | EPOLLERR | EPOLLHUP;
-            event.data.ptr = conn;
-
             /**
-             * epoll_server_add → Add an fd from the kernel’s watchlist.
+             * Collapsed forwarding: an identical cacheable request is already
+             * on its way to the backend → share its response instead of
+             * opening another backend connection. Otherwise this request
+             * leads, so the next identical one can join it.
              */
-            if (epoll_server_add(epoll_fd, conn->backend_fd, &event))
+            if (conn->cache_key)
             {
-                close(conn->backend_fd);
-                log_error("handle_client_readable: Could not add backend fd %d to epoll watchlist\n", conn->backend_fd);
-                conn->state = CONN_ERROR;
-                return HANDLER_ERROR;
+                flight_t *flight = coalesce_find(conn->cache_key);
+                if (flight && may_follow && coalesce_join(flight, conn, clock_now_ms()) == 0)
+                {
+                    conn->state = CONN_COALESCED;
+
+                    /** Like CONN_QUEUED: only watch for the client going away */
+                    struct epoll_event event;
+                    event.events = EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+                    event.data.ptr = conn;
+                    if (epoll_server_modify(epoll_fd, conn->client_fd, &event) < 0)
+                    {
+                        log_error("handle_client_readable: Failed to modify client fd %d while coalesced\n", conn->client_fd);
+                        conn->state = CONN_ERROR;
+                        return HANDLER_ERROR;
+                    }
+                    return HANDLER_OK;
+                }
+                if (!flight)
+                {
+                    /** Allocation failure only means the request isn't coalesced */
+                    coalesce_lead(conn, conn->cache_key);
+                }
             }
-            return HANDLER_OK;
+
+            return dispatch_upstream(conn, epoll_fd);
         }
         else
         {
@@ -153,86 +793,285 @@ handler_status_t handle_backend_writable(connection_t *conn, int epoll_fd)
         if (getsockopt(conn->backend_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
         {
             log_errno("handle_backend_writable: getsockopt failed\n");
-            conn->state = CONN_ERROR;
-            return HANDLER_ERROR;
+            return fail_upstream(conn, epoll_fd, 502, "Bad Gateway");
         }
+        upstream_socket_connect_result(err);
         if (err != 0)
         {
             log_error("handle_backend_writable: Backend connect failed: %d\n", err);
+            if (conn->peer.node)
+                return peer_fallback(conn, epoll_fd);
+            return fail_upstream(conn, epoll_fd, 502, "Bad Gateway");
+        }
+
+        DEBUG_PRINT("Connected to backend %s:%d\n",
+                    conn->selected_backend->host, conn->selected_backend->port);
+
+        /** CONNECT: connected is all the client asked for */
+        if (conn->tunnel.connect)
+        {
+            static const char reply[] = TUNNEL_CONNECT_REPLY;
+            if (buffer_ensure_space(&conn->response_buffer, sizeof(reply) - 1) != 0)
+            {
+                conn->state = CONN_ERROR;
+                return HANDLER_ERROR;
+            }
+            memcpy(buffer_write_ptr(&conn->response_buffer), reply, sizeof(reply) - 1);
+            conn->response_buffer.len += sizeof(reply) - 1;
+            return enter_tunnel(conn, epoll_fd);
+        }
+
+        conn->state = CONN_SENDING_REQUEST;
+        if (conn->peer.node)
+            peer_watch_response(conn, clock_now_ms());
+    }
+
+    if (conn->state == CONN_SENDING_REQUEST)
+    {
+        /**epoll: "now watch for writable, so we can send the request" */
+        ssize_t request_sent_to_backend = buffer_write_to_fd(&conn->rebuilt_request_buffer, conn->backend_fd);
+
+        if (request_sent_to_backend == -1)
+        {
+            log_error("handle_backend_writable: Failed to forward request to backend %s:%d\n",
+                      conn->selected_backend->host, conn->selected_backend->port);
+            if (conn->peer.node)
+                return peer_fallback(conn, epoll_fd);
+            return fail_upstream(conn, epoll_fd, 502, "Bad Gateway");
+        }
+        else if (request_sent_to_backend == -2)
+        {
+            DEBUG_PRINT("Backend closed connection during request send");
+            if (conn->peer.node)
+                return peer_fallback(conn, epoll_fd);
+            if (conn->stale_entry)
+                return fail_upstream(conn, epoll_fd, 0, NULL);
+            return HANDLER_CLOSED;
+        }
+        else if (request_sent_to_backend == 0)
+        {
+            return HANDLER_OK;
+        }
+
+        if (buffer_available_data(&conn->rebuilt_request_buffer) == 0)
+        {
+            /** Switch backend socket to EPOLLIN so we can read the response next */
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLERR | EPOLLHUP;
+            event.data.ptr = conn;
+            if (epoll_server_modify(epoll_fd, conn->backend_fd, &event) < 0)
+            {
+                log_error("handle_backend_writable: Failed to modify backend fd to EPOLLIN\n");
+                conn->state = CONN_ERROR;
+                return HANDLER_ERROR;
+            }
+
+            conn->state = CONN_READING_RESPONSE;
+        }
+
+        /**else part---> Keep EPOLLOUT, will try again on next event */
+    }
+    return HANDLER_OK;
+}
+
+/**
+ * Send what the compressor produced so far. EPOLLOUT is only watched while
+ * compressed bytes wait: an empty output is refilled by the workers, not by
+ * the socket draining.
+ */
+static handler_status_t send_compressed(connection_t *conn, int epoll_fd)
+{
+    buffer_t *out = compress_output(conn->compress);
+
+    if (conn->is_refresh)
+        return compress_finished(conn->compress) ? HANDLER_CLOSED : HANDLER_OK;
+
+    if (buffer_available_data(out) > 0)
+    {
+        ssize_t sent = buffer_write_to_fd(out, conn->client_fd);
+        if (sent == -1)
+        {
+            log_error("send_compressed: Client send error");
             conn->state = CONN_ERROR;
             return HANDLER_ERROR;
         }
+        else if (sent == -2)
+        {
+            DEBUG_PRINT("send_compressed: Client closed connection");
+            return HANDLER_CLOSED;
+        }
+    }
+
+    bool waiting = buffer_available_data(out) > 0;
+    if (!waiting && compress_finished(conn->compress))
+    {
+        conn->state = CONN_DONE;
+        return HANDLER_CLOSED;
+    }
+
+    if (waiting != conn->client_epollout)
+    {
+        struct epoll_event event;
+        event.events = (waiting ? EPOLLOUT : 0) | EPOLLERR | EPOLLHUP;
+        event.data.ptr = conn;
+        if (epoll_server_modify(epoll_fd, conn->client_fd, &event) < 0)
+        {
+            log_error("send_compressed: Failed to modify client fd %d\n", conn->client_fd);
+            conn->state = CONN_ERROR;
+            return HANDLER_ERROR;
+        }
+        conn->client_epollout = waiting;
+    }
+    return HANDLER_OK;
+}
+
+/**
+ * The response head is in (or the backend gave up before it): compress the
+ * response if it qualifies, otherwise it is relayed as it is.
+ * Returns false while the head is still incomplete.
+ */
+static bool decide_compression(connection_t *conn)
+{
+    const char *data = conn->response_buffer.data;
+    size_t len = conn->response_buffer.len;
+    const char *end = len ? memmem(data, len, "\r\n\r\n", 4) : NULL;
+    if (!end && conn->state != CONN_BACKEND_EOF && len < 64 * 1024)
+        return false;
 
-        DEBUG_PRINT("Connected to backend %s:%d\n",
-                    conn->selected_backend->host, conn->selected_backend->port);
+    conn->compress_pending = false;
+    if (end)
+    {
+        size_t head_len = end + 4 - data;
+        long min_bytes = conn->selected_backend->compress_min_bytes;
+        if (compress_eligible(data, head_len, -1, min_bytes ? (size_t)min_bytes : COMPRESS_MIN_BYTES))
+            conn->compress = compress_start(conn, data, head_len);
+        if (conn->compress)
+        {
+            /** From here response_buffer.offset marks what the compressor has taken */
+            conn->response_buffer.offset = head_len;
 
-        conn->state = CONN_SENDING_REQUEST;
+            /** The client fd still watches EPOLLIN from reading the request */
+            conn->client_epollout = true;
+        }
     }
 
-    if (conn->state == CONN_SENDING_REQUEST)
+    if (!conn->compress)
     {
-        /**epoll: "now watch for writable, so we can send the request" */
-        ssize_t request_sent_to_backend = buffer_write_to_fd(&conn->rebuilt_request_buffer, conn->backend_fd);
+        free(conn->compress_key);
+        conn->compress_key = NULL;
+    }
+    return true;
+}
 
-        if (request_sent_to_backend == -1)
+/**
+ * Feed new backend bytes to the compressor and send what is ready. The raw
+ * bytes stay in response_buffer for the plain cache copy and followers.
+ */
+static handler_status_t relay_compressed(connection_t *conn, int epoll_fd)
+{
+    buffer_t *raw = &conn->response_buffer;
+    bool eof = conn->state == CONN_BACKEND_EOF;
+
+    if (conn->is_refresh && raw->len > RESPONSE_CACHE_MAX_OBJECT_BYTES)
+    {
+        conn->state = CONN_ERROR;
+        return HANDLER_ERROR;
+    }
+
+    if (buffer_available_data(raw) > 0 || eof)
+    {
+        if (compress_feed(conn->compress, buffer_read_ptr(raw), buffer_available_data(raw), eof) != 0)
         {
-            log_error("handle_backend_writable: Failed to forward request to backend %s:%d\n",
-                      conn->selected_backend->host, conn->selected_backend->port);
-            send_http_error(conn->client_fd, 502, "Bad Gateway");
+            log_error("relay_compressed: Failed to compress response for client %d\n", conn->client_fd);
             conn->state = CONN_ERROR;
             return HANDLER_ERROR;
         }
-        else if (request_sent_to_backend == -2)
-        {
-            DEBUG_PRINT("Backend closed connection during request send");
-            return HANDLER_CLOSED;
-        }
-        else if (request_sent_to_backend == 0)
-        {
-            return HANDLER_OK;
-        }
+        raw->offset = raw->len;
+    }
 
-        if (buffer_available_data(&conn->rebuilt_request_buffer) == 0)
-        {
-            /** Switch backend socket to EPOLLIN so we can read the response next */
-            struct epoll_event event;
-            event.events = EPOLLIN | EPOLLERR | EPOLLHUP;
-            event.data.ptr = conn;
-            if (epoll_server_modify(epoll_fd, conn->backend_fd, &event) < 0)
-            {
-                log_error("handle_backend_writable: Failed to modify backend fd to EPOLLIN\n");
-                conn->state = CONN_ERROR;
-                return HANDLER_ERROR;
-            }
+    if (eof && conn->backend_fd >= 0)
+    {
+        /** Already removed from epoll; the workers finish the response */
+        upstream_socket_close(conn->backend_fd);
+        conn->backend_fd = -1;
+    }
+    conn->state = CONN_COMPRESSING;
+    return send_compressed(conn, epoll_fd);
+}
 
-            conn->state = CONN_READING_RESPONSE;
-        }
+/**
+ * Keep the finished gzip copy of a cacheable response, unless the backend
+ * closed before sending the Content-Length it announced.
+ */
+static void store_compressed(connection_t *conn)
+{
+    if (!conn->compress_key)
+        return;
 
-        /**else part---> Keep EPOLLOUT, will try again on next event */
+    http_cache_policy_t policy;
+    buffer_t *raw = &conn->response_buffer;
+    if (http_cache_parse_response(raw->data, raw->len, time(NULL), &policy) != 0 ||
+        (policy.content_length >= 0 && raw->len - policy.header_len != (size_t)policy.content_length))
+        return;
+
+    buffer_t *out = compress_output(conn->compress);
+    int stored = response_cache_store(conn->compress_key, &conn->parsed_request, out->data, out->len);
+    disk_cache_store(conn->compress_key, &conn->parsed_request, out->data, out->len);
+    if (conn->refresh_entry)
+    {
+        response_cache_refresh_end(conn->refresh_entry, stored == 0);
+        conn->refresh_entry = NULL;
     }
-    return HANDLER_OK;
 }
 
-handler_status_t handle_backend_readable(connection_t *conn, int epoll_fd)
+/**
+ * Handle what a backend read returned (bytes as from buffer_read_from_fd(),
+ * already appended to response_buffer): store on EOF, feed followers, relay
+ * to the client. h2c streams come here too, without a backend_fd.
+ */
+static handler_status_t relay_backend_bytes(connection_t *conn, int epoll_fd, ssize_t bytes)
 {
-    if (conn->state != CONN_READING_RESPONSE)
+    /** Reset or EOF before the peer sent anything: it is broken, not the origin */
+    if (conn->peer.node && (bytes == -1 || bytes == -2))
     {
-        return HANDLER_OK;
+        return peer_fallback(conn, epoll_fd);
     }
-    DEBUG_PRINT("DEBUG: About to read from backend fd=%d\n", conn->backend_fd);
-    ssize_t bytes = buffer_read_from_fd(&conn->response_buffer, conn->backend_fd);
-    DEBUG_PRINT("DEBUG: buffer_read_from_fd returned %zd\n", bytes);
 
     if (bytes == -1)
     {
         log_error("handle_backend_readable: Backend read error");
-        conn->state = CONN_ERROR;
-        return HANDLER_ERROR;
+        /** Nothing relayed yet (e.g. a Fast Open connect refused only now): the client can still get a 502 */
+        if (!conn->backend_responded)
+            return fail_upstream(conn, epoll_fd, 502, "Bad Gateway");
+        return fail_upstream(conn, epoll_fd, 0, NULL);
     }
     else if (bytes == -2)
     {
         DEBUG_PRINT("handle_backend_readable: Backend sent EOF");
         conn->state = CONN_BACKEND_EOF;
+
+        /**
+         * The backend closes after every response, so EOF means complete.
+         * response_buffer is never compacted: it still holds every byte from
+         * the status line on, including what was already relayed.
+         */
+        coalesce_leader_complete(conn);
+
+        /** The RTT ends here, not when the client has taken the last byte */
+        upstream_limiter_finish(conn);
+        if (conn->cache_key)
+        {
+            int stored = response_cache_store(conn->cache_key, &conn->parsed_request,
+                                              conn->response_buffer.data, conn->response_buffer.len);
+            disk_cache_store(conn->cache_key, &conn->parsed_request,
+                             conn->response_buffer.data, conn->response_buffer.len);
+            /** A refresh of a gzip copy ends when the new copy is compressed */
+            if (conn->refresh_entry && !conn->compress_key)
+            {
+                response_cache_refresh_end(conn->refresh_entry, stored == 0);
+                conn->refresh_entry = NULL;
+            }
+        }
         epoll_server_delete(epoll_fd, conn->backend_fd);
     }
     else if (bytes == 0)
@@ -243,10 +1082,75 @@ handler_status_t handle_backend_readable(connection_t *conn, int epoll_fd)
     else if (bytes > 0)
     {
         DEBUG_PRINT("DEBUG: Read %zd bytes from backend\n", bytes);
+        conn->backend_responded = true;
+
+        /** The peer answered: from here on its response is handled like the origin's */
+        peer_report(conn, true, clock_now_ms());
+
+        /** Followers of this request get the same bytes */
+        if (conn->coalesce.leader)
+        {
+            coalesce_leader_data(conn, conn->response_buffer.data + conn->response_buffer.len - bytes, bytes);
+        }
+    }
+    /** Upgrade: a 101 turns the connection into a tunnel, anything else is relayed as usual */
+    if (conn->tunnel.requested && conn->state == CONN_READING_RESPONSE)
+    {
+        const char *data = conn->response_buffer.data;
+        size_t len = conn->response_buffer.len;
+        if (!memmem(data, len, "\r\n\r\n", 4) && len < 64 * 1024)
+            return HANDLER_OK;
+        if (tunnel_accepted(data, len))
+            return enter_tunnel(conn, epoll_fd);
+        conn->tunnel.requested = false;
+    }
+
+    /**
+     * stale-if-error: relay nothing until the status line shows the backend
+     * did not fail. On 500/502/503/504, or EOF before a complete head, the
+     * client gets the stale copy instead.
+     */
+    if (conn->stale_entry)
+    {
+        const char *data = conn->response_buffer.data;
+        size_t len = conn->response_buffer.len;
+        bool head_done = len > 0 && memmem(data, len, "\r\n\r\n", 4) != NULL;
+        if (!head_done && conn->state != CONN_BACKEND_EOF && len < 64 * 1024)
+            return HANDLER_OK;
+
+        int status = 0;
+        if (head_done)
+            sscanf(data, "HTTP/1.%*d %d", &status);
+        if (!head_done || status == 500 || status == 502 || status == 503 || status == 504)
+            return fail_upstream(conn, epoll_fd, 0, NULL);
+
+        response_cache_release(conn->stale_entry);
+        conn->stale_entry = NULL;
     }
+
+    /** compress=on: the client gets the gzipped stream instead of the raw bytes */
+    if (conn->compress_pending && !decide_compression(conn))
+        return HANDLER_OK;
+    if (conn->compress)
+        return relay_compressed(conn, epoll_fd);
+
+    if (conn->is_refresh)
+    {
+        /** Background refresh: nobody to relay to, the response only goes into the cache */
+        if (conn->state == CONN_BACKEND_EOF)
+            return HANDLER_CLOSED;
+        if (conn->response_buffer.len > RESPONSE_CACHE_MAX_OBJECT_BYTES)
+        {
+            conn->state = CONN_ERROR;
+            return HANDLER_ERROR;
+        }
+        return HANDLER_OK;
+    }
+
     /**Always check for data to send, even after EOF */
     if (buffer_available_data(&conn->response_buffer) > 0)
     {
+        bool eof = conn->state == CONN_BACKEND_EOF;
         conn->state = CONN_SENDING_RESPONSE;
         ssize_t sent = buffer_write_to_fd(&conn->response_buffer, conn->client_fd);
         if (sent == -1)
@@ -264,10 +1168,9 @@ handler_status_t handle_backend_readable(connection_t *conn, int epoll_fd)
         {
             if (buffer_available_data(&conn->response_buffer) == 0)
             {
-                if (conn->state == CONN_BACKEND_EOF)
+                if (eof)
                 {
                     DEBUG_PRINT("handle_backend_readable: Backend EOF and all data sent - closing");
-                    epoll_server_delete(epoll_fd, conn->backend_fd);
                     return HANDLER_CLOSED;
                 }
                 else
@@ -278,6 +1181,13 @@ handler_status_t handle_backend_readable(connection_t *conn, int epoll_fd)
             }
             else
             {
+                /** The backend is done (already out of epoll): the client drains the rest alone */
+                if (eof && conn->backend_fd >= 0)
+                {
+                    upstream_socket_close(conn->backend_fd);
+                    conn->backend_fd = -1;
+                }
+
                 /**Partial send - enable EPOLLOUT for client */
                 conn->state = CONN_SENDING_RESPONSE;
                 struct epoll_event event;
@@ -304,17 +1214,66 @@ handler_status_t handle_backend_readable(connection_t *conn, int epoll_fd)
     return HANDLER_OK;
 }
 
+handler_status_t handle_backend_readable(connection_t *conn, int epoll_fd)
+{
+    if (conn->state == CONN_SENDING_RESPONSE)
+    {
+        /**
+         * Keep reading while the client is behind, so the backend finishes
+         * (and frees its upstream slot) on its own time, not the client's.
+         * Past UPSTREAM_READAHEAD_BYTES unsent, wait until the client drains.
+         */
+        if (buffer_available_data(&conn->response_buffer) >= UPSTREAM_READAHEAD_BYTES)
+        {
+            struct epoll_event backend_event;
+            backend_event.events = EPOLLERR | EPOLLHUP;
+            backend_event.data.ptr = conn;
+            if (epoll_server_modify(epoll_fd, conn->backend_fd, &backend_event) < 0)
+            {
+                log_error("handle_backend_readable: failed to pause backend fd %d", conn->backend_fd);
+                conn->state = CONN_ERROR;
+                return HANDLER_ERROR;
+            }
+            return HANDLER_OK;
+        }
+    }
+    else if (conn->state != CONN_READING_RESPONSE && conn->state != CONN_COMPRESSING)
+    {
+        return HANDLER_OK;
+    }
+    DEBUG_PRINT("DEBUG: About to read from backend fd=%d\n", conn->backend_fd);
+    ssize_t bytes = buffer_read_from_fd(&conn->response_buffer, conn->backend_fd);
+    DEBUG_PRINT("DEBUG: buffer_read_from_fd returned %zd\n", bytes);
+
+    return relay_backend_bytes(conn, epoll_fd, bytes);
+}
+
 handler_status_t handle_client_writable(connection_t *conn, int epoll_fd)
 {
     if (conn->state == CONN_DONE)
     {
         return HANDLER_CLOSED;
     }
+    else if (conn->state == CONN_COMPRESSING)
+    {
+        return send_compressed(conn, epoll_fd);
+    }
     else if (conn->state != CONN_SENDING_RESPONSE)
     {
         return HANDLER_OK;
     }
 
+    if (conn->cache_reply.entry || conn->disk_reply.active || conn->static_reply.active)
+    {
+        return send_cached_reply(conn, epoll_fd);
+    }
+
+    if (!conn->coalesce.leader && (conn->coalesce.flight || conn->coalesce.pending))
+    {
+        /** Detached followers wait for handle_coalesced() to decide */
+        return conn->coalesce.flight ? send_coalesced(conn, epoll_fd) : HANDLER_OK;
+    }
+
     /**Always try to send when in SENDING_RESPONSE state */
     ssize_t sent = buffer_write_to_fd(&conn->response_buffer, conn->client_fd);
 
@@ -339,6 +1298,26 @@ handler_status_t handle_client_writable(connection_t *conn, int epoll_fd)
                 epoll_server_delete(epoll_fd, conn->backend_fd);
                 return HANDLER_CLOSED;
             }
+            else if (conn->h2.upstream)
+            {
+                /** h2c: the stream gets its window back, the client only watches for hangups */
+                conn->state = CONN_READING_RESPONSE;
+                struct epoll_event client_event;
+                client_event.events = EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+                client_event.data.ptr = conn;
+                if (epoll_server_modify(epoll_fd, conn->client_fd, &client_event) < 0)
+                {
+                    log_error("handle_client_writable: failed to modify client fd %d", conn->client_fd);
+                    conn->state = CONN_ERROR;
+                    return HANDLER_ERROR;
+                }
+                h2_upstream_consumed(conn, epoll_fd);
+            }
+            else if (conn->backend_fd < 0)
+            {
+                DEBUG_PRINT("handle_client_writable: Backend finished earlier and all data sent - closing connection");
+                return HANDLER_CLOSED;
+            }
             else
             {
                 /**Switch back to reading from backend */
@@ -374,4 +1353,239 @@ handler_status_t handle_client_writable(connection_t *conn, int epoll_fd)
         }
     }
     return HANDLER_OK;
-}
\ No newline at end of file
+}
+handler_status_t handle_connection_error(connection_t *conn, int epoll_fd)
+{
+    (void)epoll_fd;
+    DEBUG_PRINT("handle_connection_error: client_fd=%d backend_fd=%d state=%d",
+                conn->client_fd, conn->backend_fd, conn->state);
+    conn->state = CONN_ERROR;
+    return HANDLER_ERROR;
+}
+
+void handle_upstream_queue(int epoll_fd)
+{
+    uint64_t now = clock_now_ms();
+    connection_t *conn;
+
+    /** Requests that waited too long: the backend is saturated, fail fast */
+    while ((conn = upstream_limiter_pop_expired(now)) != NULL)
+    {
+        log_error("handle_upstream_queue: Queue deadline passed for client %d\n", conn->client_fd);
+        if (fail_upstream(conn, epoll_fd, 503, "Service Unavailable") != HANDLER_OK)
+            connection_schedule_free(conn);
+    }
+
+    /** Slots freed by finished requests → dispatch waiting ones in FIFO order */
+    while ((conn = upstream_limiter_pop_ready()) != NULL)
+    {
+        if (conn->is_refresh)
+        {
+            if (connect_backend(conn, epoll_fd) != HANDLER_OK)
+                connection_schedule_free(conn);
+            continue;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_server_modify(epoll_fd, conn->client_fd, &event) < 0)
+        {
+            log_error("handle_upstream_queue: Failed to re-arm client fd %d\n", conn->client_fd);
+            conn->state = CONN_ERROR;
+            connection_schedule_free(conn);
+            continue;
+        }
+
+        if (connect_backend(conn, epoll_fd) != HANDLER_OK)
+        {
+            connection_schedule_free(conn);
+        }
+    }
+}
+
+void handle_peer_timeouts(int epoll_fd)
+{
+    connection_t *conn;
+
+    /** Peers that did not connect or answer in time: the origin serves these requests */
+    while ((conn = peer_pop_expired(clock_now_ms())) != NULL)
+    {
+        if (peer_fallback(conn, epoll_fd) != HANDLER_OK)
+            connection_schedule_free(conn);
+    }
+}
+
+void handle_coalesced(int epoll_fd)
+{
+    connection_t *conn;
+
+    /** Followers that waited too long for the leader's head go upstream */
+    coalesce_expire(clock_now_ms());
+
+    while ((conn = coalesce_pop_pending()) != NULL)
+    {
+        if (conn->should_free_conn)
+            continue;
+
+        struct epoll_event event;
+        event.data.ptr = conn;
+
+        if (conn->coalesce.flight)
+        {
+            /** New bytes in the shared chain */
+            conn->state = CONN_SENDING_RESPONSE;
+            event.events = EPOLLOUT | EPOLLERR | EPOLLHUP;
+            if (epoll_server_modify(epoll_fd, conn->client_fd, &event) < 0)
+            {
+                log_error("handle_coalesced: Failed to modify client fd %d to EPOLLOUT\n", conn->client_fd);
+                conn->state = CONN_ERROR;
+                connection_schedule_free(conn);
+            }
+            continue;
+        }
+
+        if (conn->coalesce.sent > 0)
+        {
+            /** Lost the flight halfway through the response: same fate as the leader's client */
+            conn->state = CONN_ERROR;
+            connection_schedule_free(conn);
+            continue;
+        }
+
+        /** Nothing sent yet: do the request ourselves */
+        event.events = EPOLLIN;
+        if (epoll_server_modify(epoll_fd, conn->client_fd, &event) < 0)
+        {
+            log_error("handle_coalesced: Failed to re-arm client fd %d\n", conn->client_fd);
+            conn->state = CONN_ERROR;
+            connection_schedule_free(conn);
+            continue;
+        }
+
+        if (dispatch_upstream(conn, epoll_fd) != HANDLER_OK)
+        {
+            connection_schedule_free(conn);
+        }
+    }
+}
+
+void handle_compress_done(int epoll_fd)
+{
+    connection_t *conn;
+    compress_result_t result;
+
+    while ((conn = compress_pop_done(&result)) != NULL)
+    {
+        if (conn->should_free_conn)
+            continue;
+
+        handler_status_t status;
+        if (result == COMPRESS_FAILED)
+        {
+            /** Part of the response may be out already: all we can do is close */
+            log_error("handle_compress_done: Compression failed for client %d\n", conn->client_fd);
+            conn->state = CONN_ERROR;
+            status = HANDLER_ERROR;
+        }
+        else
+        {
+            if (result == COMPRESS_FINISHED)
+                store_compressed(conn);
+            status = send_compressed(conn, epoll_fd);
+        }
+
+        if (status != HANDLER_OK || conn->state == CONN_DONE)
+            connection_schedule_free(conn);
+    }
+}
+
+handler_status_t handle_tunnel(connection_t *conn, int epoll_fd, uint32_t events)
+{
+    int rc = tunnel_pump(conn, epoll_fd, events, clock_now_ms());
+    if (rc < 0)
+    {
+        conn->state = CONN_ERROR;
+        return HANDLER_ERROR;
+    }
+    if (rc > 0)
+    {
+        conn->state = CONN_DONE;
+        return HANDLER_CLOSED;
+    }
+    return HANDLER_OK;
+}
+
+void handle_tunnel_timeouts(int epoll_fd)
+{
+    connection_t *conn;
+
+    while ((conn = tunnel_pop_expired(clock_now_ms())) != NULL)
+    {
+        conn->state = CONN_DONE;
+        connection_schedule_free(conn);
+    }
+
+    connection_t *next;
+    for (conn = tunnel_take_flushing(clock_now_ms()); conn; conn = next)
+    {
+        next = conn->tunnel.flush_next;
+        if (!conn->should_free_conn && handle_tunnel(conn, epoll_fd, 0) != HANDLER_OK)
+            connection_schedule_free(conn);
+    }
+}
+
+handler_status_t handle_h2_upstream(connection_t *session, int epoll_fd, uint32_t events)
+{
+    h2_upstream_io(session, epoll_fd, events);
+    handle_h2_streams(epoll_fd);
+    return HANDLER_OK;
+}
+
+void handle_h2_streams(int epoll_fd)
+{
+    connection_t *conn;
+    ssize_t bytes;
+
+    while ((conn = h2_upstream_pop_ready(&bytes)) != NULL)
+    {
+        if (conn->should_free_conn)
+            continue;
+
+        handler_status_t status;
+        if (bytes == -1 && conn->response_buffer.len == 0)
+        {
+            /** Failed before the response head: the client gets a 502 (or the stale copy) */
+            status = fail_upstream(conn, epoll_fd, 502, "Bad Gateway");
+        }
+        else
+        {
+            status = relay_backend_bytes(conn, epoll_fd, bytes);
+        }
+
+        if (status != HANDLER_OK || conn->state == CONN_DONE)
+            connection_schedule_free(conn);
+        else if (conn->state != CONN_SENDING_RESPONSE)
+            h2_upstream_consumed(conn, epoll_fd);
+    }
+}
+
+handler_status_t handle_h2_client(connection_t *conn, int epoll_fd)
+{
+    if (h2_server_io(conn, epoll_fd) != 0)
+    {
+        conn->state = CONN_DONE;
+        return HANDLER_CLOSED;
+    }
+    return HANDLER_OK;
+}
+
+handler_status_t handle_tls(connection_t *conn, int epoll_fd)
+{
+    if (tls_io(conn, epoll_fd) != 0)
+    {
+        conn->state = CONN_DONE;
+        return HANDLER_CLOSED;
+    }
+    return HANDLER_OK;
+}
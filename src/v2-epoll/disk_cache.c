@@ -0,0 +1,601 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <v2-epoll/disk_cache.h>
+#include <v2-epoll/clock.h>
+#include <common/http_cache.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+#define DISK_RECORD_MAGIC 0x43445054u /**< "TPDC" */
+#define DISK_INDEX_MAGIC 0x58445054u  /**< "TPDX" */
+#define DISK_INDEX_VERSION 1
+
+/** Record header at the start of every log record */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t total_len;      /**< Whole record, aligned */
+    uint64_t hash;           /**< Hash of the primary key */
+    uint64_t checksum;       /**< FNV-1a of everything after the header */
+    int64_t stored_s;        /**< Wall clock time the response was stored */
+    int64_t expires_s;       /**< Wall clock time it stops being fresh */
+    uint32_t initial_age_s;  /**< Age it already had when stored */
+    uint32_t head_len;
+    uint32_t body_len;
+    uint16_t key_len;        /**< Including the NUL */
+    uint16_t vary_len;       /**< Including the NUL */
+    uint16_t values_len;     /**< Including the NUL */
+    uint16_t reserved;
+} disk_record_t;
+
+typedef struct
+{
+    uint64_t hash; /**< 0 = empty slot */
+    uint64_t pos;  /**< Log position of the record */
+    uint32_t len;
+    uint32_t verified; /**< Checksum checked (or written by this process) */
+} disk_index_entry_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    uint64_t write_pos;
+    uint64_t count;
+} disk_index_header_t;
+
+typedef struct
+{
+    bool ready;
+    int fd;
+    char *map;
+    uint64_t capacity;
+    uint64_t write_pos; /**< Log position of the next record */
+
+    disk_index_entry_t *slots;
+    size_t slot_count; /**< Power of two */
+    size_t used;
+
+    char index_path[PATH_MAX];
+    bool dirty;
+    uint64_t dirty_since_ms;
+
+    disk_reply_t *pinned; /**< Replies in progress */
+} disk_cache_t;
+
+static disk_cache_t disk = {.fd = -1};
+
+static uint64_t fnv1a(const void *data, size_t len, uint64_t h)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t hash_key(const char *key)
+{
+    uint64_t h = fnv1a(key, strlen(key), 1469598103934665603ULL);
+    return h ? h : 1; /** 0 marks an empty slot */
+}
+
+static void mark_dirty(void)
+{
+    if (!disk.dirty)
+    {
+        disk.dirty = true;
+        disk.dirty_since_ms = clock_now_ms();
+    }
+}
+
+/** The log has not wrapped over this record yet */
+static bool record_intact(uint64_t pos, uint32_t len)
+{
+    if (pos + len > disk.write_pos)
+        return false;
+    return disk.write_pos <= disk.capacity || pos >= disk.write_pos - disk.capacity;
+}
+
+static disk_record_t *record_at(uint64_t pos)
+{
+    return (disk_record_t *)(disk.map + pos % disk.capacity);
+}
+
+static uint64_t record_checksum(const disk_record_t *rec)
+{
+    size_t payload = (size_t)rec->key_len + rec->vary_len + rec->values_len + rec->head_len + rec->body_len;
+    return fnv1a(rec + 1, payload, 1469598103934665603ULL);
+}
+
+/* ---------------- Index (linear probing) ---------------- */
+
+static disk_index_entry_t *slot_find(uint64_t hash)
+{
+    size_t mask = disk.slot_count - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        if (disk.slots[i].hash == hash)
+            return &disk.slots[i];
+        if (disk.slots[i].hash == 0)
+            return NULL;
+    }
+}
+
+/** Backward-shift deletion: keeps probe chains intact without tombstones */
+static void slot_remove(disk_index_entry_t *e)
+{
+    size_t mask = disk.slot_count - 1;
+    size_t i = e - disk.slots;
+    size_t j = i;
+
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (disk.slots[j].hash == 0)
+            break;
+        size_t home = disk.slots[j].hash & mask;
+        bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (stays)
+            continue;
+        disk.slots[i] = disk.slots[j];
+        i = j;
+    }
+    disk.slots[i].hash = 0;
+    disk.used--;
+    mark_dirty();
+}
+
+static void slot_put(uint64_t hash, uint64_t pos, uint32_t len, bool verified)
+{
+    size_t mask = disk.slot_count - 1;
+    size_t i = hash & mask;
+    while (disk.slots[i].hash != 0 && disk.slots[i].hash != hash)
+        i = (i + 1) & mask;
+
+    if (disk.slots[i].hash == 0)
+        disk.used++;
+    disk.slots[i].hash = hash;
+    disk.slots[i].pos = pos;
+    disk.slots[i].len = len;
+    disk.slots[i].verified = verified;
+}
+
+/** Drop entries whose record the log has overwritten */
+static void index_sweep(void)
+{
+    for (size_t i = 0; i < disk.slot_count;)
+    {
+        disk_index_entry_t *e = &disk.slots[i];
+        if (e->hash != 0 && !record_intact(e->pos, e->len))
+            slot_remove(e); /** may shift another entry into slot i, look at it again */
+        else
+            i++;
+    }
+}
+
+static bool index_full(void)
+{
+    return disk.used >= disk.slot_count / 4 * 3;
+}
+
+/* ---------------- Snapshot ---------------- */
+
+static void write_snapshot(void)
+{
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", disk.index_path);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f)
+    {
+        log_errno("disk_cache: Failed to write index snapshot %s", tmp_path);
+        return;
+    }
+
+    disk_index_header_t header = {
+        .magic = DISK_INDEX_MAGIC,
+        .version = DISK_INDEX_VERSION,
+        .capacity = disk.capacity,
+        .write_pos = disk.write_pos,
+        .count = 0,
+    };
+    for (size_t i = 0; i < disk.slot_count; i++)
+    {
+        if (disk.slots[i].hash != 0 && record_intact(disk.slots[i].pos, disk.slots[i].len))
+            header.count++;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    for (size_t i = 0; ok && i < disk.slot_count; i++)
+    {
+        if (disk.slots[i].hash != 0 && record_intact(disk.slots[i].pos, disk.slots[i].len))
+            ok = fwrite(&disk.slots[i], sizeof(disk_index_entry_t), 1, f) == 1;
+    }
+    if (fclose(f) != 0)
+        ok = false;
+
+    if (!ok || rename(tmp_path, disk.index_path) != 0)
+    {
+        log_errno("disk_cache: Failed to save index snapshot %s", disk.index_path);
+        unlink(tmp_path);
+        return;
+    }
+
+    disk.dirty = false;
+    DEBUG_PRINT("disk_cache: saved index snapshot (%llu entries)\n", (unsigned long long)header.count);
+}
+
+static void load_snapshot(void)
+{
+    FILE *f = fopen(disk.index_path, "rb");
+    if (!f)
+        return; /** First start: cold */
+
+    disk_index_header_t header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != DISK_INDEX_MAGIC ||
+        header.version != DISK_INDEX_VERSION || header.capacity != disk.capacity)
+    {
+        log_error("disk_cache: Ignoring incompatible index snapshot %s", disk.index_path);
+        fclose(f);
+        return;
+    }
+
+    disk.write_pos = header.write_pos;
+
+    size_t loaded = 0;
+    disk_index_entry_t e;
+    for (uint64_t n = 0; n < header.count && !index_full(); n++)
+    {
+        if (fread(&e, sizeof(e), 1, f) != 1)
+            break;
+        if (e.hash == 0 || !record_intact(e.pos, e.len))
+            continue;
+        /** The log may have moved on after this snapshot: check the data on first use */
+        slot_put(e.hash, e.pos, e.len, false);
+        loaded++;
+    }
+    fclose(f);
+
+    printf("Disk cache: loaded %zu entries from %s\n", loaded, disk.index_path);
+}
+
+/* ---------------- Public API ---------------- */
+
+int disk_cache_open(const char *path, int wait_ms)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        log_errno("disk_cache_open: Failed to open %s", path);
+        return -1;
+    }
+
+    /** One owner at a time; during an upgrade the old process lets go shortly */
+    int waited = 0;
+    while (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        if (errno != EWOULDBLOCK || waited >= wait_ms)
+        {
+            log_error("disk_cache_open: %s is in use by another process", path);
+            close(fd);
+            return -1;
+        }
+        usleep(10000);
+        waited += 10;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((uint64_t)st.st_size != DISK_CACHE_BYTES && ftruncate(fd, DISK_CACHE_BYTES) != 0))
+    {
+        log_errno("disk_cache_open: Failed to size %s", path);
+        close(fd);
+        return -1;
+    }
+
+    char *map = mmap(NULL, DISK_CACHE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        log_errno("disk_cache_open: Failed to map %s", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t slot_count = 1024;
+    while (slot_count < DISK_CACHE_BYTES / DISK_CACHE_AVG_OBJECT * 2)
+        slot_count <<= 1;
+    disk_index_entry_t *slots = calloc(slot_count, sizeof(disk_index_entry_t));
+    if (!slots)
+    {
+        log_errno("disk_cache_open: Failed to allocate index");
+        munmap(map, DISK_CACHE_BYTES);
+        close(fd);
+        return -1;
+    }
+
+    disk.fd = fd;
+    disk.map = map;
+    disk.capacity = DISK_CACHE_BYTES;
+    disk.write_pos = 0;
+    disk.slots = slots;
+    disk.slot_count = slot_count;
+    disk.used = 0;
+    snprintf(disk.index_path, sizeof(disk.index_path), "%s.idx", path);
+
+    load_snapshot();
+    disk.dirty = false;
+    disk.ready = true;
+    return 0;
+}
+
+void disk_cache_release(void)
+{
+    if (!disk.ready)
+        return;
+
+    write_snapshot();
+    flock(disk.fd, LOCK_UN);
+    disk.ready = false;
+}
+
+bool disk_cache_lookup(const char *key, const HttpRequest *req, disk_reply_t *reply)
+{
+    if (!disk.ready)
+        return false;
+
+    uint64_t hash = hash_key(key);
+    disk_index_entry_t *e = slot_find(hash);
+    if (!e)
+        return false;
+
+    disk_record_t *rec = record_at(e->pos);
+    if (!record_intact(e->pos, e->len) || rec->magic != DISK_RECORD_MAGIC ||
+        rec->hash != hash || rec->total_len != e->len)
+    {
+        slot_remove(e);
+        return false;
+    }
+    if (!e->verified)
+    {
+        if (record_checksum(rec) != rec->checksum)
+        {
+            DEBUG_PRINT("disk_cache: %s was overwritten after the snapshot\n", key);
+            slot_remove(e);
+            return false;
+        }
+        e->verified = 1;
+    }
+
+    const char *p = (const char *)(rec + 1);
+    const char *stored_key = p;
+    const char *vary = stored_key + rec->key_len;
+    const char *values = vary + rec->vary_len;
+    const char *head = values + rec->values_len;
+
+    if (strcmp(stored_key, key) != 0)
+        return false;
+
+    int64_t now = (int64_t)time(NULL);
+    if (now >= rec->expires_s)
+        return false;
+
+    if (vary[0])
+    {
+        char mine[HTTP_CACHE_MAX_KEY];
+        if (http_cache_vary_values(req, vary, mine, sizeof(mine)) < 0 || strcmp(mine, values) != 0)
+            return false;
+    }
+
+    int64_t age = (int64_t)rec->initial_age_s + (now > rec->stored_s ? now - rec->stored_s : 0);
+    int n = snprintf(reply->extra, sizeof(reply->extra), "Age: %lld\r\nX-Cache: HIT\r\n\r\n", (long long)age);
+
+    reply->active = true;
+    reply->pos = e->pos;
+    reply->head = head;
+    reply->head_len = rec->head_len;
+    reply->extra_len = (n > 0 && (size_t)n < sizeof(reply->extra)) ? (size_t)n : 0;
+    reply->body_off = (off_t)((head + rec->head_len) - disk.map);
+    reply->body_len = rec->body_len;
+    reply->sent = 0;
+
+    reply->pin_prev = NULL;
+    reply->pin_next = disk.pinned;
+    if (disk.pinned)
+        disk.pinned->pin_prev = reply;
+    disk.pinned = reply;
+    return true;
+}
+
+int disk_cache_store(const char *key, const HttpRequest *req, const char *resp, size_t len)
+{
+    if (!disk.ready)
+        return -1;
+
+    int64_t now = (int64_t)time(NULL);
+    http_cache_policy_t policy;
+    if (http_cache_parse_response(resp, len, now, &policy) != 0 || !policy.cacheable)
+        return -1;
+    if (policy.content_length >= 0 && (size_t)policy.content_length != len - policy.header_len)
+        return -1;
+    if ((int64_t)policy.age_s >= policy.lifetime_s)
+        return -1;
+
+    char vary_values[HTTP_CACHE_MAX_KEY] = "";
+    if (policy.vary[0] && http_cache_vary_values(req, policy.vary, vary_values, sizeof(vary_values)) < 0)
+        return -1;
+
+    size_t key_len = strlen(key) + 1;
+    size_t vary_len = strlen(policy.vary) + 1;
+    size_t values_len = strlen(vary_values) + 1;
+    size_t body_len = len - policy.header_len;
+
+    /** Upper bound (the stored head loses its Age line and blank line) */
+    size_t bound = sizeof(disk_record_t) + key_len + vary_len + values_len + policy.header_len + body_len;
+    bound = (bound + DISK_CACHE_ALIGN - 1) & ~(size_t)(DISK_CACHE_ALIGN - 1);
+    if (bound > disk.capacity / 4)
+        return -1;
+
+    uint64_t start = disk.write_pos;
+    uint64_t off = start % disk.capacity;
+    if (off + bound > disk.capacity)
+        start += disk.capacity - off; /** Doesn't fit before the end: wrap to offset 0 */
+
+    /** Never overwrite a record that is being sent */
+    uint64_t end = start + bound;
+    if (end > disk.capacity)
+    {
+        uint64_t overwrite_below = end - disk.capacity;
+        for (disk_reply_t *r = disk.pinned; r; r = r->pin_next)
+        {
+            if (r->pos < overwrite_below)
+                return -1;
+        }
+    }
+
+    if (!slot_find(hash_key(key)) && index_full())
+    {
+        index_sweep();
+        if (index_full())
+            return -1;
+    }
+
+    disk_record_t *rec = record_at(start);
+    char *p = (char *)(rec + 1);
+    memcpy(p, key, key_len);
+    p += key_len;
+    memcpy(p, policy.vary, vary_len);
+    p += vary_len;
+    memcpy(p, vary_values, values_len);
+    p += values_len;
+    size_t head_len = http_cache_copy_head(p, resp, policy.header_len);
+    p += head_len;
+    memcpy(p, resp + policy.header_len, body_len);
+    p += body_len;
+
+    size_t total = (size_t)(p - (char *)rec);
+    total = (total + DISK_CACHE_ALIGN - 1) & ~(size_t)(DISK_CACHE_ALIGN - 1);
+
+    rec->magic = DISK_RECORD_MAGIC;
+    rec->total_len = (uint32_t)total;
+    rec->hash = hash_key(key);
+    rec->stored_s = now;
+    rec->expires_s = now + (policy.lifetime_s - policy.age_s);
+    rec->initial_age_s = policy.age_s;
+    rec->head_len = (uint32_t)head_len;
+    rec->body_len = (uint32_t)body_len;
+    rec->key_len = (uint16_t)key_len;
+    rec->vary_len = (uint16_t)vary_len;
+    rec->values_len = (uint16_t)values_len;
+    rec->reserved = 0;
+    rec->checksum = record_checksum(rec);
+
+    disk.write_pos = start + total;
+    slot_put(rec->hash, start, (uint32_t)total, true);
+    mark_dirty();
+
+    DEBUG_PRINT("disk_cache: stored %s at %llu (%zu bytes)\n", key, (unsigned long long)start, total);
+    return 0;
+}
+
+ssize_t disk_cache_reply_send(disk_reply_t *reply, int fd)
+{
+    size_t prefix = reply->head_len + reply->extra_len;
+    size_t total = prefix + reply->body_len;
+
+    while (reply->sent < total)
+    {
+        ssize_t n;
+        if (reply->sent < prefix)
+        {
+            /** Head and Age/X-Cache lines; MSG_MORE lets the body share their packet */
+            struct iovec iov[2] = {
+                {.iov_base = (void *)reply->head, .iov_len = reply->head_len},
+                {.iov_base = reply->extra, .iov_len = reply->extra_len},
+            };
+            struct iovec *vec = iov;
+            int count = 2;
+            size_t skip = reply->sent;
+            if (skip >= vec->iov_len)
+            {
+                skip -= vec->iov_len;
+                vec++;
+                count--;
+            }
+            vec->iov_base = (char *)vec->iov_base + skip;
+            vec->iov_len -= skip;
+
+            struct msghdr msg = {.msg_iov = vec, .msg_iovlen = count};
+            n = sendmsg(fd, &msg, MSG_NOSIGNAL | (reply->body_len ? MSG_MORE : 0));
+        }
+        else
+        {
+            off_t off = reply->body_off + (off_t)(reply->sent - prefix);
+            n = sendfile(fd, disk.fd, &off, total - reply->sent);
+            if (n == 0)
+            {
+                log_error("disk_cache_reply_send: Data file ended early");
+                return -1;
+            }
+        }
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EPIPE || errno == ECONNRESET)
+                return -2;
+            log_errno("disk_cache_reply_send: send failed on fd %d", fd);
+            return -1;
+        }
+        reply->sent += n;
+    }
+    return 1;
+}
+
+void disk_cache_reply_cleanup(disk_reply_t *reply)
+{
+    if (!reply->active)
+        return;
+
+    if (reply->pin_prev)
+        reply->pin_prev->pin_next = reply->pin_next;
+    else
+        disk.pinned = reply->pin_next;
+    if (reply->pin_next)
+        reply->pin_next->pin_prev = reply->pin_prev;
+    reply->pin_prev = reply->pin_next = NULL;
+    reply->active = false;
+}
+
+void disk_cache_tick(uint64_t now)
+{
+    if (disk.ready && disk.dirty && now - disk.dirty_since_ms >= DISK_CACHE_SNAPSHOT_INTERVAL_MS)
+        write_snapshot();
+}
+
+int disk_cache_next_timeout(uint64_t now)
+{
+    if (!disk.ready || !disk.dirty)
+        return -1;
+
+    uint64_t due = disk.dirty_since_ms + DISK_CACHE_SNAPSHOT_INTERVAL_MS;
+    return due <= now ? 0 : (int)(due - now);
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netdb.h>
@@ -8,40 +9,68 @@
 #include <common/proxy.h>
 #include <common/error_handler.h>
 #include <v2-epoll/epoll_server.h>
+#include <v2-epoll/upstream_socket.h>
 #include <common/debug.h>
 
-int connect_to_target_nb(char *host, int port)
+/**
+ * "unix:/path" upstream: a co-located backend reached without the TCP stack
+ * (no handshake, no ephemeral port, no TIME_WAIT when it closes).
+ */
+static int connect_unix_nb(const char *path)
 {
-    char *colon = strchr(host, ':');
-    if (colon)
-    {
-        *colon = '\0'; // terminate string at ':'
-    }
-    // gethostbyname → resolve backend hostname (example: "backend.local" → 10.0.0.5).
-    struct hostent *server = gethostbyname(host);
-    if (server == NULL)
+    struct sockaddr_un target_addr;
+    memset(&target_addr, 0, sizeof(target_addr));
+    target_addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(target_addr.sun_path))
     {
-        log_error("connect_to_target_nb: No such host: %s", host);
+        log_error("connect_to_target_nb: unix socket path too long: %s", path);
         return -1;
     }
-    struct sockaddr_in target_addr;
-    int socket_fd;
-    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    strcpy(target_addr.sun_path, path);
 
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (socket_fd < 0)
     {
-        log_errno("connect_to_target_nb: Failed to create socket");
+        log_errno("connect_to_target_nb: Failed to create unix socket");
         return -1;
     }
 
-    /**Set it to non-blocking for  */
-    if (set_non_blocking(socket_fd))
+    /**
+     * A unix connect completes (or fails) right away: there is no handshake to
+     * wait for. The one non-blocking case is a full listen backlog, EAGAIN,
+     * which is a failure here, not a connect in progress (nothing would
+     * wake us when the backlog drains).
+     */
+    if (connect(socket_fd, (struct sockaddr *)&target_addr, sizeof(target_addr)) < 0)
     {
-        log_error("connect_to_target_nb: failed to set server fd non-blocking");
+        int err = errno;
+        upstream_socket_connect_result(err);
+        errno = err;
+        log_errno("connect_to_target_nb: Failed to connect to unix:%s", path);
         close(socket_fd);
         return -1;
     }
+    return socket_fd;
+}
 
+int connect_to_target_nb(char *host, int port, bool early_data)
+{
+    if (strncmp(host, "unix:", 5) == 0)
+        return connect_unix_nb(host + 5);
+
+    char *colon = strchr(host, ':');
+    if (colon)
+    {
+        *colon = '\0'; // terminate string at ':'
+    }
+    // gethostbyname → resolve backend hostname (example: "backend.local" → 10.0.0.5).
+    struct hostent *server = gethostbyname(host);
+    if (server == NULL)
+    {
+        log_error("connect_to_target_nb: No such host: %s", host);
+        return -1;
+    }
+    struct sockaddr_in target_addr;
     memset(&target_addr, 0, sizeof(target_addr));
     target_addr.sin_family = AF_INET;
     target_addr.sin_port = htons(port);
@@ -77,13 +106,49 @@ int connect_to_target_nb(char *host, int port)
      *     Later, you can check if it succeeded using select()/poll()/epoll() and getsockopt(SO_ERROR)".
      */
 
-    /**Initiate connection with target backend */
-    int ret = connect(socket_fd, (struct sockaddr *)&target_addr, sizeof(target_addr));
-    if (ret < 0 && errno != EINPROGRESS)
+    /**
+     * With a source pool (-b) an address that ran out of ports fails right
+     * here with EADDRNOTAVAIL: try the next one before giving up.
+     */
+    int attempts = upstream_socket_source_count() > 1 ? upstream_socket_source_count() : 1;
+    for (int attempt = 0; attempt < attempts; attempt++)
     {
-        log_errno("connect_to_target_nb: Failed to connect to target %s:%d", host, port);
+        /** Non-blocking from the start: no fcntl() round trips per connect */
+        int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (socket_fd < 0)
+        {
+            log_errno("connect_to_target_nb: Failed to create socket");
+            upstream_socket_connect_result(errno);
+            return -1;
+        }
+
+        if (upstream_socket_prepare(socket_fd, attempt, early_data) != 0)
+        {
+            log_errno("connect_to_target_nb: Failed to prepare the socket");
+            upstream_socket_connect_result(errno);
+            close(socket_fd);
+            return -1;
+        }
+
+        /**
+         * Initiate connection with target backend. With Fast Open this
+         * returns 0 without sending anything: the SYN leaves with the first
+         * write, which may return EINPROGRESS if there is no cookie yet.
+         */
+        int ret = connect(socket_fd, (struct sockaddr *)&target_addr, sizeof(target_addr));
+        if (ret == 0 || errno == EINPROGRESS)
+            return socket_fd;
+
+        int err = errno;
+        upstream_socket_connect_result(err);
         close(socket_fd);
-        return -1;
+        if (err != EADDRNOTAVAIL || attempt + 1 == attempts)
+        {
+            errno = err;
+            log_errno("connect_to_target_nb: Failed to connect to target %s:%d", host, port);
+            return -1;
+        }
     }
-    return socket_fd;
-}
\ No newline at end of file
+    return -1;
+}
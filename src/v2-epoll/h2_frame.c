@@ -0,0 +1,128 @@
+#include <string.h>
+#include <v2-epoll/h2_frame.h>
+
+uint32_t h2_get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+const uint8_t *h2_frame_next(buffer_t *in, h2_frame_t *frame, uint32_t max_size)
+{
+    size_t available = buffer_available_data(in);
+    if (available < H2_FRAME_HEADER_LEN)
+        return NULL;
+
+    const uint8_t *p = (const uint8_t *)buffer_read_ptr(in);
+    frame->length = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    frame->type = p[3];
+    frame->flags = p[4];
+    frame->stream_id = h2_get32(p + 5) & 0x7fffffff;
+
+    if (frame->length > max_size || available < H2_FRAME_HEADER_LEN + frame->length)
+        return NULL;
+
+    in->offset += H2_FRAME_HEADER_LEN + frame->length;
+    return p + H2_FRAME_HEADER_LEN;
+}
+
+int h2_frame_unpad(const h2_frame_t *frame, const uint8_t **payload, size_t *len)
+{
+    size_t skip = 0;
+    size_t pad = 0;
+
+    if (frame->flags & H2_FLAG_PADDED)
+    {
+        if (*len < 1)
+            return -1;
+        pad = (*payload)[0];
+        skip = 1;
+    }
+    if (frame->type == H2_HEADERS && (frame->flags & H2_FLAG_PRIORITY))
+        skip += 5;
+
+    if (skip + pad > *len)
+        return -1;
+    *payload += skip;
+    *len -= skip + pad;
+    return 0;
+}
+
+int h2_frame_append(buffer_t *out, uint8_t type, uint8_t flags, uint32_t stream_id, const void *payload, size_t len)
+{
+    if (buffer_ensure_space(out, H2_FRAME_HEADER_LEN + len) != 0)
+        return -1;
+
+    uint8_t *p = (uint8_t *)buffer_write_ptr(out);
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, stream_id & 0x7fffffff);
+    if (len)
+        memcpy(p + H2_FRAME_HEADER_LEN, payload, len);
+    out->len += H2_FRAME_HEADER_LEN + len;
+    return 0;
+}
+
+int h2_frame_headers(buffer_t *out, uint32_t stream_id, uint8_t flags, const void *block, size_t len, size_t max_frame)
+{
+    const uint8_t *p = block;
+    uint8_t type = H2_HEADERS;
+
+    do
+    {
+        size_t n = len < max_frame ? len : max_frame;
+        uint8_t f = (type == H2_HEADERS ? flags : 0) | (n == len ? H2_FLAG_END_HEADERS : 0);
+        if (h2_frame_append(out, type, f, stream_id, p, n) != 0)
+            return -1;
+        p += n;
+        len -= n;
+        type = H2_CONTINUATION;
+    } while (len > 0);
+    return 0;
+}
+
+int h2_frame_window_update(buffer_t *out, uint32_t stream_id, uint32_t increment)
+{
+    uint8_t payload[4];
+    put32(payload, increment);
+    return h2_frame_append(out, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+int h2_frame_rst_stream(buffer_t *out, uint32_t stream_id, uint32_t error)
+{
+    uint8_t payload[4];
+    put32(payload, error);
+    return h2_frame_append(out, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+int h2_frame_goaway(buffer_t *out, uint32_t last_stream_id, uint32_t error)
+{
+    uint8_t payload[8];
+    put32(payload, last_stream_id);
+    put32(payload + 4, error);
+    return h2_frame_append(out, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+int h2_frame_settings(buffer_t *out, const uint16_t *ids, const uint32_t *values, int n)
+{
+    uint8_t payload[6 * 8];
+    if (n > 8)
+        return -1;
+    for (int i = 0; i < n; i++)
+    {
+        payload[i * 6] = ids[i] >> 8;
+        payload[i * 6 + 1] = ids[i];
+        put32(payload + i * 6 + 2, values[i]);
+    }
+    return h2_frame_append(out, H2_SETTINGS, 0, 0, payload, n * 6);
+}
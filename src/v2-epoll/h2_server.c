@@ -0,0 +1,1106 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <v2-epoll/h2_server.h>
+#include <v2-epoll/h2_frame.h>
+#include <v2-epoll/hpack.h>
+#include <v2-epoll/connection.h>
+#include <v2-epoll/buffer_io.h>
+#include <v2-epoll/epoll_server.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+#define STREAM_READ_SIZE 16384 /**< Bytes read from a stream per event */
+
+/** Chunked response bodies are decoded: HTTP/2 frames the body itself */
+typedef enum
+{
+    CHUNK_SIZE,     /**< Reading the size line */
+    CHUNK_DATA,     /**< chunk_left bytes of data */
+    CHUNK_DATA_END, /**< CRLF after the data */
+    CHUNK_TRAILER,  /**< Trailer lines until the empty one */
+    CHUNK_DONE
+} chunk_state_t;
+
+/**
+ * One request stream: the session's end of the socketpair and what is on
+ * its way in either direction.
+ */
+typedef struct h2_stream
+{
+    uint32_t id;
+    int fd;                    /**< Session's end of the socketpair */
+    uint32_t watching;         /**< Events it is registered for in the session's epoll (0 = not registered) */
+    buffer_t out;              /**< Request bytes not written to the stream yet */
+    buffer_t in;               /**< Response bytes read but not framed yet (a body waiting for its Content-Length before that) */
+    int64_t send_window;       /**< Response bytes the client accepts on this stream */
+    int64_t recv_window;       /**< Request body bytes we accept */
+    uint32_t unacked;          /**< Request body bytes taken but not given back as window */
+    bool client_done;          /**< END_STREAM from the client */
+    bool wait_length;          /**< Body without Content-Length: buffered in `in` until END_STREAM */
+    bool head_request;         /**< HEAD: the response has no body */
+    bool head_done;            /**< Response HEADERS sent */
+    bool no_body;              /**< Response has no body (HEAD, 204, 304) */
+    bool chunked;
+    chunk_state_t chunk_state;
+    size_t chunk_left;
+    bool eof;                  /**< The stream's connection closed its end */
+    struct h2_stream *hash_next;
+} h2_stream_t;
+
+typedef struct h2_server
+{
+    connection_t *conn;        /**< Client connection: request_buffer is its input, response_buffer its output */
+    int epfd;                  /**< Watches the streams; registered in the loop's epoll */
+    bool epfd_armed;
+    bool epollout;
+    hpack_table_t encoder;
+    hpack_table_t decoder;
+    uint32_t last_id;          /**< Highest stream id the client opened */
+    int streams;
+    int64_t send_window;       /**< Connection window for response bytes */
+    int64_t initial_window;    /**< The client's SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t max_frame;        /**< The client's SETTINGS_MAX_FRAME_SIZE */
+    uint32_t unacked;          /**< Connection level request bytes not given back as window */
+    bool goaway;               /**< No new streams: GOAWAY received or sent */
+    buffer_t block;            /**< Header block being assembled from CONTINUATION frames */
+    uint32_t block_stream;
+    uint8_t block_flags;
+    h2_stream_t *buckets[H2_SERVER_BUCKETS];
+    struct h2_server *prev;    /**< All sessions, for a drain */
+    struct h2_server *next;
+} h2_server_t;
+
+static h2_server_t *sessions = NULL;
+
+int h2_server_preface(const buffer_t *buf)
+{
+    size_t len = buf->len < H2_PREFACE_LEN ? buf->len : H2_PREFACE_LEN;
+    if (memcmp(buf->data, H2_PREFACE, len) != 0)
+        return 0;
+    return len == H2_PREFACE_LEN ? 1 : -1;
+}
+
+/* ---------------- Streams ---------------- */
+
+static h2_stream_t **bucket_of(h2_server_t *s, uint32_t id)
+{
+    return &s->buckets[(id >> 1) % H2_SERVER_BUCKETS];
+}
+
+static h2_stream_t *stream_find(h2_server_t *s, uint32_t id)
+{
+    for (h2_stream_t *st = *bucket_of(s, id); st; st = st->hash_next)
+    {
+        if (st->id == id)
+            return st;
+    }
+    return NULL;
+}
+
+/**
+ * Register the stream for what it can do now. A stream that can't take
+ * anything is removed: a closed socketpair would report EPOLLHUP forever.
+ */
+static void stream_watch(h2_server_t *s, h2_stream_t *st)
+{
+    uint32_t events = 0;
+    if (!st->eof && (!st->head_done || (st->send_window > 0 && s->send_window > 0)))
+        events |= EPOLLIN;
+    if (buffer_available_data(&st->out) > 0 && !st->wait_length)
+        events |= EPOLLOUT;
+
+    if (events == st->watching)
+        return;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = st;
+    int rc;
+    if (!events)
+        rc = epoll_server_delete(s->epfd, st->fd);
+    else if (!st->watching)
+        rc = epoll_server_add(s->epfd, st->fd, &event);
+    else
+        rc = epoll_server_modify(s->epfd, st->fd, &event);
+    if (rc < 0)
+        log_errno("h2_server: Failed to watch stream %u", st->id);
+    st->watching = events;
+}
+
+static void stream_close(h2_server_t *s, h2_stream_t *st)
+{
+    for (h2_stream_t **p = bucket_of(s, st->id); *p; p = &(*p)->hash_next)
+    {
+        if (*p == st)
+        {
+            *p = st->hash_next;
+            break;
+        }
+    }
+    if (st->watching)
+        epoll_server_delete(s->epfd, st->fd);
+    close(st->fd);
+    buffer_cleanup(&st->out);
+    buffer_cleanup(&st->in);
+    free(st);
+    s->streams--;
+}
+
+/**
+ * New stream: a socketpair whose other end becomes a client connection of
+ * the event loop, as if accepted.
+ */
+static h2_stream_t *stream_open(h2_server_t *s, uint32_t id, int epoll_fd)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) < 0)
+    {
+        log_errno("h2_server: socketpair failed");
+        return NULL;
+    }
+
+    h2_stream_t *st = calloc(1, sizeof(*st));
+    connection_t *inner = st ? connection_create(pair[1]) : NULL;
+    if (!inner)
+    {
+        log_error("h2_server: Could not create stream %u\n", id);
+        free(st);
+        close(pair[0]);
+        close(pair[1]);
+        return NULL;
+    }
+
+    /** The request comes from the session's client */
+    inner->h2_stream = true;
+    memcpy(inner->client_ip, connection_client_ip(s->conn), sizeof(inner->client_ip));
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = inner;
+    if (epoll_server_add(epoll_fd, pair[1], &event) < 0)
+    {
+        log_error("h2_server: Could not add stream fd %d to epoll watchlist\n", pair[1]);
+        connection_free(inner, epoll_fd);
+        free(st);
+        close(pair[0]);
+        return NULL;
+    }
+
+    st->id = id;
+    st->fd = pair[0];
+    buffer_init(&st->out);
+    buffer_init(&st->in);
+    st->send_window = s->initial_window;
+    st->recv_window = H2_DEFAULT_WINDOW;
+    st->hash_next = *bucket_of(s, id);
+    *bucket_of(s, id) = st;
+    s->streams++;
+    DEBUG_PRINT("h2_server: client %d stream %u is fd %d\n", s->conn->client_fd, id, pair[1]);
+    return st;
+}
+
+/* ---------------- Requests ---------------- */
+
+typedef struct
+{
+    buffer_t *head;       /**< HTTP/1.1 request head being built */
+    char method[16];
+    buffer_t path;
+    buffer_t authority;
+    buffer_t cookie;      /**< Cookie fields, joined with "; " (RFC 9113 8.2.3) */
+    bool started;         /**< Request line written */
+    bool has_length;
+    bool bad;
+} request_ctx_t;
+
+static bool name_is(const char *name, size_t len, const char *lit)
+{
+    return strlen(lit) == len && strncasecmp(name, lit, len) == 0;
+}
+
+/** Field names are lowercase tokens, values have no CR, LF or NUL */
+static bool valid_field(const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    if (name_len == 0)
+        return false;
+    for (size_t i = 0; i < name_len; i++)
+    {
+        unsigned char c = name[i];
+        if (c <= ' ' || c >= 0x7f || c == ':' || (c >= 'A' && c <= 'Z'))
+            return false;
+    }
+    return !memchr(value, '\r', value_len) && !memchr(value, '\n', value_len) && !memchr(value, '\0', value_len);
+}
+
+static int append_str(buffer_t *buf, const char *s, size_t len)
+{
+    return buffer_append(buf, s, len);
+}
+
+/** "METHOD path HTTP/1.1" and Host, once the pseudo-header fields are in */
+static void start_request(request_ctx_t *req)
+{
+    if (req->started || req->bad)
+        return;
+    req->started = true;
+
+    bool connect = strcmp(req->method, "CONNECT") == 0;
+    buffer_t *target = connect ? &req->authority : &req->path;
+    if (!req->method[0] || target->len == 0)
+    {
+        req->bad = true;
+        return;
+    }
+
+    if (append_str(req->head, req->method, strlen(req->method)) != 0 ||
+        append_str(req->head, " ", 1) != 0 ||
+        append_str(req->head, target->data, target->len) != 0 ||
+        append_str(req->head, " HTTP/1.1\r\n", 11) != 0)
+        req->bad = true;
+    if (req->authority.len &&
+        (append_str(req->head, "Host: ", 6) != 0 ||
+         append_str(req->head, req->authority.data, req->authority.len) != 0 ||
+         append_str(req->head, "\r\n", 2) != 0))
+        req->bad = true;
+}
+
+/** hpack_field_fn: add a request field to the HTTP/1.1 head */
+static void add_request_field(void *ctx, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    request_ctx_t *req = ctx;
+    if (!req->head || req->bad)
+        return;
+
+    if (name_len > 0 && name[0] == ':')
+    {
+        /** Pseudo-header fields come first */
+        if (req->started || !valid_field(name + 1, name_len - 1, value, value_len))
+            req->bad = true;
+        else if (name_is(name, name_len, ":method") && value_len < sizeof(req->method))
+        {
+            memcpy(req->method, value, value_len);
+            req->method[value_len] = '\0';
+        }
+        else if (name_is(name, name_len, ":path"))
+            req->bad = append_str(&req->path, value, value_len) != 0;
+        else if (name_is(name, name_len, ":authority"))
+            req->bad = append_str(&req->authority, value, value_len) != 0;
+        else if (!name_is(name, name_len, ":scheme"))
+            req->bad = true;
+        return;
+    }
+
+    if (!valid_field(name, name_len, value, value_len))
+    {
+        req->bad = true;
+        return;
+    }
+    start_request(req);
+
+    /** HTTP/1.1 connection headers: not allowed in HTTP/2, dropped */
+    if (name_is(name, name_len, "connection") || name_is(name, name_len, "keep-alive") ||
+        name_is(name, name_len, "proxy-connection") || name_is(name, name_len, "transfer-encoding") ||
+        name_is(name, name_len, "upgrade") || name_is(name, name_len, "te") ||
+        (name_is(name, name_len, "host") && req->authority.len))
+        return;
+
+    if (name_is(name, name_len, "cookie"))
+    {
+        if ((req->cookie.len && append_str(&req->cookie, "; ", 2) != 0) ||
+            append_str(&req->cookie, value, value_len) != 0)
+            req->bad = true;
+        return;
+    }
+    if (name_is(name, name_len, "content-length"))
+        req->has_length = true;
+
+    if (append_str(req->head, name, name_len) != 0 || append_str(req->head, ": ", 2) != 0 ||
+        append_str(req->head, value, value_len) != 0 || append_str(req->head, "\r\n", 2) != 0)
+        req->bad = true;
+}
+
+/* ---------------- Output ---------------- */
+
+static int send_headers(h2_server_t *s, uint32_t id, uint8_t flags, buffer_t *block)
+{
+    return h2_frame_headers(&s->conn->response_buffer, id, flags, block->data, block->len, s->max_frame);
+}
+
+/** Answer a stream ourselves (the request never reached its connection) */
+static void send_status(h2_server_t *s, uint32_t id, const char *status)
+{
+    buffer_t block;
+    buffer_init(&block);
+    if (hpack_encode(&s->encoder, &block, ":status", 7, status, 3) == 0)
+        send_headers(s, id, H2_FLAG_END_STREAM, &block);
+    buffer_cleanup(&block);
+}
+
+/** The stream is over for us: close it, and tell a client still sending to stop */
+static void stream_end(h2_server_t *s, h2_stream_t *st, uint32_t error)
+{
+    if (error || !st->client_done)
+        h2_frame_rst_stream(&s->conn->response_buffer, st->id, error);
+    stream_close(s, st);
+}
+
+/** Write pending request bytes to the stream, give the body's window back once written */
+static void stream_write(h2_server_t *s, h2_stream_t *st)
+{
+    if (!st->wait_length && buffer_available_data(&st->out) > 0)
+    {
+        ssize_t sent = buffer_write_to_fd(&st->out, st->fd);
+        if (sent < 0)
+        {
+            /** The stream's connection is gone: its response (or EOF) tells the rest */
+            st->out.len = st->out.offset = 0;
+        }
+        if (buffer_available_data(&st->out) == 0)
+            st->out.len = st->out.offset = 0;
+    }
+
+    if (st->unacked > 0 && (st->wait_length || buffer_available_data(&st->out) == 0))
+    {
+        h2_frame_window_update(&s->conn->response_buffer, st->id, st->unacked);
+        st->recv_window += st->unacked;
+        st->unacked = 0;
+    }
+}
+
+/* ---------------- Responses ---------------- */
+
+/**
+ * A complete HTTP/1.1 response head from the stream: send it as HEADERS.
+ * @return 0, 1 for an informational head (dropped), -1 if malformed.
+ */
+static int send_response_head(h2_server_t *s, h2_stream_t *st, const char *head, size_t len)
+{
+    const char *end = head + len;
+    const char *eol = memmem(head, len, "\r\n", 2);
+    int status = 0;
+    char status_text[4];
+
+    if (!eol || sscanf(head, "HTTP/1.%*d %3d", &status) != 1 || status < 100 || status > 999)
+        return -1;
+    if (status < 200)
+        return 1;
+    snprintf(status_text, sizeof(status_text), "%d", status);
+
+    buffer_t block;
+    buffer_init(&block);
+    int rc = hpack_encode(&s->encoder, &block, ":status", 7, status_text, 3);
+
+    for (const char *line = eol + 2; rc == 0 && line < end - 2; line = eol + 2)
+    {
+        eol = memmem(line, end - line, "\r\n", 2);
+        if (!eol || eol == line)
+            break;
+        const char *colon = memchr(line, ':', eol - line);
+        if (!colon || colon == line)
+            continue;
+
+        size_t name_len = colon - line;
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t'))
+            value++;
+        size_t value_len = eol - value;
+        while (value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+            value_len--;
+
+        if (name_is(line, name_len, "transfer-encoding"))
+        {
+            st->chunked = memmem(value, value_len, "chunked", 7) != NULL;
+            continue;
+        }
+        if (name_is(line, name_len, "connection") || name_is(line, name_len, "keep-alive") ||
+            name_is(line, name_len, "proxy-connection") || name_is(line, name_len, "upgrade"))
+            continue;
+
+        char name[256];
+        if (name_len >= sizeof(name))
+            continue;
+        for (size_t i = 0; i < name_len; i++)
+            name[i] = (line[i] >= 'A' && line[i] <= 'Z') ? line[i] + 32 : line[i];
+        rc = hpack_encode(&s->encoder, &block, name, name_len, value, value_len);
+    }
+
+    st->no_body = st->head_request || status == 204 || status == 304;
+    if (rc == 0)
+        rc = send_headers(s, st->id, st->no_body ? H2_FLAG_END_STREAM : 0, &block);
+    buffer_cleanup(&block);
+    st->head_done = true;
+    return rc;
+}
+
+/** Frame body bytes as DATA, as far as the windows allow */
+static size_t send_data(h2_server_t *s, h2_stream_t *st, const char *data, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len && st->send_window > 0 && s->send_window > 0)
+    {
+        size_t n = len - sent;
+        if (n > s->max_frame)
+            n = s->max_frame;
+        if ((int64_t)n > st->send_window)
+            n = (size_t)st->send_window;
+        if ((int64_t)n > s->send_window)
+            n = (size_t)s->send_window;
+        if (h2_frame_append(&s->conn->response_buffer, H2_DATA, 0, st->id, data + sent, n) != 0)
+            break;
+        st->send_window -= n;
+        s->send_window -= n;
+        sent += n;
+    }
+    return sent;
+}
+
+/** Decode chunked framing from st->in, sending the data */
+static int send_chunked(h2_server_t *s, h2_stream_t *st)
+{
+    buffer_t *in = &st->in;
+    while (buffer_available_data(in) > 0 && st->chunk_state != CHUNK_DONE)
+    {
+        const char *p = buffer_read_ptr(in);
+        size_t avail = buffer_available_data(in);
+
+        if (st->chunk_state == CHUNK_DATA)
+        {
+            size_t n = avail < st->chunk_left ? avail : st->chunk_left;
+            size_t sent = send_data(s, st, p, n);
+            in->offset += sent;
+            st->chunk_left -= sent;
+            if (st->chunk_left == 0)
+                st->chunk_state = CHUNK_DATA_END;
+            if (sent < n)
+                return 0; /** Window closed */
+            continue;
+        }
+
+        const char *eol = memmem(p, avail, "\r\n", 2);
+        if (!eol)
+            return avail > 4096 ? -1 : 0;
+        size_t line_len = eol - p;
+        in->offset += line_len + 2;
+
+        if (st->chunk_state == CHUNK_SIZE)
+        {
+            char *end;
+            unsigned long size = strtoul(p, &end, 16);
+            if (end == p)
+                return -1;
+            st->chunk_left = size;
+            st->chunk_state = size ? CHUNK_DATA : CHUNK_TRAILER;
+        }
+        else if (st->chunk_state == CHUNK_DATA_END)
+        {
+            if (line_len != 0)
+                return -1;
+            st->chunk_state = CHUNK_SIZE;
+        }
+        else if (line_len == 0)
+        {
+            /** Trailers are dropped */
+            st->chunk_state = CHUNK_DONE;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Turn what was read from the stream into frames.
+ * @return 1 if the stream is finished (closed), 0 otherwise.
+ */
+static int stream_progress(h2_server_t *s, h2_stream_t *st)
+{
+    buffer_t *in = &st->in;
+
+    while (!st->head_done)
+    {
+        const char *p = buffer_read_ptr(in);
+        size_t avail = buffer_available_data(in);
+        const char *end = memmem(p, avail, "\r\n\r\n", 4);
+        if (!end)
+        {
+            if (avail > H2_SERVER_MAX_HEAD || st->eof)
+            {
+                stream_end(s, st, H2_INTERNAL_ERROR);
+                return 1;
+            }
+            return 0;
+        }
+        size_t head_len = end + 4 - p;
+        int rc = send_response_head(s, st, p, head_len);
+        in->offset += head_len;
+        if (rc < 0)
+        {
+            stream_end(s, st, H2_INTERNAL_ERROR);
+            return 1;
+        }
+    }
+
+    if (st->no_body)
+    {
+        stream_end(s, st, H2_NO_ERROR);
+        return 1;
+    }
+
+    if (st->chunked)
+    {
+        if (send_chunked(s, st) != 0)
+        {
+            stream_end(s, st, H2_INTERNAL_ERROR);
+            return 1;
+        }
+    }
+    else
+    {
+        in->offset += send_data(s, st, buffer_read_ptr(in), buffer_available_data(in));
+    }
+    if (buffer_available_data(in) == 0)
+        in->len = in->offset = 0;
+
+    bool complete = st->chunked ? st->chunk_state == CHUNK_DONE : st->eof && buffer_available_data(in) == 0;
+    if (complete)
+    {
+        h2_frame_append(&s->conn->response_buffer, H2_DATA, H2_FLAG_END_STREAM, st->id, NULL, 0);
+        stream_end(s, st, H2_NO_ERROR);
+        return 1;
+    }
+    if (st->eof && st->chunked && buffer_available_data(in) == 0)
+    {
+        /** Closed in the middle of the chunks */
+        stream_end(s, st, H2_INTERNAL_ERROR);
+        return 1;
+    }
+    if (buffer_available_data(in) > 0 || st->in.offset > 0)
+        buffer_compact(in);
+    return 0;
+}
+
+/** Read the stream's response and frame it */
+static void stream_read(h2_server_t *s, h2_stream_t *st)
+{
+    if (!st->eof)
+    {
+        if (buffer_ensure_space(&st->in, STREAM_READ_SIZE) != 0)
+            return;
+        ssize_t n = recv(st->fd, buffer_write_ptr(&st->in), STREAM_READ_SIZE, 0);
+        if (n > 0)
+            st->in.len += n;
+        else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            st->eof = true;
+    }
+    if (stream_progress(s, st) == 0)
+        stream_watch(s, st);
+}
+
+/* ---------------- Client frames ---------------- */
+
+/** A complete request header block (or trailers) */
+static int on_request_headers(h2_server_t *s, uint32_t id, uint8_t flags, const uint8_t *block, size_t len, int epoll_fd)
+{
+    h2_stream_t *st = stream_find(s, id);
+    bool open_new = !st && (id & 1) && id > s->last_id;
+
+    buffer_t head;
+    request_ctx_t req;
+    memset(&req, 0, sizeof(req));
+    buffer_init(&head);
+    buffer_init(&req.path);
+    buffer_init(&req.authority);
+    buffer_init(&req.cookie);
+    req.head = open_new ? &head : NULL;
+
+    int rc = hpack_decode(&s->decoder, block, len, add_request_field, &req);
+    if (rc == 0 && open_new)
+    {
+        s->last_id = id;
+        start_request(&req);
+        if (req.cookie.len &&
+            (append_str(&head, "Cookie: ", 8) != 0 || append_str(&head, req.cookie.data, req.cookie.len) != 0 ||
+             append_str(&head, "\r\n", 2) != 0))
+            req.bad = true;
+
+        if (req.bad)
+            h2_frame_rst_stream(&s->conn->response_buffer, id, H2_PROTOCOL_ERROR);
+        else if (s->goaway || s->streams >= H2_SERVER_MAX_STREAMS)
+            h2_frame_rst_stream(&s->conn->response_buffer, id, H2_REFUSED_STREAM);
+        else if (!(st = stream_open(s, id, epoll_fd)))
+            h2_frame_rst_stream(&s->conn->response_buffer, id, H2_REFUSED_STREAM);
+        else
+        {
+            bool connect = strcmp(req.method, "CONNECT") == 0;
+            st->head_request = strcmp(req.method, "HEAD") == 0;
+            st->client_done = flags & H2_FLAG_END_STREAM;
+            /** A body of unknown length is collected first: the request needs its Content-Length */
+            st->wait_length = !st->client_done && !req.has_length && !connect;
+            if (buffer_append(&st->out, head.data, head.len) != 0 ||
+                (!st->wait_length && buffer_append(&st->out, "\r\n", 2) != 0))
+                stream_end(s, st, H2_INTERNAL_ERROR);
+            else
+            {
+                stream_write(s, st);
+                stream_watch(s, st);
+            }
+        }
+    }
+    else if (rc == 0 && st && (flags & H2_FLAG_END_STREAM))
+    {
+        /** Trailers: dropped, but they end the request */
+        st->client_done = true;
+    }
+
+    buffer_cleanup(&head);
+    buffer_cleanup(&req.path);
+    buffer_cleanup(&req.authority);
+    buffer_cleanup(&req.cookie);
+    if (rc != 0)
+        log_error("h2_server: Bad header block from client %d\n", s->conn->client_fd);
+    return rc;
+}
+
+static int on_data(h2_server_t *s, const h2_frame_t *frame, const uint8_t *payload)
+{
+    /** The connection window comes back right away: stream windows bound what is buffered */
+    s->unacked += frame->length;
+    if (s->unacked >= H2_DEFAULT_WINDOW / 2)
+    {
+        h2_frame_window_update(&s->conn->response_buffer, 0, s->unacked);
+        s->unacked = 0;
+    }
+
+    h2_stream_t *st = stream_find(s, frame->stream_id);
+    if (!st)
+        return frame->stream_id > s->last_id ? -1 : 0;
+    if (st->client_done)
+    {
+        stream_end(s, st, H2_STREAM_CLOSED);
+        return 0;
+    }
+
+    size_t len = frame->length;
+    if (h2_frame_unpad(frame, &payload, &len) != 0)
+        return -1;
+
+    st->recv_window -= frame->length;
+    if (st->recv_window < 0)
+    {
+        stream_end(s, st, H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+    st->unacked += frame->length;
+    st->client_done = frame->flags & H2_FLAG_END_STREAM;
+
+    if (st->wait_length)
+    {
+        if (st->in.len + len > H2_SERVER_MAX_BODY)
+        {
+            send_status(s, st->id, "413");
+            stream_end(s, st, H2_NO_ERROR);
+            return 0;
+        }
+        if (buffer_append(&st->in, payload, len) != 0)
+        {
+            stream_end(s, st, H2_INTERNAL_ERROR);
+            return 0;
+        }
+        if (st->client_done)
+        {
+            char line[48];
+            int n = snprintf(line, sizeof(line), "Content-Length: %zu\r\n\r\n", st->in.len);
+            if (buffer_append(&st->out, line, n) != 0 || buffer_append(&st->out, st->in.data, st->in.len) != 0)
+            {
+                stream_end(s, st, H2_INTERNAL_ERROR);
+                return 0;
+            }
+            st->in.len = st->in.offset = 0;
+            st->wait_length = false;
+        }
+    }
+    else if (buffer_append(&st->out, payload, len) != 0)
+    {
+        stream_end(s, st, H2_INTERNAL_ERROR);
+        return 0;
+    }
+
+    stream_write(s, st);
+    stream_watch(s, st);
+    return 0;
+}
+
+/** Windows grew: streams blocked on them continue */
+static void resume_streams(h2_server_t *s)
+{
+    for (int b = 0; b < H2_SERVER_BUCKETS; b++)
+    {
+        h2_stream_t *st = s->buckets[b];
+        while (st)
+        {
+            h2_stream_t *next = st->hash_next;
+            if (st->head_done && stream_progress(s, st) == 0)
+                stream_watch(s, st);
+            st = next;
+        }
+    }
+}
+
+static int on_settings(h2_server_t *s, const h2_frame_t *frame, const uint8_t *payload)
+{
+    if (frame->flags & H2_FLAG_ACK)
+        return 0;
+    if (frame->stream_id != 0 || frame->length % 6 != 0)
+        return -1;
+
+    for (uint32_t i = 0; i < frame->length; i += 6)
+    {
+        uint16_t id = (uint16_t)(payload[i] << 8 | payload[i + 1]);
+        uint32_t value = h2_get32(payload + i + 2);
+
+        if (id == H2_SETTINGS_HEADER_TABLE_SIZE)
+            hpack_table_set_limit(&s->encoder, value);
+        else if (id == H2_SETTINGS_INITIAL_WINDOW_SIZE)
+        {
+            if (value > H2_MAX_WINDOW)
+                return -1;
+            int64_t delta = (int64_t)value - s->initial_window;
+            s->initial_window = value;
+            for (int b = 0; b < H2_SERVER_BUCKETS; b++)
+            {
+                for (h2_stream_t *st = s->buckets[b]; st; st = st->hash_next)
+                    st->send_window += delta;
+            }
+        }
+        else if (id == H2_SETTINGS_MAX_FRAME_SIZE)
+        {
+            if (value < H2_DEFAULT_FRAME_SIZE || value > 0xffffff)
+                return -1;
+            s->max_frame = value;
+        }
+    }
+    if (h2_frame_append(&s->conn->response_buffer, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0) != 0)
+        return -1;
+    resume_streams(s);
+    return 0;
+}
+
+/** Handle the frames in the client's input. @return 0, or -1 on a connection error */
+static int process_frames(h2_server_t *s, int epoll_fd)
+{
+    buffer_t *in = &s->conn->request_buffer;
+    h2_frame_t frame;
+    const uint8_t *payload;
+
+    while ((payload = h2_frame_next(in, &frame, H2_DEFAULT_FRAME_SIZE)) != NULL)
+    {
+        if (s->block_stream && (frame.type != H2_CONTINUATION || frame.stream_id != s->block_stream))
+            return -1;
+
+        switch (frame.type)
+        {
+        case H2_DATA:
+            if (frame.stream_id == 0 || on_data(s, &frame, payload) != 0)
+                return -1;
+            break;
+
+        case H2_HEADERS:
+        {
+            size_t len = frame.length;
+            if (frame.stream_id == 0 || h2_frame_unpad(&frame, &payload, &len) != 0)
+                return -1;
+            if (frame.flags & H2_FLAG_END_HEADERS)
+            {
+                if (on_request_headers(s, frame.stream_id, frame.flags, payload, len, epoll_fd) != 0)
+                    return -1;
+                break;
+            }
+            s->block.len = 0;
+            if (buffer_append(&s->block, payload, len) != 0)
+                return -1;
+            s->block_stream = frame.stream_id;
+            s->block_flags = frame.flags;
+            break;
+        }
+
+        case H2_CONTINUATION:
+            if (!s->block_stream || s->block.len + frame.length > H2_SERVER_MAX_BLOCK ||
+                buffer_append(&s->block, payload, frame.length) != 0)
+                return -1;
+            if (frame.flags & H2_FLAG_END_HEADERS)
+            {
+                uint32_t id = s->block_stream;
+                s->block_stream = 0;
+                if (on_request_headers(s, id, s->block_flags, (const uint8_t *)s->block.data, s->block.len, epoll_fd) != 0)
+                    return -1;
+            }
+            break;
+
+        case H2_RST_STREAM:
+        {
+            if (frame.length != 4 || frame.stream_id == 0)
+                return -1;
+            /** Closing our end makes the stream's connection give up too */
+            h2_stream_t *st = stream_find(s, frame.stream_id);
+            if (st)
+                stream_close(s, st);
+            break;
+        }
+
+        case H2_SETTINGS:
+            if (on_settings(s, &frame, payload) != 0)
+                return -1;
+            break;
+
+        case H2_PING:
+            if (frame.length != 8 || frame.stream_id != 0)
+                return -1;
+            if (!(frame.flags & H2_FLAG_ACK) &&
+                h2_frame_append(&s->conn->response_buffer, H2_PING, H2_FLAG_ACK, 0, payload, 8) != 0)
+                return -1;
+            break;
+
+        case H2_GOAWAY:
+            /** The client opens no more streams; the open ones are finished */
+            s->goaway = true;
+            break;
+
+        case H2_WINDOW_UPDATE:
+        {
+            if (frame.length != 4)
+                return -1;
+            uint32_t increment = h2_get32(payload) & 0x7fffffff;
+            if (frame.stream_id == 0)
+            {
+                s->send_window += increment;
+                if (s->send_window > H2_MAX_WINDOW)
+                    return -1;
+                resume_streams(s);
+            }
+            else
+            {
+                h2_stream_t *st = stream_find(s, frame.stream_id);
+                if (st)
+                {
+                    st->send_window += increment;
+                    if (st->head_done && stream_progress(s, st) == 0)
+                        stream_watch(s, st);
+                }
+            }
+            break;
+        }
+
+        case H2_PUSH_PROMISE:
+            /** Only servers push */
+            return -1;
+
+        default:
+            /** PRIORITY and unknown types are ignored */
+            break;
+        }
+    }
+
+    if (buffer_available_data(in) >= H2_FRAME_HEADER_LEN && frame.length > H2_DEFAULT_FRAME_SIZE)
+        return -1;
+    buffer_compact(in);
+    return 0;
+}
+
+/* ---------------- Session ---------------- */
+
+static int watch_client(h2_server_t *s, int epoll_fd)
+{
+    connection_t *conn = s->conn;
+    size_t pending = buffer_available_data(&conn->response_buffer);
+
+    bool out = pending > 0;
+    if (out != s->epollout)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN | (out ? EPOLLOUT : 0);
+        event.data.ptr = conn;
+        if (epoll_server_modify(epoll_fd, conn->client_fd, &event) < 0)
+            return -1;
+        s->epollout = out;
+    }
+
+    /** Too much unsent output: leave the streams' responses in their socketpairs */
+    bool armed = pending < H2_SERVER_OUT_HIGH;
+    if (armed != s->epfd_armed)
+    {
+        struct epoll_event event;
+        event.events = armed ? EPOLLIN : 0;
+        event.data.ptr = conn;
+        if (epoll_server_modify(epoll_fd, s->epfd, &event) < 0)
+            return -1;
+        s->epfd_armed = armed;
+    }
+    return 0;
+}
+
+static int flush_client(h2_server_t *s)
+{
+    buffer_t *out = &s->conn->response_buffer;
+    if (buffer_available_data(out) == 0)
+        return 0;
+
+    ssize_t sent = buffer_write_to_fd(out, s->conn->client_fd);
+    if (sent < 0)
+        return -1;
+    if (buffer_available_data(out) == 0)
+        out->len = out->offset = 0;
+    else if (out->offset > H2_SERVER_OUT_HIGH)
+        buffer_compact(out);
+    return 0;
+}
+
+int h2_server_start(connection_t *conn, int epoll_fd)
+{
+    h2_server_t *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        log_errno("h2_server_start: Out of memory");
+        return -1;
+    }
+    if (hpack_table_init(&s->encoder) != 0 || hpack_table_init(&s->decoder) != 0)
+    {
+        hpack_table_cleanup(&s->encoder);
+        free(s);
+        return -1;
+    }
+    buffer_init(&s->block);
+    s->conn = conn;
+    s->send_window = H2_DEFAULT_WINDOW;
+    s->initial_window = H2_DEFAULT_WINDOW;
+    s->max_frame = H2_DEFAULT_FRAME_SIZE;
+
+    /** Set now so connection_free() cleans up whatever happens below */
+    conn->h2_server = s;
+    conn->state = CONN_H2_CLIENT;
+    s->next = sessions;
+    if (sessions)
+        sessions->prev = s;
+    sessions = s;
+
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epfd < 0)
+    {
+        log_errno("h2_server_start: epoll_create1 failed");
+        return -1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = conn;
+    if (epoll_server_add(epoll_fd, s->epfd, &event) < 0)
+    {
+        log_errno("h2_server_start: Could not add the stream epoll to the watchlist");
+        close(s->epfd);
+        s->epfd = -1;
+        return -1;
+    }
+    s->epfd_armed = true;
+
+    /** Preface consumed; the client fd watches EPOLLIN from reading it */
+    conn->request_buffer.offset += H2_PREFACE_LEN;
+    static const uint16_t ids[] = {H2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_SETTINGS_MAX_HEADER_LIST_SIZE};
+    static const uint32_t values[] = {H2_SERVER_MAX_STREAMS, H2_SERVER_MAX_BLOCK};
+    if (h2_frame_settings(&conn->response_buffer, ids, values, 2) != 0)
+        return -1;
+
+    DEBUG_PRINT("h2_server: client %d speaks HTTP/2\n", conn->client_fd);
+    if (process_frames(s, epoll_fd) != 0 || flush_client(s) != 0)
+        return -1;
+    return watch_client(s, epoll_fd);
+}
+
+int h2_server_io(connection_t *conn, int epoll_fd)
+{
+    h2_server_t *s = conn->h2_server;
+
+    /** Client frames (the event may be for the streams: EAGAIN then) */
+    ssize_t bytes = buffer_read_from_fd(&conn->request_buffer, conn->client_fd);
+    if (bytes == -1 || bytes == -2)
+        return -1;
+    if (bytes > 0 && process_frames(s, epoll_fd) != 0)
+    {
+        log_error("h2_server: Protocol error from client %d\n", conn->client_fd);
+        h2_frame_goaway(&conn->response_buffer, s->last_id, H2_PROTOCOL_ERROR);
+        flush_client(s);
+        return -1;
+    }
+
+    /** Streams: request bytes to write, responses to read */
+    if (s->epfd_armed)
+    {
+        struct epoll_event events[64];
+        int n = epoll_wait(s->epfd, events, 64, 0);
+        for (int i = 0; i < n; i++)
+        {
+            h2_stream_t *st = events[i].data.ptr;
+            if (events[i].events & EPOLLOUT)
+            {
+                stream_write(s, st);
+                stream_watch(s, st);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                stream_read(s, st);
+        }
+    }
+
+    if (flush_client(s) != 0)
+        return -1;
+    if (s->goaway && s->streams == 0 && buffer_available_data(&conn->response_buffer) == 0)
+        return -1;
+    return watch_client(s, epoll_fd);
+}
+
+void h2_server_free(connection_t *conn, int epoll_fd)
+{
+    h2_server_t *s = conn->h2_server;
+    if (!s)
+        return;
+
+    for (int b = 0; b < H2_SERVER_BUCKETS; b++)
+    {
+        while (s->buckets[b])
+            stream_close(s, s->buckets[b]);
+    }
+    if (s->epfd >= 0)
+    {
+        epoll_server_delete(epoll_fd, s->epfd);
+        close(s->epfd);
+    }
+
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        sessions = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+
+    hpack_table_cleanup(&s->encoder);
+    hpack_table_cleanup(&s->decoder);
+    buffer_cleanup(&s->block);
+    free(s);
+    conn->h2_server = NULL;
+}
+
+void h2_server_drain(int epoll_fd)
+{
+    for (h2_server_t *s = sessions; s; s = s->next)
+    {
+        if (s->conn->should_free_conn || s->goaway)
+            continue;
+        s->goaway = true;
+        h2_frame_goaway(&s->conn->response_buffer, s->last_id, H2_NO_ERROR);
+        if (flush_client(s) != 0 || (s->streams == 0 && buffer_available_data(&s->conn->response_buffer) == 0))
+            connection_schedule_free(s->conn);
+        else
+            watch_client(s, epoll_fd);
+    }
+}
@@ -0,0 +1,1208 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <v2-epoll/h2_upstream.h>
+#include <v2-epoll/h2_frame.h>
+#include <v2-epoll/hpack.h>
+#include <v2-epoll/connection.h>
+#include <v2-epoll/buffer_io.h>
+#include <v2-epoll/epoll_server.h>
+#include <v2-epoll/epoll_proxy.h>
+#include <v2-epoll/upstream_socket.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+/**
+ * One HTTP/2 connection to a backend. `io` comes first: epoll reports it
+ * (state CONN_H2_UPSTREAM, client_fd is the socket) and h2_upstream_io()
+ * gets the session back by casting.
+ */
+typedef struct h2_session
+{
+    connection_t io;
+    struct h2_upstream *upstream;
+    int epoll_fd;
+    buffer_t in;                 /**< Received bytes, up to a whole frame */
+    buffer_t out;                /**< Frames not written yet */
+    bool connected;
+    bool closing;                /**< GOAWAY received or stream ids used up: no new streams */
+    bool dead;                   /**< Closed, freed by h2_upstream_reap() */
+    bool epollout;
+    uint32_t next_id;
+    int streams;                 /**< Open streams */
+    int max_streams;             /**< The server's SETTINGS_MAX_CONCURRENT_STREAMS, capped */
+    int64_t send_window;         /**< Connection window for request bodies */
+    int64_t initial_window;      /**< The server's SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t max_frame;          /**< The server's SETTINGS_MAX_FRAME_SIZE */
+    uint32_t unacked;            /**< Connection level bytes received since the last WINDOW_UPDATE */
+    hpack_table_t encoder;
+    hpack_table_t decoder;
+    buffer_t block;              /**< Header block being assembled from CONTINUATION frames */
+    uint32_t block_stream;       /**< Its stream (0 = none) */
+    uint8_t block_flags;         /**< Flags of its HEADERS frame */
+    connection_t *buckets[H2_UPSTREAM_BUCKETS];
+    connection_t *sending;       /**< Streams with request body left */
+    struct h2_session *next;     /**< Upstream's connection list */
+} h2_session_t;
+
+typedef struct h2_upstream
+{
+    char host[MAX_HOST_LEN];
+    int port;
+    h2_session_t *sessions;
+    int open;                    /**< Sessions not closing */
+    connection_t *wait_head;     /**< Requests waiting for a stream slot, FIFO */
+    connection_t *wait_tail;
+} h2_upstream_t;
+
+static h2_upstream_t upstreams[H2_UPSTREAM_MAX];
+static int upstream_count = 0;
+
+static h2_session_t *dead_sessions[H2_UPSTREAM_MAX * H2_UPSTREAM_MAX_CONNS];
+static int dead_count = 0;
+
+static connection_t *ready_head = NULL;
+static connection_t *ready_tail = NULL;
+
+static int start_stream(h2_session_t *s, connection_t *conn);
+static void session_close(h2_session_t *s);
+
+static h2_upstream_t *upstream_get(const char *host, int port)
+{
+    for (int i = 0; i < upstream_count; i++)
+    {
+        if (upstreams[i].port == port && strcmp(upstreams[i].host, host) == 0)
+            return &upstreams[i];
+    }
+
+    if (upstream_count >= H2_UPSTREAM_MAX)
+        return NULL;
+
+    h2_upstream_t *up = &upstreams[upstream_count++];
+    memset(up, 0, sizeof(*up));
+    strncpy(up->host, host, sizeof(up->host) - 1);
+    up->port = port;
+    return up;
+}
+
+/* ---------------- Ready list ---------------- */
+
+static void ready_push(connection_t *conn)
+{
+    h2_member_t *st = &conn->h2;
+    if (st->ready || st->held)
+        return;
+    st->ready = true;
+    st->ready_next = NULL;
+    st->ready_prev = ready_tail;
+    if (ready_tail)
+        ready_tail->h2.ready_next = conn;
+    else
+        ready_head = conn;
+    ready_tail = conn;
+}
+
+static void ready_remove(connection_t *conn)
+{
+    h2_member_t *st = &conn->h2;
+    if (!st->ready)
+        return;
+    if (st->ready_prev)
+        st->ready_prev->h2.ready_next = st->ready_next;
+    else
+        ready_head = st->ready_next;
+    if (st->ready_next)
+        st->ready_next->h2.ready_prev = st->ready_prev;
+    else
+        ready_tail = st->ready_prev;
+    st->ready = false;
+    st->ready_prev = st->ready_next = NULL;
+}
+
+bool h2_upstream_has_ready(void)
+{
+    return ready_head != NULL;
+}
+
+connection_t *h2_upstream_pop_ready(ssize_t *bytes)
+{
+    connection_t *conn = ready_head;
+    if (!conn)
+        return NULL;
+
+    h2_member_t *st = &conn->h2;
+    ready_remove(conn);
+    st->held = true;
+    if (st->fresh > 0)
+    {
+        /** Bytes first; an end that came with them follows once the client took them */
+        *bytes = (ssize_t)st->fresh;
+        st->fresh = 0;
+        return conn;
+    }
+    *bytes = st->failed ? -1 : -2;
+    st->ended = st->failed = false;
+    return conn;
+}
+
+/* ---------------- Wait list ---------------- */
+
+static void wait_push(h2_upstream_t *up, connection_t *conn)
+{
+    conn->h2.next = NULL;
+    conn->h2.prev = up->wait_tail;
+    if (up->wait_tail)
+        up->wait_tail->h2.next = conn;
+    else
+        up->wait_head = conn;
+    up->wait_tail = conn;
+}
+
+static void wait_remove(h2_upstream_t *up, connection_t *conn)
+{
+    h2_member_t *st = &conn->h2;
+    if (st->prev)
+        st->prev->h2.next = st->next;
+    else
+        up->wait_head = st->next;
+    if (st->next)
+        st->next->h2.prev = st->prev;
+    else
+        up->wait_tail = st->prev;
+    st->prev = st->next = NULL;
+}
+
+/* ---------------- Streams of a session ---------------- */
+
+static connection_t **bucket_of(h2_session_t *s, uint32_t id)
+{
+    return &s->buckets[(id >> 1) % H2_UPSTREAM_BUCKETS];
+}
+
+static connection_t *stream_find(h2_session_t *s, uint32_t id)
+{
+    for (connection_t *c = *bucket_of(s, id); c; c = c->h2.hash_next)
+    {
+        if (c->h2.id == id)
+            return c;
+    }
+    return NULL;
+}
+
+/** Take a stream off its session (id, hash bucket, body list) */
+static void stream_unlink(connection_t *conn)
+{
+    h2_member_t *st = &conn->h2;
+    h2_session_t *s = st->session;
+    if (!s)
+        return;
+
+    for (connection_t **p = bucket_of(s, st->id); *p; p = &(*p)->h2.hash_next)
+    {
+        if (*p == conn)
+        {
+            *p = st->hash_next;
+            break;
+        }
+    }
+    for (connection_t **p = &s->sending; *p; p = &(*p)->h2.send_next)
+    {
+        if (*p == conn)
+        {
+            *p = st->send_next;
+            break;
+        }
+    }
+    st->hash_next = st->send_next = NULL;
+    st->session = NULL;
+    st->id = 0;
+    s->streams--;
+}
+
+/** The least busy open connection, or a new one if all are full */
+static h2_session_t *session_open(h2_upstream_t *up, int epoll_fd);
+
+static h2_session_t *pick_session(h2_upstream_t *up, int epoll_fd)
+{
+    h2_session_t *best = NULL;
+    for (h2_session_t *s = up->sessions; s; s = s->next)
+    {
+        if (!s->closing && s->streams < s->max_streams && (!best || s->streams < best->streams))
+            best = s;
+    }
+    if (!best && up->open < H2_UPSTREAM_MAX_CONNS)
+        best = session_open(up, epoll_fd);
+    return best;
+}
+
+/** A stream slot may have freed up: start waiting requests */
+static void start_waiting(h2_upstream_t *up, int epoll_fd)
+{
+    while (up->wait_head)
+    {
+        h2_session_t *s = pick_session(up, epoll_fd);
+        if (!s)
+            return;
+        connection_t *conn = up->wait_head;
+        wait_remove(up, conn);
+        if (start_stream(s, conn) != 0)
+        {
+            conn->h2.failed = true;
+            ready_push(conn);
+        }
+    }
+}
+
+/**
+ * A stream is over: leave the session, and let the connection handler see
+ * the end. An unprocessed stream (REFUSED_STREAM, GOAWAY) goes again instead.
+ */
+static void stream_finish(connection_t *conn, bool failed, bool retry)
+{
+    h2_member_t *st = &conn->h2;
+    stream_unlink(conn);
+
+    if (retry && st->retries < H2_UPSTREAM_RETRIES && !st->head_done && conn->response_buffer.len == 0)
+    {
+        DEBUG_PRINT("h2_upstream: resending request of client %d\n", conn->client_fd);
+        st->retries++;
+        wait_push(st->upstream, conn);
+        return;
+    }
+
+    st->active = false;
+    st->ended = !failed;
+    st->failed = failed;
+    ready_push(conn);
+}
+
+/* ---------------- Output ---------------- */
+
+static int watch(h2_session_t *s, bool out)
+{
+    if (out == s->epollout)
+        return 0;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | (out ? EPOLLOUT : 0);
+    event.data.ptr = &s->io;
+    if (epoll_server_modify(s->epoll_fd, s->io.client_fd, &event) < 0)
+    {
+        log_errno("h2_upstream: Failed to modify fd %d", s->io.client_fd);
+        return -1;
+    }
+    s->epollout = out;
+    return 0;
+}
+
+/**
+ * Add DATA frames for request bodies, as far as the windows and
+ * H2_UPSTREAM_OUT_HIGH allow.
+ */
+static int send_bodies(h2_session_t *s)
+{
+    connection_t **p = &s->sending;
+    while (*p && s->send_window > 0 && buffer_available_data(&s->out) < H2_UPSTREAM_OUT_HIGH)
+    {
+        connection_t *conn = *p;
+        h2_member_t *st = &conn->h2;
+        buffer_t *req = &conn->rebuilt_request_buffer;
+
+        while (st->body_sent < req->len && st->send_window > 0 && s->send_window > 0 &&
+               buffer_available_data(&s->out) < H2_UPSTREAM_OUT_HIGH)
+        {
+            size_t n = req->len - st->body_sent;
+            if (n > s->max_frame)
+                n = s->max_frame;
+            if ((int64_t)n > st->send_window)
+                n = (size_t)st->send_window;
+            if ((int64_t)n > s->send_window)
+                n = (size_t)s->send_window;
+
+            uint8_t flags = st->body_sent + n == req->len ? H2_FLAG_END_STREAM : 0;
+            if (h2_frame_append(&s->out, H2_DATA, flags, st->id, req->data + st->body_sent, n) != 0)
+                return -1;
+            st->body_sent += n;
+            st->send_window -= n;
+            s->send_window -= n;
+        }
+
+        if (st->body_sent == req->len)
+        {
+            *p = st->send_next;
+            st->send_next = NULL;
+        }
+        else
+        {
+            p = &st->send_next;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write pending frames. Errors are left for the socket to report
+ * (EPOLLERR/EPOLLHUP), so callers outside h2_upstream_io() never see a
+ * session close under them.
+ */
+static int session_flush(h2_session_t *s)
+{
+    if (!s->connected)
+        return 0;
+
+    for (int round = 0; round < 4; round++)
+    {
+        if (send_bodies(s) != 0)
+            return -1;
+        if (buffer_available_data(&s->out) == 0)
+            break;
+
+        ssize_t sent = buffer_write_to_fd(&s->out, s->io.client_fd);
+        if (sent < 0)
+            return -1;
+        if (buffer_available_data(&s->out) > 0)
+            break;
+        s->out.len = s->out.offset = 0;
+    }
+
+    if (s->out.offset > H2_UPSTREAM_OUT_HIGH)
+        buffer_compact(&s->out);
+    return watch(s, buffer_available_data(&s->out) > 0);
+}
+
+/* ---------------- Requests ---------------- */
+
+static bool name_is(const char *name, size_t len, const char *lit)
+{
+    return strlen(lit) == len && strncasecmp(name, lit, len) == 0;
+}
+
+/** HTTP/1.1 connection headers have no meaning in HTTP/2 (RFC 9113 8.2.2) */
+static bool connection_header(const char *name, size_t len, const char *value, size_t value_len)
+{
+    if (name_is(name, len, "te"))
+        return !name_is(value, value_len, "trailers");
+    return name_is(name, len, "connection") || name_is(name, len, "keep-alive") ||
+           name_is(name, len, "proxy-connection") || name_is(name, len, "transfer-encoding") ||
+           name_is(name, len, "upgrade") || name_is(name, len, "host");
+}
+
+/**
+ * HPACK encode the rebuilt request's head. Sets *head_len to the length of
+ * the text head (the body starts there).
+ */
+static int encode_request(h2_session_t *s, connection_t *conn, buffer_t *block, size_t *head_len)
+{
+    buffer_t *req = &conn->rebuilt_request_buffer;
+    const char *data = req->data;
+    const char *end = memmem(data, req->len, "\r\n\r\n", 4);
+    if (!end)
+        return -1;
+    *head_len = end + 4 - data;
+
+    const char *line_end = memmem(data, end + 2 - data, "\r\n", 2);
+    const char *sp1 = memchr(data, ' ', line_end - data);
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', line_end - sp1 - 1) : NULL;
+    if (!sp2)
+        return -1;
+
+    /** :authority is the Host header, or the backend itself */
+    char authority[MAX_HOST_LEN + 8];
+    const char *host = NULL;
+    size_t host_len = 0;
+    for (const char *line = line_end + 2; line < end; line = memmem(line, end + 2 - line, "\r\n", 2) + 2)
+    {
+        const char *eol = memmem(line, end + 2 - line, "\r\n", 2);
+        const char *colon = memchr(line, ':', eol - line);
+        if (colon && name_is(line, colon - line, "host"))
+        {
+            host = colon + 1;
+            while (host < eol && *host == ' ')
+                host++;
+            host_len = eol - host;
+        }
+    }
+    if (!host && strncmp(s->upstream->host, "unix:", 5) == 0)
+    {
+        host = "localhost";
+        host_len = 9;
+    }
+    else if (!host)
+    {
+        host_len = snprintf(authority, sizeof(authority), "%s:%d", s->upstream->host, s->upstream->port);
+        host = authority;
+    }
+
+    if (hpack_encode(&s->encoder, block, ":method", 7, data, sp1 - data) != 0 ||
+        hpack_encode(&s->encoder, block, ":scheme", 7, "http", 4) != 0 ||
+        hpack_encode(&s->encoder, block, ":authority", 10, host, host_len) != 0 ||
+        hpack_encode(&s->encoder, block, ":path", 5, sp1 + 1, sp2 - sp1 - 1) != 0)
+        return -1;
+
+    bool content_length = false;
+    for (const char *line = line_end + 2; line < end; line = memmem(line, end + 2 - line, "\r\n", 2) + 2)
+    {
+        const char *eol = memmem(line, end + 2 - line, "\r\n", 2);
+        const char *colon = memchr(line, ':', eol - line);
+        if (!colon || colon == line)
+            continue;
+
+        size_t name_len = colon - line;
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t'))
+            value++;
+        size_t value_len = eol - value;
+        if (connection_header(line, name_len, value, value_len))
+            continue;
+
+        /** rebuild_request() appends its own Content-Length: HTTP/2 servers reject a repeated one */
+        if (name_is(line, name_len, "content-length"))
+        {
+            if (content_length)
+                continue;
+            content_length = true;
+        }
+
+        /** Field names are lowercase in HTTP/2 */
+        char name[256];
+        if (name_len >= sizeof(name))
+            return -1;
+        for (size_t i = 0; i < name_len; i++)
+            name[i] = (line[i] >= 'A' && line[i] <= 'Z') ? line[i] + 32 : line[i];
+
+        if (hpack_encode(&s->encoder, block, name, name_len, value, value_len) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/** Open stream next_id on s for the request (HEADERS now, the body as the windows allow) */
+static int start_stream(h2_session_t *s, connection_t *conn)
+{
+    h2_member_t *st = &conn->h2;
+    buffer_t block;
+    size_t head_len;
+
+    buffer_init(&block);
+    if (encode_request(s, conn, &block, &head_len) != 0)
+    {
+        log_error("h2_upstream: Could not encode the request of client %d\n", conn->client_fd);
+        buffer_cleanup(&block);
+        return -1;
+    }
+
+    st->session = s;
+    st->id = s->next_id;
+    s->next_id += 2;
+    if (s->next_id > H2_MAX_WINDOW - 2)
+    {
+        s->closing = true;
+        s->upstream->open--;
+    }
+    st->send_window = s->initial_window;
+    st->body_sent = head_len;
+    st->unacked = 0;
+    st->hash_next = *bucket_of(s, st->id);
+    *bucket_of(s, st->id) = conn;
+    s->streams++;
+
+    bool body = conn->rebuilt_request_buffer.len > head_len;
+    int rc = h2_frame_headers(&s->out, st->id, body ? 0 : H2_FLAG_END_STREAM, block.data, block.len, s->max_frame);
+    buffer_cleanup(&block);
+    if (rc != 0)
+    {
+        stream_unlink(conn);
+        return -1;
+    }
+
+    if (body)
+    {
+        connection_t **p = &s->sending;
+        while (*p)
+            p = &(*p)->h2.send_next;
+        *p = conn;
+    }
+    DEBUG_PRINT("h2_upstream: client %d is stream %u on fd %d\n", conn->client_fd, st->id, s->io.client_fd);
+    return 0;
+}
+
+int h2_upstream_submit(connection_t *conn, int epoll_fd)
+{
+    Route *route = conn->selected_backend;
+    h2_upstream_t *up = upstream_get(route->host, route->port);
+    if (!up)
+    {
+        log_error("h2_upstream_submit: Too many h2c backends (%d)\n", H2_UPSTREAM_MAX);
+        return -1;
+    }
+
+    h2_member_t *st = &conn->h2;
+    st->active = true;
+    st->upstream = up;
+
+    h2_session_t *s = up->wait_head ? NULL : pick_session(up, epoll_fd);
+    if (!s)
+    {
+        /** Every connection is at its stream limit: wait for a stream to end */
+        if (!up->sessions)
+        {
+            st->active = false;
+            return -1;
+        }
+        wait_push(up, conn);
+        return 0;
+    }
+
+    if (start_stream(s, conn) != 0)
+    {
+        st->active = false;
+        return -1;
+    }
+    session_flush(s);
+    return 0;
+}
+
+/* ---------------- Sessions ---------------- */
+
+static h2_session_t *session_open(h2_upstream_t *up, int epoll_fd)
+{
+    h2_session_t *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        log_errno("h2_upstream: Out of memory");
+        return NULL;
+    }
+    buffer_init(&s->in);
+    buffer_init(&s->out);
+    buffer_init(&s->block);
+    if (hpack_table_init(&s->encoder) != 0 || hpack_table_init(&s->decoder) != 0)
+        goto fail;
+
+    s->upstream = up;
+    s->epoll_fd = epoll_fd;
+    s->next_id = 1;
+    s->max_streams = H2_UPSTREAM_MAX_STREAMS;
+    s->send_window = H2_DEFAULT_WINDOW;
+    s->initial_window = H2_DEFAULT_WINDOW;
+    s->max_frame = H2_DEFAULT_FRAME_SIZE;
+    s->io.state = CONN_H2_UPSTREAM;
+    s->io.backend_fd = -1;
+
+    /** Preface, our settings, and the connection window raised to H2_UPSTREAM_CONN_WINDOW */
+    static const uint16_t ids[] = {H2_SETTINGS_ENABLE_PUSH, H2_SETTINGS_INITIAL_WINDOW_SIZE};
+    static const uint32_t values[] = {0, H2_UPSTREAM_STREAM_WINDOW};
+    if (buffer_append(&s->out, H2_PREFACE, H2_PREFACE_LEN) != 0 ||
+        h2_frame_settings(&s->out, ids, values, 2) != 0 ||
+        h2_frame_window_update(&s->out, 0, H2_UPSTREAM_CONN_WINDOW - H2_DEFAULT_WINDOW) != 0)
+        goto fail;
+
+    s->io.client_fd = connect_to_target_nb(up->host, up->port, true);
+    if (s->io.client_fd < 0)
+    {
+        log_error("h2_upstream: Failed to connect to %s:%d\n", up->host, up->port);
+        goto fail;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = &s->io;
+    if (epoll_server_add(epoll_fd, s->io.client_fd, &event) < 0)
+    {
+        log_error("h2_upstream: Could not add fd %d to epoll watchlist\n", s->io.client_fd);
+        close(s->io.client_fd);
+        goto fail;
+    }
+    s->epollout = true;
+
+    s->next = up->sessions;
+    up->sessions = s;
+    up->open++;
+    DEBUG_PRINT("h2_upstream: new connection %d to %s:%d\n", s->io.client_fd, up->host, up->port);
+    return s;
+
+fail:
+    hpack_table_cleanup(&s->encoder);
+    hpack_table_cleanup(&s->decoder);
+    buffer_cleanup(&s->in);
+    buffer_cleanup(&s->out);
+    buffer_cleanup(&s->block);
+    free(s);
+    return NULL;
+}
+
+/**
+ * Close the connection: its streams fail (or go again if the server never
+ * saw them), waiting requests get another connection.
+ */
+static void session_close(h2_session_t *s)
+{
+    h2_upstream_t *up = s->upstream;
+
+    s->dead = true;
+    s->io.should_free_conn = true;
+    epoll_server_delete(s->epoll_fd, s->io.client_fd);
+    upstream_socket_close(s->io.client_fd);
+    s->io.client_fd = -1;
+
+    for (h2_session_t **p = &up->sessions; *p; p = &(*p)->next)
+    {
+        if (*p == s)
+        {
+            *p = s->next;
+            break;
+        }
+    }
+    if (!s->closing)
+        up->open--;
+
+    for (int i = 0; i < H2_UPSTREAM_BUCKETS; i++)
+    {
+        while (s->buckets[i])
+            stream_finish(s->buckets[i], true, false);
+    }
+
+    if (dead_count < (int)(sizeof(dead_sessions) / sizeof(dead_sessions[0])))
+        dead_sessions[dead_count++] = s;
+    DEBUG_PRINT("h2_upstream: connection to %s:%d closed\n", up->host, up->port);
+
+    start_waiting(up, s->epoll_fd);
+
+    /** No connection could be opened: nobody would start the waiting requests */
+    if (!up->sessions)
+    {
+        while (up->wait_head)
+        {
+            connection_t *conn = up->wait_head;
+            wait_remove(up, conn);
+            conn->h2.active = false;
+            conn->h2.failed = true;
+            ready_push(conn);
+        }
+    }
+}
+
+void h2_upstream_reap(void)
+{
+    for (int i = 0; i < dead_count; i++)
+    {
+        h2_session_t *s = dead_sessions[i];
+        hpack_table_cleanup(&s->encoder);
+        hpack_table_cleanup(&s->decoder);
+        buffer_cleanup(&s->in);
+        buffer_cleanup(&s->out);
+        buffer_cleanup(&s->block);
+        free(s);
+    }
+    dead_count = 0;
+}
+
+/** A stream ended on a connection that takes no new ones: close it when it's the last */
+static void stream_done(h2_session_t *s)
+{
+    if (s->closing && s->streams == 0)
+        session_close(s);
+    else
+        start_waiting(s->upstream, s->epoll_fd);
+}
+
+/* ---------------- Responses ---------------- */
+
+static const char *status_reason(int status)
+{
+    switch (status)
+    {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "";
+    }
+}
+
+typedef struct
+{
+    buffer_t *out; /**< NULL: nobody wants the fields (trailers, unknown stream) */
+    int status;
+    bool bad;
+} head_ctx_t;
+
+static bool safe_text(const char *s, size_t len)
+{
+    return !memchr(s, '\r', len) && !memchr(s, '\n', len) && !memchr(s, '\0', len);
+}
+
+/** hpack_field_fn: write a response field as an HTTP/1.1 header line */
+static void add_response_field(void *ctx, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    head_ctx_t *head = ctx;
+    if (!head->out || head->bad)
+        return;
+
+    if (name_len > 0 && name[0] == ':')
+    {
+        /** :status must come first, and alone */
+        if (head->status || !name_is(name, name_len, ":status") || value_len != 3)
+        {
+            head->bad = true;
+            return;
+        }
+        head->status = atoi(value);
+        char line[64];
+        int n = snprintf(line, sizeof(line), "HTTP/1.1 %.3s %s\r\n", value, status_reason(head->status));
+        if (head->status < 100 || buffer_append(head->out, line, n) != 0)
+            head->bad = true;
+        return;
+    }
+
+    if (!head->status || !safe_text(name, name_len) || !safe_text(value, value_len) || memchr(name, ':', name_len))
+    {
+        head->bad = true;
+        return;
+    }
+    if (connection_header(name, name_len, value, value_len))
+        return;
+
+    if (buffer_ensure_space(head->out, name_len + value_len + 4) != 0)
+    {
+        head->bad = true;
+        return;
+    }
+    char *p = buffer_write_ptr(head->out);
+    memcpy(p, name, name_len);
+    memcpy(p + name_len, ": ", 2);
+    memcpy(p + name_len + 2, value, value_len);
+    memcpy(p + name_len + 2 + value_len, "\r\n", 2);
+    head->out->len += name_len + value_len + 4;
+}
+
+/** Reset a stream we don't want anymore and fail it */
+static void stream_reset(h2_session_t *s, connection_t *conn, uint32_t error)
+{
+    h2_frame_rst_stream(&s->out, conn->h2.id, error);
+    stream_finish(conn, true, false);
+    stream_done(s);
+}
+
+/**
+ * A complete header block: decode it (always, for the HPACK state) and turn
+ * a final response head into HTTP/1.1. Informational (1xx) heads and
+ * trailers are dropped.
+ */
+static int on_header_block(h2_session_t *s, uint32_t stream_id, uint8_t flags, const uint8_t *block, size_t len)
+{
+    connection_t *conn = stream_find(s, stream_id);
+    head_ctx_t head = {NULL, 0, false};
+    size_t start = 0;
+
+    if (conn && !conn->h2.head_done)
+    {
+        head.out = &conn->response_buffer;
+        start = head.out->len;
+    }
+
+    if (hpack_decode(&s->decoder, block, len, add_response_field, &head) != 0)
+    {
+        log_error("h2_upstream: Bad header block from %s:%d\n", s->upstream->host, s->upstream->port);
+        return -1;
+    }
+    if (!conn)
+        return 0;
+
+    h2_member_t *st = &conn->h2;
+    if (head.out)
+    {
+        static const char tail[] = "Connection: close\r\n\r\n";
+        if (head.bad || !head.status || buffer_append(head.out, tail, sizeof(tail) - 1) != 0)
+        {
+            head.out->len = start;
+            log_error("h2_upstream: Malformed response head on stream %u\n", stream_id);
+            stream_reset(s, conn, H2_PROTOCOL_ERROR);
+            return 0;
+        }
+        if (head.status < 200)
+        {
+            head.out->len = start;
+            return 0;
+        }
+        st->head_done = true;
+        st->fresh += head.out->len - start;
+        ready_push(conn);
+    }
+
+    if (flags & H2_FLAG_END_STREAM)
+    {
+        stream_finish(conn, false, false);
+        stream_done(s);
+    }
+    return 0;
+}
+
+static int on_data(h2_session_t *s, const h2_frame_t *frame, const uint8_t *payload)
+{
+    /** The connection window comes back right away: only stream windows hold bytes back */
+    s->unacked += frame->length;
+    if (s->unacked >= H2_UPSTREAM_CONN_WINDOW / 2)
+    {
+        if (h2_frame_window_update(&s->out, 0, s->unacked) != 0)
+            return -1;
+        s->unacked = 0;
+    }
+
+    connection_t *conn = stream_find(s, frame->stream_id);
+    if (!conn)
+        return 0; /** Reset by us, frames still in flight */
+
+    size_t len = frame->length;
+    if (h2_frame_unpad(frame, &payload, &len) != 0)
+        return -1;
+
+    h2_member_t *st = &conn->h2;
+    if (!st->head_done)
+    {
+        stream_reset(s, conn, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+
+    st->unacked += frame->length;
+    if (len > 0)
+    {
+        if (buffer_ensure_space(&conn->response_buffer, len) != 0)
+        {
+            stream_reset(s, conn, H2_INTERNAL_ERROR);
+            return 0;
+        }
+        memcpy(buffer_write_ptr(&conn->response_buffer), payload, len);
+        conn->response_buffer.len += len;
+        st->fresh += len;
+        ready_push(conn);
+    }
+
+    if (frame->flags & H2_FLAG_END_STREAM)
+    {
+        stream_finish(conn, false, false);
+        stream_done(s);
+    }
+    return 0;
+}
+
+static int on_settings(h2_session_t *s, const h2_frame_t *frame, const uint8_t *payload)
+{
+    if (frame->flags & H2_FLAG_ACK)
+        return 0;
+    if (frame->stream_id != 0 || frame->length % 6 != 0)
+        return -1;
+
+    for (uint32_t i = 0; i < frame->length; i += 6)
+    {
+        uint16_t id = (uint16_t)(payload[i] << 8 | payload[i + 1]);
+        uint32_t value = h2_get32(payload + i + 2);
+
+        switch (id)
+        {
+        case H2_SETTINGS_HEADER_TABLE_SIZE:
+            hpack_table_set_limit(&s->encoder, value);
+            break;
+        case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+            s->max_streams = value < H2_UPSTREAM_MAX_STREAMS ? (int)value : H2_UPSTREAM_MAX_STREAMS;
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+        {
+            if (value > H2_MAX_WINDOW)
+                return -1;
+            /** Applies to the open streams too, as a difference */
+            int64_t delta = (int64_t)value - s->initial_window;
+            s->initial_window = value;
+            for (int b = 0; b < H2_UPSTREAM_BUCKETS; b++)
+            {
+                for (connection_t *c = s->buckets[b]; c; c = c->h2.hash_next)
+                    c->h2.send_window += delta;
+            }
+            break;
+        }
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_DEFAULT_FRAME_SIZE || value > 0xffffff)
+                return -1;
+            s->max_frame = value;
+            break;
+        default:
+            break;
+        }
+    }
+    if (h2_frame_append(&s->out, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0) != 0)
+        return -1;
+    start_waiting(s->upstream, s->epoll_fd);
+    return 0;
+}
+
+/**
+ * GOAWAY: streams above last_stream_id were never processed and go again
+ * (elsewhere); the connection closes once the others are done.
+ */
+static void on_goaway(h2_session_t *s, uint32_t last_stream_id, uint32_t error)
+{
+    DEBUG_PRINT("h2_upstream: GOAWAY from %s:%d, last stream %u, error %u\n",
+                s->upstream->host, s->upstream->port, last_stream_id, error);
+    (void)error;
+    if (!s->closing)
+    {
+        s->closing = true;
+        s->upstream->open--;
+    }
+
+    for (int b = 0; b < H2_UPSTREAM_BUCKETS; b++)
+    {
+        connection_t *c = s->buckets[b];
+        while (c)
+        {
+            connection_t *next = c->h2.hash_next;
+            if (c->h2.id > last_stream_id)
+                stream_finish(c, true, true);
+            c = next;
+        }
+    }
+}
+
+/**
+ * Handle the frames in s->in.
+ * @return 0, 1 if the session was closed, -1 on a connection error.
+ */
+static int session_process(h2_session_t *s)
+{
+    h2_frame_t frame;
+    const uint8_t *payload;
+
+    while ((payload = h2_frame_next(&s->in, &frame, H2_DEFAULT_FRAME_SIZE)) != NULL)
+    {
+        /** A header block in pieces: nothing may come between them */
+        if (s->block_stream && (frame.type != H2_CONTINUATION || frame.stream_id != s->block_stream))
+            return -1;
+
+        switch (frame.type)
+        {
+        case H2_DATA:
+            if (frame.stream_id == 0 || on_data(s, &frame, payload) != 0)
+                return -1;
+            break;
+
+        case H2_HEADERS:
+        {
+            size_t len = frame.length;
+            if (frame.stream_id == 0 || h2_frame_unpad(&frame, &payload, &len) != 0)
+                return -1;
+            if (frame.flags & H2_FLAG_END_HEADERS)
+            {
+                if (on_header_block(s, frame.stream_id, frame.flags, payload, len) != 0)
+                    return -1;
+                break;
+            }
+            s->block.len = 0;
+            if (buffer_append(&s->block, payload, len) != 0)
+                return -1;
+            s->block_stream = frame.stream_id;
+            s->block_flags = frame.flags;
+            break;
+        }
+
+        case H2_CONTINUATION:
+            if (!s->block_stream || s->block.len + frame.length > H2_UPSTREAM_MAX_BLOCK ||
+                buffer_append(&s->block, payload, frame.length) != 0)
+                return -1;
+            if (frame.flags & H2_FLAG_END_HEADERS)
+            {
+                uint32_t id = s->block_stream;
+                s->block_stream = 0;
+                if (on_header_block(s, id, s->block_flags, (const uint8_t *)s->block.data, s->block.len) != 0)
+                    return -1;
+            }
+            break;
+
+        case H2_RST_STREAM:
+        {
+            if (frame.length != 4 || frame.stream_id == 0)
+                return -1;
+            connection_t *conn = stream_find(s, frame.stream_id);
+            if (conn)
+            {
+                uint32_t error = h2_get32(payload);
+                DEBUG_PRINT("h2_upstream: stream %u reset, error %u\n", frame.stream_id, error);
+                stream_finish(conn, true, error == H2_REFUSED_STREAM);
+                stream_done(s);
+            }
+            break;
+        }
+
+        case H2_SETTINGS:
+            if (on_settings(s, &frame, payload) != 0)
+                return -1;
+            break;
+
+        case H2_PING:
+            if (frame.length != 8)
+                return -1;
+            if (!(frame.flags & H2_FLAG_ACK) && h2_frame_append(&s->out, H2_PING, H2_FLAG_ACK, 0, payload, 8) != 0)
+                return -1;
+            break;
+
+        case H2_GOAWAY:
+            if (frame.length < 8)
+                return -1;
+            on_goaway(s, h2_get32(payload) & 0x7fffffff, h2_get32(payload + 4));
+            break;
+
+        case H2_WINDOW_UPDATE:
+        {
+            if (frame.length != 4)
+                return -1;
+            uint32_t increment = h2_get32(payload) & 0x7fffffff;
+            if (frame.stream_id == 0)
+            {
+                s->send_window += increment;
+                if (s->send_window > H2_MAX_WINDOW)
+                    return -1;
+            }
+            else
+            {
+                connection_t *conn = stream_find(s, frame.stream_id);
+                if (conn)
+                    conn->h2.send_window += increment;
+            }
+            break;
+        }
+
+        case H2_PUSH_PROMISE:
+            /** Disabled in our SETTINGS */
+            return -1;
+
+        default:
+            /** PRIORITY and unknown types are ignored */
+            break;
+        }
+
+        if (s->dead)
+            return 1;
+    }
+
+    if (buffer_available_data(&s->in) >= H2_FRAME_HEADER_LEN && frame.length > H2_DEFAULT_FRAME_SIZE)
+        return -1;
+    buffer_compact(&s->in);
+    return 0;
+}
+
+void h2_upstream_io(connection_t *conn, int epoll_fd, uint32_t events)
+{
+    h2_session_t *s = (h2_session_t *)conn;
+    (void)epoll_fd;
+
+    if (!s->connected)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(s->io.client_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        {
+            upstream_socket_connect_result(err ? err : errno);
+            log_error("h2_upstream: Connect to %s:%d failed: %d\n", s->upstream->host, s->upstream->port, err);
+            session_close(s);
+            return;
+        }
+        if (!(events & EPOLLOUT))
+            return;
+        upstream_socket_connect_result(0);
+        s->connected = true;
+    }
+
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    {
+        ssize_t bytes = buffer_read_from_fd(&s->in, s->io.client_fd);
+        if (bytes > 0)
+        {
+            int rc = session_process(s);
+            if (rc == 1)
+                return;
+            if (rc < 0)
+            {
+                log_error("h2_upstream: Protocol error on connection to %s:%d\n", s->upstream->host, s->upstream->port);
+                h2_frame_goaway(&s->out, 0, H2_PROTOCOL_ERROR);
+                session_flush(s);
+                session_close(s);
+                return;
+            }
+        }
+        else if (bytes < 0)
+        {
+            DEBUG_PRINT("h2_upstream: %s:%d closed the connection\n", s->upstream->host, s->upstream->port);
+            session_close(s);
+            return;
+        }
+    }
+
+    if (session_flush(s) != 0)
+        session_close(s);
+}
+
+void h2_upstream_consumed(connection_t *conn, int epoll_fd)
+{
+    h2_member_t *st = &conn->h2;
+    (void)epoll_fd;
+
+    st->held = false;
+    if (st->fresh > 0 || st->ended || st->failed)
+        ready_push(conn);
+
+    if (!st->session || st->unacked < H2_UPSTREAM_STREAM_WINDOW / 2)
+        return;
+
+    if (h2_frame_window_update(&st->session->out, st->id, st->unacked) == 0)
+    {
+        st->unacked = 0;
+        session_flush(st->session);
+    }
+}
+
+void h2_upstream_detach(connection_t *conn, int epoll_fd)
+{
+    h2_member_t *st = &conn->h2;
+    (void)epoll_fd;
+
+    ready_remove(conn);
+    if (!st->active)
+        return;
+    st->active = false;
+
+    h2_session_t *s = st->session;
+    if (!s)
+    {
+        wait_remove(st->upstream, conn);
+        return;
+    }
+
+    /** The server may still be sending: tell it to stop */
+    h2_frame_rst_stream(&s->out, st->id, H2_CANCEL);
+    stream_unlink(conn);
+    session_flush(s);
+    if (s->closing && s->streams == 0)
+        session_close(s);
+    else
+        start_waiting(s->upstream, s->epoll_fd);
+}
@@ -0,0 +1,601 @@
+#include <stdlib.h>
+#include <string.h>
+#include <v2-epoll/hpack.h>
+#include <common/error_handler.h>
+
+struct hpack_entry
+{
+    char *name; /**< name and value share one allocation */
+    size_t name_len;
+    char *value;
+    size_t value_len;
+};
+
+/** RFC 7541 Appendix A: index 1 is the first entry */
+static const struct
+{
+    const char *name;
+    const char *value;
+} static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+#define STATIC_COUNT (sizeof(static_table) / sizeof(static_table[0]))
+
+/** RFC 7541 Appendix B (symbols 0-255, EOS is 30 one bits) */
+static const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t huffman_lengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+#define HUFFMAN_EOS 256
+
+/**
+ * Decoding tree built from the code table on first use. Node 0 is the
+ * root; a child > 0 is another node, a child < 0 is the leaf of symbol
+ * -child - 1. The code is complete, so there are no empty children.
+ */
+static int16_t huffman_tree[HUFFMAN_EOS][2];
+static bool huffman_ready = false;
+
+static void huffman_insert(int symbol, uint32_t code, int len, int *nodes)
+{
+    int node = 0;
+    for (int bit = len - 1; bit > 0; bit--)
+    {
+        int b = (code >> bit) & 1;
+        if (huffman_tree[node][b] == 0)
+            huffman_tree[node][b] = (int16_t)(*nodes)++;
+        node = huffman_tree[node][b];
+    }
+    huffman_tree[node][code & 1] = (int16_t)(-symbol - 1);
+}
+
+static void huffman_build(void)
+{
+    int nodes = 1;
+    for (int symbol = 0; symbol < 256; symbol++)
+        huffman_insert(symbol, huffman_codes[symbol], huffman_lengths[symbol], &nodes);
+    huffman_insert(HUFFMAN_EOS, 0x3fffffff, 30, &nodes);
+    huffman_ready = true;
+}
+
+/**
+ * Decode into out (at least len * 8 / 5 bytes). The padding after the last
+ * symbol must be the start of EOS (all ones) and shorter than a byte.
+ */
+static int huffman_decode(const uint8_t *in, size_t len, char *out, size_t *out_len)
+{
+    if (!huffman_ready)
+        huffman_build();
+
+    size_t n = 0;
+    int node = 0;
+    int depth = 0;
+    bool ones = true;
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int bit = 7; bit >= 0; bit--)
+        {
+            int b = (in[i] >> bit) & 1;
+            int next = huffman_tree[node][b];
+            depth++;
+            ones = ones && b;
+            if (next >= 0)
+            {
+                node = next;
+                continue;
+            }
+            if (next == -HUFFMAN_EOS - 1)
+                return -1;
+            out[n++] = (char)(-next - 1);
+            node = 0;
+            depth = 0;
+            ones = true;
+        }
+    }
+    if (depth > 7 || !ones)
+        return -1;
+    *out_len = n;
+    return 0;
+}
+
+static size_t huffman_length(const char *s, size_t len)
+{
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++)
+        bits += huffman_lengths[(uint8_t)s[i]];
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(const char *s, size_t len, uint8_t *out)
+{
+    uint64_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        uint8_t c = (uint8_t)s[i];
+        acc = (acc << huffman_lengths[c]) | huffman_codes[c];
+        bits += huffman_lengths[c];
+        while (bits >= 8)
+        {
+            bits -= 8;
+            *out++ = (uint8_t)(acc >> bits);
+        }
+    }
+    /** Pad with the most significant bits of EOS */
+    if (bits > 0)
+        *out = (uint8_t)((acc << (8 - bits)) | (0xff >> bits));
+}
+
+/* ---------------- Dynamic table ---------------- */
+
+int hpack_table_init(hpack_table_t *table)
+{
+    memset(table, 0, sizeof(*table));
+    table->slots = HPACK_TABLE_SIZE / 32;
+    table->entries = calloc(table->slots, sizeof(*table->entries));
+    if (!table->entries)
+    {
+        log_errno("hpack_table_init: Out of memory");
+        return -1;
+    }
+    table->max_size = HPACK_TABLE_SIZE;
+    return 0;
+}
+
+static size_t entry_size(const struct hpack_entry *e)
+{
+    return e->name_len + e->value_len + 32;
+}
+
+static void evict_oldest(hpack_table_t *table)
+{
+    struct hpack_entry *e = &table->entries[table->first];
+    table->size -= entry_size(e);
+    free(e->name);
+    e->name = NULL;
+    table->first = (table->first + 1) % table->slots;
+    table->count--;
+}
+
+static void evict_to(hpack_table_t *table, size_t max_size)
+{
+    while (table->count > 0 && table->size > max_size)
+        evict_oldest(table);
+}
+
+void hpack_table_cleanup(hpack_table_t *table)
+{
+    if (!table->entries)
+        return;
+    evict_to(table, 0);
+    free(table->entries);
+    table->entries = NULL;
+}
+
+void hpack_table_set_limit(hpack_table_t *table, size_t limit)
+{
+    if (limit > HPACK_TABLE_SIZE)
+        limit = HPACK_TABLE_SIZE;
+    if (limit == table->max_size)
+        return;
+    table->max_size = limit;
+    table->resized = true;
+    evict_to(table, limit);
+}
+
+/** Dynamic index 1 is the newest entry */
+static const struct hpack_entry *dynamic_entry(const hpack_table_t *table, size_t index)
+{
+    if (index == 0 || index > table->count)
+        return NULL;
+    return &table->entries[(table->first + table->count - index) % table->slots];
+}
+
+/**
+ * Insert a field (copied first: name may point into an entry this evicts).
+ * A field bigger than the whole table empties it and is not stored.
+ */
+static int table_add(hpack_table_t *table, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    size_t size = name_len + value_len + 32;
+    if (size > table->max_size)
+    {
+        evict_to(table, 0);
+        return 0;
+    }
+
+    char *data = malloc(name_len + value_len + 1);
+    if (!data)
+        return -1;
+    memcpy(data, name, name_len);
+    memcpy(data + name_len, value, value_len);
+
+    evict_to(table, table->max_size - size);
+    if (table->count == table->slots)
+        evict_oldest(table);
+
+    struct hpack_entry *e = &table->entries[(table->first + table->count) % table->slots];
+    e->name = data;
+    e->name_len = name_len;
+    e->value = data + name_len;
+    e->value_len = value_len;
+    table->count++;
+    table->size += size;
+    return 0;
+}
+
+/* ---------------- Encoding ---------------- */
+
+static int put_int(buffer_t *out, uint8_t first, int prefix_bits, size_t value)
+{
+    uint8_t tmp[16];
+    size_t n = 0;
+    size_t max = (1u << prefix_bits) - 1;
+
+    if (value < max)
+    {
+        tmp[n++] = first | (uint8_t)value;
+    }
+    else
+    {
+        tmp[n++] = first | (uint8_t)max;
+        value -= max;
+        while (value >= 128)
+        {
+            tmp[n++] = (uint8_t)((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        tmp[n++] = (uint8_t)value;
+    }
+    return buffer_append(out, tmp, n);
+}
+
+static int put_string(buffer_t *out, const char *s, size_t len)
+{
+    size_t huffman = huffman_length(s, len);
+    if (huffman >= len)
+        return put_int(out, 0x00, 7, len) == 0 ? buffer_append(out, s, len) : -1;
+
+    if (put_int(out, 0x80, 7, huffman) != 0 || buffer_ensure_space(out, huffman) != 0)
+        return -1;
+    huffman_encode(s, len, (uint8_t *)buffer_write_ptr(out));
+    out->len += huffman;
+    return 0;
+}
+
+static bool name_is(const char *name, size_t name_len, const char *lit)
+{
+    return strlen(lit) == name_len && memcmp(name, lit, name_len) == 0;
+}
+
+/** Credentials: never indexed, by us or by any intermediary (RFC 7541 7.1.3) */
+static bool sensitive_field(const char *name, size_t name_len)
+{
+    return name_is(name, name_len, "authorization") ||
+           name_is(name, name_len, "proxy-authorization") ||
+           name_is(name, name_len, "set-cookie");
+}
+
+/** Values that change from message to message: indexing them only evicts useful entries */
+static bool volatile_field(const char *name, size_t name_len)
+{
+    static const char *const names[] = {
+        ":path", "content-length", "content-range", "date", "etag", "last-modified", "expires",
+        "age", "location", "if-none-match", "if-modified-since", "if-match", "range"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (name_is(name, name_len, names[i]))
+            return true;
+    }
+    return false;
+}
+
+int hpack_encode(hpack_table_t *table, buffer_t *out, const char *name, size_t name_len,
+                 const char *value, size_t value_len)
+{
+    if (table->resized)
+    {
+        if (put_int(out, 0x20, 5, table->max_size) != 0)
+            return -1;
+        table->resized = false;
+    }
+
+    size_t name_index = 0;
+    for (size_t i = 0; i < STATIC_COUNT; i++)
+    {
+        if (!name_is(name, name_len, static_table[i].name))
+            continue;
+        if (name_is(value, value_len, static_table[i].value))
+            return put_int(out, 0x80, 7, i + 1);
+        if (!name_index)
+            name_index = i + 1;
+    }
+    for (size_t i = 1; i <= table->count; i++)
+    {
+        const struct hpack_entry *e = dynamic_entry(table, i);
+        if (e->name_len == name_len && e->value_len == value_len &&
+            memcmp(e->name, name, name_len) == 0 && memcmp(e->value, value, value_len) == 0)
+            return put_int(out, 0x80, 7, STATIC_COUNT + i);
+    }
+
+    int rc;
+    bool index = false;
+    if (sensitive_field(name, name_len))
+    {
+        rc = put_int(out, 0x10, 4, name_index);
+    }
+    else if (volatile_field(name, name_len) || name_len + value_len + 32 > table->max_size / 2)
+    {
+        rc = put_int(out, 0x00, 4, name_index);
+    }
+    else
+    {
+        rc = put_int(out, 0x40, 6, name_index);
+        index = true;
+    }
+    if (rc != 0 || (!name_index && put_string(out, name, name_len) != 0) || put_string(out, value, value_len) != 0)
+        return -1;
+    return index ? table_add(table, name, name_len, value, value_len) : 0;
+}
+
+/* ---------------- Decoding ---------------- */
+
+static int get_int(const uint8_t **p, const uint8_t *end, int prefix_bits, size_t *value)
+{
+    if (*p >= end)
+        return -1;
+
+    size_t max = (1u << prefix_bits) - 1;
+    size_t v = **p & max;
+    (*p)++;
+    if (v < max)
+    {
+        *value = v;
+        return 0;
+    }
+
+    for (int shift = 0; *p < end && shift <= 28; shift += 7)
+    {
+        uint8_t b = *(*p)++;
+        v += (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/** Literal string; *s is malloc'd (Huffman decoded if needed) and owned by the caller */
+static int get_string(const uint8_t **p, const uint8_t *end, char **s, size_t *len)
+{
+    if (*p >= end)
+        return -1;
+    bool huffman = **p & 0x80;
+    size_t n;
+    if (get_int(p, end, 7, &n) != 0 || n > (size_t)(end - *p) || n > HPACK_MAX_STRING)
+        return -1;
+
+    char *str = malloc(huffman ? n * 8 / 5 + 1 : n + 1);
+    if (!str)
+        return -1;
+    if (huffman)
+    {
+        if (huffman_decode(*p, n, str, len) != 0)
+        {
+            free(str);
+            return -1;
+        }
+    }
+    else
+    {
+        memcpy(str, *p, n);
+        *len = n;
+    }
+    *p += n;
+    *s = str;
+    return 0;
+}
+
+/** Name (and value) of a static or dynamic index */
+static int lookup(const hpack_table_t *table, size_t index, const char **name, size_t *name_len,
+                  const char **value, size_t *value_len)
+{
+    if (index >= 1 && index <= STATIC_COUNT)
+    {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    const struct hpack_entry *e = dynamic_entry(table, index - STATIC_COUNT);
+    if (index == 0 || !e)
+        return -1;
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return 0;
+}
+
+int hpack_decode(hpack_table_t *table, const uint8_t *block, size_t len, hpack_field_fn fn, void *ctx)
+{
+    const uint8_t *p = block;
+    const uint8_t *end = block + len;
+    bool fields = false;
+
+    while (p < end)
+    {
+        uint8_t b = *p;
+        size_t index;
+        const char *name, *value;
+        size_t name_len, value_len;
+
+        if (b & 0x80)
+        {
+            /** Indexed field */
+            if (get_int(&p, end, 7, &index) != 0 || lookup(table, index, &name, &name_len, &value, &value_len) != 0)
+                return -1;
+            fn(ctx, name, name_len, value, value_len);
+            fields = true;
+            continue;
+        }
+
+        if ((b & 0xe0) == 0x20)
+        {
+            /** Dynamic table size update: only before the first field */
+            size_t max_size;
+            if (fields || get_int(&p, end, 5, &max_size) != 0 || max_size > HPACK_TABLE_SIZE)
+                return -1;
+            table->max_size = max_size;
+            evict_to(table, max_size);
+            continue;
+        }
+
+        /** Literal: with incremental indexing (01), without (0000) or never indexed (0001) */
+        bool add = b & 0x40;
+        char *name_buf = NULL;
+        char *value_buf = NULL;
+        if (get_int(&p, end, add ? 6 : 4, &index) != 0)
+            return -1;
+        if (index)
+        {
+            const char *unused;
+            size_t unused_len;
+            if (lookup(table, index, &name, &name_len, &unused, &unused_len) != 0)
+                return -1;
+        }
+        else
+        {
+            if (get_string(&p, end, &name_buf, &name_len) != 0)
+                return -1;
+            name = name_buf;
+        }
+        if (get_string(&p, end, &value_buf, &value_len) != 0)
+        {
+            free(name_buf);
+            return -1;
+        }
+
+        fn(ctx, name, name_len, value_buf, value_len);
+        fields = true;
+        int rc = add ? table_add(table, name, name_len, value_buf, value_len) : 0;
+        free(name_buf);
+        free(value_buf);
+        if (rc != 0)
+            return -1;
+    }
+    return 0;
+}
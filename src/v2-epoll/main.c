@@ -1,6 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdbool.h>
@@ -10,6 +13,7 @@
 #include <v2-epoll/epoll_server.h>
 #include <common/error_handler.h>
 #include <common/route_config.h>
+#include <common/route_table.h>
 #include <common/request_parser.h>
 #include <common/proxy.h>
 #include <common/rebuild_request.h>
@@ -17,13 +21,120 @@
 #include <v2-epoll/connection.h>
 #include <v2-epoll/buffer_io.h>
 #include <v2-epoll/connection_handler.h>
+#include <v2-epoll/upstream_limiter.h>
+#include <v2-epoll/admission.h>
+#include <v2-epoll/clock.h>
+#include <v2-epoll/upgrade.h>
+#include <v2-epoll/response_cache.h>
+#include <v2-epoll/coalesce.h>
+#include <v2-epoll/disk_cache.h>
+#include <v2-epoll/peer.h>
+#include <v2-epoll/compress.h>
+#include <v2-epoll/tunnel.h>
+#include <v2-epoll/sockmap.h>
+#include <v2-epoll/tls.h>
+#include <v2-epoll/upstream_socket.h>
+#include <v2-epoll/workers.h>
+#include <v2-epoll/migrate.h>
+#include <v2-epoll/offload.h>
+#include <v2-epoll/slab.h>
+#include <common/rate_limiter.h>
 #include <common/debug.h>
 
 #define PORT 8000
+#define ACCEPT_BUDGET 64 /**< Clients accepted per listener wakeup before serving the other events (-A) */
 #define BUFFER_SIZE 16384
-#define MAX_PENDING_FREE 1024
+#define ROUTES_FILE "routes.conf"
+
+/**
+ * Register an accepted (or inherited) client socket with the event loop.
+ * An accepted one starts with the TLS handshake when the listener has a
+ * certificate; inherited ones are always plaintext (TLS isn't handed over).
+ * @param addr The address accept4() returned (the fd is non-blocking
+ *        already), or NULL for an inherited fd
+ * @return 0 on success, -1 on error (fd is closed).
+ */
+static int add_client(int epoll_fd, int client_fd, bool tls, const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+    // make client_ids non-blocking
+    if (!addr && set_non_blocking(client_fd))
+    {
+        log_error("main: failed to set client fd non-blocking");
+        close(client_fd);
+        return -1;
+    }
+
+    connection_t *new_conn = connection_create(client_fd);
+    if (!new_conn)
+    {
+        close(client_fd);
+        log_error("connection_create failed for fd=%d", client_fd);
+        return -1;
+    }
+    if (addr)
+    {
+        /** Kept as is; formatted only if something needs the text (see connection_client_ip) */
+        memcpy(&new_conn->peer_addr, addr, addr_len);
+        new_conn->peer_addr_len = addr_len;
+    }
+
+    /**
+     * Here for Event flag for epoll that tells you:
+     * "This file descriptor (socket) has data
+     * you can read *without blocking*."
+     */
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = new_conn;
+
+    if (epoll_server_add(epoll_fd, client_fd, &event) < 0)
+    {
+        log_error("Failed to add client fd in epoll watchlist");
+        connection_free(new_conn, epoll_fd);
+        return -1;
+    }
+
+    if (tls && tls_start(new_conn, epoll_fd) != 0)
+    {
+        connection_free(new_conn, epoll_fd);
+        return -1;
+    }
+
+    DEBUG_PRINT("✅ New client connection created: fd=%d, state=%d\n",
+                new_conn->client_fd, new_conn->state);
+    return 0;
+}
 
-int main()
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-U] [-k] [-s control_socket] [-c cache_file] [-p port] [-P peers [-n self]] [-C cert -K key]\n"
+            "          [-b sources] [-R] [-O] [-D seconds] [-F queue] [-A budget] [-w workers [-a cpus] [-M busy]] [-H]\n"
+            "  -U  take over the listener (and idle clients) from a running proxy\n"
+            "  -k  let the kernel relay tunnel bytes (BPF sockmap, needs CAP_BPF + CAP_NET_ADMIN)\n"
+            "  -s  unix socket used for upgrades (default %s)\n"
+            "  -c  persistent cache file, \"none\" to disable (default %s)\n"
+            "  -p  port to listen on (default %d)\n"
+            "  -P  share the cache with other proxies: host:port of every node, comma separated\n"
+            "  -n  this node in the -P list (default 127.0.0.1:port)\n"
+            "  -C  serve TLS on the listener with this certificate chain (PEM)\n"
+            "  -K  private key for -C (PEM)\n"
+            "  -b  connect to backends from these addresses, ADDR[:LO-HI] comma separated\n"
+            "      (LO-HI limits the ports used, \"*\" as ADDR keeps the default address)\n"
+            "  -R  reset backend connections the proxy gives up on instead of leaving TIME_WAIT\n"
+            "  -O  send requests to backends in the SYN (TCP Fast Open)\n"
+            "  -D  accept clients only once they sent data, waiting up to this many seconds\n"
+            "  -F  accept TCP Fast Open from clients, up to this many pending\n"
+            "  -A  clients accepted per wakeup before serving other events (default %d)\n"
+            "  -w  run this many event loops, one process pinned per CPU (0 = one per CPU)\n"
+            "  -a  CPUs for the workers, e.g. 0-3,8 (default: all we may use)\n"
+            "  -M  a worker busier than this (per mille, e.g. %d) moves idle connections\n"
+            "      and tunnels to the least busy one\n"
+            "  -H  keep connections on transparent huge pages\n",
+            prog, UPGRADE_SOCKET_PATH, DISK_CACHE_PATH, PORT, ACCEPT_BUDGET, MIGRATE_BUSY_MIN);
+}
+
+int main(int argc, char *argv[])
 {
     /**
      * OPTIMIZATION 1: Ignore SIGPIPE globally
@@ -37,14 +148,174 @@ int main()
      * WHY: Freeing connections immediately during event processing can cause
      * issues if the same connection has multiple events pending. Instead,
      * mark for deletion and batch cleanup after all events processed.
+     * (see connection_schedule_free / connection_free_pending)
      */
 
-    connection_t *pending_free[MAX_PENDING_FREE];
-    int pending_free_count = 0;
+    const char *control_path = UPGRADE_SOCKET_PATH;
+    const char *disk_cache_path = DISK_CACHE_PATH;
+    const char *peer_list = NULL;
+    const char *peer_self = NULL;
+    const char *tls_cert = NULL;
+    const char *tls_key = NULL;
+    const char *upstream_sources = NULL;
+    bool upstream_reset = false;
+    bool upstream_fastopen = false;
+    int defer_accept_s = 0;
+    int fastopen_qlen = 0;
+    int accept_budget = ACCEPT_BUDGET;
+    int workers = -1;
+    const char *worker_cpus = NULL;
+    bool huge_pages = false;
+    int migrate = 0;
+    int port = PORT;
+    bool upgrade = false;
+    bool kernel_tunnels = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Uks:c:p:P:n:C:K:b:ROD:F:A:w:a:HM:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'U':
+            upgrade = true;
+            break;
+        case 'k':
+            kernel_tunnels = true;
+            break;
+        case 's':
+            control_path = optarg;
+            break;
+        case 'c':
+            disk_cache_path = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'P':
+            peer_list = optarg;
+            break;
+        case 'n':
+            peer_self = optarg;
+            break;
+        case 'C':
+            tls_cert = optarg;
+            break;
+        case 'K':
+            tls_key = optarg;
+            break;
+        case 'b':
+            upstream_sources = optarg;
+            break;
+        case 'R':
+            upstream_reset = true;
+            break;
+        case 'O':
+            upstream_fastopen = true;
+            break;
+        case 'D':
+            defer_accept_s = atoi(optarg);
+            break;
+        case 'F':
+            fastopen_qlen = atoi(optarg);
+            break;
+        case 'A':
+            accept_budget = atoi(optarg);
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'a':
+            worker_cpus = optarg;
+            break;
+        case 'H':
+            huge_pages = true;
+            break;
+        case 'M':
+            migrate = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!tls_cert != !tls_key || accept_budget < 1 || migrate < 0 || migrate > 1000 ||
+        ((worker_cpus || migrate) && workers < 0))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /** Source addresses and close strategy for backend connections */
+    if (upstream_socket_init(upstream_sources, upstream_reset, upstream_fastopen) != 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /** One rate limit table for every worker: mapped shared before they fork */
+    if (rate_limiter_init() != 0)
+    {
+        log_errno("Failed to allocate the rate limiter table");
+        return 1;
+    }
 
     int server_fd, client_fd, epoll_fd;
+    int *inherited_fds = NULL;
+    int inherited_count = 0;
 
-    server_fd = setup_server(PORT);
+    /**
+     * Workers: from here on this is one of them (the supervisor never
+     * returns). Each has its own listener, and its own control socket and
+     * cache file, so an upgrade replaces worker i by the new worker i.
+     */
+    int worker_listener = -1;
+    int migrate_inbox = -1;
+    static char worker_control_path[256], worker_cache_path[256];
+    if (workers >= 0)
+    {
+        int worker = workers_start(workers, worker_cpus, upgrade ? -1 : port, huge_pages, migrate, &worker_listener);
+        if (worker < 0)
+        {
+            log_error("Failed to start the workers");
+            return 1;
+        }
+        migrate_inbox = migrate_attach(worker);
+        snprintf(worker_control_path, sizeof(worker_control_path), "%s.%d", control_path, worker);
+        control_path = worker_control_path;
+        if (strcmp(disk_cache_path, "none") != 0)
+        {
+            snprintf(worker_cache_path, sizeof(worker_cache_path), "%s.%d", disk_cache_path, worker);
+            disk_cache_path = worker_cache_path;
+        }
+    }
+    else
+    {
+        slab_set_numa(-1, huge_pages);
+    }
+
+    /**
+     * Binary upgrade: instead of binding the port (which the old process
+     * still holds), receive its listening socket. Both processes now accept
+     * from the same queue, so there is no moment without a listener.
+     */
+    if (upgrade)
+    {
+        inherited_count = upgrade_inherit(control_path, &server_fd, &inherited_fds);
+        if (inherited_count < 0)
+        {
+            log_error("Upgrade failed, old process keeps serving");
+            return 1;
+        }
+    }
+    else if (worker_listener >= 0)
+    {
+        server_fd = worker_listener;
+    }
+    else
+    {
+        server_fd = setup_server(port);
+    }
 
     if (server_fd < 0)
     {
@@ -52,6 +323,12 @@ int main()
         return 1;
     }
 
+    /** Also applied to an inherited listener: the options of the newest binary win */
+    if (configure_listener(server_fd, defer_accept_s, fastopen_qlen) != 0)
+    {
+        log_error("Listener options not applied");
+    }
+
     /**
      * OPTIMIZATION 3: Non-blocking server socket
      * WHY: Prevents accept() from blocking the entire event loop.
@@ -65,7 +342,10 @@ int main()
         return 1;
     }
 
-    printf("Server is listening on port %d\n", PORT);
+    if (upgrade)
+        printf("Server took over the listener (%d idle connections)\n", inherited_count);
+    else
+        printf("Server is listening on port %d\n", port);
 
     /** initialize epoll fd */
     epoll_fd = epoll_server_init();
@@ -87,14 +367,15 @@ int main()
     listener.client_fd = server_fd;
     listener.state = CONN_LISTENING;
 
-    struct epoll_event event, events[EPOLL_MAX_EVENTS];
-    event.events = EPOLLIN;
-    event.data.ptr = &listener;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    struct epoll_event listener_event;
+    listener_event.events = EPOLLIN;
+    listener_event.data.ptr = &listener;
 
     /**
      * epoll_server_add → Add an fd from the kernel’s watchlist.
      */
-    if (epoll_server_add(epoll_fd, server_fd, &event))
+    if (epoll_server_add(epoll_fd, server_fd, &listener_event))
     {
         log_error("Could not add server fd to epoll watchlist");
         close(server_fd);
@@ -102,9 +383,21 @@ int main()
         return 1;
     }
 
-    /** load routes */
-    Route routes[MAX_ROUTES];
-    int route_count = load_routes("routes.conf", routes, MAX_ROUTES);
+    /**
+     * load routes
+     * The table is published through route_table.h so it can be hot reloaded.
+     * SIGHUP is blocked here (before any thread exists, so every thread
+     * inherits the mask) and consumed by the reloader thread via signalfd.
+     * SIGTERM and SIGINT too: the loop reads them from its own signalfd.
+     */
+    sigset_t reload_mask;
+    sigemptyset(&reload_mask);
+    sigaddset(&reload_mask, SIGHUP);
+    sigaddset(&reload_mask, SIGTERM);
+    sigaddset(&reload_mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &reload_mask, NULL);
+
+    int route_count = route_table_init(ROUTES_FILE);
     if (route_count <= 0)
     {
         log_error("No routes loaded");
@@ -113,11 +406,219 @@ int main()
         return 1;
     }
 
+    if (route_table_start_reloader(ROUTES_FILE) != 0)
+    {
+        log_error("Route hot reload disabled");
+    }
+
+    /** Spare fd for shedding connections when we run out of descriptors */
+    if (admission_init() != 0)
+    {
+        close(server_fd);
+        close(epoll_fd);
+        return 1;
+    }
+
+    if (response_cache_init(RESPONSE_CACHE_MAX_BYTES) != 0)
+    {
+        log_error("Response cache disabled");
+    }
+
+    /** Persistent tier; after an upgrade the old process hands it over right after the listener */
+    if (strcmp(disk_cache_path, "none") != 0 &&
+        disk_cache_open(disk_cache_path, upgrade ? DISK_CACHE_LOCK_WAIT_MS : 0) != 0)
+    {
+        log_error("Persistent cache disabled");
+    }
+
+    /** Fleet of proxies sharing their caches; every node gets the same list */
+    if (peer_list)
+    {
+        char self_name[32];
+        if (!peer_self)
+        {
+            snprintf(self_name, sizeof(self_name), "127.0.0.1:%d", port);
+            peer_self = self_name;
+        }
+        if (peer_init(peer_list, peer_self) < 0)
+        {
+            log_error("Cache sharing with peers disabled");
+        }
+    }
+
+    /** TLS listener: refuse to start in plaintext when a certificate was asked for */
+    if (tls_cert && tls_init(tls_cert, tls_key) != 0)
+    {
+        log_error("Could not load the TLS certificate or key");
+        close(server_fd);
+        close(epoll_fd);
+        return 1;
+    }
+
+    /** Established tunnels move to a BPF sockmap; without one they keep using splice */
+    if (kernel_tunnels && sockmap_init() != 0)
+    {
+        log_error("Kernel tunnel relay disabled");
+    }
+
+    /** Pool threads for CPU-heavy steps (compress=on routes); they report finished jobs on an eventfd */
+    static connection_t offload_listener;
+    memset(&offload_listener, 0, sizeof(offload_listener));
+    offload_listener.state = CONN_OFFLOAD_NOTIFY;
+    offload_listener.client_fd = -1;
+    if (offload_init() == 0)
+    {
+        struct epoll_event offload_event;
+        offload_event.events = EPOLLIN;
+        offload_event.data.ptr = &offload_listener;
+        if (epoll_server_add(epoll_fd, offload_notify_fd(), &offload_event) == 0)
+            offload_listener.client_fd = offload_notify_fd();
+    }
+    if (offload_listener.client_fd < 0)
+    {
+        log_error("Response compression disabled");
+    }
+
+    /** Connections other workers move to us (-M) */
+    static connection_t migrate_listener;
+    memset(&migrate_listener, 0, sizeof(migrate_listener));
+    migrate_listener.state = CONN_MIGRATE_INBOX;
+    migrate_listener.client_fd = -1;
+    if (migrate_inbox >= 0)
+    {
+        struct epoll_event migrate_event;
+        migrate_event.events = EPOLLIN;
+        migrate_event.data.ptr = &migrate_listener;
+        if (epoll_server_add(epoll_fd, migrate_inbox, &migrate_event) == 0)
+            migrate_listener.client_fd = migrate_inbox;
+        else
+            log_error("Connection migration disabled");
+    }
+
+    /** Connections handed over by the old process start like freshly accepted ones */
+    for (int i = 0; i < inherited_count; i++)
+    {
+        add_client(epoll_fd, inherited_fds[i], false, NULL, 0);
+    }
+    free(inherited_fds);
+
+    /**
+     * Control socket for the next upgrade. Bound only now, after a takeover
+     * completed, so the path always belongs to the process that owns the port.
+     */
+    static connection_t control_listener;
+    memset(&control_listener, 0, sizeof(control_listener));
+    control_listener.state = CONN_UPGRADE_CONTROL;
+    control_listener.client_fd = upgrade_listen(control_path);
+
+    if (control_listener.client_fd >= 0)
+    {
+        struct epoll_event control_event;
+        control_event.events = EPOLLIN;
+        control_event.data.ptr = &control_listener;
+        if (epoll_server_add(epoll_fd, control_listener.client_fd, &control_event))
+        {
+            close(control_listener.client_fd);
+            control_listener.client_fd = -1;
+        }
+    }
+    if (control_listener.client_fd < 0)
+    {
+        log_error("Binary upgrades disabled");
+    }
+
+    /** SIGTERM/SIGINT (systemd, docker stop, Ctrl-C): a plain stop keeps the cache warm too */
+    static connection_t stop_listener;
+    memset(&stop_listener, 0, sizeof(stop_listener));
+    stop_listener.state = CONN_STOP_SIGNAL;
+    sigset_t stop_mask;
+    sigemptyset(&stop_mask);
+    sigaddset(&stop_mask, SIGTERM);
+    sigaddset(&stop_mask, SIGINT);
+    stop_listener.client_fd = signalfd(-1, &stop_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (stop_listener.client_fd >= 0)
+    {
+        struct epoll_event stop_event;
+        stop_event.events = EPOLLIN;
+        stop_event.data.ptr = &stop_listener;
+        if (epoll_server_add(epoll_fd, stop_listener.client_fd, &stop_event) != 0)
+        {
+            close(stop_listener.client_fd);
+            stop_listener.client_fd = -1;
+        }
+    }
+    if (stop_listener.client_fd < 0)
+    {
+        /** Without the signalfd the signals must still stop us, just without a snapshot */
+        log_errno("Stop signals not handled, the cache index is not saved on exit");
+        pthread_sigmask(SIG_UNBLOCK, &stop_mask, NULL);
+    }
+
+    /** Set once the listener was handed to a new process */
+    bool draining = false;
+    bool stopping = false;
+    uint64_t drain_deadline_ms = 0;
+
     handler_status_t status = HANDLER_OK;
 
-    while (1)
+    while (!stopping)
     {
-        int nfds = epoll_server_wait(epoll_fd, events, -1);
+        if (draining)
+        {
+            if (connection_live_count() == 0)
+            {
+                printf("Drained, exiting\n");
+                break;
+            }
+            if (clock_now_ms() >= drain_deadline_ms)
+            {
+                log_error("Drain timeout, exiting with %d connections open", connection_live_count());
+                break;
+            }
+        }
+
+        /** Listener was paused by overload shedding and its pause is over */
+        if (!draining)
+            admission_resume_listener(epoll_fd, server_fd, &listener_event);
+
+        /**
+         * Block forever unless something has a deadline: requests waiting in
+         * an upstream queue, on a peer or for a coalesced response head, a
+         * paused listener that must be re-armed, an idle tunnel, or a cache
+         * index snapshot. h2c streams with news don't wait at all.
+         */
+        int timeout = upstream_limiter_next_timeout(clock_now_ms());
+        int admission_timeout = admission_next_timeout();
+        if (admission_timeout >= 0 && (timeout < 0 || admission_timeout < timeout))
+            timeout = admission_timeout;
+        int peer_timeout = peer_next_timeout(clock_now_ms());
+        if (peer_timeout >= 0 && (timeout < 0 || peer_timeout < timeout))
+            timeout = peer_timeout;
+        int coalesce_timeout = coalesce_next_timeout(clock_now_ms());
+        if (coalesce_timeout >= 0 && (timeout < 0 || coalesce_timeout < timeout))
+            timeout = coalesce_timeout;
+        int tunnel_timeout = tunnel_next_timeout(clock_now_ms());
+        if (tunnel_timeout >= 0 && (timeout < 0 || tunnel_timeout < timeout))
+            timeout = tunnel_timeout;
+        int disk_timeout = disk_cache_next_timeout(clock_now_ms());
+        if (disk_timeout >= 0 && (timeout < 0 || disk_timeout < timeout))
+            timeout = disk_timeout;
+        if (h2_upstream_has_ready())
+            timeout = 0; /** Streams failed or started by the last frees */
+        if (draining)
+        {
+            int drain_timeout = (int)(drain_deadline_ms - clock_now_ms());
+            if (drain_timeout < 0)
+                drain_timeout = 0;
+            if (timeout < 0 || drain_timeout < timeout)
+                timeout = drain_timeout;
+        }
+
+        uint64_t wait_start_us = clock_now_us();
+        int nfds = epoll_server_wait(epoll_fd, events, timeout);
+        uint64_t wait_end_us = clock_now_us();
+        admission_observe_wait(wait_start_us, wait_end_us, nfds);
+        migrate_observe_wait(wait_start_us, wait_end_us);
 
         if (nfds < 0)
         {
@@ -135,14 +636,6 @@ int main()
             }
         }
 
-        /**
-         * Reset pending free counter per iteration
-         * WHY: Process all events first, then cleanup. This ensures
-         * connections aren't freed while they might still have events
-         * in the current batch.
-         */
-        pending_free_count = 0;
-
         /**
          * Process all events in batch
          * WHY: epoll_wait returns multiple ready events. Processing them
@@ -166,7 +659,81 @@ int main()
                             conn->client_fd, conn->backend_fd, conn->state);
             }
 
-            if (conn->state == CONN_LISTENING)
+            if (conn->state == CONN_UPGRADE_CONTROL)
+            {
+                if (upgrade_handoff(control_listener.client_fd, server_fd) == 0)
+                {
+                    /**
+                     * The new process accepts from now on. Closing our copy
+                     * of the listener doesn't close the socket (the new
+                     * process holds it); pending events for both listeners
+                     * in this batch are skipped via should_free_conn.
+                     */
+                    epoll_server_delete(epoll_fd, server_fd);
+                    close(server_fd);
+                    server_fd = -1;
+                    listener.should_free_conn = true;
+
+                    epoll_server_delete(epoll_fd, control_listener.client_fd);
+                    close(control_listener.client_fd);
+                    control_listener.client_fd = -1;
+                    control_listener.should_free_conn = true;
+
+                    /** Save the cache index and let the new process open the file */
+                    disk_cache_release();
+
+                    /** HTTP/2 clients: GOAWAY, sessions close as their streams finish */
+                    h2_server_drain(epoll_fd);
+
+                    draining = true;
+                    drain_deadline_ms = clock_now_ms() + UPGRADE_DRAIN_TIMEOUT_MS;
+                }
+            }
+            else if (conn->state == CONN_STOP_SIGNAL)
+            {
+                struct signalfd_siginfo info;
+                if (read(stop_listener.client_fd, &info, sizeof(info)) == sizeof(info))
+                {
+                    printf("Received %s, saving the cache index and exiting\n", strsignal((int)info.ssi_signo));
+                    stopping = true;
+                }
+            }
+            else if (conn->state == CONN_OFFLOAD_NOTIFY)
+            {
+                /** Completions first: they queue the compression results handled next */
+                offload_collect();
+                handle_compress_done(epoll_fd);
+            }
+            else if (conn->state == CONN_MIGRATE_INBOX)
+            {
+                migrate_receive(epoll_fd);
+            }
+            else if (conn->state == CONN_H2_UPSTREAM)
+            {
+                handle_h2_upstream(conn, epoll_fd, events[i].events);
+            }
+            else if (conn->state == CONN_TLS)
+            {
+                /** Client socket or the bridge's plaintext end: both are serviced */
+                if (handle_tls(conn, epoll_fd) != HANDLER_OK)
+                    connection_schedule_free(conn);
+            }
+            else if (conn->state == CONN_H2_CLIENT)
+            {
+                /** Client socket or the session's stream epoll: both are serviced */
+                if (handle_h2_client(conn, epoll_fd) != HANDLER_OK)
+                    connection_schedule_free(conn);
+            }
+            else if (conn->state == CONN_LISTENING && admission_should_shed())
+            {
+                /**
+                 * Persistently overloaded (CoDel): reject the backlog with a
+                 * canned 503 and stop accepting for a while, so the loop can
+                 * finish the requests it already has.
+                 */
+                admission_shed(epoll_fd, server_fd);
+            }
+            else if (conn->state == CONN_LISTENING)
             {
                 /**
                  * Loop accept for multiple pending connections
@@ -181,83 +748,86 @@ int main()
                  * NOTE: In level-triggered mode (current), this isn't strictly needed
                  * since we'll get EPOLLIN again if connections remain. But it's still
                  * better for handling bursts efficiently.
+                 *
+                 * At most accept_budget per wakeup: a connect storm would otherwise
+                 * keep us here while the clients already connected wait for their
+                 * responses. Whatever is left in the backlog is still readable, so
+                 * the next epoll_wait() returns the listener again.
                  */
-                while (1)
+                for (int accepted = 0; accepted < accept_budget; accepted++)
                 {
                     /**
                      * accept() never returns EINPROGRESS, because accepting a connection is different:
                      * - either a connection is ready to accept, or it isn’t.
                      * - There’s no “in-progress” state like a TCP handshake.
                      */
-                    // accepts the new connections which came to connects
-                    client_fd = accept_client(listener.client_fd);
+                    // accepts the new connections which came to connects, non-blocking with the address in one syscall
+                    struct sockaddr_storage client_addr;
+                    socklen_t client_addr_len = sizeof(client_addr);
+                    client_fd = accept_client_nb(listener.client_fd, &client_addr, &client_addr_len);
                     if (client_fd == -1)
                     {
                         break; // No connection - move to next epoll event
                     }
                     if (client_fd == -2)
                     {
+                        if (errno == EMFILE || errno == ENFILE)
+                        {
+                            /** Out of fds: reject one pending client via the spare fd, retry on next event */
+                            admission_shed_emfile(server_fd);
+                            break;
+                        }
                         log_error("Failed to accept the client fd");
                         continue;
                     }
 
-                    // make client_ids non-blocking
-                    if (set_non_blocking(client_fd))
-                    {
-                        log_error("main: failed to set client fd non-blocking");
-                        close(client_fd);
-                        continue;
-                    }
-
-                    connection_t *new_conn = connection_create(client_fd);
-                    if (!new_conn)
-                    {
-                        close(client_fd);
-                        log_error("connection_create failed for fd=%d", client_fd);
-                        continue;
-                    }
-
-                    /**
-                     * Here for Event flag for epoll that tells you:
-                     * "This file descriptor (socket) has data
-                     * you can read *without blocking*."
-                     */
-                    event.events = EPOLLIN;
-                    event.data.ptr = new_conn;
-
-                    if (epoll_server_add(epoll_fd, client_fd, &event) < 0)
-                    {
-                        log_error("Failed to add client fd in epoll watchlist");
-                        connection_free(new_conn, epoll_fd);
-                        continue;
-                    }
-
-                    DEBUG_PRINT("✅ New client connection created: fd=%d, state=%d\n",
-                                new_conn->client_fd, new_conn->state);
-                    continue;
+                    add_client(epoll_fd, client_fd, tls_enabled(), &client_addr, client_addr_len);
+                }
+            }
+            else if (conn->state == CONN_QUEUED || conn->state == CONN_COALESCED || conn->coalesce.parked ||
+                     (conn->h2.upstream && conn->state == CONN_READING_RESPONSE))
+            {
+                /** Client gave up while waiting for an upstream slot, a shared response or an h2c stream */
+                if (events[i].events & (EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                {
+                    handle_connection_error(conn, epoll_fd);
+                    connection_schedule_free(conn);
+                }
+            }
+            else if (conn->state == CONN_TUNNEL)
+            {
+                /** Both directions are serviced whichever fd the event is for */
+                status = handle_tunnel(conn, epoll_fd, events[i].events);
+                if (status != HANDLER_OK)
+                {
+                    connection_schedule_free(conn);
                 }
             }
             else
             {
+                status = HANDLER_OK;
+
                 /**----------------------2--handle readable events---------------------- */
                 if (events[i].events & EPOLLIN)
                 {
                     if (conn->state == CONN_READING_REQUEST)
                     {
-                        status = handle_client_readable(conn, routes, route_count, epoll_fd);
+                        status = handle_client_readable(conn, epoll_fd);
                     }
-                    else if (conn->backend_fd >= 0 && conn->state == CONN_READING_RESPONSE)
+                    else if (conn->backend_fd >= 0 &&
+                             (conn->state == CONN_READING_RESPONSE || conn->state == CONN_COMPRESSING ||
+                              conn->state == CONN_SENDING_RESPONSE))
                     {
                         status = handle_backend_readable(conn, epoll_fd);
                     }
 
                     if (status == HANDLER_ERROR || status == HANDLER_CLOSED)
                     {
-                        conn->should_free_conn = true;
+                        connection_schedule_free(conn);
                     }
                     else if (status == HANDLER_OK && conn->state == CONN_DONE)
                     {
-                        conn->should_free_conn = true;
+                        connection_schedule_free(conn);
                     }
                 }
 
@@ -268,36 +838,49 @@ int main()
                     {
                         status = handle_backend_writable(conn, epoll_fd);
                     }
-                    else if (conn->state == CONN_SENDING_RESPONSE)
+                    else if (conn->state == CONN_SENDING_RESPONSE || conn->state == CONN_COMPRESSING)
                     {
                         status = handle_client_writable(conn, epoll_fd);
                     }
                     if (status == HANDLER_ERROR || status == HANDLER_CLOSED)
                     {
-                        conn->should_free_conn = true;
+                        connection_schedule_free(conn);
                     }
                     else if (status == HANDLER_OK && conn->state == CONN_DONE)
                     {
-                        conn->should_free_conn = true;
+                        connection_schedule_free(conn);
                     }
                 }
-
-                if (conn->should_free_conn)
-                {
-                    if (pending_free_count < MAX_PENDING_FREE)
-                        pending_free[pending_free_count++] = conn;
-                    else
-                        log_error("Too many connections pending free!");
-                }
             }
         }
-        for (int i = 0; i < pending_free_count; i++)
-        {
-            connection_free(pending_free[i], epoll_fd);
-        }
+
+        /**
+         * Process all events first, then cleanup. This ensures connections
+         * aren't freed while they might still have events in the current batch.
+         * Freeing also returns upstream slots and may orphan coalesced
+         * followers, so the wait queues, peer deadlines and followers are
+         * serviced right after; anything that fails there (or a tunnel that
+         * was idle too long) is freed in the second pass. A busy worker
+         * sends connections away first, so their copies go in the same pass.
+         */
+        if (!draining)
+            migrate_balance(epoll_fd, clock_now_ms());
+        connection_free_pending(epoll_fd);
+        handle_upstream_queue(epoll_fd);
+        handle_peer_timeouts(epoll_fd);
+        handle_tunnel_timeouts(epoll_fd);
+        handle_coalesced(epoll_fd);
+        handle_h2_streams(epoll_fd);
+        connection_free_pending(epoll_fd);
+        h2_upstream_reap();
+
+        disk_cache_tick(clock_now_ms());
     }
 
+    /** No-op after an upgrade handoff: the index was saved and the file let go then */
+    disk_cache_release();
     close(epoll_fd);
-    close(server_fd);
+    if (server_fd >= 0)
+        close(server_fd);
     return 0;
 }
\ No newline at end of file
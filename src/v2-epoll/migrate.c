@@ -0,0 +1,371 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <v2-epoll/migrate.h>
+#include <v2-epoll/workers.h>
+#include <v2-epoll/connection.h>
+#include <v2-epoll/epoll_server.h>
+#include <v2-epoll/tunnel.h>
+#include <v2-epoll/clock.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+/** What one worker publishes; a cache line each, written only by its owner */
+typedef struct
+{
+    _Atomic uint64_t busy_us;      /**< Time outside epoll_wait() since start */
+    _Atomic uint32_t live;         /**< Live connections */
+    _Atomic uint64_t moved_out;    /**< Connections sent to other workers */
+    _Atomic uint64_t moved_in;     /**< Connections taken from other workers */
+} __attribute__((aligned(64))) worker_load_t;
+
+typedef enum
+{
+    MIGRATE_IDLE_CLIENT = 1, /**< One fd: the client, nothing read */
+    MIGRATE_TUNNEL = 2       /**< Two fds: client, backend */
+} migrate_kind_t;
+
+typedef struct
+{
+    uint32_t kind;
+    uint32_t peer_addr_len;
+    struct sockaddr_storage peer_addr;
+} migrate_record_t;
+
+typedef struct
+{
+    uint32_t from;
+    uint32_t count;
+    migrate_record_t records[MIGRATE_BATCH];
+} migrate_msg_t;
+
+static int worker_total = 0;
+static int busy_threshold = MIGRATE_BUSY_MIN;
+static int self = -1;
+static worker_load_t *loads = NULL;
+static int (*inboxes)[2] = NULL; /**< [i][0]: worker i receives, [i][1]: the others send */
+
+/** This worker's side of the bookkeeping */
+static uint64_t last_wait_end_us = 0;
+static uint64_t next_balance_ms = 0;
+static uint64_t seen_busy_us[WORKERS_MAX];
+static uint64_t seen_at_ms = 0;
+
+int migrate_init(int workers, int busy_min)
+{
+    loads = mmap(NULL, workers * sizeof(worker_load_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (loads == MAP_FAILED)
+    {
+        log_errno("migrate_init: mmap failed");
+        loads = NULL;
+        return -1;
+    }
+    inboxes = calloc(workers, sizeof(*inboxes));
+    if (!inboxes)
+    {
+        munmap(loads, workers * sizeof(worker_load_t));
+        loads = NULL;
+        return -1;
+    }
+    for (int i = 0; i < workers; i++)
+    {
+        if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, inboxes[i]) < 0)
+        {
+            log_errno("migrate_init: socketpair failed");
+            while (i-- > 0)
+            {
+                close(inboxes[i][0]);
+                close(inboxes[i][1]);
+            }
+            free(inboxes);
+            inboxes = NULL;
+            munmap(loads, workers * sizeof(worker_load_t));
+            loads = NULL;
+            return -1;
+        }
+    }
+    worker_total = workers;
+    busy_threshold = busy_min;
+    return 0;
+}
+
+int migrate_attach(int index)
+{
+    if (!inboxes)
+        return -1;
+
+    /** Only we read our inbox, and we never send to ourselves */
+    for (int i = 0; i < worker_total; i++)
+    {
+        if (i == index)
+            close(inboxes[i][1]);
+        else
+            close(inboxes[i][0]);
+    }
+    self = index;
+    last_wait_end_us = clock_now_us();
+    seen_at_ms = clock_now_ms();
+    next_balance_ms = seen_at_ms + MIGRATE_INTERVAL_MS;
+    return inboxes[index][0];
+}
+
+void migrate_observe_wait(uint64_t wait_start_us, uint64_t wait_end_us)
+{
+    if (self < 0)
+        return;
+    if (wait_start_us > last_wait_end_us)
+        atomic_fetch_add_explicit(&loads[self].busy_us, wait_start_us - last_wait_end_us, memory_order_relaxed);
+    last_wait_end_us = wait_end_us;
+}
+
+/** Drop our copies of a connection whose fds another worker now holds */
+static void release_moved(connection_t *conn, int epoll_fd)
+{
+    /** Plain close: -R's SO_LINGER would reset the socket for its new owner too */
+    if (conn->backend_fd >= 0)
+    {
+        epoll_server_delete(epoll_fd, conn->backend_fd);
+        close(conn->backend_fd);
+        conn->backend_fd = -1;
+    }
+    connection_schedule_free(conn);
+}
+
+/** Send up to @p max movable connections to @p target in one datagram */
+static int send_batch(int target, int max, int epoll_fd)
+{
+    migrate_msg_t msg;
+    connection_t *moved[MIGRATE_BATCH];
+    int fds[2 * MIGRATE_BATCH];
+    int nfds = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.from = self;
+    for (connection_t *c = connection_live_first(); c && (int)msg.count < max; c = c->live_next)
+    {
+        migrate_record_t *r = &msg.records[msg.count];
+        if (connection_is_idle(c) && c->client_fd >= 0)
+        {
+            r->kind = MIGRATE_IDLE_CLIENT;
+            fds[nfds++] = c->client_fd;
+        }
+        else if (!c->should_free_conn && tunnel_movable(c))
+        {
+            r->kind = MIGRATE_TUNNEL;
+            fds[nfds++] = c->client_fd;
+            fds[nfds++] = c->backend_fd;
+        }
+        else
+        {
+            continue;
+        }
+        r->peer_addr_len = c->peer_addr_len;
+        memcpy(&r->peer_addr, &c->peer_addr, sizeof(r->peer_addr));
+        moved[msg.count++] = c;
+    }
+    if (msg.count == 0)
+        return 0;
+
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &msg, .iov_len = offsetof(migrate_msg_t, records) + msg.count * sizeof(migrate_record_t)};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                        .msg_controllen = CMSG_SPACE(nfds * sizeof(int))};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    if (sendmsg(inboxes[target][1], &mh, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    {
+        /** Inbox full or its worker gone: keep them, try again next interval */
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            log_errno("migrate: send to worker %d failed", target);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < msg.count; i++)
+        release_moved(moved[i], epoll_fd);
+    atomic_fetch_add_explicit(&loads[self].moved_out, msg.count, memory_order_relaxed);
+    return (int)msg.count;
+}
+
+void migrate_balance(int epoll_fd, uint64_t now_ms)
+{
+    if (self < 0 || now_ms < next_balance_ms)
+        return;
+    next_balance_ms = now_ms + MIGRATE_INTERVAL_MS;
+
+    int live = connection_live_count();
+    atomic_store_explicit(&loads[self].live, (uint32_t)live, memory_order_relaxed);
+
+    /** Busy per mille of every worker since our last look */
+    uint64_t elapsed_us = (now_ms - seen_at_ms) * 1000;
+    seen_at_ms = now_ms;
+    if (elapsed_us == 0)
+        return;
+
+    int mine = 0, coolest = -1, coolest_busy = 0;
+    for (int i = 0; i < worker_total; i++)
+    {
+        uint64_t busy_us = atomic_load_explicit(&loads[i].busy_us, memory_order_relaxed);
+        uint64_t delta = busy_us - seen_busy_us[i];
+        seen_busy_us[i] = busy_us;
+        int busy = delta >= elapsed_us ? 1000 : (int)(delta * 1000 / elapsed_us);
+        if (i == self)
+            mine = busy;
+        else if (coolest < 0 || busy < coolest_busy)
+        {
+            coolest = i;
+            coolest_busy = busy;
+        }
+    }
+    if (coolest < 0 || mine < busy_threshold || (mine - coolest_busy) * 1000 < mine * MIGRATE_IMBALANCE)
+        return;
+
+    /** Half the gap: both end up near the middle, and the next look corrects */
+    int share = live * (mine - coolest_busy) / (2 * mine);
+    if (share > MIGRATE_BATCH)
+        share = MIGRATE_BATCH;
+    if (share < 1)
+        share = 1;
+
+    int moved = send_batch(coolest, share, epoll_fd);
+    if (moved > 0)
+    {
+        printf("Worker %d (busy %d‰) moved %d connections to worker %d (busy %d‰)\n",
+               self, mine, moved, coolest, coolest_busy);
+        fflush(stdout);
+    }
+}
+
+/** Make a received connection ours: register its fds, restart a tunnel */
+static void adopt(const migrate_record_t *r, const int *fds, int epoll_fd)
+{
+    connection_t *conn = connection_create(fds[0]);
+    if (!conn)
+    {
+        close(fds[0]);
+        if (r->kind == MIGRATE_TUNNEL)
+            close(fds[1]);
+        return;
+    }
+    if (r->peer_addr_len <= sizeof(conn->peer_addr))
+    {
+        memcpy(&conn->peer_addr, &r->peer_addr, r->peer_addr_len);
+        conn->peer_addr_len = r->peer_addr_len;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = conn;
+    if (epoll_server_add(epoll_fd, conn->client_fd, &event) < 0)
+    {
+        if (r->kind == MIGRATE_TUNNEL)
+            close(fds[1]);
+        connection_free(conn, epoll_fd);
+        return;
+    }
+    if (r->kind != MIGRATE_TUNNEL)
+        return;
+
+    conn->backend_fd = fds[1];
+    conn->backend_responded = true;
+    if (epoll_server_add(epoll_fd, conn->backend_fd, &event) < 0 ||
+        tunnel_start(conn, epoll_fd, clock_now_ms()) != 0)
+    {
+        /** Finished right away (EOF raced the move) or failed */
+        connection_schedule_free(conn);
+    }
+}
+
+void migrate_receive(int epoll_fd)
+{
+    if (self < 0)
+        return;
+
+    for (;;)
+    {
+        migrate_msg_t msg;
+        int fds[2 * MIGRATE_BATCH];
+        char control[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov = {.iov_base = &msg, .iov_len = sizeof(msg)};
+        struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+
+        ssize_t n = recvmsg(inboxes[self][0], &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_errno("migrate: receive failed");
+            return;
+        }
+
+        int nfds = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+
+        /** Records and fds must agree; anything else is dropped whole */
+        int needed = 0;
+        bool valid = n >= (ssize_t)offsetof(migrate_msg_t, records) && !(mh.msg_flags & MSG_CTRUNC) &&
+                     msg.count <= MIGRATE_BATCH &&
+                     (size_t)n == offsetof(migrate_msg_t, records) + msg.count * sizeof(migrate_record_t);
+        for (uint32_t i = 0; valid && i < msg.count; i++)
+        {
+            if (msg.records[i].kind != MIGRATE_IDLE_CLIENT && msg.records[i].kind != MIGRATE_TUNNEL)
+                valid = false;
+            needed += msg.records[i].kind == MIGRATE_TUNNEL ? 2 : 1;
+        }
+        if (!valid || needed != nfds)
+        {
+            log_error("migrate: malformed batch (%zd bytes, %d fds), dropped", n, nfds);
+            for (int i = 0; i < nfds; i++)
+                close(fds[i]);
+            continue;
+        }
+
+        int next = 0;
+        for (uint32_t i = 0; i < msg.count; i++)
+        {
+            adopt(&msg.records[i], &fds[next], epoll_fd);
+            next += msg.records[i].kind == MIGRATE_TUNNEL ? 2 : 1;
+        }
+        atomic_fetch_add_explicit(&loads[self].moved_in, msg.count, memory_order_relaxed);
+        DEBUG_PRINT("migrate: worker %d took %u connections from worker %u\n", self, msg.count, msg.from);
+    }
+}
+
+void migrate_report(void)
+{
+    static uint64_t reported_busy_us[WORKERS_MAX];
+    static uint64_t reported_at_us = 0;
+    if (!loads)
+        return;
+
+    uint64_t now_us = clock_now_us();
+    uint64_t elapsed_us = reported_at_us ? now_us - reported_at_us : 0;
+    reported_at_us = now_us;
+    for (int i = 0; i < worker_total; i++)
+    {
+        uint64_t busy_us = atomic_load_explicit(&loads[i].busy_us, memory_order_relaxed);
+        printf("worker %d: busy %5.1f%%  live %u  moved out %lu  moved in %lu\n", i,
+               elapsed_us ? 100.0 * (busy_us - reported_busy_us[i]) / elapsed_us : 0.0,
+               atomic_load_explicit(&loads[i].live, memory_order_relaxed),
+               (unsigned long)atomic_load_explicit(&loads[i].moved_out, memory_order_relaxed),
+               (unsigned long)atomic_load_explicit(&loads[i].moved_in, memory_order_relaxed));
+        reported_busy_us[i] = busy_us;
+    }
+    fflush(stdout);
+}
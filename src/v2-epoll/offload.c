@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <v2-epoll/offload.h>
+#include <v2-epoll/clock.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+#define DEQUE_MASK (OFFLOAD_DEQUE_SIZE - 1)
+
+/**
+ * Chase-Lev deque with a fixed array. bottom is only written by the loop,
+ * top only moves by CAS; the slots are atomic so a thief reading a slot the
+ * loop is about to reuse is a lost CAS, not a data race.
+ */
+typedef struct
+{
+    _Alignas(64) _Atomic int64_t top;
+    _Alignas(64) _Atomic int64_t bottom;
+    _Atomic(offload_job_t *) slots[OFFLOAD_DEQUE_SIZE];
+} deque_t;
+
+/** Per pool thread; written by that thread only */
+typedef struct
+{
+    _Alignas(64) _Atomic uint64_t jobs;
+    _Atomic uint64_t stolen;
+    _Atomic uint64_t wait_us;     /**< Sum of queue waits */
+    _Atomic uint64_t wait_max_us; /**< Largest queue wait */
+    _Atomic uint64_t run_us;      /**< Sum of run() times */
+} thread_stats_t;
+
+static deque_t deques[OFFLOAD_THREADS];
+static thread_stats_t stats[OFFLOAD_THREADS];
+static int thread_count = 0;
+static sem_t queued;
+static _Atomic(offload_job_t *) done_head = NULL;
+static int notify_fd = -1;
+
+/* Loop side */
+static int next_deque = 0;
+static offload_job_t *waiting_head = NULL; /**< Every deque was full */
+static offload_job_t *waiting_tail = NULL;
+static uint64_t report_at_ms = 0;
+
+/** Owner end: false if the deque is full */
+static bool deque_push(deque_t *d, offload_job_t *job)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= OFFLOAD_DEQUE_SIZE)
+        return false;
+    atomic_store_explicit(&d->slots[b & DEQUE_MASK], job, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+/** Thief end: the oldest job, or NULL if empty or another thread won it */
+static offload_job_t *deque_steal(deque_t *d)
+{
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+    offload_job_t *job = atomic_load_explicit(&d->slots[t & DEQUE_MASK], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return job;
+}
+
+static void stat_max(_Atomic uint64_t *max, uint64_t value)
+{
+    if (value > atomic_load_explicit(max, memory_order_relaxed))
+        atomic_store_explicit(max, value, memory_order_relaxed);
+}
+
+static void *pool_main(void *arg)
+{
+    int self = (int)(intptr_t)arg;
+    thread_stats_t *st = &stats[self];
+
+    for (;;)
+    {
+        while (sem_wait(&queued) != 0 && errno == EINTR)
+            ;
+
+        /**
+         * The semaphore reserved one queued job for us; it may sit in any
+         * deque, and a CAS lost to another thread means try again.
+         */
+        offload_job_t *job = NULL;
+        bool stolen = false;
+        while (!job)
+        {
+            job = deque_steal(&deques[self]);
+            for (int i = 1; !job && i < thread_count; i++)
+            {
+                job = deque_steal(&deques[(self + i) % thread_count]);
+                stolen = job != NULL;
+            }
+            if (!job)
+                sched_yield();
+        }
+
+        uint64_t start_us = clock_now_us();
+        uint64_t wait_us = start_us - job->submitted_us;
+        job->run(job);
+        uint64_t run_us = clock_now_us() - start_us;
+
+        atomic_fetch_add_explicit(&st->jobs, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->stolen, stolen, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->wait_us, wait_us, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->run_us, run_us, memory_order_relaxed);
+        stat_max(&st->wait_max_us, wait_us);
+
+        /** The first completion on an empty stack wakes the loop; it takes the rest with it */
+        offload_job_t *head = atomic_load_explicit(&done_head, memory_order_relaxed);
+        do
+            job->next = head;
+        while (!atomic_compare_exchange_weak_explicit(&done_head, &head, job, memory_order_release, memory_order_relaxed));
+        if (!head)
+        {
+            uint64_t one = 1;
+            if (write(notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+                log_errno("offload: eventfd write failed");
+        }
+    }
+    return NULL;
+}
+
+int offload_init(void)
+{
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd < 0)
+    {
+        log_errno("offload_init: eventfd failed");
+        return -1;
+    }
+    if (sem_init(&queued, 0, 0) != 0)
+    {
+        log_errno("offload_init: sem_init failed");
+        close(notify_fd);
+        notify_fd = -1;
+        return -1;
+    }
+
+    for (int i = 0; i < OFFLOAD_THREADS; i++)
+    {
+        pthread_t tid;
+        int err = pthread_create(&tid, NULL, pool_main, (void *)(intptr_t)i);
+        if (err != 0)
+        {
+            log_error("offload_init: pthread_create failed: %s", strerror(err));
+            break;
+        }
+        pthread_detach(tid);
+        thread_count++;
+    }
+    if (thread_count == 0)
+    {
+        sem_destroy(&queued);
+        close(notify_fd);
+        notify_fd = -1;
+        return -1;
+    }
+    report_at_ms = clock_now_ms() + OFFLOAD_REPORT_MS;
+    return 0;
+}
+
+bool offload_available(void)
+{
+    return notify_fd >= 0;
+}
+
+int offload_notify_fd(void)
+{
+    return notify_fd;
+}
+
+/** Push on the next deque with room; false if all are full */
+static bool push_any(offload_job_t *job)
+{
+    for (int i = 0; i < thread_count; i++)
+    {
+        deque_t *d = &deques[next_deque];
+        next_deque = (next_deque + 1) % thread_count;
+        if (deque_push(d, job))
+        {
+            sem_post(&queued);
+            return true;
+        }
+    }
+    return false;
+}
+
+void offload_submit(offload_job_t *job)
+{
+    job->submitted_us = clock_now_us();
+    job->next = NULL;
+    if (!waiting_head && push_any(job))
+        return;
+
+    /** Keep submission order: behind the ones already waiting */
+    if (waiting_tail)
+        waiting_tail->next = job;
+    else
+        waiting_head = job;
+    waiting_tail = job;
+}
+
+static void report(uint64_t now_ms)
+{
+    uint64_t jobs = 0, stolen = 0, wait_us = 0, wait_max_us = 0, run_us = 0;
+    for (int i = 0; i < thread_count; i++)
+    {
+        jobs += atomic_exchange_explicit(&stats[i].jobs, 0, memory_order_relaxed);
+        stolen += atomic_exchange_explicit(&stats[i].stolen, 0, memory_order_relaxed);
+        wait_us += atomic_exchange_explicit(&stats[i].wait_us, 0, memory_order_relaxed);
+        run_us += atomic_exchange_explicit(&stats[i].run_us, 0, memory_order_relaxed);
+        uint64_t max = atomic_exchange_explicit(&stats[i].wait_max_us, 0, memory_order_relaxed);
+        if (max > wait_max_us)
+            wait_max_us = max;
+    }
+    if (jobs)
+    {
+        printf("offload: %lu jobs in the last %lus, queue wait avg %lu us max %lu us, run avg %lu us, stolen %lu (%.1f%%)\n",
+               (unsigned long)jobs, (unsigned long)(OFFLOAD_REPORT_MS + now_ms - report_at_ms) / 1000,
+               (unsigned long)(wait_us / jobs), (unsigned long)wait_max_us, (unsigned long)(run_us / jobs),
+               (unsigned long)stolen, 100.0 * stolen / jobs);
+        fflush(stdout);
+    }
+    report_at_ms = now_ms + OFFLOAD_REPORT_MS;
+}
+
+void offload_collect(void)
+{
+    /** Drain the eventfd before taking the stack: a completion after the exchange wakes us again */
+    uint64_t count;
+    if (read(notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        log_errno("offload_collect: eventfd read failed");
+    offload_job_t *done = atomic_exchange_explicit(&done_head, NULL, memory_order_acquire);
+
+    /** The stack is newest first */
+    offload_job_t *ordered = NULL;
+    while (done)
+    {
+        offload_job_t *next = done->next;
+        done->next = ordered;
+        ordered = done;
+        done = next;
+    }
+
+    /** Completions made room in the deques (next is the pool's once pushed) */
+    while (waiting_head)
+    {
+        offload_job_t *next = waiting_head->next;
+        if (!push_any(waiting_head))
+            break;
+        waiting_head = next;
+        if (!waiting_head)
+            waiting_tail = NULL;
+    }
+
+    while (ordered)
+    {
+        offload_job_t *job = ordered;
+        ordered = job->next;
+        job->complete(job);
+    }
+
+    uint64_t now = clock_now_ms();
+    if (now >= report_at_ms)
+        report(now);
+}
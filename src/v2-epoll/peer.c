@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <v2-epoll/peer.h>
+#include <v2-epoll/connection.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+typedef struct
+{
+    uint64_t hash;
+    int node;
+} ring_point_t;
+
+static peer_t nodes[PEER_MAX];
+static int node_count = 0;
+static peer_t *self_node = NULL;
+
+static ring_point_t ring[PEER_MAX * PEER_VNODES];
+static int ring_len = 0;
+
+/**
+ * Deadline lists, oldest first. Each has a single timeout, so deadlines are
+ * ordered and only the heads need checking.
+ */
+enum
+{
+    WAIT_NONE = 0,
+    WAIT_CONNECT,
+    WAIT_RESPONSE,
+    WAIT_LISTS
+};
+static connection_t *wait_head[WAIT_LISTS];
+static connection_t *wait_tail[WAIT_LISTS];
+
+/** FNV-1a, then a final avalanche (splitmix64) so nearby names land far apart */
+static uint64_t hash_str(const char *s)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; s++)
+    {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static int point_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const ring_point_t *)a)->hash;
+    uint64_t y = ((const ring_point_t *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static int parse_node(peer_t *node, const char *name, size_t len)
+{
+    const char *colon = memrchr(name, ':', len);
+    if (!colon || colon == name || (size_t)(colon - name) >= sizeof(node->host) || len >= sizeof(node->name))
+        return -1;
+
+    memset(node, 0, sizeof(*node));
+    memcpy(node->name, name, len);
+    memcpy(node->host, name, colon - name);
+
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    if (end != name + len || port <= 0 || port > 65535)
+        return -1;
+    node->port = (int)port;
+    return 0;
+}
+
+int peer_init(const char *list, const char *self)
+{
+    node_count = 0;
+    ring_len = 0;
+    self_node = NULL;
+
+    const char *p = list;
+    while (*p)
+    {
+        size_t len = strcspn(p, ",");
+        if (node_count >= PEER_MAX || parse_node(&nodes[node_count], p, len) != 0)
+        {
+            log_error("peer_init: Bad peer '%.*s' (want host:port, at most %d)", (int)len, p, PEER_MAX);
+            return -1;
+        }
+        if (strcmp(nodes[node_count].name, self) == 0)
+        {
+            nodes[node_count].self = true;
+            self_node = &nodes[node_count];
+        }
+        node_count++;
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+
+    if (!self_node)
+    {
+        log_error("peer_init: This node (%s) is not in the peer list", self);
+        node_count = 0;
+        return -1;
+    }
+
+    /** Points depend only on the names, so every node builds the same ring */
+    for (int i = 0; i < node_count; i++)
+    {
+        for (int v = 0; v < PEER_VNODES; v++)
+        {
+            char point[sizeof(nodes[i].name) + 16];
+            snprintf(point, sizeof(point), "%s#%d", nodes[i].name, v);
+            ring[ring_len].hash = hash_str(point);
+            ring[ring_len].node = i;
+            ring_len++;
+        }
+    }
+    qsort(ring, ring_len, sizeof(ring[0]), point_cmp);
+    return node_count;
+}
+
+const char *peer_self_name(void)
+{
+    return self_node ? self_node->name : NULL;
+}
+
+bool peer_assign(connection_t *conn, const char *key, uint64_t now_ms)
+{
+    if (node_count < 2)
+        return false;
+
+    /** First point at or after the key's hash (wrapping around) */
+    uint64_t h = hash_str(key);
+    int lo = 0, hi = ring_len;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /** Walk clockwise past down peers; reaching this node means "fetch it yourself" */
+    for (int i = 0; i < ring_len; i++)
+    {
+        peer_t *node = &nodes[ring[(lo + i) % ring_len].node];
+        if (node->self)
+            return false;
+
+        if (!node->down)
+        {
+            conn->peer.node = node;
+            conn->peer.probe = false;
+            return true;
+        }
+        if (!node->probing && now_ms >= node->retry_ms)
+        {
+            node->probing = true;
+            conn->peer.node = node;
+            conn->peer.probe = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* ---------------- Deadline lists ---------------- */
+
+static void wait_remove(connection_t *conn)
+{
+    peer_member_t *m = &conn->peer;
+    if (m->wait == WAIT_NONE)
+        return;
+
+    if (m->prev)
+        m->prev->peer.next = m->next;
+    else
+        wait_head[m->wait] = m->next;
+    if (m->next)
+        m->next->peer.prev = m->prev;
+    else
+        wait_tail[m->wait] = m->prev;
+
+    m->prev = NULL;
+    m->next = NULL;
+    m->wait = WAIT_NONE;
+}
+
+static void wait_push(connection_t *conn, int list, uint64_t deadline_ms)
+{
+    peer_member_t *m = &conn->peer;
+    wait_remove(conn);
+
+    m->wait = list;
+    m->deadline_ms = deadline_ms;
+    m->next = NULL;
+    m->prev = wait_tail[list];
+    if (wait_tail[list])
+        wait_tail[list]->peer.next = conn;
+    else
+        wait_head[list] = conn;
+    wait_tail[list] = conn;
+}
+
+void peer_watch_connect(connection_t *conn, uint64_t now_ms)
+{
+    wait_push(conn, WAIT_CONNECT, now_ms + PEER_CONNECT_TIMEOUT_MS);
+}
+
+void peer_watch_response(connection_t *conn, uint64_t now_ms)
+{
+    wait_push(conn, WAIT_RESPONSE, now_ms + PEER_RESPONSE_TIMEOUT_MS);
+}
+
+void peer_report(connection_t *conn, bool ok, uint64_t now_ms)
+{
+    peer_t *node = conn->peer.node;
+    if (!node)
+        return;
+
+    wait_remove(conn);
+    if (conn->peer.probe)
+        node->probing = false;
+
+    if (ok && node->down)
+    {
+        log_error("peer: %s is back up", node->name);
+        node->down = false;
+    }
+    else if (!ok)
+    {
+        if (!node->down)
+            log_error("peer: %s failed, skipping it for %d ms", node->name, PEER_RETRY_MS);
+        node->down = true;
+        node->retry_ms = now_ms + PEER_RETRY_MS;
+    }
+
+    conn->peer.node = NULL;
+    conn->peer.probe = false;
+}
+
+void peer_detach(connection_t *conn)
+{
+    if (!conn->peer.node)
+        return;
+
+    /** The client left before the verdict: let the next request probe */
+    wait_remove(conn);
+    if (conn->peer.probe)
+        conn->peer.node->probing = false;
+    conn->peer.node = NULL;
+    conn->peer.probe = false;
+}
+
+connection_t *peer_pop_expired(uint64_t now_ms)
+{
+    for (int list = WAIT_CONNECT; list < WAIT_LISTS; list++)
+    {
+        connection_t *head = wait_head[list];
+        if (head && head->peer.deadline_ms <= now_ms)
+        {
+            wait_remove(head);
+            DEBUG_PRINT("peer: %s timed out (%s)\n", head->peer.node->name,
+                        list == WAIT_CONNECT ? "connect" : "response");
+            return head;
+        }
+    }
+    return NULL;
+}
+
+int peer_next_timeout(uint64_t now_ms)
+{
+    int timeout = -1;
+    for (int list = WAIT_CONNECT; list < WAIT_LISTS; list++)
+    {
+        connection_t *head = wait_head[list];
+        if (!head)
+            continue;
+        if (head->peer.deadline_ms <= now_ms)
+            return 0;
+
+        int wait = (int)(head->peer.deadline_ms - now_ms);
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+    return timeout;
+}
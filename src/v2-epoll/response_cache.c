@@ -0,0 +1,515 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <v2-epoll/response_cache.h>
+#include <v2-epoll/clock.h>
+#include <common/http_cache.h>
+#include <common/frequency_sketch.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+typedef struct
+{
+    cache_entry_t *head; /**< Most recently used */
+    cache_entry_t *tail; /**< Eviction end */
+    size_t bytes;
+} lru_list_t;
+
+typedef struct
+{
+    bool ready;
+    cache_entry_t **buckets;
+    size_t bucket_count; /**< Power of two */
+    size_t entry_count;
+
+    size_t max_bytes;
+    size_t window_max;
+    size_t protected_max;
+    size_t main_max; /**< probation + protected */
+
+    lru_list_t window;
+    lru_list_t probation;
+    lru_list_t protected_;
+
+    frequency_sketch_t sketch;
+
+    int refreshes; /**< Background refreshes in flight */
+} response_cache_t;
+
+static response_cache_t cache;
+
+static uint64_t hash_key(const char *key)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = key; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* ---------------- LRU lists ---------------- */
+
+static lru_list_t *segment_list(cache_segment_t segment)
+{
+    switch (segment)
+    {
+    case CACHE_SEGMENT_WINDOW:
+        return &cache.window;
+    case CACHE_SEGMENT_PROBATION:
+        return &cache.probation;
+    case CACHE_SEGMENT_PROTECTED:
+        return &cache.protected_;
+    default:
+        return NULL;
+    }
+}
+
+static void lru_unlink(cache_entry_t *e)
+{
+    lru_list_t *list = segment_list(e->segment);
+    if (!list)
+        return;
+
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        list->head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        list->tail = e->lru_prev;
+
+    list->bytes -= e->charge;
+    e->lru_prev = e->lru_next = NULL;
+    e->segment = CACHE_SEGMENT_NONE;
+}
+
+static void lru_push_head(cache_entry_t *e, cache_segment_t segment)
+{
+    lru_list_t *list = segment_list(segment);
+
+    e->segment = segment;
+    e->lru_prev = NULL;
+    e->lru_next = list->head;
+    if (list->head)
+        list->head->lru_prev = e;
+    list->head = e;
+    if (!list->tail)
+        list->tail = e;
+    list->bytes += e->charge;
+}
+
+/* ---------------- Hash table ---------------- */
+
+static void table_unlink(cache_entry_t *e)
+{
+    cache_entry_t **link = &cache.buckets[e->hash & (cache.bucket_count - 1)];
+    while (*link && *link != e)
+        link = &(*link)->hash_next;
+    if (*link)
+    {
+        *link = e->hash_next;
+        cache.entry_count--;
+    }
+    e->hash_next = NULL;
+}
+
+static void table_grow(void)
+{
+    size_t new_count = cache.bucket_count * 2;
+    cache_entry_t **buckets = calloc(new_count, sizeof(cache_entry_t *));
+    if (!buckets)
+        return; /** Longer chains, still correct */
+
+    for (size_t i = 0; i < cache.bucket_count; i++)
+    {
+        cache_entry_t *e = cache.buckets[i];
+        while (e)
+        {
+            cache_entry_t *next = e->hash_next;
+            size_t b = e->hash & (new_count - 1);
+            e->hash_next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+    free(cache.buckets);
+    cache.buckets = buckets;
+    cache.bucket_count = new_count;
+}
+
+static void table_insert(cache_entry_t *e)
+{
+    if (cache.entry_count >= cache.bucket_count)
+        table_grow();
+
+    size_t b = e->hash & (cache.bucket_count - 1);
+    e->hash_next = cache.buckets[b];
+    cache.buckets[b] = e;
+    cache.entry_count++;
+}
+
+/** Remove from table and LRU, drop the cache's reference */
+static void entry_remove(cache_entry_t *e)
+{
+    table_unlink(e);
+    lru_unlink(e);
+    response_cache_release(e);
+}
+
+/* ---------------- W-TinyLFU policy ---------------- */
+
+/**
+ * Main segment full: the window's LRU candidate competes with the victims it
+ * would push out (probation tail first, then protected tail). It is admitted
+ * only if it has been asked for more often than every one of them, otherwise
+ * the candidate itself is dropped and the main segment stays untouched.
+ */
+static void admit_to_main(cache_entry_t *candidate)
+{
+    if (candidate->charge > cache.main_max)
+    {
+        entry_remove(candidate);
+        return;
+    }
+
+    size_t needed = cache.probation.bytes + cache.protected_.bytes + candidate->charge;
+    if (needed > cache.main_max)
+    {
+        int candidate_freq = frequency_sketch_estimate(&cache.sketch, candidate->hash);
+        size_t to_free = needed - cache.main_max;
+        size_t freed = 0;
+
+        cache_entry_t *victim = cache.probation.tail;
+        bool in_protected = false;
+        while (freed < to_free)
+        {
+            if (!victim && !in_protected)
+            {
+                victim = cache.protected_.tail;
+                in_protected = true;
+            }
+            if (!victim || frequency_sketch_estimate(&cache.sketch, victim->hash) >= candidate_freq)
+            {
+                DEBUG_PRINT("response_cache: rejected %s (freq %d)\n", candidate->key, candidate_freq);
+                entry_remove(candidate);
+                return;
+            }
+            freed += victim->charge;
+            victim = victim->lru_prev;
+        }
+
+        /** Candidate won against all of them: evict in LRU order */
+        while (cache.probation.bytes + cache.protected_.bytes + candidate->charge > cache.main_max)
+        {
+            cache_entry_t *evict = cache.probation.tail ? cache.probation.tail : cache.protected_.tail;
+            DEBUG_PRINT("response_cache: evicted %s\n", evict->key);
+            entry_remove(evict);
+        }
+    }
+
+    lru_push_head(candidate, CACHE_SEGMENT_PROBATION);
+}
+
+static void on_hit(cache_entry_t *e)
+{
+    cache_segment_t segment = e->segment;
+    lru_unlink(e);
+
+    if (segment != CACHE_SEGMENT_PROBATION)
+    {
+        lru_push_head(e, segment);
+        return;
+    }
+
+    /** Second access while in main → protected; overflow goes back to probation */
+    lru_push_head(e, CACHE_SEGMENT_PROTECTED);
+    while (cache.protected_.bytes > cache.protected_max && cache.protected_.tail != e)
+    {
+        cache_entry_t *demoted = cache.protected_.tail;
+        lru_unlink(demoted);
+        lru_push_head(demoted, CACHE_SEGMENT_PROBATION);
+    }
+}
+
+static void insert_entry(cache_entry_t *e)
+{
+    table_insert(e);
+    lru_push_head(e, CACHE_SEGMENT_WINDOW);
+
+    while (cache.window.bytes > cache.window_max && cache.window.tail)
+    {
+        cache_entry_t *candidate = cache.window.tail;
+        lru_unlink(candidate);
+        admit_to_main(candidate);
+    }
+}
+
+/* ---------------- Public API ---------------- */
+
+int response_cache_init(size_t max_bytes)
+{
+    memset(&cache, 0, sizeof(cache));
+
+    size_t expected = max_bytes / RESPONSE_CACHE_AVG_OBJECT;
+    cache.bucket_count = 1024;
+    while (cache.bucket_count < expected)
+        cache.bucket_count <<= 1;
+
+    cache.buckets = calloc(cache.bucket_count, sizeof(cache_entry_t *));
+    if (!cache.buckets)
+    {
+        log_errno("response_cache_init: Failed to allocate hash table");
+        return -1;
+    }
+    if (frequency_sketch_init(&cache.sketch, expected) != 0)
+    {
+        free(cache.buckets);
+        cache.buckets = NULL;
+        return -1;
+    }
+
+    cache.max_bytes = max_bytes;
+    cache.window_max = max_bytes * RESPONSE_CACHE_WINDOW_PERCENT / 100;
+    cache.main_max = max_bytes - cache.window_max;
+    cache.protected_max = cache.main_max * RESPONSE_CACHE_PROTECTED_PERCENT / 100;
+    cache.ready = true;
+    return 0;
+}
+
+/** Same variant: request values for the entry's Vary headers match */
+static bool vary_matches(const cache_entry_t *e, const HttpRequest *req)
+{
+    if (e->vary[0] == '\0')
+        return true;
+
+    char values[HTTP_CACHE_MAX_KEY];
+    if (http_cache_vary_values(req, e->vary, values, sizeof(values)) < 0)
+        return false;
+    return strcmp(values, e->vary_values) == 0;
+}
+
+cache_entry_t *response_cache_lookup(const char *key, const HttpRequest *req, cache_lookup_t *result)
+{
+    if (!cache.ready)
+        return NULL;
+
+    uint64_t hash = hash_key(key);
+    frequency_sketch_increment(&cache.sketch, hash);
+
+    uint64_t now = clock_now_ms();
+    cache_entry_t *e = cache.buckets[hash & (cache.bucket_count - 1)];
+    while (e)
+    {
+        cache_entry_t *next = e->hash_next;
+        if (e->hash == hash && strcmp(e->key, key) == 0 && vary_matches(e, req))
+        {
+            if (now < e->expires_ms)
+                *result = CACHE_LOOKUP_FRESH;
+            else if (now < e->swr_until_ms)
+                *result = CACHE_LOOKUP_STALE;
+            else if (now < e->sie_until_ms)
+            {
+                /** Only a fallback: not a hit, don't promote it */
+                *result = CACHE_LOOKUP_STALE_IF_ERROR;
+                e->refs++;
+                return e;
+            }
+            else
+            {
+                /** Past every stale window: free the space now, the miss will refill it */
+                entry_remove(e);
+                return NULL;
+            }
+            on_hit(e);
+            e->refs++;
+            return e;
+        }
+        e = next;
+    }
+    return NULL;
+}
+
+int response_cache_store(const char *key, const HttpRequest *req, const char *resp, size_t len)
+{
+    if (!cache.ready || len > RESPONSE_CACHE_MAX_OBJECT_BYTES)
+        return -1;
+
+    http_cache_policy_t policy;
+    if (http_cache_parse_response(resp, len, (int64_t)time(NULL), &policy) != 0 || !policy.cacheable)
+        return -1;
+
+    /** Backend closed early: never cache a truncated body */
+    if (policy.content_length >= 0 && (size_t)policy.content_length != len - policy.header_len)
+        return -1;
+
+    char vary_values[HTTP_CACHE_MAX_KEY] = "";
+    if (policy.vary[0] && http_cache_vary_values(req, policy.vary, vary_values, sizeof(vary_values)) < 0)
+        return -1;
+
+    if ((int64_t)policy.age_s >= policy.lifetime_s)
+        return -1; /** Already stale on arrival */
+
+    size_t key_len = strlen(key) + 1;
+    size_t vary_len = strlen(policy.vary) + 1;
+    size_t values_len = strlen(vary_values) + 1;
+    size_t body_len = len - policy.header_len;
+    size_t alloc = sizeof(cache_entry_t) + key_len + vary_len + values_len + policy.header_len + body_len;
+
+    cache_entry_t *e = malloc(alloc);
+    if (!e)
+    {
+        log_errno("response_cache_store: Failed to allocate %zu bytes", alloc);
+        return -1;
+    }
+    memset(e, 0, sizeof(*e));
+
+    char *p = (char *)(e + 1);
+    memcpy(p, key, key_len);
+    e->key = p;
+    p += key_len;
+    memcpy(p, policy.vary, vary_len);
+    e->vary = p;
+    p += vary_len;
+    memcpy(p, vary_values, values_len);
+    e->vary_values = p;
+    p += values_len;
+
+    e->head = p;
+    e->head_len = http_cache_copy_head(p, resp, policy.header_len);
+    p += e->head_len;
+    memcpy(p, resp + policy.header_len, body_len);
+    e->body = p;
+    e->body_len = body_len;
+
+    e->hash = hash_key(key);
+    e->stored_ms = clock_now_ms();
+    e->initial_age_s = policy.age_s;
+    e->expires_ms = e->stored_ms + (uint64_t)(policy.lifetime_s - policy.age_s) * 1000;
+    e->swr_until_ms = e->expires_ms + (uint64_t)policy.stale_while_revalidate_s * 1000;
+    e->sie_until_ms = e->expires_ms + (uint64_t)policy.stale_if_error_s * 1000;
+    e->charge = alloc;
+    e->refs = 1; /** owned by the cache */
+    e->segment = CACHE_SEGMENT_NONE;
+
+    /** Replace an older copy of the same variant */
+    for (cache_entry_t *old = cache.buckets[e->hash & (cache.bucket_count - 1)]; old; old = old->hash_next)
+    {
+        if (old->hash == e->hash && strcmp(old->key, key) == 0 && strcmp(old->vary_values, e->vary_values) == 0)
+        {
+            entry_remove(old);
+            break;
+        }
+    }
+
+    insert_entry(e);
+    DEBUG_PRINT("response_cache: stored %s (%zu bytes, fresh for %llds)\n",
+                key, alloc, (long long)(policy.lifetime_s - policy.age_s));
+    return 0;
+}
+
+bool response_cache_refresh_begin(cache_entry_t *entry)
+{
+    if (entry->refreshing || entry->segment == CACHE_SEGMENT_NONE)
+        return false; /** Already refreshing, or replaced by a newer copy */
+    if (clock_now_ms() < entry->next_refresh_ms || cache.refreshes >= RESPONSE_CACHE_MAX_REFRESHES)
+        return false;
+
+    entry->refreshing = true;
+    entry->refs++;
+    cache.refreshes++;
+    return true;
+}
+
+void response_cache_refresh_end(cache_entry_t *entry, bool ok)
+{
+    entry->refreshing = false;
+    if (!ok)
+        entry->next_refresh_ms = clock_now_ms() + RESPONSE_CACHE_REFRESH_RETRY_MS;
+    cache.refreshes--;
+    response_cache_release(entry);
+}
+
+void response_cache_release(cache_entry_t *entry)
+{
+    if (entry && --entry->refs == 0)
+        free(entry);
+}
+
+void response_cache_reply_start(cache_reply_t *reply, cache_entry_t *entry)
+{
+    uint64_t now = clock_now_ms();
+    uint64_t age = entry->initial_age_s + (now - entry->stored_ms) / 1000;
+
+    reply->entry = entry;
+    reply->sent = 0;
+    int n = snprintf(reply->extra, sizeof(reply->extra), "Age: %llu\r\nX-Cache: %s\r\n\r\n",
+                     (unsigned long long)age, now < entry->expires_ms ? "HIT" : "STALE");
+    reply->extra_len = (n > 0 && (size_t)n < sizeof(reply->extra)) ? (size_t)n : 0;
+}
+
+ssize_t response_cache_reply_send(cache_reply_t *reply, int fd)
+{
+    cache_entry_t *e = reply->entry;
+    struct iovec iov[3] = {
+        {.iov_base = (void *)e->head, .iov_len = e->head_len},
+        {.iov_base = reply->extra, .iov_len = reply->extra_len},
+        {.iov_base = (void *)e->body, .iov_len = e->body_len},
+    };
+    size_t total = e->head_len + reply->extra_len + e->body_len;
+
+    while (reply->sent < total)
+    {
+        /** Skip what a previous partial writev already sent */
+        struct iovec *vec = iov;
+        int count = 3;
+        size_t skip = reply->sent;
+        while (count > 0 && skip >= vec->iov_len)
+        {
+            skip -= vec->iov_len;
+            vec++;
+            count--;
+        }
+        vec->iov_base = (char *)vec->iov_base + skip;
+        vec->iov_len -= skip;
+
+        ssize_t n = writev(fd, vec, count);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EPIPE || errno == ECONNRESET)
+                return -2;
+            log_errno("response_cache_reply_send: writev failed on fd %d", fd);
+            return -1;
+        }
+        reply->sent += n;
+
+        /** Restore the vector for the next round */
+        iov[0].iov_base = (void *)e->head;
+        iov[0].iov_len = e->head_len;
+        iov[1].iov_base = reply->extra;
+        iov[1].iov_len = reply->extra_len;
+        iov[2].iov_base = (void *)e->body;
+        iov[2].iov_len = e->body_len;
+    }
+    return 1;
+}
+
+void response_cache_reply_cleanup(cache_reply_t *reply)
+{
+    if (reply->entry)
+    {
+        response_cache_release(reply->entry);
+        reply->entry = NULL;
+    }
+}
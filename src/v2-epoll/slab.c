@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <v2-epoll/slab.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+#define SLAB_ALIGN 64
+
+static int numa_node = -1;
+static bool huge = false;
+
+void slab_set_numa(int node, bool huge_pages)
+{
+    numa_node = node;
+    huge = huge_pages;
+}
+
+void slab_init(slab_t *slab, size_t object_size)
+{
+    memset(slab, 0, sizeof(*slab));
+    if (object_size < sizeof(void *))
+        object_size = sizeof(void *);
+    slab->object_size = (object_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+}
+
+/** SLAB_CHUNK_BYTES, aligned to a huge page when those are asked for */
+static char *map_chunk(void)
+{
+    size_t len = huge ? 2 * SLAB_CHUNK_BYTES : SLAB_CHUNK_BYTES;
+    char *raw = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        log_errno("slab: mmap failed");
+        return NULL;
+    }
+    if (!huge)
+        return raw;
+
+    /** Trim to an aligned 2MB so the whole chunk can be one huge page */
+    char *chunk = (char *)(((uintptr_t)raw + SLAB_CHUNK_BYTES - 1) & ~(uintptr_t)(SLAB_CHUNK_BYTES - 1));
+    if (chunk > raw)
+        munmap(raw, chunk - raw);
+    if (raw + len > chunk + SLAB_CHUNK_BYTES)
+        munmap(chunk + SLAB_CHUNK_BYTES, raw + len - (chunk + SLAB_CHUNK_BYTES));
+    if (madvise(chunk, SLAB_CHUNK_BYTES, MADV_HUGEPAGE) != 0)
+        DEBUG_PRINT("slab: MADV_HUGEPAGE failed: %s\n", strerror(errno));
+    return chunk;
+}
+
+static int slab_grow(slab_t *slab)
+{
+    char *chunk = map_chunk();
+    if (!chunk)
+        return -1;
+
+    if (numa_node >= 0 && numa_node < (int)(sizeof(unsigned long) * 8))
+    {
+        /** Preferred, not bound: a full node still gives us memory (remote) instead of failing */
+        unsigned long mask = 1UL << numa_node;
+        if (syscall(SYS_mbind, chunk, SLAB_CHUNK_BYTES, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0) != 0)
+            DEBUG_PRINT("slab: mbind to node %d failed: %s\n", numa_node, strerror(errno));
+        /** First touch from the worker's own CPU, before any object is in use */
+        memset(chunk, 0, SLAB_CHUNK_BYTES);
+    }
+
+    /** Thread the new objects onto the free list, lowest address first */
+    size_t count = SLAB_CHUNK_BYTES / slab->object_size;
+    for (size_t i = count; i-- > 0;)
+    {
+        void *object = chunk + i * slab->object_size;
+        *(void **)object = slab->free_list;
+        slab->free_list = object;
+    }
+    slab->chunks++;
+    return 0;
+}
+
+void *slab_alloc(slab_t *slab)
+{
+    if (!slab->free_list && slab_grow(slab) != 0)
+        return NULL;
+
+    void *object = slab->free_list;
+    slab->free_list = *(void **)object;
+    slab->in_use++;
+    return object;
+}
+
+void slab_free(slab_t *slab, void *object)
+{
+    if (!object)
+        return;
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+}
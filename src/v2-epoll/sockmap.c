@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/tcp.h>
+#include <linux/sockios.h>
+#include <v2-epoll/sockmap.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+static int peers_fd = -1;
+static int verdict_fd = -1;
+static int bytes_fd = -1;
+static int prog_fd = -1;
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn){.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+#define CTX(field) offsetof(struct __sk_buff, field)
+#define KEY(field) ((int)offsetof(sockmap_key_t, field) - (int)sizeof(sockmap_key_t))
+
+static long sys_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int map_create(enum bpf_map_type type, uint32_t value_size)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = sizeof(sockmap_key_t);
+    attr.value_size = value_size;
+    attr.max_entries = SOCKMAP_MAX_TUNNELS * 2;
+    return (int)sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int map_update(int map_fd, const sockmap_key_t *key, const void *value)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    attr.flags = BPF_ANY;
+    return (int)sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int map_lookup(int map_fd, const sockmap_key_t *key, void *value)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    attr.value = (uint64_t)(uintptr_t)value;
+    return (int)sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+static void map_delete(int map_fd, const sockmap_key_t *key)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(uintptr_t)key;
+    sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/**
+ * The verdict program, by hand (no clang/libbpf needed to build the proxy):
+ *
+ *   if (skb->len == 0)
+ *       return SK_DROP;
+ *   key = { local_ip4, remote_ip4, local_port, remote_port }   on the stack
+ *   if (bpf_sk_redirect_hash(skb, &peers, &key, 0) == SK_PASS)
+ *       if ((count = bpf_map_lookup_elem(&bytes, &key)))
+ *           __sync_fetch_and_add(count, skb->len);
+ *   return SK_PASS;
+ *
+ * SK_PASS without a redirect keeps the skb on its own socket, so a socket
+ * whose peer is gone loses nothing. A FIN arrives as an empty skb: sent on
+ * through the other socket, it would fail there with EPIPE and break that
+ * socket. The proxy passes EOF on itself (sockmap_flushed()).
+ */
+static int load_program(void)
+{
+    struct bpf_insn prog[] = {
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_6, CTX(len), 0),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_7, 0, 2, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_DROP),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, CTX(local_ip4), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, KEY(local_ip4), 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, CTX(remote_ip4), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, KEY(remote_ip4), 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, CTX(local_port), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, KEY(local_port), 0),
+        INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, CTX(remote_port), 0),
+        INSN(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_2, KEY(remote_port), 0),
+
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, peers_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -(int)sizeof(sockmap_key_t)),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+        INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 7, SK_PASS),
+
+        INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, bytes_fd),
+        INSN(0, 0, 0, 0, 0),
+        INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+        INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -(int)sizeof(sockmap_key_t)),
+        INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        INSN(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 1, 0),
+        INSN(BPF_STX | BPF_ATOMIC | BPF_DW, BPF_REG_0, BPF_REG_7, 0, BPF_ADD),
+
+        INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+        INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    char verifier_log[4096] = "";
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(uintptr_t) "Dual MIT/GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)verifier_log;
+    attr.log_size = sizeof(verifier_log);
+    attr.log_level = 1;
+
+    int fd = (int)sys_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0)
+    {
+        log_errno("sockmap: Failed to load the verdict program");
+        DEBUG_PRINT("%s\n", verifier_log);
+    }
+    return fd;
+}
+
+/** BPF_SK_SKB_VERDICT (5.13+) runs without a stream parser; older kernels keep splice */
+static int attach_program(void)
+{
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.target_fd = verdict_fd;
+    attr.attach_bpf_fd = prog_fd;
+    attr.attach_type = BPF_SK_SKB_VERDICT;
+    if (sys_bpf(BPF_PROG_ATTACH, &attr) != 0)
+    {
+        log_errno("sockmap: Failed to attach the verdict program");
+        return -1;
+    }
+    return 0;
+}
+
+static void close_all(void)
+{
+    int *fds[] = {&prog_fd, &verdict_fd, &peers_fd, &bytes_fd};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+    {
+        if (*fds[i] >= 0)
+            close(*fds[i]);
+        *fds[i] = -1;
+    }
+}
+
+int sockmap_init(void)
+{
+    peers_fd = map_create(BPF_MAP_TYPE_SOCKHASH, sizeof(uint32_t));
+    verdict_fd = map_create(BPF_MAP_TYPE_SOCKHASH, sizeof(uint32_t));
+    bytes_fd = map_create(BPF_MAP_TYPE_HASH, sizeof(uint64_t));
+    if (peers_fd < 0 || verdict_fd < 0 || bytes_fd < 0)
+    {
+        log_errno("sockmap: Failed to create maps");
+        close_all();
+        return -1;
+    }
+
+    prog_fd = load_program();
+    if (prog_fd < 0 || attach_program() != 0)
+    {
+        close_all();
+        return -1;
+    }
+    return 0;
+}
+
+bool sockmap_available(void)
+{
+    return prog_fd >= 0;
+}
+
+/**
+ * IPv4 address of one end: an IPv4 client on the dual-stack listener is
+ * AF_INET6 ::ffff:a.b.c.d, but its skbs are IPv4 (what the program keys on)
+ */
+static int to_ipv4(const struct sockaddr_storage *addr, struct sockaddr_in *out)
+{
+    if (addr->ss_family == AF_INET)
+    {
+        memcpy(out, addr, sizeof(*out));
+        return 0;
+    }
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)addr;
+    if (addr->ss_family != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&a6->sin6_addr))
+        return -1;
+    memset(out, 0, sizeof(*out));
+    out->sin_family = AF_INET;
+    out->sin_port = a6->sin6_port;
+    memcpy(&out->sin_addr, &a6->sin6_addr.s6_addr[12], sizeof(out->sin_addr));
+    return 0;
+}
+
+/** The key the verdict program builds for skbs arriving on this socket */
+static int socket_key(int fd, sockmap_key_t *key)
+{
+    struct sockaddr_storage local_addr, remote_addr;
+    socklen_t local_len = sizeof(local_addr), remote_len = sizeof(remote_addr);
+    struct sockaddr_in local, remote;
+
+    if (getsockname(fd, (struct sockaddr *)&local_addr, &local_len) != 0 ||
+        getpeername(fd, (struct sockaddr *)&remote_addr, &remote_len) != 0 ||
+        to_ipv4(&local_addr, &local) != 0 || to_ipv4(&remote_addr, &remote) != 0)
+        return -1;
+
+    key->local_ip4 = local.sin_addr.s_addr;
+    key->remote_ip4 = remote.sin_addr.s_addr;
+    key->local_port = ntohs(local.sin_port);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    key->remote_port = (uint32_t)remote.sin_port << 16;
+#else
+    key->remote_port = remote.sin_port;
+#endif
+    return 0;
+}
+
+/**
+ * Bytes ever written to a socket: acknowledged + still in the send queue.
+ * Read in this order the sum can only come out low, never high.
+ */
+static int socket_written(int fd, uint64_t *written)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    int outq;
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0 ||
+        ioctl(fd, SIOCOUTQ, &outq) != 0)
+        return -1;
+
+    *written = info.tcpi_bytes_acked + (uint64_t)outq;
+    return 0;
+}
+
+static void forget(sockmap_pair_t *pair)
+{
+    for (int side = 0; side < 2; side++)
+    {
+        map_delete(verdict_fd, &pair->key[side]);
+        map_delete(peers_fd, &pair->key[side]);
+        map_delete(bytes_fd, &pair->key[side]);
+    }
+}
+
+int sockmap_attach(sockmap_pair_t *pair, int client_fd, int backend_fd)
+{
+    int fds[2] = {client_fd, backend_fd};
+    uint64_t zero = 0;
+
+    memset(pair, 0, sizeof(*pair));
+    for (int side = 0; side < 2; side++)
+    {
+        if (socket_key(fds[side], &pair->key[side]) != 0 ||
+            socket_written(fds[side], &pair->written[side]) != 0)
+            return 0; /** Not IPv4 TCP */
+    }
+
+    /** Targets first: nothing is redirected until a socket joins `verdict` */
+    for (int side = 0; side < 2; side++)
+    {
+        uint32_t other = (uint32_t)fds[!side];
+        if (map_update(bytes_fd, &pair->key[side], &zero) != 0 ||
+            map_update(peers_fd, &pair->key[side], &other) != 0)
+        {
+            DEBUG_PRINT("sockmap: fd %d stays in user space: %s\n", client_fd, strerror(errno));
+            forget(pair);
+            return 0;
+        }
+    }
+
+    for (int side = 0; side < 2; side++)
+    {
+        uint32_t self = (uint32_t)fds[side];
+        if (map_update(verdict_fd, &pair->key[side], &self) != 0)
+        {
+            /** With the client already redirecting, its bytes can't be taken back */
+            log_errno("sockmap: Failed to hand over fd %d", fds[side]);
+            if (side == SOCKMAP_CLIENT)
+            {
+                forget(pair);
+                return 0;
+            }
+            return -1;
+        }
+    }
+
+    /** Bytes queued before the program was attached: run them through it now */
+    int one = 1;
+    for (int side = 0; side < 2; side++)
+        setsockopt(fds[side], SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+
+    DEBUG_PRINT("sockmap: client %d <-> backend %d relayed by the kernel\n", client_fd, backend_fd);
+    return 1;
+}
+
+int sockmap_flushed(const sockmap_pair_t *pair, int from, int to_fd)
+{
+    uint64_t redirected = 0, written;
+
+    if (map_lookup(bytes_fd, &pair->key[from], &redirected) != 0 ||
+        socket_written(to_fd, &written) != 0)
+        return -1;
+    return written - pair->written[!from] >= redirected;
+}
+
+uint64_t sockmap_moved(const sockmap_pair_t *pair)
+{
+    uint64_t total = 0;
+    for (int side = 0; side < 2; side++)
+    {
+        uint64_t count = 0;
+        map_lookup(bytes_fd, &pair->key[side], &count);
+        total += count;
+    }
+    return total;
+}
+
+void sockmap_detach(sockmap_pair_t *pair)
+{
+    for (int side = 0; side < 2; side++)
+        map_delete(bytes_fd, &pair->key[side]);
+}
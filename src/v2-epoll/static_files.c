@@ -0,0 +1,635 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#include <v2-epoll/static_files.h>
+#include <v2-epoll/clock.h>
+#include <common/request_parser.h>
+#include <common/http_cache.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+#define STATIC_TABLE_SIZE 2048 /**< Hash buckets (entries of both LRUs) */
+#define STATIC_SENDFILE_CHUNK (1024 * 1024)
+
+/** One LRU for open files, one for missing ones, so probes can't evict open fds */
+typedef struct
+{
+    static_file_t *head; /**< Most recently used */
+    static_file_t *tail;
+    int count;
+    int max;
+} lru_t;
+
+static static_file_t *table[STATIC_TABLE_SIZE];
+static lru_t open_lru = {.max = STATIC_FD_CACHE_SIZE};
+static lru_t missing_lru = {.max = STATIC_NEG_CACHE_SIZE};
+
+static uint64_t hash_path(const char *path)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = path; *p; p++)
+    {
+        h ^= (unsigned char)*p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* ---------------- Open file cache ---------------- */
+
+static lru_t *lru_of(const static_file_t *f)
+{
+    return f->fd >= 0 ? &open_lru : &missing_lru;
+}
+
+static void lru_unlink(static_file_t *f)
+{
+    lru_t *lru = lru_of(f);
+    if (f->lru_prev)
+        f->lru_prev->lru_next = f->lru_next;
+    else
+        lru->head = f->lru_next;
+    if (f->lru_next)
+        f->lru_next->lru_prev = f->lru_prev;
+    else
+        lru->tail = f->lru_prev;
+    f->lru_prev = f->lru_next = NULL;
+    lru->count--;
+}
+
+static void lru_push_front(static_file_t *f)
+{
+    lru_t *lru = lru_of(f);
+    f->lru_prev = NULL;
+    f->lru_next = lru->head;
+    if (lru->head)
+        lru->head->lru_prev = f;
+    else
+        lru->tail = f;
+    lru->head = f;
+    lru->count++;
+}
+
+static void file_release(static_file_t *f)
+{
+    if (--f->refs > 0)
+        return;
+    if (f->fd >= 0)
+        close(f->fd);
+    free(f->path);
+    free(f);
+}
+
+/** Drop a file from the cache; replies still sending it keep it open */
+static void table_remove(static_file_t *f)
+{
+    static_file_t **pp = &table[f->hash % STATIC_TABLE_SIZE];
+    while (*pp && *pp != f)
+        pp = &(*pp)->hash_next;
+    if (*pp)
+        *pp = f->hash_next;
+
+    lru_unlink(f);
+    f->in_table = false;
+    file_release(f);
+}
+
+static void table_insert(static_file_t *f)
+{
+    lru_t *lru = lru_of(f);
+    if (lru->count >= lru->max && lru->tail)
+        table_remove(lru->tail);
+
+    f->hash_next = table[f->hash % STATIC_TABLE_SIZE];
+    table[f->hash % STATIC_TABLE_SIZE] = f;
+    f->in_table = true;
+    f->refs = 1;
+    lru_push_front(f);
+}
+
+static const char *content_type_of(const char *path)
+{
+    static const struct
+    {
+        const char *ext;
+        const char *type;
+    } types[] = {
+        {"html", "text/html; charset=utf-8"},
+        {"htm", "text/html; charset=utf-8"},
+        {"css", "text/css; charset=utf-8"},
+        {"js", "text/javascript; charset=utf-8"},
+        {"mjs", "text/javascript; charset=utf-8"},
+        {"json", "application/json"},
+        {"map", "application/json"},
+        {"txt", "text/plain; charset=utf-8"},
+        {"xml", "application/xml"},
+        {"svg", "image/svg+xml"},
+        {"png", "image/png"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"gif", "image/gif"},
+        {"webp", "image/webp"},
+        {"avif", "image/avif"},
+        {"ico", "image/x-icon"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        {"ttf", "font/ttf"},
+        {"otf", "font/otf"},
+        {"wasm", "application/wasm"},
+        {"pdf", "application/pdf"},
+        {"mp4", "video/mp4"},
+        {"webm", "video/webm"},
+    };
+
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(slash ? slash : path, '.');
+    if (dot)
+    {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        {
+            if (strcasecmp(dot + 1, types[i].ext) == 0)
+                return types[i].type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+/**
+ * Open a file below dir without leaving it: ".." and absolute symlinks are
+ * resolved inside dir, anything that would escape fails with EXDEV.
+ * rel == NULL opens dir itself (a route naming a single file).
+ */
+static int open_beneath(const char *dir, const char *rel)
+{
+    if (!rel)
+        return open(dir, O_RDONLY | O_CLOEXEC);
+
+    int dir_fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        return -1;
+
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    int fd = (int)syscall(SYS_openat2, dir_fd, rel, &how, sizeof(how));
+    if (fd < 0 && errno == ENOSYS)
+    {
+        /** Kernel before 5.6: ".." was already rejected, only symlinks are followed */
+        fd = openat(dir_fd, rel, O_RDONLY | O_CLOEXEC);
+    }
+    int saved = errno;
+    close(dir_fd);
+    errno = saved;
+    return fd;
+}
+
+static void fill_metadata(static_file_t *f, const struct stat *st)
+{
+    f->size = st->st_size;
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+    f->mtime = st->st_mtim;
+    snprintf(f->etag, sizeof(f->etag), "\"%llx-%llx%06lx\"", (unsigned long long)st->st_size,
+             (unsigned long long)st->st_mtim.tv_sec, (unsigned long)(st->st_mtim.tv_nsec / 1000));
+
+    struct tm tm;
+    gmtime_r(&st->st_mtim.tv_sec, &tm);
+    strftime(f->last_modified, sizeof(f->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/** Did the file at f->path change since it was cached? */
+static bool file_changed(const static_file_t *f)
+{
+    struct stat st;
+    if (stat(f->path, &st) != 0)
+        return f->fd >= 0;
+    if (f->fd < 0)
+        return true;
+    return st.st_ino != f->ino || st.st_dev != f->dev || st.st_size != f->size ||
+           st.st_mtim.tv_sec != f->mtime.tv_sec || st.st_mtim.tv_nsec != f->mtime.tv_nsec;
+}
+
+/**
+ * Cached file for dir + rel (open or missing). The result is referenced by
+ * the cache only; take another reference to keep it.
+ *
+ * @return Entry, NULL on allocation failure or a path longer than STATIC_MAX_PATH.
+ */
+static static_file_t *file_get(const char *dir, const char *rel)
+{
+    char path[STATIC_MAX_PATH];
+    int n = rel ? snprintf(path, sizeof(path), "%s%s%s", dir, dir[strlen(dir) - 1] == '/' ? "" : "/", rel)
+                : snprintf(path, sizeof(path), "%s", dir);
+    if (n < 0 || (size_t)n >= sizeof(path))
+        return NULL;
+
+    uint64_t h = hash_path(path);
+    uint64_t now = clock_now_ms();
+
+    for (static_file_t *f = table[h % STATIC_TABLE_SIZE]; f; f = f->hash_next)
+    {
+        if (f->hash != h || strcmp(f->path, path) != 0)
+            continue;
+
+        if (now - f->checked_ms >= STATIC_REVALIDATE_MS)
+        {
+            if (file_changed(f))
+            {
+                DEBUG_PRINT("static_files: %s changed on disk, reopening\n", path);
+                table_remove(f);
+                break;
+            }
+            f->checked_ms = now;
+        }
+        lru_unlink(f);
+        lru_push_front(f);
+        return f;
+    }
+
+    static_file_t *f = calloc(1, sizeof(*f));
+    if (!f || !(f->path = strdup(path)))
+    {
+        free(f);
+        return NULL;
+    }
+    f->hash = h;
+    f->checked_ms = now;
+    f->content_type = content_type_of(path);
+
+    f->fd = open_beneath(dir, rel);
+    if (f->fd < 0 && errno == EXDEV)
+    {
+        log_error("static_files: %s leaves %s, refused", rel, dir);
+    }
+
+    struct stat st;
+    if (f->fd >= 0 && (fstat(f->fd, &st) != 0 || !S_ISREG(st.st_mode)))
+    {
+        /** Directories and devices are "not found" */
+        close(f->fd);
+        f->fd = -1;
+    }
+    if (f->fd >= 0)
+        fill_metadata(f, &st);
+
+    table_insert(f);
+    return f;
+}
+
+/* ---------------- Request handling ---------------- */
+
+/**
+ * Request path → path relative to the route directory, percent-decoded.
+ * Returns 0 (out is "" for an exact match of the prefix), -1 if the path
+ * must not be served (NUL byte, ".." segment, bad escape).
+ */
+static int relative_path(const Route *route, const char *req_path, char *out, size_t out_size)
+{
+    const char *p = req_path + strlen(route->prefix);
+    size_t len = 0;
+
+    while (*p == '/')
+        p++;
+
+    for (; *p && *p != '?' && *p != '#'; p++)
+    {
+        char c = *p;
+        if (c == '%')
+        {
+            if (!isxdigit((unsigned char)p[1]) || !isxdigit((unsigned char)p[2]))
+                return -1;
+            char hex[3] = {p[1], p[2], '\0'};
+            c = (char)strtol(hex, NULL, 16);
+            p += 2;
+        }
+        if (c == '\0' || len + 1 >= out_size)
+            return -1;
+        out[len++] = c;
+    }
+    out[len] = '\0';
+
+    /** Reject ".." as a whole segment; "a..b" is a valid name */
+    for (const char *seg = out; *seg;)
+    {
+        size_t seg_len = strcspn(seg, "/");
+        if (seg_len == 2 && seg[0] == '.' && seg[1] == '.')
+            return -1;
+        seg += seg_len;
+        while (*seg == '/')
+            seg++;
+    }
+    return 0;
+}
+
+/** If-None-Match: "*" or a list of (possibly weak) tags; weak comparison */
+static bool etag_matches(const char *header, const char *etag)
+{
+    if (strcmp(header, "*") == 0)
+        return true;
+
+    size_t etag_len = strlen(etag);
+    for (const char *p = header; *p;)
+    {
+        while (*p == ' ' || *p == ',')
+            p++;
+        if (strncmp(p, "W/", 2) == 0)
+            p += 2;
+        size_t len = strcspn(p, ", ");
+        if (len == etag_len && strncmp(p, etag, len) == 0)
+            return true;
+        p += len;
+    }
+    return false;
+}
+
+static bool not_modified_since(const char *header, const static_file_t *f)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(header, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+        return false;
+    return f->mtime.tv_sec <= timegm(&tm);
+}
+
+/**
+ * Parse a single "bytes=" range against a file size.
+ * Returns 1 with [*start, *end) set, 0 to ignore the header (several ranges,
+ * malformed), -1 if unsatisfiable.
+ */
+static int parse_range(const char *header, off_t size, off_t *start, off_t *end)
+{
+    if (strncmp(header, "bytes=", 6) != 0 || strchr(header, ','))
+        return 0;
+
+    const char *p = header + 6;
+    char *stop;
+    if (*p == '-')
+    {
+        /** Suffix: the last N bytes */
+        long long n = strtoll(p + 1, &stop, 10);
+        if (stop == p + 1 || *stop || n < 0)
+            return 0;
+        if (n == 0 || size == 0)
+            return -1;
+        *start = n >= size ? 0 : size - n;
+        *end = size;
+        return 1;
+    }
+
+    long long first = strtoll(p, &stop, 10);
+    if (stop == p || *stop != '-' || first < 0)
+        return 0;
+    p = stop + 1;
+
+    long long last = size - 1;
+    if (*p)
+    {
+        last = strtoll(p, &stop, 10);
+        if (stop == p || *stop || last < first)
+            return 0;
+    }
+    if (first >= size)
+        return -1;
+    if (last >= size)
+        last = size - 1;
+
+    *start = first;
+    *end = last + 1;
+    return 1;
+}
+
+/** Reply without a file: an error, body included in the head buffer (dropped for HEAD) */
+static void reply_simple(static_reply_t *reply, bool head_only, int status, const char *reason, const char *extra)
+{
+    int n = snprintf(reply->head, sizeof(reply->head),
+                     "HTTP/1.1 %d %s\r\n"
+                     "%s"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n"
+                     "\r\n"
+                     "%s\n",
+                     status, reason, extra ? extra : "", strlen(reason) + 1, reason);
+    reply->head_len = (n > 0 && (size_t)n < sizeof(reply->head)) ? (size_t)n : 0;
+    if (head_only && reply->head_len)
+        reply->head_len -= strlen(reason) + 1;
+}
+
+/**
+ * Build the reply for an existing file (or one of its precompressed
+ * siblings). The caller holds a reference on file, which is either handed
+ * to the reply or dropped.
+ */
+static int file_reply(const Route *route, const HttpRequest *req, const char *name, static_file_t *file,
+                      bool head_only, static_reply_t *reply);
+
+int static_files_start(const Route *route, const HttpRequest *req, static_reply_t *reply)
+{
+    memset(reply, 0, sizeof(*reply));
+    reply->active = true;
+
+    bool head_only = strcmp(req->methode, "HEAD") == 0;
+    if (!head_only && strcmp(req->methode, "GET") != 0)
+    {
+        reply_simple(reply, false, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n");
+        return 0;
+    }
+
+    char rel[STATIC_MAX_PATH];
+    if (relative_path(route, req->path, rel, sizeof(rel)) != 0)
+    {
+        DEBUG_PRINT("static_files: refusing path %s\n", req->path);
+        reply_simple(reply, head_only, 404, "Not Found", NULL);
+        return 0;
+    }
+    const char *name = rel[0] ? rel : NULL;
+
+    static_file_t *file = file_get(route->static_path, name);
+    if (!file)
+        return -1;
+    if (file->fd < 0)
+    {
+        reply_simple(reply, head_only, 404, "Not Found", NULL);
+        return 0;
+    }
+
+    /** Sibling lookups below may evict entries; keep this one */
+    file->refs++;
+    return file_reply(route, req, name, file, head_only, reply);
+}
+
+static int file_reply(const Route *route, const HttpRequest *req, const char *name, static_file_t *file,
+                      bool head_only, static_reply_t *reply)
+{
+    /**
+     * Precompressed siblings. Looked up even when the client doesn't want
+     * them: if they exist, the response varies by Accept-Encoding.
+     * Not for single-file routes (name NULL) or range requests.
+     */
+    const char *range = get_request_header(req, "Range");
+    const char *accept = get_request_header(req, "Accept-Encoding");
+    const char *encoding = NULL;
+    bool has_variants = false;
+    static const char *const codings[][2] = {{"br", ".br"}, {"gzip", ".gz"}};
+
+    for (size_t i = 0; name && i < sizeof(codings) / sizeof(codings[0]); i++)
+    {
+        char sibling[STATIC_MAX_PATH];
+        if (snprintf(sibling, sizeof(sibling), "%s%s", name, codings[i][1]) >= (int)sizeof(sibling))
+            continue;
+
+        static_file_t *variant = file_get(route->static_path, sibling);
+        if (!variant || variant->fd < 0)
+            continue;
+        has_variants = true;
+
+        if (!encoding && !range && accept && http_cache_accepts_encoding(accept, codings[i][0]))
+        {
+            encoding = codings[i][0];
+            variant->refs++;
+            file_release(file);
+            file = variant;
+        }
+    }
+
+    /** Encoded representations get their own validator */
+    char etag[sizeof(file->etag) + 8];
+    if (encoding)
+        snprintf(etag, sizeof(etag), "%.*s-%s\"", (int)strlen(file->etag) - 1, file->etag, encoding);
+    else
+        snprintf(etag, sizeof(etag), "%s", file->etag);
+
+    char extra[192];
+    int extra_len = snprintf(extra, sizeof(extra), "ETag: %s\r\nLast-Modified: %s\r\n%s", etag,
+                             file->last_modified, has_variants ? "Vary: Accept-Encoding\r\n" : "");
+    if (extra_len < 0 || (size_t)extra_len >= sizeof(extra))
+    {
+        file_release(file);
+        return -1;
+    }
+
+    const char *inm = get_request_header(req, "If-None-Match");
+    const char *ims = get_request_header(req, "If-Modified-Since");
+    if ((inm && etag_matches(inm, etag)) || (!inm && ims && not_modified_since(ims, file)))
+    {
+        int n = snprintf(reply->head, sizeof(reply->head),
+                         "HTTP/1.1 304 Not Modified\r\n%sConnection: close\r\n\r\n", extra);
+        reply->head_len = (n > 0 && (size_t)n < sizeof(reply->head)) ? (size_t)n : 0;
+        file_release(file);
+        return 0;
+    }
+
+    off_t start = 0, end = file->size;
+    int ranged = 0;
+    if (range)
+    {
+        const char *if_range = get_request_header(req, "If-Range");
+        if (!if_range || strcmp(if_range, etag) == 0 || strcmp(if_range, file->last_modified) == 0)
+            ranged = parse_range(range, file->size, &start, &end);
+    }
+    if (ranged < 0)
+    {
+        char content_range[64];
+        snprintf(content_range, sizeof(content_range), "Content-Range: bytes */%lld\r\n", (long long)file->size);
+        reply_simple(reply, head_only, 416, "Range Not Satisfiable", content_range);
+        file_release(file);
+        return 0;
+    }
+
+    char content_range[96] = "";
+    if (ranged)
+        snprintf(content_range, sizeof(content_range), "Content-Range: bytes %lld-%lld/%lld\r\n",
+                 (long long)start, (long long)end - 1, (long long)file->size);
+
+    char content_encoding[48] = "";
+    if (encoding)
+        snprintf(content_encoding, sizeof(content_encoding), "Content-Encoding: %s\r\n", encoding);
+
+    int n = snprintf(reply->head, sizeof(reply->head),
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %lld\r\n"
+                     "%s%s%s"
+                     "Accept-Ranges: bytes\r\n"
+                     "Connection: close\r\n"
+                     "\r\n",
+                     ranged ? "206 Partial Content" : "200 OK", file->content_type, (long long)(end - start),
+                     extra, content_encoding, content_range);
+    if (n < 0 || (size_t)n >= sizeof(reply->head))
+    {
+        file_release(file);
+        return -1;
+    }
+    reply->head_len = (size_t)n;
+
+    if (head_only || end == start)
+    {
+        file_release(file);
+        return 0;
+    }
+    reply->file = file;
+    reply->off = start;
+    reply->end = end;
+    return 0;
+}
+
+ssize_t static_reply_send(static_reply_t *reply, int fd)
+{
+    while (reply->head_sent < reply->head_len || (reply->file && reply->off < reply->end))
+    {
+        ssize_t n;
+        if (reply->head_sent < reply->head_len)
+        {
+            /** MSG_MORE lets the first body bytes share the head's packet */
+            n = send(fd, reply->head + reply->head_sent, reply->head_len - reply->head_sent,
+                     MSG_NOSIGNAL | (reply->file ? MSG_MORE : 0));
+            if (n > 0)
+                reply->head_sent += n;
+        }
+        else
+        {
+            off_t left = reply->end - reply->off;
+            n = sendfile(fd, reply->file->fd, &reply->off, left > STATIC_SENDFILE_CHUNK ? STATIC_SENDFILE_CHUNK : left);
+            if (n == 0)
+            {
+                log_error("static_reply_send: %s shrank while being sent", reply->file->path);
+                return -1;
+            }
+        }
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EPIPE || errno == ECONNRESET)
+                return -2;
+            log_errno("static_reply_send: send failed on fd %d", fd);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+void static_reply_cleanup(static_reply_t *reply)
+{
+    if (reply->file)
+        file_release(reply->file);
+    reply->file = NULL;
+    reply->active = false;
+}
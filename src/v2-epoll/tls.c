@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <v2-epoll/tls.h>
+#include <v2-epoll/connection.h>
+#include <v2-epoll/buffer_io.h>
+#include <v2-epoll/epoll_server.h>
+#include <common/rebuild_request.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+typedef struct tls_session
+{
+    SSL *ssl;
+    bool established;   /**< Handshake done */
+    bool failed;        /**< Fatal TLS error: no close_notify (SSL_shutdown() must not be called) */
+    bool shutdown_sent;
+    int pair;           /**< Our end of the bridge (-1: handshaking or kernel TLS) */
+    uint32_t tcp_events;
+    uint32_t pair_events; /**< 0 = not registered */
+    bool want_write;    /**< OpenSSL waits for the client socket to be writable */
+    bool client_eof;
+    bool pair_eof;
+    bool pair_shut;     /**< Client's EOF passed on to the plaintext side */
+    buffer_t to_pair;   /**< Decrypted client bytes for the plaintext side */
+    buffer_t to_client; /**< Plaintext waiting for SSL_write() (retried with the same bytes) */
+} tls_session_t;
+
+static SSL_CTX *ctx = NULL;
+
+/** ALPN: h2 if the client offers it, else HTTP/1.1 */
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *out_len,
+                       const unsigned char *in, unsigned int in_len, void *arg)
+{
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    (void)ssl;
+    (void)arg;
+    if (SSL_select_next_proto((unsigned char **)out, out_len, protos, sizeof(protos) - 1, in, in_len) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static void log_ssl_errors(const char *what)
+{
+    unsigned long err;
+    while ((err = ERR_get_error()) != 0)
+    {
+        char text[256];
+        ERR_error_string_n(err, text, sizeof(text));
+        log_error("%s: %s\n", what, text);
+    }
+}
+
+int tls_init(const char *cert_file, const char *key_file)
+{
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+    {
+        log_ssl_errors("tls_init");
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        log_ssl_errors("tls_init");
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return -1;
+    }
+
+    uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_ENABLE_KTLS
+    /** Records go to the kernel once keys are set, where the kernel supports it */
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options(ctx, options);
+
+    /**
+     * Bridge writes may be partial and are retried from a buffer that can
+     * move; idle connections give their record buffers back.
+     */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+
+    /** Resumption: session ids (TLS 1.2) from the cache, tickets (TLS 1.3) from the context's key */
+    static const unsigned char session_context[] = "turboproxy";
+    SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT_S);
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+    return 0;
+}
+
+bool tls_enabled(void)
+{
+    return ctx != NULL;
+}
+
+static int watch(int epoll_fd, connection_t *conn, int fd, uint32_t *current, uint32_t events, bool registered)
+{
+    if (registered ? events == *current : !events)
+        return 0;
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = conn;
+    int rc;
+    if (!registered)
+        rc = epoll_server_add(epoll_fd, fd, &event);
+    else if (!events && fd != conn->client_fd)
+        rc = epoll_server_delete(epoll_fd, fd);
+    else
+        rc = epoll_server_modify(epoll_fd, fd, &event);
+    if (rc < 0)
+        return -1;
+    *current = events;
+    return 0;
+}
+
+/**
+ * Plaintext side: a socketpair whose other end is a new client connection
+ * of the event loop.
+ */
+static int start_bridge(connection_t *conn, tls_session_t *s, int epoll_fd)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) < 0)
+    {
+        log_errno("tls: socketpair failed");
+        return -1;
+    }
+
+    connection_t *inner = connection_create(pair[1]);
+    if (!inner)
+    {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    inner->tls_inner = true;
+    memcpy(inner->client_ip, connection_client_ip(conn), sizeof(inner->client_ip));
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = inner;
+    if (epoll_server_add(epoll_fd, pair[1], &event) < 0)
+    {
+        log_error("tls: Could not add bridge fd %d to epoll watchlist\n", pair[1]);
+        connection_free(inner, epoll_fd);
+        close(pair[0]);
+        return -1;
+    }
+
+    s->pair = pair[0];
+    return 0;
+}
+
+static int finish_handshake(connection_t *conn, tls_session_t *s, int epoll_fd)
+{
+    s->established = true;
+    DEBUG_PRINT("tls: client %d %s %s%s\n", conn->client_fd, SSL_get_version(s->ssl),
+                SSL_get_cipher_name(s->ssl), SSL_session_reused(s->ssl) ? " (resumed)" : "");
+
+#ifndef OPENSSL_NO_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(s->ssl)) && BIO_get_ktls_recv(SSL_get_rbio(s->ssl)))
+    {
+        /** The kernel does the records both ways: carry on as a plaintext client */
+        conn->state = CONN_READING_REQUEST;
+        return watch(epoll_fd, conn, conn->client_fd, &s->tcp_events, EPOLLIN, true);
+    }
+#endif
+    return start_bridge(conn, s, epoll_fd);
+}
+
+/** Move bytes both ways until nothing moves. @return 0, or -1 when the connection is over */
+static int pump(tls_session_t *s)
+{
+    for (int round = 0; round < 64; round++)
+    {
+        bool moved = false;
+
+        /** Client → plaintext side */
+        while (!s->client_eof && buffer_available_data(&s->to_pair) < TLS_BRIDGE_HIGH)
+        {
+            if (buffer_ensure_space(&s->to_pair, TLS_RECORD_SIZE) != 0)
+                return -1;
+            ERR_clear_error();
+            int n = SSL_read(s->ssl, buffer_write_ptr(&s->to_pair), buffer_available_space(&s->to_pair));
+            if (n > 0)
+            {
+                s->to_pair.len += n;
+                moved = true;
+                continue;
+            }
+            int err = SSL_get_error(s->ssl, n);
+            if (err == SSL_ERROR_WANT_READ)
+                break;
+            if (err == SSL_ERROR_WANT_WRITE)
+            {
+                s->want_write = true;
+                break;
+            }
+            if (err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && ERR_peek_error() == 0))
+            {
+                /** close_notify or plain EOF: the plaintext side sees the same half-close */
+                s->client_eof = true;
+                moved = true;
+                break;
+            }
+            s->failed = true;
+            return -1;
+        }
+
+        if (buffer_available_data(&s->to_pair) > 0)
+        {
+            ssize_t sent = buffer_write_to_fd(&s->to_pair, s->pair);
+            if (sent < 0)
+                s->to_pair.len = s->to_pair.offset = 0; /** Plaintext side gone: its EOF follows */
+            else if (sent > 0)
+                moved = true;
+            if (buffer_available_data(&s->to_pair) == 0)
+                s->to_pair.len = s->to_pair.offset = 0;
+        }
+        if (s->client_eof && !s->pair_shut && buffer_available_data(&s->to_pair) == 0)
+        {
+            shutdown(s->pair, SHUT_WR);
+            s->pair_shut = true;
+        }
+
+        /** Plaintext side → client */
+        if (buffer_available_data(&s->to_client) == 0 && !s->pair_eof)
+        {
+            s->to_client.len = s->to_client.offset = 0;
+            if (buffer_ensure_space(&s->to_client, TLS_RECORD_SIZE) != 0)
+                return -1;
+            ssize_t n = recv(s->pair, buffer_write_ptr(&s->to_client), TLS_RECORD_SIZE, 0);
+            if (n > 0)
+            {
+                s->to_client.len += n;
+                moved = true;
+            }
+            else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            {
+                s->pair_eof = true;
+                moved = true;
+            }
+        }
+
+        if (buffer_available_data(&s->to_client) > 0)
+        {
+            s->want_write = false;
+            ERR_clear_error();
+            int n = SSL_write(s->ssl, buffer_read_ptr(&s->to_client), buffer_available_data(&s->to_client));
+            if (n > 0)
+            {
+                s->to_client.offset += n;
+                moved = true;
+            }
+            else
+            {
+                int err = SSL_get_error(s->ssl, n);
+                if (err == SSL_ERROR_WANT_WRITE)
+                    s->want_write = true;
+                else if (err != SSL_ERROR_WANT_READ)
+                {
+                    s->failed = true;
+                    return -1;
+                }
+            }
+        }
+
+        if (s->pair_eof && buffer_available_data(&s->to_client) == 0)
+        {
+            /** Response done and the plaintext side closed: close_notify, then close */
+            ERR_clear_error();
+            SSL_shutdown(s->ssl);
+            s->shutdown_sent = true;
+            return -1;
+        }
+        if (!moved)
+            break;
+    }
+    return 0;
+}
+
+int tls_start(connection_t *conn, int epoll_fd)
+{
+    tls_session_t *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        log_errno("tls_start: Out of memory");
+        return -1;
+    }
+    s->pair = -1;
+    s->tcp_events = EPOLLIN;
+    buffer_init(&s->to_pair);
+    buffer_init(&s->to_client);
+
+    /** Set now so connection_free() cleans up whatever happens below */
+    conn->tls = s;
+    conn->state = CONN_TLS;
+
+    s->ssl = SSL_new(ctx);
+    if (!s->ssl || SSL_set_fd(s->ssl, conn->client_fd) != 1)
+    {
+        log_ssl_errors("tls_start");
+        s->failed = true;
+        return -1;
+    }
+    SSL_set_accept_state(s->ssl);
+    return tls_io(conn, epoll_fd);
+}
+
+int tls_io(connection_t *conn, int epoll_fd)
+{
+    tls_session_t *s = conn->tls;
+
+    if (!s->established)
+    {
+        ERR_clear_error();
+        int rc = SSL_do_handshake(s->ssl);
+        if (rc != 1)
+        {
+            int err = SSL_get_error(s->ssl, rc);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                return watch(epoll_fd, conn, conn->client_fd, &s->tcp_events,
+                             err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT, true);
+
+            /** Scanners and clients rejecting the certificate: not worth a log line each */
+            DEBUG_PRINT("tls: handshake with client %d failed\n", conn->client_fd);
+            ERR_clear_error();
+            s->failed = true;
+            return -1;
+        }
+        if (finish_handshake(conn, s, epoll_fd) != 0)
+            return -1;
+        if (conn->state != CONN_TLS)
+            return 0;
+    }
+
+    if (pump(s) != 0)
+        return -1;
+
+    uint32_t tcp = (s->want_write ? EPOLLOUT : 0);
+    if (!s->client_eof && buffer_available_data(&s->to_pair) < TLS_BRIDGE_HIGH)
+        tcp |= EPOLLIN;
+    uint32_t pair = 0;
+    if (!s->pair_eof && buffer_available_data(&s->to_client) == 0)
+        pair |= EPOLLIN;
+    if (buffer_available_data(&s->to_pair) > 0)
+        pair |= EPOLLOUT;
+
+    if (watch(epoll_fd, conn, conn->client_fd, &s->tcp_events, tcp, true) != 0 ||
+        watch(epoll_fd, conn, s->pair, &s->pair_events, pair, s->pair_events != 0) != 0)
+        return -1;
+    return 0;
+}
+
+void tls_free(connection_t *conn, int epoll_fd)
+{
+    tls_session_t *s = conn->tls;
+    if (!s)
+        return;
+
+    if (s->pair >= 0)
+    {
+        if (s->pair_events)
+            epoll_server_delete(epoll_fd, s->pair);
+        close(s->pair);
+    }
+    if (s->ssl)
+    {
+        if (s->established && !s->failed && !s->shutdown_sent)
+        {
+            ERR_clear_error();
+            SSL_shutdown(s->ssl);
+        }
+        SSL_free(s->ssl);
+    }
+    ERR_clear_error();
+    buffer_cleanup(&s->to_pair);
+    buffer_cleanup(&s->to_client);
+    free(s);
+    conn->tls = NULL;
+}
@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <v2-epoll/tunnel.h>
+#include <v2-epoll/connection.h>
+#include <v2-epoll/buffer_io.h>
+#include <v2-epoll/epoll_server.h>
+#include <common/request_parser.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+/** Registration of a socket that was removed from epoll (watch() never stores EPOLLHUP) */
+#define UNWATCHED ((uint32_t)EPOLLHUP)
+
+/** Empty pipes ready for the next direction that has bytes to move */
+static int pipe_pool[TUNNEL_PIPE_POOL][2];
+static int pipe_pool_count = 0;
+
+/** Open tunnels, least recently active first */
+static connection_t *idle_head = NULL;
+static connection_t *idle_tail = NULL;
+
+/** Offloaded tunnels waiting for the kernel before a FIN, and when to look at them */
+static connection_t *flush_head = NULL;
+static uint64_t flush_due_ms = 0;
+
+bool tunnel_request(const HttpRequest *req)
+{
+    if (strcmp(req->methode, "CONNECT") == 0)
+        return true;
+    if (strcmp(req->methode, "GET") != 0)
+        return false;
+
+    const char *upgrade = get_request_header(req, "Upgrade");
+    const char *connection = get_request_header(req, "Connection");
+    return upgrade && connection && strcasecmp(upgrade, "websocket") == 0 &&
+           strcasestr(connection, "upgrade") != NULL;
+}
+
+bool tunnel_accepted(const char *head, size_t len)
+{
+    int status = 0;
+    return len > 12 && sscanf(head, "HTTP/1.%*d %d", &status) == 1 && status == 101;
+}
+
+static void idle_remove(connection_t *conn)
+{
+    tunnel_member_t *t = &conn->tunnel;
+
+    if (t->prev)
+        t->prev->tunnel.next = t->next;
+    else if (idle_head == conn)
+        idle_head = t->next;
+    else
+        return; /** Not on the list */
+
+    if (t->next)
+        t->next->tunnel.prev = t->prev;
+    else
+        idle_tail = t->prev;
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+static void idle_push(connection_t *conn, uint64_t now_ms)
+{
+    tunnel_member_t *t = &conn->tunnel;
+    idle_remove(conn);
+
+    t->active_ms = now_ms;
+    t->next = NULL;
+    t->prev = idle_tail;
+    if (idle_tail)
+        idle_tail->tunnel.next = conn;
+    else
+        idle_head = conn;
+    idle_tail = conn;
+}
+
+static void flush_remove(connection_t *conn)
+{
+    tunnel_member_t *t = &conn->tunnel;
+    if (!t->flushing)
+        return;
+
+    if (t->flush_prev)
+        t->flush_prev->tunnel.flush_next = t->flush_next;
+    else
+        flush_head = t->flush_next;
+    if (t->flush_next)
+        t->flush_next->tunnel.flush_prev = t->flush_prev;
+    t->flush_prev = NULL;
+    t->flush_next = NULL;
+    t->flushing = false;
+}
+
+static void flush_add(connection_t *conn, uint64_t now_ms)
+{
+    tunnel_member_t *t = &conn->tunnel;
+    if (t->flushing)
+        return;
+
+    if (!flush_head)
+        flush_due_ms = now_ms + TUNNEL_FLUSH_POLL_MS;
+    t->flush_prev = NULL;
+    t->flush_next = flush_head;
+    if (flush_head)
+        flush_head->tunnel.flush_prev = conn;
+    flush_head = conn;
+    t->flushing = true;
+}
+
+static int pipe_acquire(tunnel_flow_t *flow)
+{
+    if (flow->pipe[0] >= 0)
+        return 0;
+
+    if (pipe_pool_count > 0)
+    {
+        pipe_pool_count--;
+        flow->pipe[0] = pipe_pool[pipe_pool_count][0];
+        flow->pipe[1] = pipe_pool[pipe_pool_count][1];
+        return 0;
+    }
+    if (pipe2(flow->pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        log_errno("tunnel: pipe2 failed");
+        flow->pipe[0] = flow->pipe[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/** An empty pipe goes back to the pool; one still holding bytes is closed */
+static void pipe_release(tunnel_flow_t *flow)
+{
+    if (flow->pipe[0] < 0)
+        return;
+
+    if (flow->queued == 0 && pipe_pool_count < TUNNEL_PIPE_POOL)
+    {
+        pipe_pool[pipe_pool_count][0] = flow->pipe[0];
+        pipe_pool[pipe_pool_count][1] = flow->pipe[1];
+        pipe_pool_count++;
+    }
+    else
+    {
+        close(flow->pipe[0]);
+        close(flow->pipe[1]);
+    }
+    flow->pipe[0] = flow->pipe[1] = -1;
+    flow->queued = 0;
+}
+
+/**
+ * Move what can be moved from src to dst without blocking: early bytes
+ * first, then pipe fills of up to TUNNEL_SPLICE_BYTES, each drained before
+ * the next one is read. Stops when src has nothing, dst is full, or after
+ * TUNNEL_PUMP_ROUNDS fills. Returns 0 or -1 on a socket error.
+ */
+static int pump_flow(tunnel_flow_t *flow, int src, int dst, bool *moved)
+{
+    if (flow->early)
+    {
+        ssize_t sent = buffer_write_to_fd(flow->early, dst);
+        if (sent < 0)
+            return -1;
+        if (sent > 0)
+            *moved = true;
+        if (buffer_available_data(flow->early) > 0)
+            return 0;
+
+        /** Sent: drop its heap memory, an idle tunnel keeps none */
+        buffer_cleanup(flow->early);
+        buffer_init(flow->early);
+        flow->early = NULL;
+    }
+
+    for (int round = 0; round < TUNNEL_PUMP_ROUNDS; round++)
+    {
+        while (flow->queued > 0)
+        {
+            ssize_t n = splice(flow->pipe[0], NULL, dst, NULL, flow->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EINTR)
+                    return 0; /** dst is full: wait for EPOLLOUT, keep the pipe */
+                DEBUG_PRINT("tunnel: splice to fd %d failed: %s\n", dst, strerror(errno));
+                return -1;
+            }
+            if (n == 0)
+                return -1; /** Pipe lost its bytes: can't happen, but must not spin */
+            flow->queued -= n;
+            *moved = true;
+        }
+
+        if (flow->eof)
+            break;
+        if (pipe_acquire(flow) != 0)
+            return -1;
+
+        ssize_t n = splice(src, NULL, flow->pipe[1], NULL, TUNNEL_SPLICE_BYTES, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            flow->queued = n;
+            *moved = true;
+        }
+        else if (n == 0)
+        {
+            flow->eof = true;
+        }
+        else if (errno == EAGAIN || errno == EINTR)
+        {
+            break;
+        }
+        else
+        {
+            DEBUG_PRINT("tunnel: splice from fd %d failed: %s\n", src, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (flow->queued == 0)
+        pipe_release(flow);
+
+    /** Half-close: the other side reads EOF, the opposite direction keeps going */
+    if (flow->eof && flow->queued == 0 && !flow->shut)
+    {
+        shutdown(dst, SHUT_WR);
+        flow->shut = true;
+    }
+    return 0;
+}
+
+/** A direction reads while it has nothing left to write, and writes while it has */
+static uint32_t flow_reads(const tunnel_flow_t *flow)
+{
+    return !flow->eof && !flow->early && flow->queued == 0 ? EPOLLIN : 0;
+}
+
+static uint32_t flow_writes(const tunnel_flow_t *flow)
+{
+    return flow->early || flow->queued > 0 ? EPOLLOUT : 0;
+}
+
+static int watch(int epoll_fd, connection_t *conn, int fd, uint32_t *current, uint32_t wanted)
+{
+    if (*current == wanted)
+        return 0;
+
+    struct epoll_event event;
+    event.events = wanted | EPOLLERR | EPOLLHUP;
+    event.data.ptr = conn;
+    if (epoll_server_modify(epoll_fd, fd, &event) < 0)
+    {
+        log_error("tunnel: Failed to modify fd %d\n", fd);
+        return -1;
+    }
+    *current = wanted;
+    return 0;
+}
+
+/** Nothing read and not yet written in either direction, and both still open */
+static bool relay_empty(const tunnel_member_t *t)
+{
+    return !t->up.early && !t->down.early && t->up.queued == 0 && t->down.queued == 0 &&
+           !t->up.eof && !t->down.eof;
+}
+
+/** Only FIN is left to see on a socket whose bytes the kernel redirects */
+static bool socket_eof(int fd)
+{
+    char byte;
+    return recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+/**
+ * One direction of an offloaded tunnel: notice EOF at src, and pass it on
+ * once the kernel wrote everything it redirected to dst.
+ */
+static int finish_offloaded(tunnel_flow_t *flow, const sockmap_pair_t *pair, int from, int src, int dst, bool *changed)
+{
+    if (!flow->eof && socket_eof(src))
+    {
+        flow->eof = true;
+        *changed = true;
+    }
+    if (!flow->eof || flow->shut)
+        return 0;
+
+    int flushed = sockmap_flushed(pair, from, dst);
+    if (flushed < 0)
+        return -1;
+    if (flushed)
+    {
+        shutdown(dst, SHUT_WR);
+        flow->shut = true;
+        *changed = true;
+    }
+    return 0;
+}
+
+/**
+ * EPOLLRDHUP until the socket sent EOF. One that also got its shutdown
+ * would report EPOLLHUP forever: it leaves epoll while the other direction
+ * is still finishing.
+ */
+static int watch_offloaded(int epoll_fd, connection_t *conn, int fd, uint32_t *current,
+                           const tunnel_flow_t *from, const tunnel_flow_t *to)
+{
+    if (!from->eof || !to->shut)
+        return watch(epoll_fd, conn, fd, current, from->eof ? 0 : EPOLLRDHUP);
+
+    if (*current != UNWATCHED)
+        epoll_server_delete(epoll_fd, fd);
+    *current = UNWATCHED;
+    return 0;
+}
+
+static int pump_offloaded(connection_t *conn, int epoll_fd, uint32_t events, uint64_t now_ms)
+{
+    tunnel_member_t *t = &conn->tunnel;
+    bool changed = false;
+
+    if (events & EPOLLERR)
+        return -1;
+
+    if (finish_offloaded(&t->up, &t->kernel, SOCKMAP_CLIENT, conn->client_fd, conn->backend_fd, &changed) != 0 ||
+        finish_offloaded(&t->down, &t->kernel, SOCKMAP_BACKEND, conn->backend_fd, conn->client_fd, &changed) != 0)
+        return -1;
+
+    if (t->up.shut && t->down.shut)
+    {
+        DEBUG_PRINT("tunnel: client %d finished in the kernel\n", conn->client_fd);
+        return 1;
+    }
+
+    /** Finished sockets are unwatched, so a hangup here is a reset */
+    if (!changed && (events & EPOLLHUP))
+        return -1;
+
+    if (changed)
+        idle_push(conn, now_ms);
+    if (t->up.eof != t->up.shut || t->down.eof != t->down.shut)
+        flush_add(conn, now_ms);
+
+    if (watch_offloaded(epoll_fd, conn, conn->client_fd, &t->client_events, &t->up, &t->down) != 0 ||
+        watch_offloaded(epoll_fd, conn, conn->backend_fd, &t->backend_events, &t->down, &t->up) != 0)
+        return -1;
+    return 0;
+}
+
+int tunnel_pump(connection_t *conn, int epoll_fd, uint32_t events, uint64_t now_ms)
+{
+    tunnel_member_t *t = &conn->tunnel;
+    bool moved = false;
+
+    if (t->offloaded)
+        return pump_offloaded(conn, epoll_fd, events, now_ms);
+
+    if (pump_flow(&t->up, conn->client_fd, conn->backend_fd, &moved) != 0 ||
+        pump_flow(&t->down, conn->backend_fd, conn->client_fd, &moved) != 0)
+        return -1;
+
+    if (t->up.shut && t->down.shut)
+    {
+        DEBUG_PRINT("tunnel: client %d finished\n", conn->client_fd);
+        return 1;
+    }
+
+    /** A socket that hung up reports it forever: once nothing moves, give up */
+    if (!moved && (events & (EPOLLERR | EPOLLHUP)))
+        return -1;
+
+    if (moved)
+        idle_push(conn, now_ms);
+
+    /** Kernel relay (-k): taken over at the first moment nothing is in flight */
+    if (!t->offload_tried && sockmap_available() && relay_empty(t) && !conn->tls)
+    {
+        t->offload_tried = true;
+        int rc = sockmap_attach(&t->kernel, conn->client_fd, conn->backend_fd);
+        if (rc < 0)
+            return -1;
+        if (rc > 0)
+        {
+            t->offloaded = true;
+            return pump_offloaded(conn, epoll_fd, 0, now_ms);
+        }
+    }
+
+    if (watch(epoll_fd, conn, conn->client_fd, &t->client_events, flow_reads(&t->up) | flow_writes(&t->down)) != 0 ||
+        watch(epoll_fd, conn, conn->backend_fd, &t->backend_events, flow_reads(&t->down) | flow_writes(&t->up)) != 0)
+        return -1;
+    return 0;
+}
+
+int tunnel_start(connection_t *conn, int epoll_fd, uint64_t now_ms)
+{
+    tunnel_member_t *t = &conn->tunnel;
+
+    t->active = true;
+    conn->state = CONN_TUNNEL;
+    t->up.pipe[0] = t->up.pipe[1] = -1;
+    t->down.pipe[0] = t->down.pipe[1] = -1;
+
+    /** Registered for whatever the handshake needed: the first watch() always updates */
+    t->client_events = t->backend_events = ~0u;
+
+    if (buffer_available_data(&conn->rebuilt_request_buffer) > 0)
+        t->up.early = &conn->rebuilt_request_buffer;
+    else
+    {
+        buffer_cleanup(&conn->rebuilt_request_buffer);
+        buffer_init(&conn->rebuilt_request_buffer);
+    }
+    if (buffer_available_data(&conn->response_buffer) > 0)
+        t->down.early = &conn->response_buffer;
+    else
+    {
+        buffer_cleanup(&conn->response_buffer);
+        buffer_init(&conn->response_buffer);
+    }
+
+    /** The request was forwarded: nothing of it is needed any more */
+    buffer_cleanup(&conn->request_buffer);
+    buffer_init(&conn->request_buffer);
+    if (conn->request_parsed)
+    {
+        free_http_request(&conn->parsed_request);
+        conn->request_parsed = false;
+    }
+
+    idle_push(conn, now_ms);
+    DEBUG_PRINT("tunnel: client %d <-> backend %d open\n", conn->client_fd, conn->backend_fd);
+    return tunnel_pump(conn, epoll_fd, 0, now_ms);
+}
+
+bool tunnel_movable(const connection_t *conn)
+{
+    const tunnel_member_t *t = &conn->tunnel;
+    return conn->state == CONN_TUNNEL && t->active && !t->offloaded && !t->flushing &&
+           relay_empty(t) && !t->up.shut && !t->down.shut &&
+           t->up.pipe[0] < 0 && t->down.pipe[0] < 0 && !conn->tls && !conn->tls_inner && !conn->h2_stream;
+}
+
+void tunnel_detach(connection_t *conn)
+{
+    tunnel_member_t *t = &conn->tunnel;
+    if (!t->active)
+        return;
+
+    idle_remove(conn);
+    flush_remove(conn);
+    pipe_release(&t->up);
+    pipe_release(&t->down);
+    if (t->offloaded)
+        sockmap_detach(&t->kernel);
+    t->active = false;
+}
+
+connection_t *tunnel_pop_expired(uint64_t now_ms)
+{
+    connection_t *head;
+
+    while ((head = idle_head) != NULL && head->tunnel.active_ms + TUNNEL_IDLE_TIMEOUT_MS <= now_ms)
+    {
+        /** The kernel moves an offloaded tunnel's bytes unseen: ask its counters */
+        tunnel_member_t *t = &head->tunnel;
+        if (!t->offloaded)
+            break;
+        uint64_t moved = sockmap_moved(&t->kernel);
+        if (moved == t->kernel.moved)
+            break;
+        t->kernel.moved = moved;
+        idle_push(head, now_ms);
+    }
+    if (!head || head->tunnel.active_ms + TUNNEL_IDLE_TIMEOUT_MS > now_ms)
+        return NULL;
+
+    idle_remove(head);
+    DEBUG_PRINT("tunnel: client %d idle for %d ms\n", head->client_fd, TUNNEL_IDLE_TIMEOUT_MS);
+    return head;
+}
+
+connection_t *tunnel_take_flushing(uint64_t now_ms)
+{
+    if (!flush_head || flush_due_ms > now_ms)
+        return NULL;
+
+    /** The flags go now: pumping puts back whatever still waits */
+    connection_t *chain = flush_head;
+    for (connection_t *conn = chain; conn; conn = conn->tunnel.flush_next)
+    {
+        conn->tunnel.flushing = false;
+        conn->tunnel.flush_prev = NULL;
+    }
+    flush_head = NULL;
+    return chain;
+}
+
+int tunnel_next_timeout(uint64_t now_ms)
+{
+    if (!idle_head)
+        return -1;
+
+    uint64_t deadline_ms = idle_head->tunnel.active_ms + TUNNEL_IDLE_TIMEOUT_MS;
+    if (flush_head && flush_due_ms < deadline_ms)
+        deadline_ms = flush_due_ms;
+    return deadline_ms <= now_ms ? 0 : (int)(deadline_ms - now_ms);
+}
@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <v2-epoll/upgrade.h>
+#include <v2-epoll/connection.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+#define UPGRADE_MAGIC 0x54505550u /**< "TPUP" */
+
+typedef enum
+{
+    UPGRADE_MSG_HELLO = 1, /**< new → old: please hand over */
+    UPGRADE_MSG_LISTENER,  /**< old → new: listen fd attached, count = idle fds that follow */
+    UPGRADE_MSG_IDLE,      /**< old → new: count idle client fds attached */
+    UPGRADE_MSG_DONE       /**< new → old: everything registered, count = idle fds taken */
+} upgrade_msg_type_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t type;
+    uint32_t count;
+} upgrade_msg_t;
+
+static int fill_unix_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        log_error("upgrade: control socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/** Bound both directions so a stuck peer can't hang the event loop */
+static void set_io_timeout(int fd)
+{
+    struct timeval tv = {
+        .tv_sec = UPGRADE_IO_TIMEOUT_MS / 1000,
+        .tv_usec = (UPGRADE_IO_TIMEOUT_MS % 1000) * 1000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int send_msg(int sock, uint32_t type, uint32_t count, const int *fds, int nfds)
+{
+    upgrade_msg_t msg = {.magic = UPGRADE_MAGIC, .type = type, .count = count};
+    struct iovec iov = {.iov_base = &msg, .iov_len = sizeof(msg)};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+
+    if (nfds > 0)
+    {
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    ssize_t n;
+    do
+    {
+        n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    if (n != (ssize_t)sizeof(msg))
+    {
+        log_errno("upgrade: sendmsg failed");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Receive one message. Received fds are stored in fds (up to max_fds) and
+ * their number in *nfds; the kernel has already installed them in our table,
+ * so on any error they are closed here.
+ */
+static int recv_msg(int sock, upgrade_msg_t *msg, int *fds, int max_fds, int *nfds)
+{
+    struct iovec iov = {.iov_base = msg, .iov_len = sizeof(*msg)};
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+    struct msghdr mh = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    *nfds = 0;
+
+    ssize_t n;
+    do
+    {
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < count; i++)
+        {
+            if (*nfds < max_fds)
+                fds[(*nfds)++] = received[i];
+            else
+                close(received[i]);
+        }
+    }
+
+    if (n != (ssize_t)sizeof(*msg) || msg->magic != UPGRADE_MAGIC || (mh.msg_flags & MSG_CTRUNC))
+    {
+        if (n < 0)
+            log_errno("upgrade: recvmsg failed");
+        else
+            log_error("upgrade: malformed control message");
+        for (int i = 0; i < *nfds; i++)
+            close(fds[i]);
+        *nfds = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int upgrade_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    if (fill_unix_addr(&addr, path) != 0)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        log_errno("upgrade_listen: socket failed");
+        return -1;
+    }
+
+    /** A previous process (or the one we just took over from) may have left the file behind */
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4) < 0)
+    {
+        log_errno("upgrade_listen: cannot listen on %s", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int upgrade_inherit(const char *path, int *listen_fd, int **idle_fds)
+{
+    struct sockaddr_un addr;
+    if (fill_unix_addr(&addr, path) != 0)
+        return -1;
+
+    *listen_fd = -1;
+    *idle_fds = NULL;
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        log_errno("upgrade_inherit: socket failed");
+        return -1;
+    }
+    set_io_timeout(sock);
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        log_errno("upgrade_inherit: no running proxy on %s", path);
+        close(sock);
+        return -1;
+    }
+
+    upgrade_msg_t msg;
+    int fds[UPGRADE_FDS_PER_MSG];
+    int nfds = 0;
+    int *idle = NULL;
+    int idle_expected = 0, idle_count = 0;
+
+    if (send_msg(sock, UPGRADE_MSG_HELLO, 0, NULL, 0) != 0)
+        goto fail;
+
+    if (recv_msg(sock, &msg, fds, UPGRADE_FDS_PER_MSG, &nfds) != 0)
+        goto fail;
+    if (msg.type != UPGRADE_MSG_LISTENER || nfds != 1)
+    {
+        log_error("upgrade_inherit: expected the listening socket, got type=%u fds=%d", msg.type, nfds);
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
+        goto fail;
+    }
+    *listen_fd = fds[0];
+    nfds = 0;
+
+    idle_expected = (int)msg.count;
+    if (idle_expected > 0)
+    {
+        idle = malloc(sizeof(int) * idle_expected);
+        if (!idle)
+        {
+            log_errno("upgrade_inherit: Failed to allocate %d idle fds", idle_expected);
+            goto fail;
+        }
+    }
+
+    while (idle_count < idle_expected)
+    {
+        if (recv_msg(sock, &msg, fds, UPGRADE_FDS_PER_MSG, &nfds) != 0)
+            goto fail;
+        if (msg.type != UPGRADE_MSG_IDLE || nfds != (int)msg.count || idle_count + nfds > idle_expected)
+        {
+            log_error("upgrade_inherit: unexpected idle batch (type=%u count=%u fds=%d)", msg.type, msg.count, nfds);
+            for (int i = 0; i < nfds; i++)
+                close(fds[i]);
+            goto fail;
+        }
+        memcpy(idle + idle_count, fds, sizeof(int) * nfds);
+        idle_count += nfds;
+    }
+
+    /**
+     * Acknowledge before the caller registers anything: from here on the old
+     * process closes its copies, and our copies keep the sockets open.
+     */
+    if (send_msg(sock, UPGRADE_MSG_DONE, idle_count, NULL, 0) != 0)
+        goto fail;
+
+    close(sock);
+    *idle_fds = idle;
+    return idle_count;
+
+fail:
+    for (int i = 0; i < idle_count; i++)
+        close(idle[i]);
+    free(idle);
+    if (*listen_fd >= 0)
+    {
+        close(*listen_fd);
+        *listen_fd = -1;
+    }
+    close(sock);
+    return -1;
+}
+
+int upgrade_handoff(int control_fd, int listen_fd)
+{
+    int sock = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            log_errno("upgrade_handoff: accept failed");
+        return -1;
+    }
+    set_io_timeout(sock);
+
+    upgrade_msg_t msg;
+    int fds[UPGRADE_FDS_PER_MSG];
+    int nfds = 0;
+
+    if (recv_msg(sock, &msg, fds, UPGRADE_FDS_PER_MSG, &nfds) != 0 || msg.type != UPGRADE_MSG_HELLO)
+    {
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
+        log_error("upgrade_handoff: ignoring unexpected control connection");
+        close(sock);
+        return -1;
+    }
+
+    int idle_total = 0;
+    for (connection_t *c = connection_live_first(); c; c = c->live_next)
+    {
+        if (connection_is_idle(c))
+            idle_total++;
+    }
+
+    if (send_msg(sock, UPGRADE_MSG_LISTENER, idle_total, &listen_fd, 1) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    /**
+     * Single-threaded loop: nothing can change between counting and sending,
+     * so the batches contain exactly idle_total connections.
+     */
+    int batch = 0;
+    for (connection_t *c = connection_live_first(); c; c = c->live_next)
+    {
+        if (!connection_is_idle(c))
+            continue;
+
+        fds[batch++] = c->client_fd;
+        if (batch == UPGRADE_FDS_PER_MSG)
+        {
+            if (send_msg(sock, UPGRADE_MSG_IDLE, batch, fds, batch) != 0)
+            {
+                close(sock);
+                return -1;
+            }
+            batch = 0;
+        }
+    }
+    if (batch > 0 && send_msg(sock, UPGRADE_MSG_IDLE, batch, fds, batch) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    if (recv_msg(sock, &msg, fds, UPGRADE_FDS_PER_MSG, &nfds) != 0 || msg.type != UPGRADE_MSG_DONE)
+    {
+        log_error("upgrade_handoff: new process did not confirm, continuing to serve");
+        close(sock);
+        return -1;
+    }
+    close(sock);
+
+    /** The new process owns them now; dropping our copies does not close the sockets */
+    for (connection_t *c = connection_live_first(); c; c = c->live_next)
+    {
+        if (connection_is_idle(c))
+            connection_schedule_free(c);
+    }
+
+    printf("Handed listener and %d idle connections to the new process\n", idle_total);
+    fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include <math.h>
+#include <string.h>
+#include <v2-epoll/upstream_limiter.h>
+#include <v2-epoll/connection.h>
+#include <v2-epoll/clock.h>
+#include <common/debug.h>
+
+/**
+ * Fixed table, one entry per backend seen in routes.conf. Several routes
+ * usually point to the same backend ("localhost 3000"), and the limit has to
+ * protect the backend, not the route, so the key is host + port.
+ */
+static upstream_limiter_t limiters[MAX_UPSTREAMS];
+static int limiter_count = 0;
+
+upstream_limiter_t *upstream_limiter_get(const char *host, int port)
+{
+    for (int i = 0; i < limiter_count; i++)
+    {
+        if (limiters[i].port == port && strcmp(limiters[i].host, host) == 0)
+            return &limiters[i];
+    }
+
+    if (limiter_count >= MAX_UPSTREAMS)
+        return NULL;
+
+    upstream_limiter_t *ul = &limiters[limiter_count++];
+    memset(ul, 0, sizeof(*ul));
+    strncpy(ul->host, host, sizeof(ul->host) - 1);
+    ul->port = port;
+    ul->limit = UPSTREAM_LIMIT_INITIAL;
+    return ul;
+}
+
+static bool has_free_slot(const upstream_limiter_t *ul)
+{
+    return ul->inflight < (int)ul->limit;
+}
+
+static void take_slot(upstream_limiter_t *ul, connection_t *conn)
+{
+    ul->inflight++;
+    conn->upstream = ul;
+    conn->upstream_slot_held = true;
+    conn->upstream_start_us = clock_now_us();
+}
+
+bool upstream_limiter_try_acquire(upstream_limiter_t *ul, connection_t *conn)
+{
+    /** Never overtake requests that are already waiting */
+    if (ul->queue_len > 0 || !has_free_slot(ul))
+        return false;
+
+    take_slot(ul, conn);
+    return true;
+}
+
+int upstream_limiter_enqueue(upstream_limiter_t *ul, connection_t *conn, uint64_t now_ms)
+{
+    if (ul->queue_len >= UPSTREAM_QUEUE_MAX)
+        return -1;
+
+    conn->upstream = ul;
+    conn->upstream_slot_held = false;
+    conn->queue_deadline_ms = now_ms + UPSTREAM_QUEUE_TIMEOUT_MS;
+    conn->queue_next = NULL;
+    conn->queue_prev = ul->queue_tail;
+
+    if (ul->queue_tail)
+        ul->queue_tail->queue_next = conn;
+    else
+        ul->queue_head = conn;
+    ul->queue_tail = conn;
+    ul->queue_len++;
+
+    DEBUG_PRINT("upstream %s:%d: queued fd=%d (queue=%d, inflight=%d, limit=%.1f)",
+                ul->host, ul->port, conn->client_fd, ul->queue_len, ul->inflight, ul->limit);
+    return 0;
+}
+
+static void queue_remove(upstream_limiter_t *ul, connection_t *conn)
+{
+    if (conn->queue_prev)
+        conn->queue_prev->queue_next = conn->queue_next;
+    else
+        ul->queue_head = conn->queue_next;
+
+    if (conn->queue_next)
+        conn->queue_next->queue_prev = conn->queue_prev;
+    else
+        ul->queue_tail = conn->queue_prev;
+
+    conn->queue_prev = NULL;
+    conn->queue_next = NULL;
+    ul->queue_len--;
+}
+
+/**
+ * Feed one completed request into the limit.
+ *
+ * @param inflight Requests in flight when this one completed (including itself).
+ *                 If we were using far less than the limit, the sample says
+ *                 nothing about whether a higher limit is safe, so we do not grow.
+ */
+static void update_limit(upstream_limiter_t *ul, double rtt_us, int inflight, bool dropped)
+{
+    if (dropped)
+    {
+        ul->limit *= UPSTREAM_DROP_BACKOFF;
+        if (ul->limit < UPSTREAM_LIMIT_MIN)
+            ul->limit = UPSTREAM_LIMIT_MIN;
+        return;
+    }
+
+    if (rtt_us < 1.0)
+        rtt_us = 1.0;
+
+    if (ul->long_rtt == 0.0)
+        ul->long_rtt = rtt_us;
+    else
+        ul->long_rtt += (rtt_us - ul->long_rtt) / UPSTREAM_LONG_RTT_WINDOW;
+
+    /**
+     * If the baseline drifted far above current latency (e.g. after a slow
+     * period), pull it back down so a recovered backend is not starved.
+     */
+    if (ul->long_rtt / rtt_us > 2.0)
+        ul->long_rtt *= 0.95;
+
+    if (inflight < ul->limit / 2)
+        return;
+
+    double gradient = UPSTREAM_RTT_TOLERANCE * ul->long_rtt / rtt_us;
+    if (gradient < 0.5)
+        gradient = 0.5;
+    if (gradient > 1.0)
+        gradient = 1.0;
+
+    double new_limit = ul->limit * gradient + sqrt(ul->limit);
+    ul->limit = ul->limit * (1.0 - UPSTREAM_LIMIT_SMOOTHING) + new_limit * UPSTREAM_LIMIT_SMOOTHING;
+
+    if (ul->limit < UPSTREAM_LIMIT_MIN)
+        ul->limit = UPSTREAM_LIMIT_MIN;
+    if (ul->limit > UPSTREAM_LIMIT_MAX)
+        ul->limit = UPSTREAM_LIMIT_MAX;
+}
+
+void upstream_limiter_finish(connection_t *conn)
+{
+    upstream_limiter_t *ul = conn->upstream;
+    if (!ul)
+        return;
+
+    if (!conn->upstream_slot_held)
+    {
+        queue_remove(ul, conn);
+    }
+    else
+    {
+        double rtt_us = (double)(clock_now_us() - conn->upstream_start_us);
+        update_limit(ul, rtt_us, ul->inflight, !conn->backend_responded);
+        ul->inflight--;
+
+        DEBUG_PRINT("upstream %s:%d: released slot (rtt=%.0fus, ok=%d, inflight=%d, limit=%.1f)",
+                    ul->host, ul->port, rtt_us, conn->backend_responded, ul->inflight, ul->limit);
+    }
+
+    conn->upstream = NULL;
+    conn->upstream_slot_held = false;
+}
+
+connection_t *upstream_limiter_pop_expired(uint64_t now_ms)
+{
+    for (int i = 0; i < limiter_count; i++)
+    {
+        /** FIFO with a single timeout → the head always has the earliest deadline */
+        connection_t *head = limiters[i].queue_head;
+        if (head && head->queue_deadline_ms <= now_ms)
+        {
+            queue_remove(&limiters[i], head);
+            head->upstream = NULL;
+            return head;
+        }
+    }
+    return NULL;
+}
+
+connection_t *upstream_limiter_pop_ready(void)
+{
+    for (int i = 0; i < limiter_count; i++)
+    {
+        upstream_limiter_t *ul = &limiters[i];
+        if (ul->queue_head && has_free_slot(ul))
+        {
+            connection_t *conn = ul->queue_head;
+            queue_remove(ul, conn);
+            take_slot(ul, conn);
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+int upstream_limiter_next_timeout(uint64_t now_ms)
+{
+    int timeout = -1;
+    for (int i = 0; i < limiter_count; i++)
+    {
+        upstream_limiter_t *ul = &limiters[i];
+        if (!ul->queue_head)
+            continue;
+        if (has_free_slot(ul) || ul->queue_head->queue_deadline_ms <= now_ms)
+            return 0;
+
+        int wait = (int)(ul->queue_head->queue_deadline_ms - now_ms);
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+    return timeout;
+}
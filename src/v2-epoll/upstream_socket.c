@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <v2-epoll/upstream_socket.h>
+#include <v2-epoll/clock.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+#ifndef IP_LOCAL_PORT_RANGE
+#define IP_LOCAL_PORT_RANGE 51
+#endif
+
+typedef struct
+{
+    struct in_addr addr;
+    bool any;           /**< "*": no bind, only the port range */
+    uint16_t port_lo;   /**< 0 = system-wide ip_local_port_range */
+    uint16_t port_hi;
+} upstream_source_t;
+
+static upstream_source_t sources[UPSTREAM_SOURCES_MAX];
+static int source_count = 0;
+static unsigned next_source = 0;
+static bool reset_abandoned = false;
+static bool fastopen = false;
+
+/** Connect results by errno (slot 0 = connected): since start, and since the last summary */
+static uint64_t connect_total[UPSTREAM_ERRNO_MAX];
+static uint64_t connect_window[UPSTREAM_ERRNO_MAX];
+static uint64_t window_start_ms = 0;
+
+/** "ADDR[:LO-HI]" */
+static int parse_source(const char *item, upstream_source_t *src)
+{
+    char addr[INET_ADDRSTRLEN];
+    const char *colon = strchr(item, ':');
+    size_t addr_len = colon ? (size_t)(colon - item) : strlen(item);
+    if (addr_len == 0 || addr_len >= sizeof(addr))
+        return -1;
+    memcpy(addr, item, addr_len);
+    addr[addr_len] = '\0';
+
+    memset(src, 0, sizeof(*src));
+    if (strcmp(addr, "*") == 0)
+        src->any = true;
+    else if (inet_pton(AF_INET, addr, &src->addr) != 1)
+        return -1;
+
+    if (colon)
+    {
+        unsigned lo, hi;
+        int consumed = 0;
+        if (sscanf(colon + 1, "%u-%u%n", &lo, &hi, &consumed) != 2 || colon[1 + consumed] != '\0' ||
+            lo == 0 || lo > hi || hi > 65535)
+            return -1;
+        src->port_lo = lo;
+        src->port_hi = hi;
+    }
+    else if (src->any)
+    {
+        return -1; /** "*" alone would change nothing */
+    }
+    return 0;
+}
+
+int upstream_socket_init(const char *list, bool reset, bool tfo)
+{
+    reset_abandoned = reset;
+    fastopen = tfo;
+    source_count = 0;
+    window_start_ms = clock_now_ms();
+    if (!list)
+        return 0;
+
+    char *copy = strdup(list);
+    if (!copy)
+        return -1;
+
+    char *saveptr = NULL;
+    for (char *item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr))
+    {
+        if (source_count >= UPSTREAM_SOURCES_MAX || parse_source(item, &sources[source_count]) != 0)
+        {
+            log_error("upstream_socket_init: Invalid source '%s' (ADDR[:LO-HI], at most %d)", item, UPSTREAM_SOURCES_MAX);
+            free(copy);
+            source_count = 0;
+            return -1;
+        }
+        source_count++;
+    }
+    free(copy);
+    return 0;
+}
+
+int upstream_socket_source_count(void)
+{
+    return source_count;
+}
+
+int upstream_socket_prepare(int fd, int attempt, bool early_data)
+{
+    if (fastopen && early_data)
+    {
+        int one = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) < 0)
+            return -1;
+    }
+    if (source_count == 0)
+        return 0;
+
+    /** Round robin, so every address's ports are used before any runs out */
+    if (attempt == 0)
+        next_source++;
+    const upstream_source_t *src = &sources[(next_source + attempt) % source_count];
+
+    if (src->port_lo)
+    {
+        uint32_t range = ((uint32_t)src->port_hi << 16) | src->port_lo;
+        if (setsockopt(fd, IPPROTO_IP, IP_LOCAL_PORT_RANGE, &range, sizeof(range)) < 0)
+            return -1;
+    }
+    if (src->any)
+        return 0;
+
+    /** Defer the port to connect(): chosen for the 4-tuple, not reserved for every destination */
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one)) < 0)
+        return -1;
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr = src->addr;
+    return bind(fd, (struct sockaddr *)&local, sizeof(local));
+}
+
+/** One log line with the failures since the last one */
+static void report_window(uint64_t now)
+{
+    char line[512];
+    uint64_t failed = 0;
+    int len = 0;
+    for (int err = 1; err < UPSTREAM_ERRNO_MAX; err++)
+    {
+        if (!connect_window[err])
+            continue;
+        failed += connect_window[err];
+        const char *name = err < UPSTREAM_ERRNO_MAX - 1 ? strerrorname_np(err) : NULL;
+        if (len < (int)sizeof(line))
+            len += name ? snprintf(line + len, sizeof(line) - len, " %s=%lu", name, (unsigned long)connect_window[err])
+                        : snprintf(line + len, sizeof(line) - len, " errno%d=%lu", err, (unsigned long)connect_window[err]);
+    }
+    if (failed)
+    {
+        uint64_t failed_total = 0;
+        for (int err = 1; err < UPSTREAM_ERRNO_MAX; err++)
+            failed_total += connect_total[err];
+        log_error("upstream connects in the last %lus: %lu ok, %lu failed:%s (since start: %lu ok, %lu failed)",
+                  (unsigned long)((now - window_start_ms) / 1000), (unsigned long)connect_window[0],
+                  (unsigned long)failed, line, (unsigned long)connect_total[0], (unsigned long)failed_total);
+    }
+    memset(connect_window, 0, sizeof(connect_window));
+    window_start_ms = now;
+}
+
+void upstream_socket_connect_result(int err)
+{
+    if (err < 0 || err >= UPSTREAM_ERRNO_MAX)
+        err = UPSTREAM_ERRNO_MAX - 1;
+    connect_total[err]++;
+    connect_window[err]++;
+
+    uint64_t now = clock_now_ms();
+    if (now - window_start_ms >= UPSTREAM_CONNECT_REPORT_MS)
+        report_window(now);
+}
+
+void upstream_socket_close(int fd)
+{
+    if (reset_abandoned)
+    {
+        /**
+         * Still ESTABLISHED (or connecting), or only our side shut down (a
+         * tunnel relaying the client's EOF): we'd close first and keep the
+         * port in TIME_WAIT. CLOSE_WAIT: the backend closed first, a normal
+         * close costs nothing. Not TCP (unix socket): no TIME_WAIT at all.
+         * A RST throws away our unacknowledged bytes, so only with an empty
+         * send queue (a tunnel may still be delivering the client's last
+         * bytes).
+         */
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        int queued = 0;
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+            (info.tcpi_state == TCP_ESTABLISHED || info.tcpi_state == TCP_SYN_SENT ||
+             info.tcpi_state == TCP_FIN_WAIT1 || info.tcpi_state == TCP_FIN_WAIT2) &&
+            ioctl(fd, SIOCOUTQ, &queued) == 0 && queued == 0)
+        {
+            struct linger linger = {.l_onoff = 1, .l_linger = 0};
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        }
+    }
+    close(fd);
+}
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <common/server.h>
+#include <v2-epoll/workers.h>
+#include <v2-epoll/slab.h>
+#include <v2-epoll/migrate.h>
+#include <common/error_handler.h>
+#include <common/debug.h>
+
+static int worker_count = 0;
+
+int workers_count(void)
+{
+    return worker_count;
+}
+
+/** "0-3,8,10-11" → CPU numbers in order; NULL = our affinity mask */
+static int parse_cpus(const char *list, int *cpus, int max)
+{
+    int n = 0;
+    if (!list)
+    {
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) != 0)
+            return -1;
+        for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++)
+            if (CPU_ISSET(cpu, &set))
+                cpus[n++] = cpu;
+        return n;
+    }
+
+    const char *p = list;
+    while (*p)
+    {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p || lo < 0 || lo >= CPU_SETSIZE)
+            return -1;
+        if (*end == '-')
+        {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo || hi >= CPU_SETSIZE)
+                return -1;
+        }
+        for (long cpu = lo; cpu <= hi; cpu++)
+        {
+            if (n == max)
+                return -1;
+            cpus[n++] = (int)cpu;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+    return n;
+}
+
+/** NUMA node of a CPU (the nodeN link in sysfs), -1 if the kernel has no NUMA */
+static int cpu_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+
+    int node = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/**
+ * Reuseport program: worker i's listener for connections received on its
+ * CPU. Return values past the group size make the kernel use its hash.
+ */
+static int attach_steering(int fd, const int *cpus, int count)
+{
+    struct sock_filter code[2 * WORKERS_MAX + 2];
+    int n = 0;
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+    for (int i = 0; i < count; i++)
+    {
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, count);
+
+    struct sock_fprog prog = {.len = n, .filter = code};
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+/** In the new worker: stay on its CPU and keep its memory on that CPU's node */
+static void worker_setup(int index, int cpu, bool huge_pages)
+{
+    /** Don't outlive the supervisor (killed with SIGKILL, crashed) */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        log_errno("worker %d: could not pin to CPU %d", index, cpu);
+
+    int node = cpu_node(cpu);
+    if (node >= 0 && node < (int)(sizeof(unsigned long) * 8))
+    {
+        /** Everything allocated from now on (buffers, caches) prefers the local node */
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1) != 0)
+            log_errno("worker %d: set_mempolicy failed", index);
+    }
+    slab_set_numa(node, huge_pages);
+    printf("Worker %d (pid %d) on CPU %d, NUMA node %d\n", index, getpid(), cpu, node);
+    fflush(stdout);
+}
+
+/** Forward signals to the workers until every one of them exited */
+static void supervise(pid_t *pids, int count, const sigset_t *signals)
+{
+    int running = count;
+    int stop_signal = 0;
+    while (running > 0)
+    {
+        siginfo_t info;
+        int sig = sigwaitinfo(signals, &info);
+        if (sig < 0)
+            continue;
+        if (sig == SIGUSR1)
+        {
+            migrate_report();
+            continue;
+        }
+        if (sig != SIGCHLD)
+        {
+            if (sig != SIGHUP)
+                stop_signal = sig;
+            for (int i = 0; i < count; i++)
+                if (pids[i] > 0)
+                    kill(pids[i], sig);
+            continue;
+        }
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                if (pids[i] != pid)
+                    continue;
+                bool stopped = WIFSIGNALED(status) && WTERMSIG(status) == stop_signal;
+                if (!stopped && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+                    log_error("worker %d (pid %d) died (status 0x%x), its connections go to the others", i, pid, status);
+                pids[i] = -1;
+                running--;
+            }
+        }
+    }
+}
+
+int workers_start(int count, const char *cpu_list, int port, bool huge_pages, int migrate, int *listener)
+{
+    int cpus[WORKERS_MAX];
+    int cpu_count = parse_cpus(cpu_list, cpus, WORKERS_MAX);
+    if (cpu_count <= 0)
+    {
+        log_error("workers_start: Invalid CPU list '%s' (at most %d CPUs)", cpu_list ? cpu_list : "", WORKERS_MAX);
+        return -1;
+    }
+    if (count == 0)
+        count = cpu_count;
+    if (count > WORKERS_MAX)
+    {
+        log_error("workers_start: At most %d workers", WORKERS_MAX);
+        return -1;
+    }
+    /** Fewer CPUs than workers: round robin */
+    for (int i = cpu_count; i < count; i++)
+        cpus[i] = cpus[i % cpu_count];
+    /** Workers sharing a CPU: the CPU can't tell them apart, the kernel's hash can */
+    bool steer = count > 1;
+    for (int i = 0; i < count; i++)
+        for (int j = 0; j < i; j++)
+            if (cpus[i] == cpus[j])
+                steer = false;
+
+    /** One listener per worker, bound in worker order: group index = worker index */
+    int fds[WORKERS_MAX];
+    for (int i = 0; i < count; i++)
+    {
+        fds[i] = port >= 0 ? setup_server_reuseport(port) : -1;
+        if (port >= 0 && fds[i] < 0)
+        {
+            while (i-- > 0)
+                close(fds[i]);
+            return -1;
+        }
+        /** Fallback steering; also harmless next to the program */
+        if (fds[i] >= 0 && steer)
+            setsockopt(fds[i], SOL_SOCKET, SO_INCOMING_CPU, &cpus[i], sizeof(cpus[i]));
+    }
+    if (port >= 0 && steer && attach_steering(fds[0], cpus, count) != 0)
+        log_errno("workers_start: reuseport steering program not attached, using SO_INCOMING_CPU");
+
+    if (migrate > 0 && count > 1 && migrate_init(count, migrate) != 0)
+        log_error("workers_start: connection migration disabled");
+
+    /** Blocked before forking, so none is lost between fork() and sigwaitinfo() */
+    sigset_t signals, old_mask;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &signals, &old_mask);
+
+    fflush(stdout);
+    pid_t pids[WORKERS_MAX];
+    for (int i = 0; i < count; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] < 0)
+        {
+            /**
+             * The group can't shrink: the steering program and the workers
+             * already running count on every listener being accepted from.
+             * Stop those workers and fail as a whole.
+             */
+            log_errno("workers_start: fork of worker %d failed, stopping the others", i);
+            for (int j = 0; j < count; j++)
+                if (fds[j] >= 0)
+                    close(fds[j]);
+            for (int j = 0; j < i; j++)
+                kill(pids[j], SIGTERM);
+            for (int j = 0; j < i; j++)
+                while (waitpid(pids[j], NULL, 0) < 0 && errno == EINTR)
+                    ;
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            return -1;
+        }
+        if (pids[i] == 0)
+        {
+            /**
+             * SIGHUP stays blocked: main blocks it anyway for the reloader's
+             * signalfd, but only after attach/inherit/epoll setup, and a
+             * reload forwarded before that would kill the worker.
+             */
+            sigset_t child_mask = old_mask;
+            sigaddset(&child_mask, SIGHUP);
+            sigprocmask(SIG_SETMASK, &child_mask, NULL);
+            /** Another worker's listener must die with that worker, not live on here */
+            for (int j = 0; j < count; j++)
+                if (j != i && fds[j] >= 0)
+                    close(fds[j]);
+            worker_count = count;
+            worker_setup(i, cpus[i], huge_pages);
+            *listener = fds[i];
+            return i;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+
+    printf("Supervising %d workers\n", count);
+    supervise(pids, count, &signals);
+    printf("All workers exited\n");
+    exit(0);
+}
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "common/server.h"
+#include "common/request_parser.h"
+#include "common/proxy.h"
+#include "common/route_config.h"
+#include "common/rebuild_request.h"
+#include "common/error_handler.h"
+#include "common/debug.h"
+#include "v3-threaded/work_queue.h"
+
+#define PORT 8000
+#define BUFFER_SIZE 16384
+#define WORKER_THREADS 64     /**< Default pool size: each thread serves one client at a time */
+#define QUEUE_CAPACITY 1024   /**< Accepted clients waiting for a worker (power of two) */
+#define IO_TIMEOUT_S 30       /**< A silent client or backend frees its worker after this */
+#define ACCEPT_RETRY_US 10000 /**< Pause after accept() ran out of descriptors */
+
+/** Read-only once the workers start: shared by all of them without locks */
+static Route routes[MAX_ROUTES];
+static int route_count = 0;
+static work_queue_t queue;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-p port] [-t threads] [-q queue]\n"
+            "  -p  port to listen on (default %d)\n"
+            "  -t  worker threads (default %d)\n"
+            "  -q  accepted clients waiting for a worker, a power of two (default %d)\n",
+            prog, PORT, WORKER_THREADS, QUEUE_CAPACITY);
+}
+
+/**
+ * Blocking calls with a deadline: without one, a client that connects and
+ * never sends (or a backend that never answers) holds a worker forever,
+ * and the pool is small compared to the connections it serves.
+ */
+static void set_io_timeout(int fd)
+{
+    struct timeval timeout = {.tv_sec = IO_TIMEOUT_S, .tv_usec = 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/**
+ * The v1 pipeline for one client: read, parse, route, connect, forward,
+ * relay, close. Everything it touches is per call (stack buffers, the
+ * parsed request, both sockets) or read-only (the routes).
+ */
+static void handle_client(int client_id)
+{
+    char buffer[BUFFER_SIZE];
+    int targetfd = -1;
+    bool req_parsed = false;
+    HttpRequest req;
+
+    set_io_timeout(client_id);
+
+    int bytes_read;
+    do
+    {
+        bytes_read = read(client_id, buffer, BUFFER_SIZE - 1);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            log_error("Client %d sent nothing for %d seconds", client_id, IO_TIMEOUT_S);
+        else if (errno == ECONNRESET)
+            log_errno("Client disconnected (ECONNRESET)");
+        else
+            log_errno("Failed to read request");
+        goto cleanup;
+    }
+    if (bytes_read == 0)
+    {
+        log_error("read returned 0 bytes (connection closed)");
+        goto cleanup;
+    }
+    buffer[bytes_read] = '\0';
+
+    DEBUG_PRINT("Received request:\n%s\n", buffer);
+    if (parse_http_request(buffer, &req) != 0)
+    {
+        log_error("Failed to parse HTTP request\n");
+        send_http_error(client_id, 400, "Bad Request");
+        goto cleanup;
+    }
+    req_parsed = true;
+
+    // Find best backend based on path prefix
+    Route *backend = find_backend(routes, route_count, req.path);
+    if (!backend)
+    {
+        log_error("No backend found for path: %s", req.path);
+        send_http_error(client_id, 502, "Bad Gateway");
+        goto cleanup;
+    }
+
+    if (backend->static_path[0])
+    {
+        log_error("Static route %s is only served by v2-epoll", backend->prefix);
+        send_http_error(client_id, 404, "Not Found");
+        goto cleanup;
+    }
+
+    /** connect_to_target() only speaks HTTP/1.1 over TCP */
+    if (strncmp(backend->host, "unix:", 5) == 0 || backend->h2c)
+    {
+        log_error("Route %s (%s%s) is only served by v2-epoll", backend->prefix, backend->host,
+                  backend->h2c ? " proto=h2c" : "");
+        send_http_error(client_id, 502, "Bad Gateway");
+        goto cleanup;
+    }
+
+    DEBUG_PRINT("Routing to backend: %s:%d for prefix: %s\n", backend->host, backend->port, backend->prefix);
+
+    targetfd = connect_to_target(backend->host, backend->port);
+    if (targetfd < 0)
+    {
+        log_error("Failed to connect to backend %s:%d", backend->host, backend->port);
+        send_http_error(client_id, 502, "Bad Gateway");
+        goto cleanup;
+    }
+    set_io_timeout(targetfd);
+
+    char client_ip[INET6_ADDRSTRLEN];
+    get_client_ip(client_id, client_ip, sizeof(client_ip));
+
+    char request[MAX_REQUEST_SIZE];
+    if (rebuild_request(&req, request, client_ip, sizeof(request)) < 0)
+    {
+        log_error("Failed to rebuild request from client %d", client_id);
+        send_http_error(client_id, 500, "Internal Server Error");
+        goto cleanup;
+    }
+
+    if (forward_request(targetfd, request, strlen(request)) < 0)
+    {
+        log_errno("Failed to forward request to backend %s:%d", backend->host, backend->port);
+        send_http_error(client_id, 502, "Bad Gateway");
+        goto cleanup;
+    }
+
+    /** One request per connection, as in v1: the backend closes after the response */
+    if (relay_response(targetfd, client_id) < 0)
+    {
+        log_error("Failed to relay response to client");
+        send_http_error(client_id, 502, "Bad Gateway");
+        goto cleanup;
+    }
+
+cleanup:
+    if (req_parsed)
+        free_http_request(&req);
+    if (targetfd != -1)
+        close(targetfd);
+    close(client_id);
+}
+
+static void *worker_main(void *arg)
+{
+    (void)arg;
+    for (;;)
+        handle_client(work_queue_pop(&queue));
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    // Ignore SIGPIPE globally so the server doesn't crash on client disconnects
+    signal(SIGPIPE, SIG_IGN);
+
+    int port = PORT;
+    int threads = WORKER_THREADS;
+    int capacity = QUEUE_CAPACITY;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:q:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'q':
+            capacity = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (threads < 1 || capacity < 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    route_count = load_routes("routes.conf", routes, MAX_ROUTES);
+    if (route_count <= 0)
+    {
+        log_error("No routes loaded");
+        return 1;
+    }
+
+    if (work_queue_init(&queue, (size_t)capacity) != 0)
+        return 1;
+
+    int server_id = setup_server(port);
+    if (server_id < 0)
+    {
+        log_error("Failed to start server");
+        return 1;
+    }
+
+    /** Blocking I/O needs little stack: 256 KiB per worker instead of the 8 MiB default */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_t thread;
+        int rc = pthread_create(&thread, &attr, worker_main, NULL);
+        if (rc != 0)
+        {
+            errno = rc;
+            log_errno("Failed to start worker thread %d", i);
+            if (i == 0)
+                return 1;
+            threads = i;
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    printf("Server is listening on port %d (%d worker threads, queue of %d)\n", port, threads, capacity);
+    fflush(stdout);
+
+    /** This thread is the acceptor: it only accepts and queues */
+    while (1)
+    {
+        int client_id = accept_client(server_id);
+        if (client_id < 0)
+        {
+            /** Out of descriptors: let the workers close some before trying again */
+            if (errno == EMFILE || errno == ENFILE)
+                usleep(ACCEPT_RETRY_US);
+            continue;
+        }
+        work_queue_push(&queue, client_id);
+    }
+    close(server_id);
+    return 0;
+}
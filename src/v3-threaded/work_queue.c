@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include "v3-threaded/work_queue.h"
+#include "common/error_handler.h"
+
+int work_queue_init(work_queue_t *queue, size_t capacity)
+{
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+    {
+        log_error("work_queue_init: capacity %zu is not a power of two", capacity);
+        return -1;
+    }
+    queue->cells = calloc(capacity, sizeof(work_queue_cell_t));
+    if (!queue->cells)
+    {
+        log_errno("work_queue_init: calloc failed");
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++)
+        atomic_init(&queue->cells[i].sequence, i);
+    queue->mask = capacity - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    if (sem_init(&queue->items, 0, 0) != 0 || sem_init(&queue->slots, 0, capacity) != 0)
+    {
+        log_errno("work_queue_init: sem_init failed");
+        free(queue->cells);
+        return -1;
+    }
+    return 0;
+}
+
+void work_queue_destroy(work_queue_t *queue)
+{
+    sem_destroy(&queue->items);
+    sem_destroy(&queue->slots);
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+bool work_queue_try_push(work_queue_t *queue, int fd)
+{
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        work_queue_cell_t *cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            /** Our turn on this cell: claim the position */
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                cell->fd = fd;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return true;
+            }
+            /** Another producer won; pos now holds the current position */
+        }
+        else if (diff < 0)
+        {
+            /** The cell still holds the item from one lap ago: full */
+            return false;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+bool work_queue_try_pop(work_queue_t *queue, int *fd)
+{
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        work_queue_cell_t *cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                *fd = cell->fd;
+                /** Free for the push one lap later */
+                atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            /** Not pushed yet: empty */
+            return false;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+void work_queue_push(work_queue_t *queue, int fd)
+{
+    while (sem_wait(&queue->slots) != 0 && errno == EINTR)
+        ;
+    /**
+     * A free cell exists, but a consumer that claimed the oldest one may not
+     * have released it yet (consumers finish out of order): that's a matter
+     * of a few instructions.
+     */
+    while (!work_queue_try_push(queue, fd))
+        sched_yield();
+    sem_post(&queue->items);
+}
+
+int work_queue_pop(work_queue_t *queue)
+{
+    while (sem_wait(&queue->items) != 0 && errno == EINTR)
+        ;
+    int fd;
+    while (!work_queue_try_pop(queue, &fd))
+        sched_yield();
+    sem_post(&queue->slots);
+    return fd;
+}